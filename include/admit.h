@@ -0,0 +1,84 @@
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include <stddef.h>
+
+#include "transaction.h"
+
+/*
+ * Admission control.
+ *
+ * When more transactions are started than can commit, pending versions
+ * pile up in the store, dependency chains grow longer, commits wait
+ * longer, and more and more transactions end up aborting.  So a new
+ * transaction is not admitted while the server is past any of these
+ * thresholds (zero disables one):
+ *
+ *   - the number of transactions in progress (option -m),
+ *   - the average length of the dependency chain of the transactions that
+ *     commit (option -k), and
+ *   - the average time a commit takes, in milliseconds (option -c).
+ *
+ * A transaction that is not admitted is aborted before it has done
+ * anything, and its requests are answered TRANS_ABORTED, or XACTO_OVERLOADED
+ * (see proto_status.h) to a client that asked for it, so that the client
+ * can tell it to back off from an ordinary conflict.  While only the
+ * averages are too high, one in ADMIT_PROBE transactions is admitted
+ * anyway, to measure them anew, and a transaction is always admitted when
+ * none is in progress.
+ *
+ * The length of the dependency chain of a transaction is worked out as
+ * the store adds its dependencies, and remembered in a table indexed by
+ * transaction ID; the averages are moving averages over the commits.
+ */
+
+typedef struct admit_stats {
+    size_t admitted;
+    size_t rejected_pending;        // Transactions refused for each threshold
+    size_t rejected_depth;
+    size_t rejected_latency;
+    double depth;                   // Average dependency chain length
+    double commit_ms;               // Average commit time
+} ADMIT_STATS;
+
+/*
+ * Set the thresholds.  Until this is called, or if they are all zero,
+ * every transaction is admitted and nothing is measured.
+ */
+void admit_init(int max_pending, int max_depth, int max_commit_ms);
+
+void admit_fini(void);
+
+/*
+ * Create a transaction for a client, subject to admission control.  One
+ * that is not admitted is aborted already, and *rejectedp is set.
+ *
+ * @return  The transaction, or NULL if it could not be created.
+ */
+TRANSACTION *admit_trans_create(int *rejectedp);
+
+/*
+ * The status to reply with, given the status of a request in a
+ * transaction that was (or was not) rejected, to a client that asked for
+ * XACTO_OVERLOADED; others are given the status as it is.
+ */
+int admit_status(TRANS_STATUS status, int rejected);
+
+/*
+ * Record that a transaction depends on another (called by the store).
+ */
+void admit_dependency(TRANSACTION *tp, TRANSACTION *dtp);
+
+/*
+ * Commit a transaction, as by trans_commit(), measuring the commit.
+ */
+TRANS_STATUS admit_commit(TRANSACTION *tp);
+
+void admit_get_stats(ADMIT_STATS *sp);
+
+/*
+ * Print the figures to stderr.
+ */
+void admit_show(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stddef.h>
+
+#include "protocol.h"
+#include "transaction.h"
+
+/*
+ * Execute a batched request (MGET or MPUT, see proto_batch.h) in a
+ * transaction.  The payload is only read, not kept.
+ *
+ * @param statusp  Set to the status of the transaction afterwards.
+ * @param valuesp  For an MGET, set to malloc'd storage holding the framed
+ *   payload of the VALUE packet of the reply, which the caller must free;
+ *   set to NULL otherwise.  If the values would not fit in
+ *   PROTO_BATCH_REPLY_MAX bytes, the transaction has been aborted and
+ *   they are all null (see proto_batch.h).
+ * @param sizep  Set to the size of that payload.
+ * @return  0 if successful, -1 if the payload is malformed or memory could
+ *   not be allocated.  The request may then have been partly performed, and
+ *   the client should be disconnected as for any other protocol error.
+ */
+int batch_execute(TRANSACTION *tp, XACTO_PACKET *pkt, void *data,
+                  TRANS_STATUS *statusp, char **valuesp, size_t *sizep);
+
+#endif
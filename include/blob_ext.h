@@ -0,0 +1,62 @@
+#ifndef __BLOB_EXT_H__
+#define __BLOB_EXT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+
+/*
+ * Extended representation used for blobs that are subject to dedup or
+ * compression.  The blob must be the first member, so that a BLOB * handed
+ * out to the rest of the server can be converted back to its BLOB_EXT, and
+ * so that freeing the blob frees the whole structure.
+ *
+ * Whether a blob is extended is decided purely by its size (see
+ * blob_is_ext()), so the dedup and compression thresholds must be set
+ * before the first blob is created and not changed afterwards.  Whether
+ * it is in the dedup table is not: that is what the interned flag is for.
+ */
+typedef struct blob_ext {
+    BLOB blob;
+    uint64_t hash;                 // Hash of the uncompressed content (dedup)
+    struct blob_ext *next;         // Next blob in the same dedup bucket
+    size_t zsize;                  // Size of content if compressed, otherwise 0
+    int interned;                  // Whether the blob is in the dedup table
+} BLOB_EXT;
+
+/*
+ * Determine whether a blob of the given size uses the extended representation.
+ */
+int blob_is_ext(size_t size);
+
+/*
+ * Helpers from data.c, shared with the dedup table so that interned
+ * blobs are set up and torn down exactly like ordinary ones.
+ * blob_init() copies (and, if eligible, compresses) the content and sets
+ * the reference count to 1; it returns 0 on success and -1 if memory could
+ * not be allocated.  blob_free() releases the content and the blob itself.
+ */
+int blob_init(BLOB *bp, char *content, size_t size);
+void blob_free(BLOB *bp);
+
+/*
+ * Create a blob from malloc'd content, taking ownership of the storage
+ * instead of copying it, so that a large received payload becomes the
+ * content of the blob as it is.  Content subject to dedup or compression
+ * is copied as by blob_create() and the storage freed.  Either way the
+ * content belongs to this function once it is called, even if it fails.
+ *
+ * @return  The blob, with a reference count of 1, or NULL if memory could
+ *   not be allocated.
+ */
+BLOB *blob_adopt(char *content, size_t size);
+
+/*
+ * Compare the content of a blob with a block of uncompressed data.
+ *
+ * @return 0 if they are equal, nonzero otherwise.
+ */
+int blob_content_compare(BLOB *bp, char *content, size_t size);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef __COMMITQ_H__
+#define __COMMITQ_H__
+
+#include "transaction.h"
+
+/*
+ * Commits taken off the threads of an event-driven server core.
+ *
+ * trans_commit() waits for the transactions that the one committing
+ * depends on to commit or abort, and those may well be served by the same
+ * thread: a commit like that, done inline, would stop the thread, and the
+ * requests that would end the wait with it.  So a core hands a commit that
+ * would wait to a thread of its own, which posts the outcome to a queue
+ * that the core watches through an eventfd, and goes on serving its other
+ * connections meanwhile.  Each such commit gets a thread, since the
+ * commits that a fixed set of threads were waiting on might be queued
+ * behind them.  The threads have small stacks (COMMITQ_STACK), and no more
+ * than COMMITQ_THREADS of them run at once over all queues: past that, a
+ * commit is refused, and the core aborts the transaction as overloaded
+ * rather than have a thread for every connection.
+ */
+typedef struct commitq COMMITQ;
+
+/*
+ * Create a queue, for the use of one thread.
+ *
+ * @return  The queue, or NULL if it could not be created.
+ */
+COMMITQ *commitq_create(void);
+
+/*
+ * Free a queue, which must have no commits under way.
+ */
+void commitq_destroy(COMMITQ *q);
+
+/*
+ * Get the eventfd that becomes readable when commits have completed.  The
+ * thread owning the queue reads it, which resets it, before taking the
+ * outcomes with commitq_next().
+ */
+int commitq_fd(COMMITQ *q);
+
+/*
+ * Determine whether committing a transaction would wait, because some
+ * transaction that it depends on is still pending.  Nothing else may be
+ * adding to its dependencies meanwhile.
+ */
+int commitq_would_wait(TRANSACTION *tp);
+
+/*
+ * Commit a transaction, as by admit_commit(), on a thread of its own.
+ * The reference to the transaction passes to that thread.
+ *
+ * @return  0 if successful, -1 if COMMITQ_THREADS are running already or
+ *   the thread could not be started, in which case the caller still has
+ *   the reference.
+ */
+int commitq_submit(COMMITQ *q, TRANSACTION *tp, void *arg);
+
+/*
+ * Take the outcome of a commit that has completed, if any.
+ *
+ * @return  The arg given to commitq_submit(), with the ID and the final
+ *   status of the transaction stored in *idp and *statusp, or NULL if no
+ *   commit has completed since the last call.
+ */
+void *commitq_next(COMMITQ *q, int *idp, TRANS_STATUS *statusp);
+
+#endif
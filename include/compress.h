@@ -0,0 +1,85 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stddef.h>
+
+#include "data.h"
+
+/*
+ * Transparent at-rest compression of large blobs.
+ *
+ * When enabled, blobs of at least the configured size are stored compressed
+ * with the in-tree LZ codec (see lz.h), provided that this actually saves
+ * space.  The size field of such a blob is still the uncompressed size;
+ * the compressed content is only expanded when someone needs the bytes,
+ * which is done with blob_data().
+ */
+
+typedef struct compress_stats {
+    size_t candidates;      // Blobs large enough to be considered
+    size_t compressed;      // Blobs actually stored compressed
+    size_t raw_bytes;       // Uncompressed size of compressed blobs
+    size_t stored_bytes;    // Compressed size of compressed blobs
+    size_t expansions;      // Number of blob_data() calls that decompressed
+} COMPRESS_STATS;
+
+/*
+ * Enable compression of blobs of at least min_size bytes.
+ * Must be called before any blobs are created.
+ */
+void compress_init(size_t min_size);
+
+/*
+ * Disable compression.
+ */
+void compress_fini(void);
+
+/*
+ * Determine whether a blob with the given size is considered for compression.
+ */
+int compress_eligible(size_t size);
+
+/*
+ * Compress content for storage in a blob.
+ *
+ * @return  A malloc'd buffer with the compressed content, whose size is
+ *   stored in *zsizep, or NULL if compression would not save enough
+ *   space to be worthwhile.
+ */
+char *compress_content(char *content, size_t size, size_t *zsizep);
+
+/*
+ * Get the content of a blob as stored, if it is compressed, for sending it
+ * to a client that expands it itself.
+ *
+ * @return  The compressed content, whose size is stored in *zsizep, or
+ *   NULL if the blob is not stored compressed.
+ */
+char *blob_compressed(BLOB *bp, size_t *zsizep);
+
+/*
+ * Get the uncompressed content of a blob.  For an ordinary blob this is
+ * just the content pointer; for a compressed blob a buffer is allocated
+ * and the content is expanded into it.  Either way, the result must be
+ * passed to blob_data_release() once the caller is done with it.
+ *
+ * @return  The uncompressed content, or NULL if it could not be produced.
+ */
+char *blob_data(BLOB *bp);
+
+/*
+ * Release a pointer obtained from blob_data().
+ */
+void blob_data_release(BLOB *bp, char *data);
+
+/*
+ * Take a snapshot of the compression counters.
+ */
+void compress_get_stats(COMPRESS_STATS *sp);
+
+/*
+ * Print the compression counters to stderr, at any time.
+ */
+void compress_show(void);
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef __CONN_H__
+#define __CONN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "transaction.h"
+#include "data.h"
+#include "proto_status.h"
+#include "commitq.h"
+
+/*
+ * Protocol state machine for one client connection, for I/O engines that
+ * do not dedicate a blocking thread to each client (see evloop.h).
+ *
+ * The engine reads whatever bytes the socket has into the input buffer,
+ * lets conn_process() execute all the complete requests found there, and
+ * writes out the replies accumulated in the output buffer when the socket
+ * allows.  A connection behaves exactly like one served by
+ * xacto_client_service(): it has a single transaction, created when the
+ * connection is, and the service ends with the first request that does not
+ * leave the transaction pending, unless the connection has become a
+ * session.  Either wire format may be used: the first bytes received tell
+ * v1 from v2 (see proto2.h).
+ *
+ * Requests are no longer executed once CONN_OUT_MAX bytes of replies are
+ * waiting, and the engine then stops reading from the socket until the
+ * client has taken enough of them (see flow.h): a client that does not
+ * read its replies only ever costs that much memory.  The same goes once
+ * as many requests as may be in flight (see service.h) have been executed
+ * since the output buffer was last empty, until it is again.
+ *
+ * An engine that serves many connections on a thread must not let one of
+ * them wait in trans_commit(), for the transactions it waits for may be
+ * those of the others.  It sets the commits field of each connection to a
+ * commit queue (see commitq.h), and calls conn_committed() when a commit
+ * handed to the queue has completed.  The connection must not be
+ * destroyed while its committing field is set.
+ *
+ * A value of CONN_SEND_REF_MIN bytes or more is not copied into the output
+ * buffer: the reply refers to the blob holding it, which stays referenced
+ * until the value has been sent, so replies are sent with gathered writes.
+ */
+typedef struct conn_value {
+    size_t at;              // Position in the buffer's bytes that it follows
+    BLOB *bp;               // Blob holding it
+    char *data;             // The value as sent
+    size_t size;
+    int expanded;           // data came from blob_data(), to be released
+} CONN_VALUE;
+
+typedef struct conn_buf {
+    char *data;
+    size_t start;           // Offset of the first unconsumed byte
+    size_t end;             // Offset just past the last valid byte
+    size_t cap;             // Allocated size
+    size_t pos;             // Bytes consumed before the first unconsumed one
+    CONN_VALUE *values;     // Values sent from their blobs, in order (output only)
+    int vstart, vend, vcap; // Unsent ones, and allocated size
+    size_t vsent;           // Bytes of the first unsent value already sent
+    size_t vbytes;          // Bytes of values not yet sent
+} CONN_BUF;
+
+typedef struct conn {
+    int fd;
+    int done;               // No further requests will be processed
+    int proto;              // Wire format: 1 or 2 (see proto2.h), 0 until known
+    uint8_t opts;           // Options granted to a v2 client
+    int session;            // Transactions follow one another (see proto_session.h)
+    TRANSACTION *tp;        // Current transaction, NULL once committed
+    COMMITQ *commits;       // Where commits that would wait go, if anywhere
+    int committing;         // A commit is under way on another thread
+    void *engine;           // What the engine keeps for the connection, if anything
+    TRANS_STATUS status;    // Status after the last request
+    int rejected;           // The transaction was not admitted (see admit.h)
+    XACTO_ABORT_INFO abort; // Why it was aborted, once it was (see reason.h)
+    int stage;              // Which packet of a request is expected next
+    XACTO_PACKET req;       // Header of the request being assembled
+    KEY *key;               // Key of a PUT waiting for its value
+    size_t need;            // Bytes needed to complete the next packet
+    CONN_BUF in;            // Received bytes not yet processed
+    XACTO_PACKET hdr;       // Header of a large packet received directly
+    char *payload;          // Its payload, to become a blob as it is
+    size_t got;             // Bytes of the payload received so far
+    CONN_BUF out;           // Replies not yet sent
+    int inflight;           // Replies queued since the output buffer was last empty
+    int throttled;          // Stopped on a full output buffer
+} CONN;
+
+/*
+ * Set up the state of a newly accepted connection: register it with the
+ * client registry and create its transaction.
+ *
+ * @return  The connection, or NULL if memory could not be allocated.
+ */
+CONN *conn_create(int fd);
+
+/*
+ * Like conn_create(), for a connection that the caller has already
+ * registered with the client registry.
+ */
+CONN *conn_attach(int fd);
+
+/*
+ * Abort the transaction of a connection if still pending, unregister and
+ * close it, and free its state.
+ */
+void conn_destroy(CONN *cp);
+
+/*
+ * Get space to receive bytes into, growing the input buffer if a partially
+ * received packet does not fit.  The payload of a packet larger than the
+ * input buffer is instead received straight into storage of its own, which
+ * later becomes the content of a blob (see blob_adopt()); the space given
+ * out for it then ends with the payload.
+ *
+ * @return  Where to store received bytes, with *lenp set to the room
+ *   available, or NULL if memory could not be allocated.
+ */
+char *conn_rspace(CONN *cp, size_t *lenp);
+
+/*
+ * Record that n bytes have been stored at the address given by conn_rspace().
+ */
+void conn_received(CONN *cp, size_t n);
+
+/*
+ * Execute all complete requests in the input buffer and queue their
+ * replies, stopping early if the output buffer fills up.
+ *
+ * @return  0 if more requests may follow, -1 if the service of the
+ *   connection has ended and it should be closed once the output buffer
+ *   has been written.
+ */
+int conn_process(CONN *cp);
+
+/*
+ * Record the outcome of a commit handed to the commit queue and queue its
+ * reply, then go on with the requests received meanwhile, as by
+ * conn_process().
+ */
+int conn_committed(CONN *cp, int id, TRANS_STATUS status);
+
+/*
+ * Determine whether the output buffer is full, or holds the replies to as
+ * many requests as may be in flight, or a commit is under way, so that
+ * reading should stop until some of it has been sent, or the commit has
+ * completed, and conn_process() has been called again.
+ */
+int conn_throttled(CONN *cp);
+
+/*
+ * Get the replies waiting to be sent, as up to *iovcntp iovecs, which may
+ * not cover them all.  iov may be NULL if iovcntp is.
+ *
+ * @return  The number of bytes waiting, with *iovcntp set to the number of
+ *   iovecs filled in.
+ */
+size_t conn_pending(CONN *cp, struct iovec *iov, int *iovcntp);
+
+/*
+ * Record that the first n pending bytes have been sent.
+ */
+void conn_sent(CONN *cp, size_t n);
+
+/*
+ * The same for replies taken out of a connection with conn_take_output().
+ */
+size_t conn_buf_pending(CONN_BUF *b, struct iovec *iov, int *iovcntp);
+void conn_buf_sent(CONN_BUF *b, size_t n);
+
+/*
+ * Free the memory of a buffer taken out of a connection, and release the
+ * values it still refers to.
+ */
+void conn_buf_free(CONN_BUF *b);
+
+/*
+ * Take all pending replies out of a connection, for an engine whose sends
+ * complete asynchronously: the output buffer moves as replies are added,
+ * so it cannot be handed to the kernel while requests are still processed.
+ * The connection's output buffer is replaced with *bp, which must hold no
+ * unsent data, so that its memory is reused.  The replies taken no longer
+ * count as in flight.
+ */
+void conn_take_output(CONN *cp, CONN_BUF *bp);
+
+#endif
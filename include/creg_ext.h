@@ -0,0 +1,105 @@
+#ifndef __CREG_EXT_H__
+#define __CREG_EXT_H__
+
+#include <stddef.h>
+#include <time.h>
+
+#include "client_registry.h"
+#include "transaction.h"
+
+/*
+ * Per-client metadata kept by the client registry, beyond the set of file
+ * descriptors that client_registry.h calls for.
+ *
+ * The registry is a table indexed by file descriptor.  It is made of
+ * chunks of CREG_CHUNK entries, allocated the first time a descriptor in
+ * their range is registered and never moved, so that registering and
+ * unregistering a client take constant time, and finding the entry of a
+ * client takes no lock at all.  The thread serving a client updates its
+ * counters with relaxed atomic operations as it goes.
+ */
+#define CREG_PEER_MAX 64
+
+typedef struct client_info {
+    int fd;
+    char peer[CREG_PEER_MAX];   // Numeric address and port, or "local"
+    int trans_id;               // Current transaction, or -1 if none
+    size_t bytes_in;            // Bytes of requests received
+    size_t bytes_out;           // Bytes of replies sent
+    struct timespec start;      // When the client was registered (CLOCK_REALTIME)
+    long idle_ms;               // Time since bytes last went either way
+    long trans_ms;              // Age of the current transaction, or -1 if none
+} CLIENT_INFO;
+
+/*
+ * Get the number of clients currently registered.
+ */
+int creg_count(CLIENT_REGISTRY *cr);
+
+/*
+ * Get the number of clients with a transaction recorded (see below), which
+ * is the number of transactions in progress.  It takes no lock.
+ */
+int creg_transactions(CLIENT_REGISTRY *cr);
+
+/*
+ * Get the metadata of a registered client.
+ *
+ * @return  0 if successful, -1 if fd is not registered.
+ */
+int creg_info(CLIENT_REGISTRY *cr, int fd, CLIENT_INFO *ip);
+
+/*
+ * Record the transaction a client is now performing requests in, if any,
+ * when it has none.  The age of a transaction counts from here.
+ *
+ * The registry does not hold a reference to the transaction.  The thread
+ * serving the client takes it back with creg_release_transaction() before
+ * it commits the transaction or lets go of it, so that it can then be
+ * sure that creg_abort_transaction() is not using it.
+ */
+void creg_set_transaction(CLIENT_REGISTRY *cr, int fd, TRANSACTION *tp);
+
+/*
+ * Take back the transaction of a client: it has none from then on.
+ *
+ * @return  0 if successful, -1 if there was none, because it has been
+ *   aborted by creg_abort_transaction() (or it was never recorded).
+ */
+int creg_release_transaction(CLIENT_REGISTRY *cr, int fd);
+
+/*
+ * Abort the current transaction of a client, from a thread other than the
+ * one serving it, which will find it aborted.  Any transactions that
+ * depend on it are thereby released.
+ *
+ * @return  0 if a transaction was aborted, -1 if the client had none.
+ */
+int creg_abort_transaction(CLIENT_REGISTRY *cr, int fd);
+
+/*
+ * Add to the byte counts of a client.  Any bytes count as activity, as far
+ * as the idle time of the client is concerned.
+ */
+void creg_add_bytes(CLIENT_REGISTRY *cr, int fd, size_t in, size_t out);
+
+/*
+ * Shut down the receiving side of the connections of clients that have no
+ * transaction in progress, so that their service ends (see service.h).
+ */
+void creg_shutdown_idle(CLIENT_REGISTRY *cr);
+
+/*
+ * Like creg_wait_for_empty(), but give up at an absolute CLOCK_REALTIME
+ * deadline.
+ *
+ * @return  0 if no clients are left, -1 if the deadline has passed.
+ */
+int creg_wait_for_empty_until(CLIENT_REGISTRY *cr, const struct timespec *deadline);
+
+/*
+ * Print the metadata of all registered clients to stderr.
+ */
+void creg_show(CLIENT_REGISTRY *cr);
+
+#endif
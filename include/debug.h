@@ -3,6 +3,8 @@
 
 #include <stdio.h>
 
+#include "log.h"
+
 #define NL "\n"
 
 #ifdef COLOR
@@ -38,8 +40,9 @@
 #ifdef DEBUG
 #define debug(S, ...)                                                          \
   do {                                                                         \
-    fprintf(stderr, KMAG "DEBUG: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    if (LOG_ENABLED(LOG_DEBUG))                                                \
+      log_write(LOG_DEBUG, __FILE__, __extension__ __FUNCTION__, __LINE__,     \
+                S, ##__VA_ARGS__);                                             \
   } while (0)
 #else
 #define debug(S, ...)
@@ -48,8 +51,9 @@
 #ifdef INFO
 #define info(S, ...)                                                           \
   do {                                                                         \
-    fprintf(stderr, KBLU "INFO: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    if (LOG_ENABLED(LOG_INFO))                                                 \
+      log_write(LOG_INFO, __FILE__, __extension__ __FUNCTION__, __LINE__,      \
+                S, ##__VA_ARGS__);                                             \
   } while (0)
 #else
 #define info(S, ...)
@@ -58,8 +62,9 @@
 #ifdef WARN
 #define warn(S, ...)                                                           \
   do {                                                                         \
-    fprintf(stderr, KYEL "WARN: %s:%s:%d " KNRM S NL, __FILE__,                \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    if (LOG_ENABLED(LOG_WARN))                                                 \
+      log_write(LOG_WARN, __FILE__, __extension__ __FUNCTION__, __LINE__,      \
+                S, ##__VA_ARGS__);                                             \
   } while (0)
 #else
 #define warn(S, ...)
@@ -68,8 +73,9 @@
 #ifdef SUCCESS
 #define success(S, ...)                                                        \
   do {                                                                         \
-    fprintf(stderr, KGRN "SUCCESS: %s:%s:%d " KNRM S NL, __FILE__,             \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    if (LOG_ENABLED(LOG_SUCCESS))                                              \
+      log_write(LOG_SUCCESS, __FILE__, __extension__ __FUNCTION__, __LINE__,   \
+                S, ##__VA_ARGS__);                                             \
   } while (0)
 #else
 #define success(S, ...)
@@ -78,8 +84,9 @@
 #ifdef ERROR
 #define error(S, ...)                                                          \
   do {                                                                         \
-    fprintf(stderr, KRED "ERROR: %s:%s:%d " KNRM S NL, __FILE__,               \
-            __extension__ __FUNCTION__, __LINE__, ##__VA_ARGS__);                \
+    if (LOG_ENABLED(LOG_ERROR))                                                \
+      log_write(LOG_ERROR, __FILE__, __extension__ __FUNCTION__, __LINE__,     \
+                S, ##__VA_ARGS__);                                             \
   } while (0)
 #else
 #define error(S, ...)
@@ -0,0 +1,86 @@
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "data.h"
+#include "blob_ext.h"
+
+/*
+ * Content-addressed blob deduplication.
+ *
+ * When enabled, every blob whose size is at least the configured threshold
+ * is "interned": blob_create() first hashes the content and looks for an
+ * existing blob with identical content.  If one is found, its reference
+ * count is increased and it is returned in place of the new copy, which is
+ * dropped.  Since blobs never change once created, sharing them between
+ * keys and versions is safe.
+ *
+ * Interned blobs are removed from the table when their reference count
+ * drops to zero, so the table never keeps a blob alive by itself.
+ */
+
+typedef struct dedup_stats {
+    size_t lookups;         // Number of blob_create() calls eligible for dedup
+    size_t hits;            // Number of those satisfied by an existing blob
+    size_t live_blobs;      // Number of interned blobs currently alive
+    size_t live_bytes;      // Total content bytes held by interned blobs
+    size_t logical_bytes;   // Total bytes requested by eligible blob_create() calls
+    size_t bytes_saved;     // Total bytes not kept because of dedup hits
+} DEDUP_STATS;
+
+/*
+ * 64-bit FNV-1a hash of a block of data.
+ */
+static inline uint64_t fnv1a64(const char *data, size_t size){
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for(size_t i = 0; i < size; i++){
+        h ^= (unsigned char)data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Enable deduplication of blobs of at least min_size bytes.
+ * Must be called before any blobs are created.
+ */
+void dedup_init(size_t min_size);
+
+/*
+ * Disable deduplication.  Should be called only once all interned
+ * blobs have been freed.
+ */
+void dedup_fini(void);
+
+/*
+ * Determine whether a blob with the given size is subject to dedup.
+ */
+int dedup_eligible(size_t size);
+
+/*
+ * Look up or create an interned blob with the given content.
+ * The returned blob has one reference that becomes the caller's
+ * responsibility, exactly as for blob_create().
+ */
+BLOB *dedup_intern(char *content, size_t size);
+
+/*
+ * Drop a reference to an interned blob, unlinking and freeing it
+ * if it was the last one.
+ */
+void dedup_unref(BLOB *bp);
+
+/*
+ * Take a snapshot of the dedup counters.
+ */
+void dedup_get_stats(DEDUP_STATS *sp);
+
+/*
+ * Print the dedup counters, hit ratio and bytes saved to stderr.  This may
+ * be done at any time, not just on shutdown.
+ */
+void dedup_show(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+/*
+ * Event-driven server core (enabled with -e <threads>).
+ *
+ * Instead of a thread per client, a small fixed set of event-loop threads
+ * each multiplex many connections with an edge-triggered epoll instance.
+ * All of them wait on the listening socket, and a connection stays with the
+ * thread that accepted it for its whole life.  Sockets are non-blocking, the
+ * protocol is run by the state machine in conn.h, and store operations are
+ * executed inline by the event-loop thread, except for commits that would
+ * wait for other transactions, which are handed to threads of their own
+ * (see commitq.h) while the loop goes on.
+ */
+
+/*
+ * Start nthreads event-loop threads serving connections accepted on listenfd,
+ * which is made non-blocking.  The threads run until the process exits;
+ * signals are blocked in them so that SIGHUP is handled by the caller.
+ *
+ * @return  0 if successful, -1 if the threads could not be started.
+ */
+int evloop_start(int listenfd, int nthreads);
+
+#endif
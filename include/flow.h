@@ -0,0 +1,74 @@
+#ifndef __FLOW_H__
+#define __FLOW_H__
+
+#include <stddef.h>
+
+/*
+ * Per-connection output flow control metrics.
+ *
+ * Every server core keeps the replies that a client has not yet taken in
+ * a bounded queue of its own (CONN_OUT_MAX bytes for the connection state
+ * machine of conn.h, PROTO_QUEUE_MAX for the packet queue of proto_queue.h).
+ * When the queue is full, the server stops reading requests from that
+ * client until it catches up, rather than blocking a thread in a write.
+ * The size of a reply is not known until its request has been served, so
+ * the packet queue is checked before each request and may end up over its
+ * bound by the reply to one request: at most PROTO_QUEUE_MAX plus one value,
+ * or plus PROTO_BATCH_REPLY_MAX for a batch.
+ *
+ * The cores report here how many bytes are queued for each connection,
+ * after each attempt to send them, and each time a connection is stalled.
+ * The figures are kept in a table indexed by file descriptor, so that
+ * reporting is a couple of relaxed atomic stores; they can be read at any
+ * time with flow_get(), and are shown by flow_show() with the other
+ * statistics, every -S seconds and on shutdown.
+ */
+
+typedef struct flow_stats {
+    size_t queued;          // Reply bytes waiting for the client
+    size_t peak;            // Most bytes ever waiting
+    size_t stalls;          // Times reading stopped on a full queue
+} FLOW_STATS;
+
+/*
+ * Allocate the table, with room for every file descriptor the process may
+ * open.  Until this is called, reports are ignored.
+ */
+void flow_init(void);
+
+/*
+ * Start and stop tracking a connection.
+ */
+void flow_open(int fd);
+void flow_close(int fd);
+
+/*
+ * Report the number of bytes queued for a connection.
+ */
+void flow_queued(int fd, size_t bytes);
+
+/*
+ * Report that reading from a connection has stopped on a full queue.
+ */
+void flow_stalled(int fd);
+
+/*
+ * Get the figures of a connection.
+ *
+ * @return  0 if successful, -1 if the connection is not tracked.
+ */
+int flow_get(int fd, FLOW_STATS *sp);
+
+/*
+ * Get the totals over all connections, past and present: bytes queued now,
+ * the largest queue ever, and stalls.
+ */
+void flow_get_totals(FLOW_STATS *sp);
+
+/*
+ * Print the totals, and the figures of each connection with replies
+ * waiting, to stderr.
+ */
+void flow_show(void);
+
+#endif
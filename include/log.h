@@ -0,0 +1,58 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdatomic.h>
+
+/*
+ * Asynchronous logger behind the debug/info/warn/success/error macros.
+ *
+ * Each thread that logs gets its own single-producer ring of preformatted
+ * messages, and a background thread drains all the rings to stderr in
+ * batches, so a logging service thread takes no lock and makes no system
+ * call.  If a ring is full the message is dropped and counted rather than
+ * blocking the caller.
+ *
+ * Which macros exist is still decided at compile time (see debug.h); among
+ * those, the level can be changed at runtime.  The level test comes before
+ * the arguments are evaluated, so a disabled level costs one relaxed load.
+ * Before log_init() and after log_fini(), messages are written synchronously.
+ */
+typedef enum {
+    LOG_DEBUG, LOG_INFO, LOG_SUCCESS, LOG_WARN, LOG_ERROR, LOG_OFF
+} LOG_LEVEL;
+
+extern atomic_int log_level;
+
+#define LOG_ENABLED(lvl) ((lvl) >= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+/*
+ * Start the background drain thread.
+ */
+void log_init(void);
+
+/*
+ * Drain all pending messages and stop the background thread.
+ */
+void log_fini(void);
+
+/*
+ * Set the current log level.  Async-signal-safe.
+ */
+void log_set_level(int level);
+
+/*
+ * Convert a level name ("debug", "info", "success", "warn", "error", "off")
+ * to a LOG_LEVEL.
+ *
+ * @return  The level, or -1 if the name is not recognized.
+ */
+int log_parse_level(const char *name);
+
+/*
+ * Format a message and queue it on the calling thread's ring.
+ * Normally called through the macros in debug.h.
+ */
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A small, fast LZ77 codec (in the style of LZF) used to compress blob
+ * content at rest.  The compressed stream is a sequence of:
+ *
+ *   000LLLLL <L+1 literal bytes>                  literal run (1..32 bytes)
+ *   LLLooooo oooooooo                             back reference, 3..8 bytes
+ *   111ooooo LLLLLLLL oooooooo                    back reference, 9..264 bytes
+ *
+ * where the offset of a back reference is relative to the current output
+ * position (1..8192 bytes back).  Compression is deterministic: the same
+ * input always produces the same output.
+ */
+
+/*
+ * Compress in_len bytes from in into out, which has room for out_cap bytes.
+ *
+ * @return  The compressed size, or 0 if the result would not fit in out_cap
+ *   bytes (which is the usual way of rejecting incompressible data).
+ */
+size_t lz_compress(const char *in, size_t in_len, char *out, size_t out_cap);
+
+/*
+ * Decompress in_len bytes from in into out, which has room for out_cap bytes.
+ *
+ * @return  The decompressed size, or -1 if the input is corrupt or
+ *   the output would not fit.
+ */
+ssize_t lz_decompress(const char *in, size_t in_len, char *out, size_t out_cap);
+
+#endif
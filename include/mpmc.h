@@ -0,0 +1,93 @@
+#ifndef __MPMC_H__
+#define __MPMC_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A bounded lock-free multi-producer/multi-consumer FIFO queue.
+ *
+ * Items of a fixed size are copied into a ring of cells, each with a
+ * sequence number telling whether it is ready to be filled or emptied for
+ * the current lap around the ring.  A producer or consumer claims a cell
+ * with a single compare-and-swap on the tail or head index and publishes
+ * it with a release store of the sequence number, so an uncontended
+ * operation costs one atomic read-modify-write and no system call.
+ *
+ * The blocking operations only sleep (on a futex) when the queue is full
+ * or empty, after spinning briefly on a multiprocessor, and the other side
+ * only makes a wakeup call when someone is actually sleeping.
+ *
+ * The thread pool of tpool.h hands connections from the acceptor to its
+ * workers through a queue like this, and its pushes wait on a full queue
+ * with mpmc_push_unless().  Its workers do not wait in mpmc_pop(), as they
+ * have deques of their own to look at as well, but sleep on the pool.
+ */
+typedef struct mpmc_queue {
+    size_t mask;                        // Number of cells minus one
+    size_t elem_size;                   // Size of an item
+    size_t cell_size;                   // Size of a cell: sequence number and item
+    int spins;                          // Retries before a blocked operation sleeps
+    char *cells;
+    _Alignas(64) atomic_size_t head;    // Next cell to empty
+    _Alignas(64) atomic_size_t tail;    // Next cell to fill
+    _Alignas(64) atomic_uint not_empty; // Futex words, changed to wake sleepers
+    atomic_uint not_full;
+    atomic_uint pop_waiters;            // Number of threads sleeping on each
+    atomic_uint push_waiters;
+} MPMC_QUEUE;
+
+/*
+ * Initialize a queue for at least capacity items of elem_size bytes each.
+ * The capacity is rounded up to a power of two.
+ *
+ * @return  0 if successful, -1 if memory could not be allocated.
+ */
+int mpmc_init(MPMC_QUEUE *q, size_t capacity, size_t elem_size);
+
+/*
+ * Free the memory of a queue.  Items still in it are discarded.
+ */
+void mpmc_fini(MPMC_QUEUE *q);
+
+/*
+ * Copy an item into the queue if there is room.
+ *
+ * @return  true if the item was added, false if the queue was full.
+ */
+bool mpmc_try_push(MPMC_QUEUE *q, const void *item);
+
+/*
+ * Copy the oldest item out of the queue if there is one.
+ *
+ * @return  true if an item was removed, false if the queue was empty.
+ */
+bool mpmc_try_pop(MPMC_QUEUE *q, void *item);
+
+/*
+ * Add an item, waiting while the queue is full.
+ */
+void mpmc_push(MPMC_QUEUE *q, const void *item);
+
+/*
+ * Add an item, waiting while the queue is full, unless cancel (if not
+ * NULL) is set.  Whoever sets it then calls mpmc_wake_all(), which ends
+ * the wait.
+ *
+ * @return  true if the item was added, false if cancel was set first.
+ */
+bool mpmc_push_unless(MPMC_QUEUE *q, const void *item, atomic_bool *cancel);
+
+/*
+ * Wake every thread waiting on the queue, to look again at whatever made
+ * it wait.
+ */
+void mpmc_wake_all(MPMC_QUEUE *q);
+
+/*
+ * Remove the oldest item, waiting while the queue is empty.
+ */
+void mpmc_pop(MPMC_QUEUE *q, void *item);
+
+#endif
@@ -0,0 +1,167 @@
+#ifndef __PROTO2_H__
+#define __PROTO2_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact wire format ("v2"), negotiated per connection.
+ *
+ * A v1 connection starts with a packet header, whose first byte is a
+ * nonzero packet type.  A v2 client instead starts with a four-byte
+ * preface: a zero byte, 'X', '2', and a byte of PROTO2_OPT_* options it
+ * asks for.  The server answers with the same preface carrying the options
+ * it grants, and from then on both sides exchange frames.
+ *
+ * A frame is a varint (LEB128) length followed by that many bytes of body.
+ * All integers in a body are varints, so a request on a short key costs a
+ * few bytes of overhead instead of a 24-byte header per packet.
+ *
+ * Request body:
+ *   op        One byte: a packet type from protocol.h (PUT, GET, COMMIT),
+ *             proto_batch.h (MGET, MPUT) or proto_session.h (BEGIN), ORed
+ *             with PROTO2_F_* flags
+ *   serial    Echoed in the reply
+ *   [sec nsec]  Timestamp, only if PROTO2_F_TS is set
+ *   PUT:      key length, key, then the value up to the end of the frame
+ *             (absent if PROTO2_F_NULL is set)
+ *   GET:      the key, up to the end of the frame
+ *   MGET, MPUT:  a framed batch payload (see proto_batch.h)
+ *
+ * Reply body:
+ *   status    One byte: a TRANS_STATUS, or one of proto_status.h, ORed
+ *             with PROTO2_F_* flags (including PROTO2_F_REASON, which only
+ *             replies have); XACTO_OVERLOADED only if the client asked for
+ *             PROTO2_OPT_OVERLOAD, TRANS_ABORTED in its place otherwise
+ *   serial    Of the request
+ *   [sec nsec]  Timestamp, only if PROTO2_F_TS is set; the server sets it
+ *             if the client asked for PROTO2_OPT_TS
+ *   [size]    Uncompressed size of the value, only if PROTO2_F_LZ is set
+ *   [reason retry key]  Why the transaction was aborted, the suggested
+ *             delay in microseconds and the key hash (see proto_status.h),
+ *             only if PROTO2_F_REASON is set; the server sets it on aborted
+ *             replies if the client asked for PROTO2_OPT_REASON
+ *   value     Only if PROTO2_F_VALUE is set (GET and MGET), up to the end
+ *             of the frame; absent if PROTO2_F_NULL is also set.  For an
+ *             MGET it is a framed batch payload.  With PROTO2_F_LZ the value
+ *             is in the compressed form of lz.h, which the server only sends
+ *             to a client that asked for PROTO2_OPT_LZ.
+ */
+#define PROTO2_PREFACE_LEN 4
+#define PROTO2_OPT_TS 0x01          /* Timestamp replies */
+#define PROTO2_OPT_LZ 0x02          /* Values may be sent compressed */
+#define PROTO2_OPT_REASON 0x04      /* Explain aborts */
+#define PROTO2_OPT_OVERLOAD 0x08    /* Tell rejected transactions apart (XACTO_OVERLOADED) */
+
+#define PROTO2_F_TS 0x80
+#define PROTO2_F_NULL 0x40
+#define PROTO2_F_LZ 0x20
+#define PROTO2_F_VALUE 0x10
+#define PROTO2_F_MASK 0xf0
+#define PROTO2_F_REASON 0x08        /* Replies only: statuses are below it */
+
+#define PROTO2_VARINT_MAX 10        /* Longest encoding of a 64-bit varint */
+#define PROTO2_HEAD_MAX (PROTO2_VARINT_MAX * 9 + 1)    /* Longest reply head */
+#define PROTO2_FRAME_MAX (0x100000 + 64)   /* Largest frame body accepted */
+
+/*
+ * A request, as parsed from a frame.  Key and value point into the frame.
+ */
+typedef struct proto2_req {
+    uint8_t op;             // Packet type, without flags
+    uint8_t flags;
+    uint32_t serial;
+    char *key;
+    size_t klen;
+    char *value;            // NULL for a null value; the batch payload for MGET/MPUT
+    size_t vlen;
+} PROTO2_REQ;
+
+/*
+ * A reply head: everything up to the value.
+ */
+typedef struct proto2_reply {
+    uint8_t status;
+    uint8_t flags;
+    uint32_t serial;
+    size_t vlen;            // Bytes of value that follow the head
+    size_t rawlen;          // Uncompressed size, if PROTO2_F_LZ
+    uint8_t reason;         // If PROTO2_F_REASON: an XACTO_REASON,
+    uint32_t retry_us;      // the suggested delay,
+    uint32_t key_hash;      // and the key hash
+} PROTO2_REPLY;
+
+/*
+ * Encode an unsigned integer as a varint at p.
+ *
+ * @return  The number of bytes written, at most PROTO2_VARINT_MAX.
+ */
+int proto2_put_varint(char *p, uint64_t v);
+
+/*
+ * Decode a varint from at most n bytes at p.
+ *
+ * @return  The number of bytes it took, 0 if it is incomplete, or -1 if
+ *   it is too long to be valid or its value does not fit in 64 bits.
+ */
+int proto2_get_varint(const char *p, size_t n, uint64_t *vp);
+
+/*
+ * Determine whether the bytes at the start of a connection are a v2
+ * preface.  At least one byte must be given.
+ *
+ * @return  1 for a v2 preface (*optsp set to the options requested),
+ *   0 for v1, -1 if more bytes are needed, or -2 if the preface is invalid.
+ */
+int proto2_detect(const char *p, size_t n, uint8_t *optsp);
+
+/*
+ * Write the preface granting the given options at p.
+ */
+void proto2_preface(char *p, uint8_t opts);
+
+/*
+ * Find the extent of the frame at p, of which n bytes are available.
+ *
+ * @return  The number of bytes taken by the length prefix, with *lenp set
+ *   to the length of the body; 0 if the length is incomplete; -1 if the
+ *   frame is invalid or too large.
+ */
+int proto2_frame(const char *p, size_t n, size_t *lenp);
+
+/*
+ * Parse a request body.
+ *
+ * @return  0 if successful, -1 if the request is malformed.
+ */
+int proto2_parse(char *body, size_t len, PROTO2_REQ *req);
+
+/*
+ * Encode a reply frame up to its value, which the caller sends next.
+ * A timestamp is included if PROTO2_F_TS is set in the flags.
+ *
+ * @param buf  At least PROTO2_HEAD_MAX bytes.
+ * @return  The number of bytes written.
+ */
+size_t proto2_reply_head(char *buf, PROTO2_REPLY *r);
+
+/*
+ * Client side: encode a request frame up to its key (for a PUT, up to and
+ * including the length of the key), which the caller sends next, followed
+ * by the value.  The length of the frame is computed from req->klen and
+ * req->vlen; the key and value pointers are not used.
+ *
+ * @param buf  At least PROTO2_HEAD_MAX bytes.
+ * @return  The number of bytes written.
+ */
+size_t proto2_request_head(char *buf, PROTO2_REQ *req);
+
+/*
+ * Client side: parse a reply body.  *valuep is set to the value, which
+ * points into the body, or NULL if there is none or it is null.
+ *
+ * @return  0 if successful, -1 if the reply is malformed.
+ */
+int proto2_parse_reply(char *body, size_t len, PROTO2_REPLY *r, char **valuep);
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef __PROTO_BATCH_H__
+#define __PROTO_BATCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h"
+
+/*
+ * Batched requests, an extension of the protocol in protocol.h.
+ *
+ * A batched request carries all its keys (and values) in the payload of
+ * the request packet itself, with no separate KEY or VALUE packets:
+ *
+ *   MGET:    Get the values of many keys
+ *            (payload: count, then count keys)
+ *            (reply: REPLY with status, then one VALUE packet whose
+ *             payload holds count values, in the order of the keys)
+ *   MPUT:    Put many key/value mappings
+ *            (payload: count, then count pairs of key and value)
+ *            (reply: REPLY with status)
+ *
+ * The operations are performed in order, as by the corresponding sequence
+ * of GET or PUT requests, and stop when the transaction aborts; values not
+ * read are then null.  The payload of an MGET reply may be no larger than
+ * PROTO_BATCH_REPLY_MAX, the most a client takes in one packet: an MGET
+ * whose values would not fit aborts its transaction (for the reason
+ * XACTO_REASON_TOO_LARGE, see proto_status.h), and all its values are
+ * then null.
+ *
+ * A framed payload is a 32-bit count followed by items, each a 32-bit
+ * length and that many bytes, all in network byte order.  A length of
+ * PROTO_BATCH_NULL, with no bytes following, is a null item, which is
+ * allowed for values only.
+ */
+#define XACTO_MGET_PKT (XACTO_REPLY_PKT + 1)
+#define XACTO_MPUT_PKT (XACTO_REPLY_PKT + 2)
+
+#define PROTO_BATCH_NULL 0xffffffff
+#define PROTO_BATCH_REPLY_MAX 0x100000
+
+/*
+ * Cursor over the items of a framed payload.
+ */
+typedef struct proto_batch {
+    char *data;
+    size_t size;
+    size_t off;             // Offset of the next item
+    uint32_t count;         // Count found at the start of the payload
+} PROTO_BATCH;
+
+/*
+ * Start reading a framed payload.
+ *
+ * @param items  Number of items expected per counted entry (1 for MGET,
+ *   2 for MPUT), used to reject counts that the payload cannot hold.
+ * @return  0 if successful, -1 if the payload is malformed.
+ */
+int proto_batch_open(PROTO_BATCH *b, void *data, size_t size, int items);
+
+/*
+ * Read the next item of a framed payload.  The item is not copied:
+ * *itemp points into the payload, or is NULL for a null item.
+ *
+ * @return  0 if successful, -1 if the payload ends before the item does.
+ */
+int proto_batch_next(PROTO_BATCH *b, char **itemp, size_t *lenp);
+
+/*
+ * Size of an item of len bytes in a framed payload.
+ */
+static inline size_t proto_batch_item_size(size_t len){
+    return sizeof(uint32_t) + len;
+}
+
+/*
+ * Write the count of a framed payload, or an item (a null item if item is
+ * NULL), at p.
+ *
+ * @return  The address just past what was written.
+ */
+char *proto_batch_put_count(char *p, uint32_t count);
+char *proto_batch_put(char *p, const void *item, size_t len);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __PROTO_QUEUE_H__
+#define __PROTO_QUEUE_H__
+
+#include <sys/uio.h>
+
+#include "protocol.h"
+#include "settings.h"
+
+/*
+ * An outgoing packet queue.  Packets (header plus payload) are gathered
+ * into an iovec array and written with a single sendmsg() call when the
+ * queue is flushed, so that all the packets making up a reply, or the
+ * replies to a whole batch of requests, go out in one system call and
+ * usually in one TCP segment.
+ *
+ * Headers are copied into the queue, but payloads are not: a payload must
+ * remain valid until it has been written.  The release function given with
+ * a payload, if any, is called once that is the case (or once the packet
+ * has been discarded because of an error).
+ *
+ * A queue can also be sent without waiting for the client to read: what
+ * the socket does not take is copied into a backlog, ahead of which
+ * nothing is sent, so that a client slow to read its replies does not
+ * hold up the thread serving it (see flow.h).
+ */
+typedef void (*proto_release_t)(void *arg, void *data);
+
+typedef struct proto_queue {
+    int fd;                                     // Where packets are sent
+    int npkts;                                  // Number of packets queued
+    int iovcnt;                                 // Number of iovec entries used
+    size_t bytes;                               // Total bytes queued
+    XACTO_PACKET hdrs[PROTO_QUEUE_PKTS];        // Copies of queued headers
+    struct iovec iov[2 * PROTO_QUEUE_PKTS];     // Header and payload segments
+    struct {
+        proto_release_t func;
+        void *arg;
+        void *data;
+    } release[PROTO_QUEUE_PKTS];                // Payload release callbacks
+    char *backlog;                              // Bytes the socket would not take yet
+    size_t backlog_start, backlog_end;          // Extent of the unsent bytes
+    size_t backlog_cap;                         // Allocated size
+} PROTO_QUEUE;
+
+/*
+ * Fill in the header of an outgoing packet, with multi-byte fields in
+ * network byte order.  The serial number is taken to be in network byte
+ * order already, as it is normally copied from a request.
+ */
+void proto_init_header(XACTO_PACKET *pkt, uint8_t type, uint32_t serial);
+
+/*
+ * Initialize an empty queue for packets to be sent on fd.
+ */
+void proto_queue_init(PROTO_QUEUE *q, int fd);
+
+/*
+ * Free the backlog of a queue.
+ */
+void proto_queue_fini(PROTO_QUEUE *q);
+
+/*
+ * Add a packet to a queue.  The header is in network byte order, as for
+ * proto_send_packet().  If the queue is already full it is sent first, as
+ * by proto_queue_send().
+ *
+ * @param release  Function to call once data is no longer needed, or NULL.
+ * @param arg  Argument passed to the release function.
+ * @return  0 if successful, -1 if a send was needed and failed.
+ *   The release function has been called in the latter case.
+ */
+int proto_queue_packet(PROTO_QUEUE *q, XACTO_PACKET *pkt, void *data,
+                       proto_release_t release, void *arg);
+
+/*
+ * Write as much of the backlog and the queued packets as the socket takes
+ * without waiting, copy the rest into the backlog, and empty the queue.
+ *
+ * @return  0 if successful, -1 otherwise, with errno set.  Either way the
+ *   queue is empty afterwards and all release functions have been called.
+ */
+int proto_queue_send(PROTO_QUEUE *q);
+
+/*
+ * Get the number of bytes in the backlog.
+ */
+size_t proto_queue_backlog(PROTO_QUEUE *q);
+
+/*
+ * Write the backlog and all queued packets, waiting as long as it takes,
+ * and empty the queue.
+ *
+ * @return  0 if successful, -1 otherwise, with errno set.  Either way the
+ *   queue is empty afterwards and all release functions have been called.
+ */
+int proto_queue_flush(PROTO_QUEUE *q);
+
+/*
+ * Write out a sequence of iovecs in full, with as few system calls as
+ * possible.  The iovec array is modified.
+ *
+ * @return  0 if successful, -1 otherwise, with errno set.
+ */
+int proto_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef __PROTO_RBUF_H__
+#define __PROTO_RBUF_H__
+
+#include "protocol.h"
+#include "wrappers.h"
+
+/*
+ * Buffered packet reception.
+ *
+ * Instead of separate read() calls for every header and payload, each
+ * connection has a Rio read buffer that is filled with as much as the
+ * socket has to offer, and packets are parsed out of it.  A burst of
+ * small pipelined packets thus costs a single system call.
+ */
+
+/*
+ * Receive a packet through a connection's read buffer, blocking until one
+ * is available.  As with proto_recv_packet(), the returned header has its
+ * multi-byte fields in network byte order.
+ *
+ * A payload that fits in the read buffer is handed out as a slice of it:
+ * *datap then points into the buffer, *ownedp is set to 0, and the data
+ * is only valid until the next receive on the same buffer.  A larger
+ * payload is read into malloc'd storage, *ownedp is set to 1, and the
+ * caller must free it.  If there is no payload, *datap is set to NULL.
+ *
+ * @return  0 in case of successful reception, -1 otherwise.  In the
+ *   latter case, errno is set to indicate the error (0 for a clean EOF
+ *   before the start of a packet).
+ */
+int proto_recv_packet_buffered(rio_t *rp, XACTO_PACKET *pkt, void **datap, int *ownedp);
+
+/*
+ * Number of bytes received but not yet parsed in a connection's read buffer.
+ * Nonzero means that more requests are already waiting to be processed.
+ */
+static inline int proto_buffered(rio_t *rp){
+    return rp->rio_cnt > 0 ? rp->rio_cnt : 0;
+}
+
+#endif
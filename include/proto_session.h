@@ -0,0 +1,29 @@
+#ifndef __PROTO_SESSION_H__
+#define __PROTO_SESSION_H__
+
+#include "protocol.h"
+
+/*
+ * Sessions: several transactions on one connection, an extension of the
+ * protocol in protocol.h.
+ *
+ * Without sessions, a connection is a single transaction, which starts
+ * when the connection is accepted and ends the service with its COMMIT or
+ * abort.  Sending a BEGIN request turns the connection into a session:
+ *
+ *   BEGIN:   Start a new transaction
+ *            (sends request serial #)
+ *            (reply echoes serial # and returns TRANS_PENDING)
+ *
+ * A transaction still pending on the connection when BEGIN arrives is
+ * aborted.  In a session the connection stays open when a transaction
+ * ends, and the request following a COMMIT implicitly begins the next
+ * transaction, so a pooled connection can just go on sending requests.
+ * A transaction aborted by the store, on the other hand, remains current
+ * until its COMMIT (or a BEGIN): requests pipelined behind the one that
+ * failed are answered TRANS_ABORTED without effect, rather than being
+ * performed in a transaction of their own.
+ */
+#define XACTO_BEGIN_PKT (XACTO_REPLY_PKT + 3)
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef __PROTO_STATUS_H__
+#define __PROTO_STATUS_H__
+
+#include <stdint.h>
+
+#include "transaction.h"
+
+/*
+ * Reply statuses beyond the TRANS_STATUS values, an extension of the
+ * protocol in protocol.h (and proto2.h).
+ *
+ *   XACTO_OVERLOADED:  The server did not admit the transaction that the
+ *            request would have started (see admit.h), and did nothing.
+ *            Like an abort, this holds for every request up to and
+ *            including the COMMIT of that transaction, and ends the service
+ *            of a connection that is not a session.  The client may try
+ *            the transaction again later.  Only a v2 client that asks for
+ *            PROTO2_OPT_OVERLOAD (see proto2.h) gets this status; others
+ *            are answered TRANS_ABORTED, as before admission control.
+ */
+#define XACTO_OVERLOADED (TRANS_ABORTED + 1)
+
+/*
+ * Why a transaction was aborted, given to a v2 client that asks for
+ * PROTO2_OPT_REASON (see proto2.h) with every reply of status
+ * TRANS_ABORTED or XACTO_OVERLOADED from then on:
+ *
+ *   CONFLICT:    A newer transaction had already accessed a key that it
+ *                tried to access, so it could not be ordered before it.
+ *   DEPENDENCY:  A transaction whose version of a key it had seen or
+ *                written over was aborted, or it was still depending on
+ *                one that aborted when it tried to commit.
+ *   EXPIRED:     It overstayed its lifetime (see timeout.h).
+ *   OVERLOADED:  It was not admitted (see admit.h).
+ *   TOO_LARGE:   An MGET would have read more than PROTO_BATCH_REPLY_MAX
+ *                bytes of values, more than its reply may carry (see
+ *                proto_batch.h).  Trying again does not help unless
+ *                those values have shrunk meanwhile.
+ *
+ * protocol.h replies, which have no way to ask for it, do not carry the
+ * reason: their null field stays zero.  Along with the reason, the client
+ * gets the hash of the key involved, if any, and a delay the server
+ * suggests waiting before trying again, which grows with the number of
+ * transactions in progress.  A client that
+ * waits at least that long keeps the retries of aborted transactions from
+ * adding to the contention that aborted them.
+ */
+typedef enum {
+    XACTO_REASON_NONE,      // Not aborted
+    XACTO_REASON_CONFLICT,
+    XACTO_REASON_DEPENDENCY,
+    XACTO_REASON_EXPIRED,
+    XACTO_REASON_OVERLOADED,
+    XACTO_REASON_TOO_LARGE
+} XACTO_REASON;
+
+#define XACTO_REASONS (XACTO_REASON_TOO_LARGE + 1)
+
+typedef struct xacto_abort_info {
+    uint8_t reason;         // An XACTO_REASON
+    uint32_t retry_us;      // Suggested delay before trying again, or 0
+    uint32_t key_hash;      // Hash of the key involved (blob_hash()), or 0
+} XACTO_ABORT_INFO;
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __REASON_H__
+#define __REASON_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "proto_status.h"
+
+/*
+ * Abort reasons (see proto_status.h).
+ *
+ * Whoever aborts a transaction for a reason that the thread serving its
+ * client cannot see for itself records it first, in a table indexed by
+ * transaction ID: the store, for a conflict and for the transactions it
+ * aborts in a cascade.  When that thread then finds the transaction
+ * aborted, it explains the abort from the table, or else from where it
+ * found out: a transaction aborted by trans_commit() was waiting on one
+ * that aborted, one found aborted by any other request was aborted through
+ * the client registry for overstaying its lifetime, and one that was not
+ * admitted is known to the thread already.
+ *
+ * The table is not synchronized beyond each of its words, and its slots
+ * are shared by IDs ABORT_REASON_SLOTS apart; a reason lost to either is
+ * taken for the one the thread would guess.  Reasons are only advice.
+ */
+
+/*
+ * Record why a transaction is about to be aborted, unless a reason has
+ * been recorded for it already, with the hash of the key involved.
+ */
+void reason_set(int id, XACTO_REASON reason, uint32_t key_hash);
+
+/*
+ * Explain the abort of a transaction, the first time a request in it is
+ * answered with an abort: fill in the reason recorded for it, or the one
+ * given if there is none, with the suggested delay before a retry.  Once
+ * *ip has a reason, it is left alone.
+ */
+void reason_explain(XACTO_ABORT_INFO *ip, int id, XACTO_REASON otherwise);
+
+/*
+ * Get the number of aborts explained so far, indexed by XACTO_REASON.
+ */
+void reason_get_counts(size_t counts[XACTO_REASONS]);
+
+/*
+ * Print the counts to stderr.
+ */
+void reason_show(void);
+
+#endif
@@ -1,3 +1,6 @@
+#include <stdint.h>
+#include <errno.h>
+
 #ifdef __APPLE__
 #include <dispatch/dispatch.h>
 #else
@@ -0,0 +1,49 @@
+#ifndef __SERVICE_H__
+#define __SERVICE_H__
+
+#include "tpool.h"
+
+/*
+ * Settings of the client service loop (see server.c) that can be changed
+ * from the command line.  They must be set before clients are accepted.
+ */
+
+/*
+ * Request pipelining.
+ *
+ * A client need not wait for the reply to one request before sending the
+ * next: requests on a connection are processed in the order received and
+ * each reply carries the serial number of its request.  Replies are held
+ * back while more requests are already buffered, so that a burst of
+ * requests is answered with a single write.  Once max_inflight requests
+ * have been taken from a connection without their replies having all gone
+ * out, no more are read from it until they have.
+ */
+void service_set_max_inflight(int max_inflight);
+int service_max_inflight(void);
+
+/*
+ * Client services on a thread pool (option -t, see tpool.h).
+ *
+ * A service run by a pool worker does not keep it while other connections
+ * are queued for the pool: before its first request, and between the
+ * transactions of a session, with every reply sent, the service goes to
+ * the back of the queue, or if its client is idle, is parked until the
+ * client sends more, and then goes on on whichever worker is free.  If the
+ * pool stops meanwhile, the connection is closed.  A service keeps its
+ * worker within a transaction, and over shared memory (see shm.h).
+ */
+void service_set_pool(tpool_t *pool);
+
+/*
+ * Graceful shutdown (SIGHUP, see main.c).
+ *
+ * Once draining has begun, no transaction is started on a connection: a
+ * session ends when the transaction in progress, if any, has committed or
+ * aborted, as does any other connection, so that the clients can go on
+ * elsewhere without having a transaction aborted under them.
+ */
+void service_drain(void);
+int service_draining(void);
+
+#endif
@@ -3,6 +3,105 @@
 
 #include <limits.h>
 
-#define MAX_CLIENTS 1024
+/* Client registry (see creg_ext.h) */
+#define CREG_CHUNK 1024             /* Entries allocated at a time */
+#define CREG_CHUNKS 4096            /* Chunks at most: file descriptors up to 4M */
 
-#endif
\ No newline at end of file
+/* Thread pool for client sessions (enabled with -t <threads>) */
+#define TPOOL_DEQUE_SIZE 256        /* Jobs queued per worker */
+#define TPOOL_QUEUE_SIZE 1024       /* Jobs queued from outside the pool */
+#define MPMC_SPINS 100              /* Retries before a blocked queue operation sleeps (SMP only) */
+#define TPOOL_PARK_EVENTS 64        /* Parked jobs woken per epoll_wait() */
+#define TPOOL_YIELD_MS 10           /* How often a session waiting on its client checks for queued ones */
+
+/* Blob dedup table (enabled with -d <min_size>) */
+#define DEDUP_BUCKETS 4096      /* Must be a power of two */
+#define DEDUP_STRIPES 64        /* Number of locks protecting the buckets */
+
+/* Blob compression (enabled with -z <min_size>) */
+#define COMPRESS_MIN_SAVING 8   /* Keep compressed form only if it saves >= 1/8 */
+
+/* Outgoing packet queues */
+#define PROTO_QUEUE_PKTS 64         /* Packets gathered into one sendmsg() */
+
+/* Output flow control (see flow.h) */
+#define CONN_OUT_MAX (256 * 1024)   /* Reply bytes queued before a connection stops reading */
+#define PROTO_QUEUE_MAX (256 * 1024) /* Same, for a v1 client served by a thread (plus one reply) */
+
+/* Statistics (reported every -S <seconds> while running, and on shutdown) */
+#define STATS_INTERVAL 0            /* Seconds between reports; 0 for none */
+
+/* Graceful shutdown on SIGHUP (deadline set with -g <seconds>) */
+#define DRAIN_TIMEOUT 10            /* Seconds given to transactions in progress */
+
+/* Idle and transaction timeouts (set with -w <seconds> and -x <seconds>, see timeout.h) */
+#define IDLE_TIMEOUT 0              /* Seconds without traffic before a connection is closed; 0 for none */
+#define TRANS_LIFETIME 0            /* Seconds a transaction may last before it is aborted; 0 for none */
+#define TIMEOUT_TICK_MS 100         /* Resolution of the timers */
+#define TIMEOUT_LIFETIME_DIV 8      /* Fraction of the lifetime a new transaction may overstay it by */
+#define TWHEEL_BITS 6               /* Timing wheel levels have 2^TWHEEL_BITS slots */
+#define TWHEEL_LEVELS 4             /* Span: 2^(TWHEEL_BITS * TWHEEL_LEVELS) ticks */
+
+/* Admission control (thresholds set with -m, -k and -c, see admit.h) */
+#define ADMIT_MAX_PENDING 0         /* Transactions in progress; 0 for no limit */
+#define ADMIT_MAX_DEPTH 0           /* Average dependency chain length; 0 for no limit */
+#define ADMIT_MAX_COMMIT_MS 0       /* Average commit time; 0 for no limit */
+#define ADMIT_PROBE 16              /* One in this many is admitted past the averages */
+#define ADMIT_DEPTH_SLOTS 65536     /* Chain lengths remembered; a power of two */
+#define ADMIT_AVG_SHIFT 4           /* Moving averages weigh a new commit 1/2^ADMIT_AVG_SHIFT */
+
+/* Abort reasons and suggested retry delays (see proto_status.h, reason.h) */
+#define ABORT_RETRY_CONFLICT_US 200     /* After a conflict or a dependency abort */
+#define ABORT_RETRY_OVERLOAD_US 5000    /* After a transaction was not admitted */
+#define ABORT_RETRY_LOAD_STEP 16        /* Each this many transactions in progress add the base delay */
+#define ABORT_RETRY_MAX_US 500000       /* Cap on a suggested delay */
+#define ABORT_REASON_SLOTS 65536        /* Reasons remembered; a power of two */
+
+/* Request pipelining (cap set with -i <max_inflight>) */
+#define MAX_INFLIGHT 32             /* Requests taken ahead of their replies, by default */
+
+/* Event-loop server core (enabled with -e <threads>) */
+#define EVLOOP_EVENTS 64            /* Events handled per epoll_wait() */
+#define CONN_BUF_INIT 8192          /* Initial size of connection buffers */
+#define CONN_BUF_MAX 65536          /* Larger buffers are freed once empty */
+#define CONN_SEND_REF_MIN 1024      /* Values this large are sent from their blobs, not copied */
+#define CONN_SEND_IOV 64            /* Pieces of replies gathered into one send */
+#define COMMITQ_THREADS 64          /* Commits waiting on threads of their own, at most (see commitq.h) */
+#define COMMITQ_STACK (64 * 1024)   /* Stack size of those threads */
+
+/* io_uring server core (enabled with -u <threads>) */
+#define URING_ENTRIES 256           /* Submission queue size */
+#define URING_BUFS 256              /* Receive buffers per ring; a power of two */
+#define URING_BUF_SIZE 4096         /* Size of each receive buffer */
+
+/* Shared-memory transport for local clients (Unix domain socket, -s <path>) */
+#define SHM_RING_SIZE (256 * 1024)  /* Bytes per direction */
+#define SHM_SPINS 2000              /* Retries before a side sleeps (SMP only) */
+
+/* Asynchronous logger (level set with -l <level>, SIGUSR1/SIGUSR2 at runtime) */
+#define LOG_RING_SLOTS 256          /* Messages buffered per thread */
+#define LOG_MSG_MAX 256             /* Longest formatted message */
+#define LOG_DRAIN_INTERVAL_US 2000  /* How often the drain thread wakes up */
+
+/* Client library (lib/libxclient.a, see xclient.h) */
+#define XC_FLUSH_SIZE (64 * 1024)   /* Queued request bytes that trigger a send */
+#define XC_READ_SIZE (64 * 1024)    /* Room offered to each read of replies */
+#define XC_BACKOFF_MIN_US 100       /* Delay before the first retry of an aborted transaction */
+#define XC_BACKOFF_MAX_US 100000    /* Cap on the delay, which doubles with each retry */
+
+/* Load generator (bin/xacto_bench, defaults of its options) */
+#define BENCH_SESSIONS 8            /* Concurrent sessions (-n) */
+#define BENCH_DURATION 10           /* Seconds of load (-d) */
+#define BENCH_OPS 4                 /* Requests per transaction before COMMIT (-o) */
+#define BENCH_READ_PCT 50           /* Percentage of requests that are GETs (-r) */
+#define BENCH_KEYS 10000            /* Distinct keys (-k) */
+#define BENCH_KEY_SIZE 16           /* Bytes per key (-K) */
+#define BENCH_VALUE_SIZE 100        /* Bytes per value (-V) */
+#define BENCH_HIST_SUB_BITS 4       /* Latency histograms: 2^BITS buckets per power of two */
+
+/* Connection handoff benchmark (bin/xacto_handoff, defaults of its options) */
+#define HANDOFF_THREADS 4           /* Producers, and consumers (-t) */
+#define HANDOFF_ITEMS 100000        /* Items handed over per producer (-n) */
+#define HANDOFF_QUEUE_SIZE 64       /* Capacity of the queue (-q) */
+
+#endif
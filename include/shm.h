@@ -0,0 +1,127 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "settings.h"
+
+/*
+ * Shared-memory transport for clients on the same host.
+ *
+ * A client connected over the Unix domain socket (see main.c, option -s)
+ * may send the preface SHM_PREFACE instead of its first request.  The
+ * server answers with the same preface, passing along (SCM_RIGHTS) a memfd
+ * holding a pair of single-producer/single-consumer byte rings, one for
+ * requests and one for replies, and an eventfd for each side.  From then
+ * on the byte stream that would have gone over the socket, in either wire
+ * format, goes through the rings instead; the socket is only kept to tell
+ * when the other side goes away.
+ *
+ * Moving bytes through a ring takes no system call.  A side only sleeps
+ * (in poll() on its eventfd and the socket) when it has nothing to do,
+ * after spinning briefly on a multiprocessor, and the other side only
+ * writes to the eventfd when it knows the sleeper is there.
+ *
+ * Either side can write anywhere in the region, so neither trusts the
+ * other with its indices: each keeps its own copy of those it advances,
+ * and reads those of the peer once per operation.  If the peer's index
+ * would put more than SHM_RING_SIZE bytes in a ring, or fewer than none,
+ * the channel is broken: nothing more moves through it, and shm_wait()
+ * fails as if the peer had gone away.
+ */
+#define SHM_PREFACE "\0XM"
+#define SHM_PREFACE_LEN 4          /* Including a byte of options, 0 for now */
+#define SHM_MAGIC 0x58534d31        /* "XSM1" */
+
+typedef struct shm_ring {
+    _Alignas(64) _Atomic uint64_t head;     // Bytes consumed, ever
+    _Alignas(64) _Atomic uint64_t tail;     // Bytes produced, ever
+    _Alignas(64) char data[SHM_RING_SIZE];
+} SHM_RING;
+
+typedef struct shm_region {
+    uint32_t magic;
+    uint32_t ring_size;
+    _Alignas(64) atomic_int sleeping[2];    // Server, client: in poll()
+    SHM_RING rings[2];                      // Requests, replies
+} SHM_REGION;
+
+/*
+ * One side of a shared-memory channel.
+ */
+typedef struct shm_chan {
+    SHM_REGION *region;
+    SHM_RING *rx, *tx;                      // Ring read, ring written
+    atomic_int *sleeping, *peer_sleeping;
+    int efd, peer_efd;                      // Eventfds to sleep on and to wake the peer
+    int sock;                               // Socket of the connection
+    int spins;                              // Retries before sleeping
+    uint64_t rx_head, tx_tail;              // Our own indices, as we last set them
+    int broken;                             // The peer has corrupted a ring
+} SHM_CHAN;
+
+/*
+ * Server side: create a channel for a client whose preface has been
+ * received on sock, and answer the preface with it.
+ *
+ * @return  The channel, or NULL if it could not be set up.
+ */
+SHM_CHAN *shm_chan_create(int sock);
+
+/*
+ * Client side: send the preface on sock, a Unix domain socket connected to
+ * the server, and map the channel passed back.
+ *
+ * @return  The channel, or NULL if it could not be set up.
+ */
+SHM_CHAN *shm_chan_connect(int sock);
+
+/*
+ * Unmap a channel and close its eventfds.  The socket is left open.
+ */
+void shm_chan_destroy(SHM_CHAN *ch);
+
+/*
+ * Number of bytes that can be read, or written without waiting; 0 once
+ * the channel is broken.
+ */
+size_t shm_readable(SHM_CHAN *ch);
+size_t shm_writable(SHM_CHAN *ch);
+
+/*
+ * Copy up to n bytes out of or into the channel, without waiting, and
+ * wake the peer if it is sleeping.
+ *
+ * @return  The number of bytes copied.
+ */
+size_t shm_read(SHM_CHAN *ch, void *buf, size_t n);
+size_t shm_write(SHM_CHAN *ch, const void *buf, size_t n);
+
+/*
+ * Wait until there is something to read (SHM_READABLE in events) or room
+ * to write (SHM_WRITABLE), or the socket has an event (which, there being
+ * no traffic on it, means that the peer has gone away or the connection
+ * has been shut down).
+ *
+ * @return  0 if the channel is ready, -1 if the socket has an event or
+ *   the channel is broken.
+ */
+#define SHM_READABLE 1
+#define SHM_WRITABLE 2
+
+int shm_wait(SHM_CHAN *ch, int events);
+
+/*
+ * Blocking transfers, for clients.
+ *
+ * shm_send() writes all n bytes, returning 0, or -1 if the connection
+ * ended first.  shm_recv() reads between 1 and n bytes, returning how many,
+ * or 0 if the connection ended.
+ */
+int shm_send(SHM_CHAN *ch, const void *buf, size_t n);
+ssize_t shm_recv(SHM_CHAN *ch, void *buf, size_t n);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef __STORE_BATCH_H__
+#define __STORE_BATCH_H__
+
+#include "store.h"
+
+/*
+ * Batched store operations, for requests carrying many keys (see
+ * proto_batch.h).  They behave like the corresponding sequence of
+ * store_put() or store_get() calls, but lock the store only once.
+ * Once an operation aborts the transaction, the following ones are not
+ * performed.
+ */
+
+/*
+ * Put n key/value mappings in the store, in order.  All the keys are
+ * inherited and one reference on each non-NULL value is consumed.
+ *
+ * @return  Updated status of the transaction, as for store_put().
+ */
+TRANS_STATUS store_put_many(TRANSACTION *tp, KEY **keys, BLOB **values, int n);
+
+/*
+ * Get the values associated with n keys, in order.  All the keys are
+ * inherited.  The caller is responsible for one reference on each value
+ * returned; values not read because the transaction aborted are NULL.
+ *
+ * @return  Updated status of the transaction, as for store_get().
+ */
+TRANS_STATUS store_get_many(TRANSACTION *tp, KEY **keys, BLOB **values, int n);
+
+#endif
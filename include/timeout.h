@@ -0,0 +1,58 @@
+#ifndef __TIMEOUT_H__
+#define __TIMEOUT_H__
+
+#include <stddef.h>
+
+/*
+ * Idle-connection and transaction-lifetime timeouts.
+ *
+ * A client that goes silent in the middle of a transaction leaves its
+ * pending versions in the store, and every transaction that touches the
+ * same keys comes to depend on it and waits in commit for as long as it
+ * stays.  So a transaction is aborted once it has been going on for longer
+ * than the transaction lifetime (option -x), which releases its dependents
+ * at once; its client finds out with the reply to its next request.  A
+ * connection is shut down, and its transaction aborted, once no bytes have
+ * gone either way on it for the idle timeout (option -w).  Transactions
+ * are aborted through the client registry (see creg_abort_transaction()),
+ * which keeps this from racing with the commit of the transaction.
+ *
+ * Each connection has a timer on a timing wheel (see twheel.h), driven by
+ * a thread of its own every TIMEOUT_TICK_MS.  The activity of the clients
+ * is read from the client registry (see creg_ext.h), so serving a request
+ * costs nothing more here: when the timer of a connection expires, it is
+ * started again for the time left to the nearer of the two deadlines, if
+ * neither has passed.
+ */
+
+/*
+ * Start enforcing timeouts, in seconds; zero disables either one.  Until
+ * this is called, or if both are disabled, the other functions do nothing.
+ */
+void timeout_init(int idle_secs, int lifetime_secs);
+
+/*
+ * Stop the thread and free the timers.
+ */
+void timeout_fini(void);
+
+/*
+ * Start and stop watching a connection, which must be in the client
+ * registry meanwhile.  A connection must not be closed before it is no
+ * longer watched.
+ */
+void timeout_open(int fd);
+void timeout_close(int fd);
+
+/*
+ * Get the number of connections shut down so far, for being idle and for
+ * the age of their transaction.
+ */
+void timeout_get_counts(size_t *idle, size_t *expired);
+
+/*
+ * Print the counts to stderr.
+ */
+void timeout_show(void);
+
+#endif
@@ -1,33 +1,145 @@
 #ifndef __TPOOL_H__
 #define __TPOOL_H__
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 
-#include "wrappers.h"
+#include "settings.h"
+#include "mpmc.h"
 
 typedef void *(*thread_func_t)(void *arg);
 
+/*
+ * A fixed pool of worker threads with work stealing.
+ *
+ * Jobs pushed from outside the pool (such as connections handed over by
+ * the acceptor) go through a shared lock-free queue (see mpmc.h).  Each
+ * worker also has its own deque, protected by its own lock, for the jobs it
+ * pushes itself.  A worker runs the jobs of its own deque oldest first,
+ * then takes from the shared queue, and when both are dry it steals from
+ * the other workers before going to sleep, on a condition variable of the
+ * pool rather than on the shared queue, since a job may turn up in any of
+ * the deques.  A push from outside waits on the shared queue itself while
+ * it is full.  Jobs are stored by value: pushing a job allocates nothing.
+ *
+ * A job may also be parked on a file descriptor, to be queued once there
+ * is something to read from it: a job serving a client that has gone idle
+ * parks itself rather than holding on to its worker, and one whose client
+ * is busy goes to the back of the shared queue while others are waiting.
+ * A job that the pool will never run, because it was stopped first, is
+ * handed to its drop function instead, if it has one, so that what it was
+ * given is let go.
+ */
 typedef struct tpool_job {
     thread_func_t      func;
     void              *arg;
-    struct tpool_job *next;
+    void             (*drop)(void *arg); /* called instead of func if the pool stops first, or NULL */
 } tpool_job_t;
 
+typedef struct tpool_deque {
+    pthread_mutex_t    mutex;
+    size_t             head; /* next job to run */
+    size_t             tail; /* next free slot */
+    tpool_job_t        jobs[TPOOL_DEQUE_SIZE];
+} tpool_deque_t;
+
+typedef struct tpool_parked {
+    tpool_job_t          job;
+    int                  fd;
+    struct tpool_parked *prev, *next;
+} tpool_parked_t;
+
 typedef struct tpool {
-    tpool_job_t    *first; /* pop index */
-    tpool_job_t    *last; /* push index */
-    pthread_mutex_t  mutex; 
+    MPMC_QUEUE       inject; /* jobs pushed from outside the pool */
+    tpool_deque_t   *deques; /* one per thread */
+    pthread_t       *threads;
+    size_t           thread_cnt; /* num threads started */
+    atomic_long      queued; /* num jobs waiting, may lag briefly behind */
+    atomic_size_t    working_cnt; /* num threads actively working */
+    atomic_size_t    idle_cnt; /* num threads asleep, or about to be */
+    atomic_size_t    pushing; /* num pushes under way */
+    atomic_size_t    steals; /* num jobs run by a thread other than the pushed-to one */
+    pthread_mutex_t  mutex; /* for sleeping and waiting only, not taken by a push if no worker sleeps */
     pthread_cond_t   work_to_be_processed;
     pthread_cond_t   work_in_progress;
-    size_t           working_cnt; /* num threads actively working */
-    size_t           thread_cnt; /* num alive threads */
-    bool             stop; /* used to stop pool */
+    atomic_bool      stop; /* used to stop pool */
+    int              parkfd; /* epoll instance watching the parked jobs */
+    int              wakefd; /* eventfd telling the parker to stop */
+    pthread_t        parker;
+    atomic_bool      parking; /* parker running */
+    pthread_mutex_t  park_mutex; /* protects the list of parked jobs */
+    tpool_parked_t  *parked;
 } tpool_t;
 
+/*
+ * Start a pool of num_threads workers.  Workers block all signals.
+ *
+ * @return  The pool, or NULL if it could not be created.
+ */
 tpool_t *tpool_init(size_t num_threads);
+
+/*
+ * Pin each worker to its own CPU, in order, among those the process may
+ * run on (wrapping around if there are more workers than CPUs).
+ *
+ * @return  0 if successful, -1 if some worker could not be pinned.
+ */
+int tpool_pin(tpool_t *pool);
+
+/*
+ * Stop starting jobs.  Jobs already running are not affected; those still
+ * queued or parked are discarded, and handed to their drop functions.
+ */
+void tpool_stop(tpool_t *pool);
+
+/*
+ * Stop the pool, wait for the running jobs to finish, and free the pool.
+ */
 void tpool_destroy(tpool_t *pool);
+
+/*
+ * Queue a job.  A push from outside the pool waits while the shared queue
+ * is full (see mpmc_push_unless()), until the pool stops; a push from a
+ * worker never waits.
+ *
+ * @return  true if the job was queued, false if the pool is stopped or
+ *   (for a push from a worker) both its deque and the shared queue are full.
+ */
 bool tpool_push(tpool_t *pool, thread_func_t func, void *arg);
+
+/*
+ * Queue a job with a drop function, as tpool_push() does.
+ */
+bool tpool_push_job(tpool_t *pool, tpool_job_t job);
+
+/*
+ * Park a job until fd is readable or hung up, then queue it.  Nothing else
+ * may be waiting for fd meanwhile.
+ *
+ * @return  true if the job was parked, false if the pool is stopped or fd
+ *   cannot be watched, in which case the job is left to the caller.
+ */
+bool tpool_park(tpool_t *pool, int fd, tpool_job_t job);
+
+/*
+ * Queue a job behind all those waiting in the shared queue, so that a
+ * worker may take turns between long-running jobs.  Never waits.
+ *
+ * @return  true if the job was queued, false if the pool is stopped or the
+ *   shared queue is full.
+ */
+bool tpool_yield(tpool_t *pool, tpool_job_t job);
+
+/*
+ * Determine whether jobs are queued, waiting for a worker.
+ */
+bool tpool_busy(tpool_t *pool);
+
+/*
+ * Wait until no job is queued or running.
+ */
 void tpool_wait(tpool_t *pool);
 
-#endif 
+#endif
@@ -0,0 +1,70 @@
+#ifndef __TWHEEL_H__
+#define __TWHEEL_H__
+
+#include <stdint.h>
+
+#include "settings.h"
+
+/*
+ * A hierarchical timing wheel.
+ *
+ * Time is counted in ticks.  Each level is a ring of 2^TWHEEL_BITS slots;
+ * a slot of level 0 holds the timers due at one tick, and a slot of each
+ * level above covers as many ticks as all the slots of the level below.
+ * A timer is put on the lowest level whose span reaches its expiry, and is
+ * moved down a level ("cascaded") when the wheel comes to its slot, so
+ * that starting, stopping and expiring a timer all take constant time, no
+ * matter how many there are.  Timers due beyond the span of the top level
+ * expire at its end instead.
+ *
+ * Timers are embedded in the structures they belong to, and are linked
+ * into the slots in place: the wheel allocates nothing.  It is not
+ * synchronized; its user must serialize access to it.
+ */
+#define TWHEEL_SLOTS (1 << TWHEEL_BITS)
+
+typedef struct twheel_timer {
+    struct twheel_timer *next;      // In a slot, or a list of expired timers
+    struct twheel_timer *prev;
+    uint64_t expires;               // Tick at which the timer expires
+} TWHEEL_TIMER;
+
+typedef struct twheel {
+    uint64_t now;                   // Last tick processed
+    TWHEEL_TIMER slots[TWHEEL_LEVELS][TWHEEL_SLOTS];   // List heads
+} TWHEEL;
+
+/*
+ * Initialize a wheel, at a given tick.
+ */
+void twheel_init(TWHEEL *w, uint64_t now);
+
+/*
+ * Initialize a timer, or a list of timers, as not started (empty).
+ */
+void twheel_timer_init(TWHEEL_TIMER *t);
+
+/*
+ * Tell whether a timer has been started and has not yet expired or been
+ * stopped.  For a list head, tell whether the list is non-empty.
+ */
+int twheel_pending(TWHEEL_TIMER *t);
+
+/*
+ * Start a timer, restarting it if it is pending, to expire at a given tick
+ * (at the next tick, if that one has passed).
+ */
+void twheel_start(TWHEEL *w, TWHEEL_TIMER *t, uint64_t expires);
+
+/*
+ * Stop a timer, if it is pending.
+ */
+void twheel_stop(TWHEEL_TIMER *t);
+
+/*
+ * Process the ticks up to a given one, and move the timers that expire to
+ * the end of a list, in the order of their expiry.
+ */
+void twheel_advance(TWHEEL *w, uint64_t to, TWHEEL_TIMER *expired);
+
+#endif
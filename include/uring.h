@@ -0,0 +1,35 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+/*
+ * io_uring server core (enabled with -u <threads>).
+ *
+ * Like the event loops of evloop.h, a fixed set of threads each serve many
+ * connections with the state machine of conn.h, but socket I/O goes through
+ * an io_uring instance per thread, driven with raw system calls: a multishot
+ * accept on the listening socket, a multishot receive per connection that
+ * fills buffers from a ring registered with the kernel, and one send at a
+ * time per connection.  A single io_uring_enter() both submits all the
+ * operations queued while handling a batch of completions and waits for
+ * the next batch.  Each send is a sendmsg() gathering the connection's
+ * output buffer and the large values it refers to, which go out of their
+ * blobs (see conn.h); registered buffers are not used, since the output
+ * buffers grow and are swapped as replies are queued, and registering them
+ * would mean copying every reply into a fixed slot first.  If the kernel
+ * refuses a multishot accept, the thread falls back to accepting one
+ * connection at a time; a commit that would wait for another transaction
+ * is handed off as in evloop.h.
+ */
+
+/*
+ * Start nthreads io_uring threads serving connections accepted on listenfd.
+ * The threads run until the process exits; signals are blocked in them so
+ * that SIGHUP is handled by the caller.
+ *
+ * @return  0 if successful, -1 if io_uring (or a feature it needs) is not
+ *   available, in which case nothing has been changed and the caller
+ *   should serve listenfd some other way.
+ */
+int uring_start(int listenfd, int nthreads);
+
+#endif
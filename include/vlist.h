@@ -0,0 +1,60 @@
+#ifndef __VLIST_H__
+#define __VLIST_H__
+
+#include "data.h"
+
+/*
+ * A version list is a contiguous array of versions, kept in increasing
+ * order of creator transaction ID.  After garbage collection a list holds
+ * at most one committed version followed by a few pending ones, so the
+ * first VLIST_INLINE slots live inside the list itself and the array only
+ * moves to the heap when more versions than that are needed at once.
+ * It moves back inline once it shrinks again.  The links of the versions
+ * (next and prev in data.h) are not used.
+ */
+#define VLIST_INLINE 2
+
+typedef struct version_list {
+    int count;                          // Number of versions in the list
+    int capacity;                       // Number of slots available
+    VERSION *heap;                      // Heap array, or NULL if inline slots are used
+    VERSION inline_slots[VLIST_INLINE];
+} VERSION_LIST;
+
+#define VLIST_SLOTS(vl) ((vl)->heap ? (vl)->heap : (vl)->inline_slots)
+#define VLIST_AT(vl, i) (&VLIST_SLOTS(vl)[i])
+#define VLIST_LAST(vl) ((vl)->count ? VLIST_AT(vl, (vl)->count - 1) : NULL)
+
+/*
+ * Initialize an empty version list.
+ */
+void vlist_init(VERSION_LIST *vl);
+
+/*
+ * Dispose of all versions in a list and release any heap storage.
+ */
+void vlist_fini(VERSION_LIST *vl);
+
+/*
+ * Append a version for a creator transaction to the end of a list.
+ * As with version_create(), the version inherits the caller's reference
+ * to the blob and takes a new reference to the creator.
+ *
+ * @return 0 if successful, -1 if memory could not be allocated.
+ */
+int vlist_append(VERSION_LIST *vl, TRANSACTION *tp, BLOB *bp);
+
+/*
+ * Dispose of the versions in positions [from, to) and close the gap.
+ */
+void vlist_remove(VERSION_LIST *vl, int from, int to);
+
+/*
+ * Set up a version in caller-supplied storage, or tear one down.
+ * These do the reference counting of version_create()/version_dispose()
+ * without the allocation.
+ */
+void version_init(VERSION *vp, TRANSACTION *tp, BLOB *bp);
+void version_fini(VERSION *vp);
+
+#endif
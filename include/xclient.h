@@ -0,0 +1,167 @@
+#ifndef __XCLIENT_H__
+#define __XCLIENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Client library for the xacto server (lib/libxclient.a).
+ *
+ * A connection speaks the v2 wire format (see proto2.h) as a session (see
+ * proto_session.h), so it carries one transaction after another and can
+ * be kept in a pool.  It may be a TCP connection, or a connection to the
+ * Unix domain socket of a server on the same host, optionally switched to
+ * a shared-memory channel (see shm.h).
+ *
+ * Requests are pipelined: the *_async() calls only queue a request, and
+ * its callback is called, in order, when the reply has arrived, from
+ * within a later library call (xc_wait() at the latest).  Requests are
+ * sent when enough of them have accumulated or when xc_wait() is called.
+ * The synchronous calls queue a request and wait for everything queued.
+ * If the connection fails, the callbacks of all unanswered requests are
+ * called with XC_ERROR.  A callback may queue further requests, but not
+ * wait: it must not call xc_wait() or a synchronous call.
+ *
+ * A connection is used by one thread at a time; a pool may be shared.
+ * Status values are those of TRANS_STATUS (transaction.h): TRANS_PENDING
+ * for a request performed in a transaction that is still open,
+ * TRANS_COMMITTED or TRANS_ABORTED, or XACTO_OVERLOADED (proto_status.h)
+ * for a transaction the server did not admit; or XC_ERROR if the
+ * connection failed, after which it can only be closed.
+ */
+#define XC_ERROR (-1)
+
+#define XC_SHM 0x01     /* Use shared memory over the Unix domain socket */
+#define XC_LZ 0x02      /* Let the server send values compressed */
+
+typedef struct xc_conn XC_CONN;
+typedef struct xc_pool XC_POOL;
+
+/*
+ * Called with the reply to an asynchronous request.  The value is that of
+ * a GET, or for an MGET a framed batch payload (see proto_batch.h); it is
+ * NULL for a null value or a request that returns none, and is only valid
+ * until the callback returns.
+ */
+typedef void XC_CALLBACK(void *arg, int status, char *value, size_t size);
+
+/*
+ * The body of a transaction run by xc_run(): perform requests on the
+ * connection, possibly committing.
+ *
+ * @return  The status of the transaction after the last request, or
+ *   XC_ERROR to give up.
+ */
+typedef int XC_TXN(XC_CONN *c, void *arg);
+
+/*
+ * Connect to a server.  If host is NULL, port is the path of the server's
+ * Unix domain socket.  Flags are XC_* options; XC_SHM only applies to a
+ * Unix domain socket.
+ *
+ * @return  The connection, or NULL if it could not be established.
+ */
+XC_CONN *xc_connect(const char *host, const char *port, int flags);
+
+/*
+ * Close a connection.  A transaction still open on it is aborted by the
+ * server; callbacks of requests still queued are not called.
+ */
+void xc_close(XC_CONN *c);
+
+/*
+ * Queue a request.  A NULL value for a PUT puts a null value.  MGET and
+ * MPUT take n keys (and values) with their lengths.
+ *
+ * @return  0 if the request was queued, XC_ERROR if the connection failed.
+ */
+int xc_put_async(XC_CONN *c, const void *key, size_t klen, const void *value, size_t vlen,
+                 XC_CALLBACK *cb, void *arg);
+int xc_get_async(XC_CONN *c, const void *key, size_t klen, XC_CALLBACK *cb, void *arg);
+int xc_mput_async(XC_CONN *c, int n, const void **keys, const size_t *klens,
+                  const void **values, const size_t *vlens, XC_CALLBACK *cb, void *arg);
+int xc_mget_async(XC_CONN *c, int n, const void **keys, const size_t *klens,
+                  XC_CALLBACK *cb, void *arg);
+int xc_commit_async(XC_CONN *c, XC_CALLBACK *cb, void *arg);
+int xc_begin_async(XC_CONN *c, XC_CALLBACK *cb, void *arg);
+
+/*
+ * Send everything queued and process replies until at most n requests
+ * remain unanswered.
+ *
+ * @return  0 if successful, XC_ERROR if the connection failed.
+ */
+int xc_wait(XC_CONN *c, int n);
+
+/*
+ * Synchronous requests.  xc_get() sets *valuep to a copy of the value,
+ * which the caller frees, or NULL for a null value.  The copy has a null
+ * byte after its *sizep bytes, so a text value can be used as a string.
+ * xc_mget() does the same for each of the n values.
+ *
+ * @return  The status of the request.
+ */
+int xc_put(XC_CONN *c, const void *key, size_t klen, const void *value, size_t vlen);
+int xc_get(XC_CONN *c, const void *key, size_t klen, char **valuep, size_t *sizep);
+int xc_mput(XC_CONN *c, int n, const void **keys, const size_t *klens,
+            const void **values, const size_t *vlens);
+int xc_mget(XC_CONN *c, int n, const void **keys, const size_t *klens,
+            char **values, size_t *sizes);
+int xc_commit(XC_CONN *c);
+int xc_begin(XC_CONN *c);
+
+/*
+ * Get why the transaction last answered with an abort on a connection was
+ * aborted, as the server explained it (see proto_status.h): the delay it
+ * suggests before trying again, in microseconds, and the hash of the key
+ * involved, or 0.
+ *
+ * @return  An XACTO_REASON, or 0 if no request has been answered with an
+ *   abort since the connection was established.
+ */
+int xc_abort_reason(XC_CONN *c, uint32_t *retry_usp, uint32_t *key_hashp);
+
+/*
+ * Run a transaction, committing it unless the body did, and run it again
+ * as long as it aborts or is not admitted, at most tries times in all
+ * (without limit if tries is 0).  Retries wait a randomized, exponentially
+ * growing delay, or the one the server suggests if that is longer.
+ *
+ * @return  The final status of the transaction, or XC_ERROR.
+ */
+int xc_run(XC_CONN *c, XC_TXN *fn, void *arg, int tries);
+
+/*
+ * Create a pool of at most size connections to a server, as by
+ * xc_connect().  Connections are established when first needed.
+ */
+XC_POOL *xc_pool_create(const char *host, const char *port, int flags, int size);
+
+/*
+ * Close all the connections of a pool, which must all have been returned,
+ * and free it.
+ */
+void xc_pool_destroy(XC_POOL *p);
+
+/*
+ * Take a connection from a pool, waiting if all are in use.
+ *
+ * @return  The connection, or NULL if a new one could not be established.
+ */
+XC_CONN *xc_pool_get(XC_POOL *p);
+
+/*
+ * Return a connection to its pool.  Requests still queued or unanswered
+ * on it are seen through first, with their callbacks called, and a
+ * transaction left open is abandoned, as by xc_begin(), so that whoever
+ * takes it next starts afresh.  A connection that has failed, or fails
+ * doing so, is closed and replaced when next needed.
+ */
+void xc_pool_put(XC_POOL *p, XC_CONN *c);
+
+/*
+ * Run a transaction, as by xc_run(), on a connection from a pool.
+ */
+int xc_pool_run(XC_POOL *p, XC_TXN *fn, void *arg, int tries);
+
+#endif
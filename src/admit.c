@@ -0,0 +1,149 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "admit.h"
+#include "proto_status.h"
+#include "creg_ext.h"
+#include "server.h"
+#include "settings.h"
+#include "debug.h"
+
+/* Averages are kept in fixed point, with this many fractional bits */
+#define FIXED 8
+
+static struct {
+    int enabled;
+    int max_pending;
+    long max_depth;                 // In fixed point
+    long max_commit_us;
+    atomic_uint_fast64_t *depths;   // (ID << 32) | chain length, by ID modulo ADMIT_DEPTH_SLOTS
+    atomic_long depth;              // Averages, in fixed point
+    atomic_long commit_us;
+    atomic_uint probe;
+    atomic_size_t admitted;
+    atomic_size_t rejected_pending;
+    atomic_size_t rejected_depth;
+    atomic_size_t rejected_latency;
+} adm;
+
+/*
+ * Get the length of the dependency chain of a transaction, as far as it is
+ * known: zero for one that depends on nothing, or that has been forgotten.
+ */
+static unsigned depth_of(unsigned id){
+    uint64_t v = atomic_load_explicit(&adm.depths[id & (ADMIT_DEPTH_SLOTS - 1)], memory_order_relaxed);
+    return (v >> 32) == id ? (unsigned)v : 0;
+}
+
+/*
+ * Fold a sample into a moving average.  Updates racing with each other may
+ * lose a sample, which does not matter to an average.
+ */
+static void average(atomic_long *avg, long sample){
+    long a = atomic_load_explicit(avg, memory_order_relaxed);
+    atomic_store_explicit(avg, a + ((sample << FIXED) - a) / (1 << ADMIT_AVG_SHIFT), memory_order_relaxed);
+}
+
+void admit_init(int max_pending, int max_depth, int max_commit_ms){
+    if(max_pending <= 0 && max_depth <= 0 && max_commit_ms <= 0) return;
+    if((adm.depths = calloc(ADMIT_DEPTH_SLOTS, sizeof(*adm.depths))) == NULL){
+        error("unable to allocate admission control table");
+        return;
+    }
+    adm.max_pending = max_pending > 0 ? max_pending : 0;
+    adm.max_depth = max_depth > 0 ? (long)max_depth << FIXED : 0;
+    adm.max_commit_us = max_commit_ms > 0 ? max_commit_ms * 1000L : 0;
+    adm.enabled = 1;
+    info("Admission control: %d transactions, chain depth %d, commit %d ms",
+         max_pending, max_depth, max_commit_ms);
+}
+
+void admit_fini(void){
+    adm.enabled = 0;
+    free(adm.depths);
+    adm.depths = NULL;
+}
+
+/*
+ * Decide whether to admit a new transaction.
+ */
+static int admit(void){
+    int pending = creg_transactions(client_registry);
+
+    if(pending == 0) return 1;
+    if(adm.max_pending && pending >= adm.max_pending){
+        atomic_fetch_add_explicit(&adm.rejected_pending, 1, memory_order_relaxed);
+        return 0;
+    }
+    int deep = adm.max_depth && atomic_load_explicit(&adm.depth, memory_order_relaxed) > adm.max_depth;
+    int slow = adm.max_commit_us
+               && atomic_load_explicit(&adm.commit_us, memory_order_relaxed) > adm.max_commit_us << FIXED;
+    if((deep || slow) && atomic_fetch_add_explicit(&adm.probe, 1, memory_order_relaxed) % ADMIT_PROBE){
+        atomic_fetch_add_explicit(deep ? &adm.rejected_depth : &adm.rejected_latency, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+TRANSACTION *admit_trans_create(int *rejectedp){
+    TRANSACTION *tp = trans_create();
+
+    *rejectedp = 0;
+    if(tp == NULL || !adm.enabled) return tp;
+    if(admit()){
+        atomic_fetch_add_explicit(&adm.admitted, 1, memory_order_relaxed);
+        return tp;
+    }
+    debug("Transaction %d not admitted", tp->id);
+    // The abort consumes a reference of its own: the one returned stays the caller's.
+    trans_abort(trans_ref(tp, "not admitted"));
+    *rejectedp = 1;
+    return tp;
+}
+
+int admit_status(TRANS_STATUS status, int rejected){
+    return rejected && status == TRANS_ABORTED ? XACTO_OVERLOADED : status;
+}
+
+void admit_dependency(TRANSACTION *tp, TRANSACTION *dtp){
+    if(!adm.enabled) return;
+    unsigned depth = depth_of(dtp->id) + 1;
+    if(depth > depth_of(tp->id))
+        atomic_store_explicit(&adm.depths[tp->id & (ADMIT_DEPTH_SLOTS - 1)],
+                              (uint64_t)tp->id << 32 | depth, memory_order_relaxed);
+}
+
+TRANS_STATUS admit_commit(TRANSACTION *tp){
+    struct timespec start, end;
+    TRANS_STATUS status;
+
+    if(!adm.enabled) return trans_commit(tp);
+    unsigned depth = depth_of(tp->id);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = trans_commit(tp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    average(&adm.depth, depth);
+    average(&adm.commit_us, (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000);
+    return status;
+}
+
+void admit_get_stats(ADMIT_STATS *sp){
+    sp->admitted = atomic_load_explicit(&adm.admitted, memory_order_relaxed);
+    sp->rejected_pending = atomic_load_explicit(&adm.rejected_pending, memory_order_relaxed);
+    sp->rejected_depth = atomic_load_explicit(&adm.rejected_depth, memory_order_relaxed);
+    sp->rejected_latency = atomic_load_explicit(&adm.rejected_latency, memory_order_relaxed);
+    sp->depth = (double)atomic_load_explicit(&adm.depth, memory_order_relaxed) / (1 << FIXED);
+    sp->commit_ms = (double)atomic_load_explicit(&adm.commit_us, memory_order_relaxed) / (1 << FIXED) / 1000;
+}
+
+void admit_show(void){
+    ADMIT_STATS s;
+    if(!adm.enabled) return;
+    admit_get_stats(&s);
+    fprintf(stderr, "ADMIT: %zu admitted, rejected %zu for pending transactions, %zu for chain depth, "
+            "%zu for commit latency; average chain depth %.2f, commit %.2f ms\n",
+            s.admitted, s.rejected_pending, s.rejected_depth, s.rejected_latency, s.depth, s.commit_ms);
+}
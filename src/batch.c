@@ -0,0 +1,110 @@
+#include <stdlib.h>
+
+#include "batch.h"
+#include "proto_batch.h"
+#include "store_batch.h"
+#include "compress.h"
+#include "reason.h"
+#include "debug.h"
+
+/*
+ * Build the framed payload of the values read by an MGET, releasing them.
+ * If they would make the payload larger than a client takes, the
+ * transaction is aborted instead and the values are all null.
+ */
+static char *batch_values(TRANSACTION *tp, TRANS_STATUS *statusp, BLOB **values, int n,
+                          size_t *sizep){
+    size_t size = sizeof(uint32_t);
+    char *buf = NULL, *p = NULL;
+    int drop;
+
+    for(int i = 0; i < n; i++)
+        size += proto_batch_item_size(values[i] ? values[i]->size : 0);
+    if((drop = (size > PROTO_BATCH_REPLY_MAX))){
+        debug("MGET reply of %zu bytes is too large", size);
+        if(*statusp == TRANS_PENDING){
+            reason_set(tp->id, XACTO_REASON_TOO_LARGE, 0);
+            *statusp = trans_abort(trans_ref(tp, "aborting an oversized MGET"));
+        }
+        size = sizeof(uint32_t) + n * proto_batch_item_size(0);
+    }
+    if((buf = malloc(size)) != NULL)
+        p = proto_batch_put_count(buf, n);
+    for(int i = 0; i < n; i++){
+        BLOB *bp = values[i];
+        char *data;
+        if(p && bp && !drop && (data = blob_data(bp)) != NULL){
+            p = proto_batch_put(p, data, bp->size);
+            blob_data_release(bp, data);
+        } else if(p && bp && !drop){
+            p = NULL;
+        } else if(p){
+            p = proto_batch_put(p, NULL, 0);
+        }
+        if(bp) blob_unref(bp, "value sent in MGET reply");
+    }
+    if(p == NULL){
+        free(buf);
+        return NULL;
+    }
+    *sizep = size;
+    return buf;
+}
+
+int batch_execute(TRANSACTION *tp, XACTO_PACKET *pkt, void *data,
+                  TRANS_STATUS *statusp, char **valuesp, size_t *sizep){
+    int get = (pkt->type == XACTO_MGET_PKT);
+    PROTO_BATCH b;
+    KEY **keys = NULL;
+    BLOB **values = NULL;
+    int n = 0;
+
+    *valuesp = NULL;
+    *sizep = 0;
+    if(proto_batch_open(&b, data, ntohl(pkt->size), get ? 1 : 2)) goto bad;
+    keys = malloc((b.count ? b.count : 1) * sizeof(KEY *));
+    values = malloc((b.count ? b.count : 1) * sizeof(BLOB *));
+    if(keys == NULL || values == NULL) goto fail;
+    for(; n < b.count; n++){
+        char *item;
+        size_t len;
+        BLOB *kbp;
+        values[n] = NULL;
+        if(proto_batch_next(&b, &item, &len) || item == NULL) goto bad;
+        if((kbp = blob_create(item, len)) == NULL) goto fail;
+        if((keys[n] = key_create(kbp)) == NULL){
+            blob_unref(kbp, "");
+            goto fail;
+        }
+        if(get) continue;
+        if(proto_batch_next(&b, &item, &len)){
+            key_dispose(keys[n]);
+            goto bad;
+        }
+        if(item && (values[n] = blob_create(item, len)) == NULL){
+            key_dispose(keys[n]);
+            goto fail;
+        }
+    }
+    debug("%s of %d keys", get ? "MGET" : "MPUT", n);
+    if(get){
+        *statusp = store_get_many(tp, keys, values, n);
+        if((*valuesp = batch_values(tp, statusp, values, n, sizep)) == NULL) n = -1;
+    } else {
+        *statusp = store_put_many(tp, keys, values, n);
+    }
+    free(keys);
+    free(values);
+    return n < 0 ? -1 : 0;
+
+bad:
+    error("malformed batch request");
+fail:
+    for(int i = 0; i < n; i++){
+        key_dispose(keys[i]);
+        if(values[i]) blob_unref(values[i], "");
+    }
+    free(keys);
+    free(values);
+    return -1;
+}
@@ -0,0 +1,461 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "xclient.h"
+#include "proto_status.h"
+#include "settings.h"
+
+/*
+ * Load generator.
+ *
+ * Opens a number of sessions to a server, each on a thread and connection
+ * of its own (see xclient.h), and runs transactions on them for a while:
+ * each transaction is a number of GETs and PUTs, in a given proportion, on
+ * keys drawn uniformly or from a Zipfian distribution, followed by a
+ * COMMIT.  A transaction that aborts is counted and abandoned, not tried
+ * again, so that the abort rate shows the contention of the mix.
+ *
+ * In a closed loop (the default), each session starts a transaction as
+ * soon as the last one has ended, so the load adjusts itself to what the
+ * server can take.  In an open loop (-R <rate>), transactions are started
+ * at a fixed total rate, spread evenly over the sessions, whether or not
+ * the server keeps up; the latency of a transaction then counts from when
+ * it was due to start, so that the time it spent waiting behind late ones
+ * is not hidden.
+ *
+ * At the end, the throughput, the abort rate with the reasons the server
+ * gave (see proto_status.h), and percentiles of the latency of each type
+ * of request and of committed transactions are printed.
+ */
+
+enum { OP_GET, OP_PUT, OP_COMMIT, OP_TXN, NOPS };
+
+static const char *op_names[NOPS] = { "GET", "PUT", "COMMIT", "TXN" };
+
+static const char *reason_names[XACTO_REASONS] = {
+    "unexplained", "conflict", "dependency", "expired", "overloaded", "too large"
+};
+
+/*
+ * A log-linear histogram of latencies in nanoseconds: each power of two
+ * is split into HIST_SUB buckets, so that any value is known to within
+ * 1/HIST_SUB of itself whatever its magnitude.
+ */
+#define HIST_SUB (1 << BENCH_HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct hist {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t n, sum, max;
+} HIST;
+
+/*
+ * Keys are drawn by rank from a Zipfian distribution with exponent theta,
+ * as by Gray et al., "Quickly generating billion-record synthetic
+ * databases": rank 0 is the hottest key.
+ */
+typedef struct zipf {
+    uint64_t n;
+    double theta, alpha, zetan, eta, zeta2;
+} ZIPF;
+
+typedef struct session {
+    pthread_t tid;
+    int id;
+    uint64_t rng;               // State of the random number generator
+    char *key;                  // Buffer for the key of the next request
+    HIST hist[NOPS];
+    size_t committed, aborted;
+    size_t reasons[XACTO_REASONS];  // Aborts by the reason given
+    int failed;
+} SESSION;
+
+static struct {
+    const char *host, *port;
+    int flags;
+    int sessions;
+    int duration;
+    int ops;
+    int read_pct;
+    uint64_t keys;
+    int key_size, value_size;
+    double theta;               // Zipfian exponent, 0 for uniform
+    double rate;                // Transactions per second, 0 for a closed loop
+    char *value;
+    ZIPF zipf;
+    uint64_t start, end;        // Nanoseconds on the monotonic clock
+} cfg;
+
+static uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t){
+    struct timespec ts = { t / 1000000000, t % 1000000000 };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+        ;
+}
+
+/*
+ * xorshift64*: fast, and good enough to pick keys.
+ */
+static uint64_t rng_next(uint64_t *s){
+    uint64_t x = *s;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/*
+ * A uniform double in [0, 1).
+ */
+static double rng_unit(uint64_t *s){
+    return (rng_next(s) >> 11) * 0x1.0p-53;
+}
+
+static int hist_index(uint64_t v){
+    if(v < HIST_SUB) return v;
+    int shift = 63 - __builtin_clzll(v) - BENCH_HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/*
+ * The largest value that falls into a bucket.
+ */
+static uint64_t hist_value(int i){
+    if(i < HIST_SUB) return i;
+    int shift = i / HIST_SUB - 1;
+    return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static void hist_add(HIST *h, uint64_t v){
+    h->counts[hist_index(v)]++;
+    h->n++;
+    h->sum += v;
+    if(v > h->max) h->max = v;
+}
+
+static void hist_merge(HIST *to, HIST *from){
+    for(int i = 0; i < HIST_BUCKETS; i++)
+        to->counts[i] += from->counts[i];
+    to->n += from->n;
+    to->sum += from->sum;
+    if(from->max > to->max) to->max = from->max;
+}
+
+/*
+ * The value below which a fraction p of the values fall, to within the
+ * width of a bucket.
+ */
+static uint64_t hist_percentile(HIST *h, double p){
+    uint64_t rank = (uint64_t)ceil(p * h->n), seen = 0;
+    if(rank == 0) rank = 1;
+    for(int i = 0; i < HIST_BUCKETS; i++){
+        if((seen += h->counts[i]) >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static void zipf_init(ZIPF *z, uint64_t n, double theta){
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for(uint64_t i = 1; i <= n; i++)
+        z->zetan += 1 / pow(i, theta);
+    z->zeta2 = 1 + 1 / pow(2, theta);
+    z->alpha = 1 / (1 - theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - z->zeta2 / z->zetan);
+}
+
+static uint64_t zipf_next(ZIPF *z, double u){
+    double uz = u * z->zetan;
+    if(uz < 1) return 0;
+    if(uz < z->zeta2) return 1;
+    uint64_t r = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return r < z->n ? r : z->n - 1;
+}
+
+/*
+ * Get the length of the longest key: a letter and the largest rank, in
+ * decimal.  -K may not be less, or keys would not all be the same size.
+ */
+static int key_size_min(void){
+    int n = 1;
+    for(uint64_t rank = cfg.keys - 1; rank >= 10; rank /= 10) n++;
+    return 1 + n;
+}
+
+/*
+ * Pick the key of the next request, into the buffer of the session.
+ *
+ * @return  The length of the key, which is cfg.key_size.
+ */
+static size_t next_key(SESSION *s){
+    uint64_t rank = cfg.theta > 0 ? zipf_next(&cfg.zipf, rng_unit(&s->rng))
+                                  : rng_next(&s->rng) % cfg.keys;
+    return snprintf(s->key, cfg.key_size + 1, "k%0*llu", cfg.key_size - 1, (unsigned long long)rank);
+}
+
+/*
+ * Run one transaction, due to start at a given time.
+ *
+ * @return  The final status of the transaction, or XC_ERROR.
+ */
+static int run_transaction(SESSION *s, XC_CONN *c, uint64_t due){
+    int status = TRANS_PENDING, op;
+    uint64_t t;
+
+    for(int i = 0; i < cfg.ops && status == TRANS_PENDING; i++){
+        size_t klen = next_key(s);
+        t = now_ns();
+        if((int)(rng_next(&s->rng) % 100) < cfg.read_pct){
+            char *value;
+            size_t size;
+            op = OP_GET;
+            if((status = xc_get(c, s->key, klen, &value, &size)) != XC_ERROR) free(value);
+        } else {
+            op = OP_PUT;
+            status = xc_put(c, s->key, klen, cfg.value, cfg.value_size);
+        }
+        hist_add(&s->hist[op], now_ns() - t);
+    }
+    int early = status != TRANS_PENDING;
+    if(!early){
+        t = now_ns();
+        status = xc_commit(c);
+        hist_add(&s->hist[OP_COMMIT], now_ns() - t);
+    }
+    if(status == XC_ERROR) return XC_ERROR;
+    if(status == TRANS_COMMITTED){
+        hist_add(&s->hist[OP_TXN], now_ns() - due);
+        s->committed++;
+        return status;
+    }
+    int reason = xc_abort_reason(c, NULL, NULL);
+    s->reasons[reason < XACTO_REASONS ? reason : XACTO_REASON_NONE]++;
+    s->aborted++;
+    // A transaction aborted before its COMMIT stays current until a BEGIN.
+    if(early && xc_begin(c) == XC_ERROR) return XC_ERROR;
+    return status;
+}
+
+static void *session_thread(void *arg){
+    SESSION *s = arg;
+    XC_CONN *c = xc_connect(cfg.host, cfg.port, cfg.flags);
+    uint64_t interval = cfg.rate > 0 ? 1e9 * cfg.sessions / cfg.rate : 0;
+    uint64_t due = cfg.start + interval * s->id / cfg.sessions;
+
+    if(c == NULL){
+        fprintf(stderr, "Session %d could not connect\n", s->id);
+        s->failed = 1;
+        return NULL;
+    }
+    for(;;){
+        uint64_t t = now_ns();
+        if(interval){
+            // A transaction that is late starts at once; the ones behind it
+            // are not skipped.
+            if(due >= cfg.end) break;
+            if(t < due) sleep_until(due);
+        } else {
+            if(t >= cfg.end) break;
+            due = t;
+        }
+        if(run_transaction(s, c, due) == XC_ERROR){
+            fprintf(stderr, "Session %d lost its connection\n", s->id);
+            s->failed = 1;
+            break;
+        }
+        due += interval;
+    }
+    xc_close(c);
+    return NULL;
+}
+
+static void report(SESSION *sessions, double secs){
+    static HIST hist[NOPS];
+    size_t committed = 0, aborted = 0, reasons[XACTO_REASONS] = { 0 };
+
+    for(int i = 0; i < cfg.sessions; i++){
+        SESSION *s = &sessions[i];
+        committed += s->committed;
+        aborted += s->aborted;
+        for(int r = 0; r < XACTO_REASONS; r++)
+            reasons[r] += s->reasons[r];
+        for(int op = 0; op < NOPS; op++)
+            hist_merge(&hist[op], &s->hist[op]);
+    }
+    char dist[32] = "uniform";
+    if(cfg.theta > 0) snprintf(dist, sizeof(dist), "zipf %.2f", cfg.theta);
+    printf("%d sessions, %s, %.1f s: %d requests per transaction, %d%% GETs, "
+           "%llu keys (%s), %d-byte keys, %d-byte values\n",
+           cfg.sessions, cfg.rate > 0 ? "open loop" : "closed loop", secs, cfg.ops, cfg.read_pct,
+           (unsigned long long)cfg.keys, dist, cfg.key_size, cfg.value_size);
+    if(cfg.rate > 0) printf("Target rate: %.1f transactions/s\n", cfg.rate);
+    printf("Transactions: %zu committed (%.1f/s), %zu aborted (%.2f%%)\n",
+           committed, committed / secs, aborted,
+           committed + aborted ? 100.0 * aborted / (committed + aborted) : 0.0);
+    if(aborted){
+        printf("Aborts:");
+        for(int r = 0; r < XACTO_REASONS; r++)
+            if(reasons[r]) printf(" %zu %s", reasons[r], reason_names[r]);
+        printf("\n");
+    }
+    printf("%-8s %10s %10s %10s %10s %10s %10s %10s\n",
+           "Latency", "count", "mean us", "p50", "p90", "p99", "p99.9", "max");
+    for(int op = 0; op < NOPS; op++){
+        HIST *h = &hist[op];
+        if(h->n == 0) continue;
+        printf("%-8s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+               (unsigned long long)h->n, h->sum / 1e3 / h->n,
+               hist_percentile(h, 0.5) / 1e3, hist_percentile(h, 0.9) / 1e3,
+               hist_percentile(h, 0.99) / 1e3, hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+    }
+}
+
+static void usage(char *name){
+    fprintf(stderr,
+            "Usage: %s -p <port> [-h <host>] [-u] [-m] [-n <sessions>] [-d <seconds>]\n"
+            "         [-o <ops>] [-r <read%%>] [-k <keys>] [-K <key size>] [-V <value size>]\n"
+            "         [-z <theta>] [-R <transactions/s>]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    // Option '-p <port>' is required: the port of the server, or with '-u'
+    // the path of its Unix domain socket, over which '-m' uses shared
+    // memory.  Option '-h <host>' names the server (default localhost).
+    // Option '-n <sessions>' sets the number of concurrent sessions, and
+    // option '-d <seconds>' how long they run.
+    // Option '-o <ops>' sets the number of GETs and PUTs per transaction,
+    // option '-r <percent>' the share of GETs among them, and options
+    // '-K <bytes>' and '-V <bytes>' the size of keys and values; keys
+    // must have room for the largest key number.
+    // Option '-k <keys>' sets the number of distinct keys, and option
+    // '-z <theta>' draws them from a Zipfian distribution with exponent
+    // theta in (0, 1) instead of uniformly.
+    // Option '-R <rate>' starts that many transactions per second in all
+    // (open loop), instead of each session starting one whenever the last
+    // one ends (closed loop).
+    int c, unix_socket = 0;
+    SESSION *sessions;
+
+    cfg.host = "localhost";
+    cfg.sessions = BENCH_SESSIONS;
+    cfg.duration = BENCH_DURATION;
+    cfg.ops = BENCH_OPS;
+    cfg.read_pct = BENCH_READ_PCT;
+    cfg.keys = BENCH_KEYS;
+    cfg.key_size = BENCH_KEY_SIZE;
+    cfg.value_size = BENCH_VALUE_SIZE;
+    #define PORT_OPTION 'p'
+    #define HOST_OPTION 'h'
+    #define UNIX_OPTION 'u'
+    #define SHM_OPTION 'm'
+    #define SESSIONS_OPTION 'n'
+    #define DURATION_OPTION 'd'
+    #define OPS_OPTION 'o'
+    #define READ_OPTION 'r'
+    #define KEYS_OPTION 'k'
+    #define KEY_SIZE_OPTION 'K'
+    #define VALUE_SIZE_OPTION 'V'
+    #define ZIPF_OPTION 'z'
+    #define RATE_OPTION 'R'
+    while((c = getopt(argc, argv, "p:h:umn:d:o:r:k:K:V:z:R:")) != -1){
+        switch(c){
+        case PORT_OPTION:
+            cfg.port = optarg;
+            break;
+        case HOST_OPTION:
+            cfg.host = optarg;
+            break;
+        case UNIX_OPTION:
+            unix_socket = 1;
+            break;
+        case SHM_OPTION:
+            cfg.flags |= XC_SHM;
+            break;
+        case SESSIONS_OPTION:
+            cfg.sessions = atoi(optarg);
+            break;
+        case DURATION_OPTION:
+            cfg.duration = atoi(optarg);
+            break;
+        case OPS_OPTION:
+            cfg.ops = atoi(optarg);
+            break;
+        case READ_OPTION:
+            cfg.read_pct = atoi(optarg);
+            break;
+        case KEYS_OPTION:
+            cfg.keys = strtoull(optarg, NULL, 10);
+            break;
+        case KEY_SIZE_OPTION:
+            cfg.key_size = atoi(optarg);
+            break;
+        case VALUE_SIZE_OPTION:
+            cfg.value_size = atoi(optarg);
+            break;
+        case ZIPF_OPTION:
+            cfg.theta = atof(optarg);
+            break;
+        case RATE_OPTION:
+            cfg.rate = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc || cfg.port == NULL || cfg.sessions < 1 || cfg.duration < 1 || cfg.ops < 0
+       || cfg.read_pct < 0 || cfg.read_pct > 100 || cfg.keys < 1 || cfg.key_size < 1
+       || cfg.value_size < 0 || cfg.theta < 0 || cfg.theta >= 1 || cfg.rate < 0)
+        usage(argv[0]);
+    if(cfg.key_size < key_size_min()){
+        fprintf(stderr, "Key size must be at least %d bytes for %llu keys\n",
+                key_size_min(), (unsigned long long)cfg.keys);
+        exit(EXIT_FAILURE);
+    }
+    if(unix_socket) cfg.host = NULL;
+
+    if(cfg.theta > 0) zipf_init(&cfg.zipf, cfg.keys, cfg.theta);
+    if((cfg.value = malloc(cfg.value_size + 1)) == NULL
+       || (sessions = calloc(cfg.sessions, sizeof(SESSION))) == NULL){
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(cfg.value, 'v', cfg.value_size);
+
+    cfg.start = now_ns();
+    cfg.end = cfg.start + cfg.duration * 1000000000ULL;
+    for(int i = 0; i < cfg.sessions; i++){
+        SESSION *s = &sessions[i];
+        s->id = i;
+        s->rng = (cfg.start ^ (0x9e3779b97f4a7c15ULL * (i + 1))) | 1;
+        if((s->key = malloc(cfg.key_size + 1)) == NULL
+           || pthread_create(&s->tid, NULL, session_thread, s)){
+            fprintf(stderr, "Could not start session %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    int failed = 0;
+    for(int i = 0; i < cfg.sessions; i++){
+        pthread_join(sessions[i].tid, NULL);
+        failed |= sessions[i].failed;
+        free(sessions[i].key);
+    }
+    report(sessions, (now_ns() - cfg.start) / 1e9);
+    free(sessions);
+    free(cfg.value);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,119 +1,321 @@
 #include <fcntl.h>
 #include <errno.h>
-#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "client_registry.h"
+#include "creg_ext.h"
 #include "settings.h"
-#include "wrappers.h"
 #include "debug.h"
 
-struct client_registry
-{
-    int *buf;       /* Buffer array */
-    int n;          /* Maximum number of slots */
-    int front;      /* buf[(front+1)%n] is first item */
-    int back;       /* buf[back%n] is last item */
-    sem_t mutex;    /* Protects accesses to buf */
-    sem_t slots;    /* Counts available slots */
-    sem_t items;    /* Counts available items */
-    pthread_mutex_t lock; /* lock to wait for items to be zero */
-    pthread_mutex_t cond; /* declaring mutex */
+/*
+ * The entry of a file descriptor.  Whether it is in use only changes under
+ * the registry lock; the counters belong to the thread serving the client.
+ */
+struct creg_entry {
+    int used;
+    _Atomic(TRANSACTION *) tp;  // Current transaction, NULL, or ABORTING
+    atomic_int trans_id;
+    atomic_size_t bytes_in;
+    atomic_size_t bytes_out;
+    atomic_long active_ms;      // Last activity, on the coarse monotonic clock
+    atomic_long trans_ms;       // Start of the current transaction, likewise
+    struct timespec start;
+    char peer[CREG_PEER_MAX];
 };
 
-void swap(int *a, int *b){
-    int tmp = *a;
-    *a = *b;
-    *b = tmp;
+/*
+ * Stands for the transaction of a client while creg_abort_transaction()
+ * gets a reference to it, during which the thread serving the client
+ * cannot take it back (and maybe free it).
+ */
+#define ABORTING ((TRANSACTION *)1)
+
+struct client_registry {
+    pthread_mutex_t lock;
+    pthread_cond_t empty;                           // Signalled when count drops to zero
+    int count;                                      // Clients registered
+    atomic_int transactions;                        // Clients with a transaction recorded
+    int nchunks;                                    // Chunks allocated are all below this
+    _Atomic(struct creg_entry *) chunks[CREG_CHUNKS];   // Each of CREG_CHUNK entries, or NULL
+};
+
+/*
+ * Find the entry of a file descriptor, if its chunk has been allocated.
+ */
+static struct creg_entry *lookup(CLIENT_REGISTRY *cr, int fd){
+    if(cr == NULL || fd < 0 || fd >= CREG_CHUNK * CREG_CHUNKS) return NULL;
+    struct creg_entry *chunk = atomic_load_explicit(&cr->chunks[fd / CREG_CHUNK], memory_order_acquire);
+    return chunk ? &chunk[fd % CREG_CHUNK] : NULL;
 }
 
-long get_self(){
-    return (long)Pthread_self()->__sig
+/*
+ * Read the coarse monotonic clock, which is cheap enough to be read on
+ * every request, in milliseconds.
+ */
+static long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
 }
 
+/*
+ * Describe the peer of a socket, without consulting the name server.
+ */
+static void peer_name(int fd, char *buf){
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    char host[INET6_ADDRSTRLEN], port[8];
+
+    if(getpeername(fd, (struct sockaddr *)&sa, &len) < 0)
+        snprintf(buf, CREG_PEER_MAX, "unknown");
+    else if(sa.ss_family == AF_UNIX)
+        snprintf(buf, CREG_PEER_MAX, "local");
+    else if(getnameinfo((struct sockaddr *)&sa, len, host, sizeof(host), port, sizeof(port),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+        snprintf(buf, CREG_PEER_MAX, "%s:%s", host, port);
+    else
+        snprintf(buf, CREG_PEER_MAX, "unknown");
+}
 
 CLIENT_REGISTRY *creg_init(){
-    info("%ld: Initialize client registry", Pthread_self()->__sig);
-    CLIENT_REGISTRY *cr = malloc(sizeof(CLIENT_REGISTRY));
-    cr->buf = calloc(MAX_CLIENTS, sizeof(int));
-    cr->n = MAX_CLIENTS;
-    memset(cr->buf, -1, sizeof(int)*MAX_CLIENTS);
-    cr->front = cr->back = -1;
-    Sem_init(&cr->mutex, 0, 1); // binary sem for locking
-    Sem_init(&cr->slots, 0, MAX_CLIENTS); // initially buf has n empty slots
-    Sem_init(&cr->items, 0, 0); //initially buf has zero items
+    CLIENT_REGISTRY *cr = calloc(1, sizeof(CLIENT_REGISTRY));
+    if(cr == NULL) return NULL;
+    pthread_mutex_init(&cr->lock, NULL);
+    pthread_cond_init(&cr->empty, NULL);
+    info("Initialize client registry");
     return cr;
 }
 
 void creg_fini(CLIENT_REGISTRY *cr){
-    if(cr == NULL) return; // sanity check;
-    free(cr->buf);
+    if(cr == NULL) return;
+    for(int i = 0; i < cr->nchunks; i++)
+        free(atomic_load(&cr->chunks[i]));
+    pthread_cond_destroy(&cr->empty);
+    pthread_mutex_destroy(&cr->lock);
     free(cr);
 }
 
-bool fd_is_valid(int fd)
-{
-    return (fcntl(fd, F_GETFD) != -1 || errno != EBADF);
-}
-
 int creg_register(CLIENT_REGISTRY *cr, int fd){
-    
-    if(cr == NULL) return -1; // sanity check;
-    if(!fd_is_valid(fd)) return -1; // sanity check
-    P(&cr->slots);                          /* Wait for available slot */
-    P(&cr->mutex);                          /* Lock the buffer */
-    cr->buf[(++cr->back)%(cr->n)] = fd;     /* Insert the item */
-    V(&cr->mutex);                          /* Unlock the buffer */
-    V(&cr->items);                          /* Announce available item */ 
-    int val; sem_getvalue(&cr->items, &val);
-    info("%ld: Register client fd %i (total connected: %i)", get_self(),fd, val);
+    struct creg_entry *e;
+    struct timespec now;
+    char peer[CREG_PEER_MAX];
+
+    if(cr == NULL || fd < 0 || fd >= CREG_CHUNK * CREG_CHUNKS) return -1;
+    if(fcntl(fd, F_GETFD) < 0 && errno == EBADF) return -1;
+    peer_name(fd, peer);
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    pthread_mutex_lock(&cr->lock);
+    if((e = lookup(cr, fd)) == NULL){
+        struct creg_entry *chunk = calloc(CREG_CHUNK, sizeof(struct creg_entry));
+        if(chunk == NULL){
+            pthread_mutex_unlock(&cr->lock);
+            error("unable to allocate client registry entries");
+            return -1;
+        }
+        atomic_store_explicit(&cr->chunks[fd / CREG_CHUNK], chunk, memory_order_release);
+        if(fd / CREG_CHUNK >= cr->nchunks) cr->nchunks = fd / CREG_CHUNK + 1;
+        e = &chunk[fd % CREG_CHUNK];
+    }
+    if(e->used){
+        pthread_mutex_unlock(&cr->lock);
+        error("client fd %d is already registered", fd);
+        return -1;
+    }
+    e->used = 1;
+    atomic_store_explicit(&e->tp, NULL, memory_order_relaxed);
+    atomic_store_explicit(&e->trans_id, -1, memory_order_relaxed);
+    atomic_store_explicit(&e->bytes_in, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->bytes_out, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->active_ms, now_ms(), memory_order_relaxed);
+    e->start = now;
+    memcpy(e->peer, peer, CREG_PEER_MAX);
+    cr->count++;
+    info("Register client fd %d (total connected: %d)", fd, cr->count);
+    pthread_mutex_unlock(&cr->lock);
     return 0;
 }
 
 int creg_unregister(CLIENT_REGISTRY *cr, int fd){
-    int item;
-    P(&cr->items);                                  /* Wait for available */ 
-    P(&cr->mutex);                                  /* Lock the buffer */
-    int found = 0;
-    for(int i = 0; i < cr->n; i++){      /* Looking for the fd we need and moving it to the front of the queue */
-        if(!found && cr->buf[i] == fd) {
-            found = 1;
-            int pop = (cr->front+1)%(cr->n);
-            // swap
-            int temp = cr->buf[pop];
-            cr->buf[pop] = cr->buf[i];
-            cr->buf[i] = temp;
-            // swap(&cr->buf[pop], &cr->buf[i]);
-        }
-    }
-    if(found == 0){
-        error("%ld: client fd %i is not registered", get_self(), fd);
-        V(&cr->mutex); /* unlock buffer */
-        V(&cr->items); /* announce items are unchanged */
+    struct creg_entry *e;
+
+    if(cr == NULL) return -1;
+    pthread_mutex_lock(&cr->lock);
+    if((e = lookup(cr, fd)) == NULL || !e->used){
+        pthread_mutex_unlock(&cr->lock);
+        error("client fd %d is not registered", fd);
         return -1;
     }
-    item = cr->buf[(++cr->front)%(cr->n)];          /* Remove the item */
-    int val; sem_getvalue(&cr->items, &val);
-    info("%ld: Unregister client fd %i (total connected: %i)", get_self(), item, val);
-    V(&cr->mutex);                                  /* Unlock the buffer */
-    V(&cr->slots);                                  /* Announce available slot */
+    e->used = 0;
+    if(--cr->count == 0) pthread_cond_broadcast(&cr->empty);
+    info("Unregister client fd %d (total connected: %d)", fd, cr->count);
+    pthread_mutex_unlock(&cr->lock);
     return 0;
 }
+
 void creg_wait_for_empty(CLIENT_REGISTRY *cr){
-    int val;
-    while(1){
-        sem_getvalue(&cr->items, &val);
-        if(val == 0) return;
+    if(cr == NULL) return;
+    pthread_mutex_lock(&cr->lock);
+    while(cr->count > 0)
+        pthread_cond_wait(&cr->empty, &cr->lock);
+    pthread_mutex_unlock(&cr->lock);
+}
+
+int creg_wait_for_empty_until(CLIENT_REGISTRY *cr, const struct timespec *deadline){
+    int ret = 0;
+    if(cr == NULL) return 0;
+    pthread_mutex_lock(&cr->lock);
+    while(cr->count > 0 && ret != ETIMEDOUT)
+        ret = pthread_cond_timedwait(&cr->empty, &cr->lock, deadline);
+    ret = cr->count > 0 ? -1 : 0;
+    pthread_mutex_unlock(&cr->lock);
+    return ret;
+}
+
+/*
+ * Shut down the connections of registered clients, only those without a
+ * transaction in progress if idle_only is set.
+ */
+static void shutdown_clients(CLIENT_REGISTRY *cr, int how, int idle_only){
+    if(cr == NULL) return;
+    pthread_mutex_lock(&cr->lock);
+    for(int c = 0; c < cr->nchunks; c++){
+        struct creg_entry *chunk = atomic_load_explicit(&cr->chunks[c], memory_order_relaxed);
+        for(int i = 0; chunk && i < CREG_CHUNK; i++){
+            int fd = c * CREG_CHUNK + i;
+            if(!chunk[i].used || (idle_only && atomic_load(&chunk[i].trans_id) >= 0)) continue;
+            if(shutdown(fd, how) < 0 && errno != ENOTCONN)
+                warn("error shutting down fd %d: %s", fd, strerror(errno));
+        }
     }
+    pthread_mutex_unlock(&cr->lock);
 }
+
 void creg_shutdown_all(CLIENT_REGISTRY *cr){
-    for(int i = 0; i < cr->n; ++i){
-        if(cr->buf[i] > 0){
-            if(shutdown(cr->buf[i], SHUT_RDWR) < 0){
-                unix_error("error shutting down fd");
-            }
+    shutdown_clients(cr, SHUT_RDWR, 0);
+}
+
+void creg_shutdown_idle(CLIENT_REGISTRY *cr){
+    shutdown_clients(cr, SHUT_RD, 1);
+}
+
+int creg_count(CLIENT_REGISTRY *cr){
+    if(cr == NULL) return 0;
+    pthread_mutex_lock(&cr->lock);
+    int n = cr->count;
+    pthread_mutex_unlock(&cr->lock);
+    return n;
+}
+
+int creg_transactions(CLIENT_REGISTRY *cr){
+    if(cr == NULL) return 0;
+    return atomic_load_explicit(&cr->transactions, memory_order_relaxed);
+}
+
+int creg_info(CLIENT_REGISTRY *cr, int fd, CLIENT_INFO *ip){
+    struct creg_entry *e;
+    int ret = -1;
+
+    if(cr == NULL) return -1;
+    pthread_mutex_lock(&cr->lock);
+    if((e = lookup(cr, fd)) != NULL && e->used){
+        ip->fd = fd;
+        memcpy(ip->peer, e->peer, CREG_PEER_MAX);
+        ip->trans_id = atomic_load_explicit(&e->trans_id, memory_order_relaxed);
+        ip->bytes_in = atomic_load_explicit(&e->bytes_in, memory_order_relaxed);
+        ip->bytes_out = atomic_load_explicit(&e->bytes_out, memory_order_relaxed);
+        ip->start = e->start;
+        ip->idle_ms = now_ms() - atomic_load_explicit(&e->active_ms, memory_order_relaxed);
+        ip->trans_ms = ip->trans_id < 0 ? -1
+            : now_ms() - atomic_load_explicit(&e->trans_ms, memory_order_relaxed);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&cr->lock);
+    return ret;
+}
+
+void creg_set_transaction(CLIENT_REGISTRY *cr, int fd, TRANSACTION *tp){
+    struct creg_entry *e = lookup(cr, fd);
+    if(e == NULL || tp == NULL) return;
+    atomic_store_explicit(&e->trans_ms, now_ms(), memory_order_relaxed);
+    atomic_store_explicit(&e->trans_id, tp->id, memory_order_relaxed);
+    // Only a client that had none is counted again; one being aborted is
+    // waited out, as the abort would otherwise clear the new transaction.
+    TRANSACTION *old = atomic_load_explicit(&e->tp, memory_order_relaxed);
+    while(old == ABORTING || !atomic_compare_exchange_weak_explicit(&e->tp, &old, tp,
+                                                                   memory_order_release,
+                                                                   memory_order_relaxed)){
+        if(old == ABORTING){
+            sched_yield();
+            old = atomic_load_explicit(&e->tp, memory_order_relaxed);
         }
     }
-    return;
-}
\ No newline at end of file
+    if(old == NULL)
+        atomic_fetch_add_explicit(&cr->transactions, 1, memory_order_relaxed);
+}
+
+int creg_release_transaction(CLIENT_REGISTRY *cr, int fd){
+    struct creg_entry *e = lookup(cr, fd);
+    if(e == NULL) return -1;
+    TRANSACTION *tp = atomic_load_explicit(&e->tp, memory_order_relaxed);
+    while(tp == ABORTING || !atomic_compare_exchange_weak(&e->tp, &tp, NULL)){
+        if(tp == ABORTING){
+            sched_yield();
+            tp = atomic_load_explicit(&e->tp, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&e->trans_id, -1, memory_order_relaxed);
+    if(tp == NULL) return -1;
+    atomic_fetch_sub_explicit(&cr->transactions, 1, memory_order_relaxed);
+    return 0;
+}
+
+int creg_abort_transaction(CLIENT_REGISTRY *cr, int fd){
+    struct creg_entry *e = lookup(cr, fd);
+    if(e == NULL) return -1;
+    TRANSACTION *tp = atomic_load_explicit(&e->tp, memory_order_acquire);
+    do {
+        if(tp == NULL || tp == ABORTING) return -1;
+    } while(!atomic_compare_exchange_weak(&e->tp, &tp, ABORTING));
+    trans_ref(tp, "aborted through client registry");
+    atomic_store_explicit(&e->trans_id, -1, memory_order_relaxed);
+    atomic_store_explicit(&e->tp, NULL, memory_order_release);
+    atomic_fetch_sub_explicit(&cr->transactions, 1, memory_order_relaxed);
+    trans_abort(tp);
+    return 0;
+}
+
+void creg_add_bytes(CLIENT_REGISTRY *cr, int fd, size_t in, size_t out){
+    struct creg_entry *e = lookup(cr, fd);
+    if(e == NULL) return;
+    if(in) atomic_fetch_add_explicit(&e->bytes_in, in, memory_order_relaxed);
+    if(out) atomic_fetch_add_explicit(&e->bytes_out, out, memory_order_relaxed);
+    atomic_store_explicit(&e->active_ms, now_ms(), memory_order_relaxed);
+}
+
+void creg_show(CLIENT_REGISTRY *cr){
+    struct timespec now;
+    CLIENT_INFO ci;
+
+    if(cr == NULL) return;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&cr->lock);
+    int count = cr->count, nfds = cr->nchunks * CREG_CHUNK;
+    pthread_mutex_unlock(&cr->lock);
+    fprintf(stderr, "CLIENTS: %d connected\n", count);
+    for(int fd = 0; fd < nfds; fd++){
+        if(creg_info(cr, fd, &ci)) continue;
+        fprintf(stderr, "CLIENTS: [%d] %s, transaction %d, in=%zu, out=%zu bytes, for %.1fs, idle %.1fs\n",
+                fd, ci.peer, ci.trans_id, ci.bytes_in, ci.bytes_out,
+                (now.tv_sec - ci.start.tv_sec) + (now.tv_nsec - ci.start.tv_nsec) / 1e9,
+                ci.idle_ms / 1e3);
+    }
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include "commitq.h"
+#include "admit.h"
+#include "settings.h"
+#include "debug.h"
+
+struct commit {
+    struct commitq *q;
+    TRANSACTION *tp;
+    void *arg;
+    int id;                         // Taken before the transaction may be gone
+    TRANS_STATUS status;
+    struct commit *next;
+};
+
+struct commitq {
+    int efd;
+    pthread_mutex_t lock;           // Protects the list of completed commits
+    struct commit *head, *tail;
+};
+
+static atomic_int running;          // Commit threads, over all queues
+
+COMMITQ *commitq_create(void){
+    COMMITQ *q = calloc(1, sizeof(COMMITQ));
+    if(q == NULL) return NULL;
+    if((q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+        free(q);
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    return q;
+}
+
+void commitq_destroy(COMMITQ *q){
+    close(q->efd);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+int commitq_fd(COMMITQ *q){
+    return q->efd;
+}
+
+int commitq_would_wait(TRANSACTION *tp){
+    // A status other than pending is final; the list itself only changes
+    // as the transaction performs operations.
+    for(DEPENDENCY *dp = tp->depends; dp; dp = dp->next){
+        if(trans_get_status(dp->trans) == TRANS_PENDING) return 1;
+    }
+    return 0;
+}
+
+static void *commitq_thread(void *arg){
+    struct commit *cp = arg;
+    COMMITQ *q = cp->q;
+    uint64_t one = 1;
+
+    cp->status = admit_commit(cp->tp);
+    debug("Transaction %d finished waiting to commit", cp->id);
+    pthread_mutex_lock(&q->lock);
+    if(q->tail) q->tail->next = cp;
+    else q->head = cp;
+    q->tail = cp;
+    pthread_mutex_unlock(&q->lock);
+    if(write(q->efd, &one, sizeof(one)) < 0)
+        error("commit queue eventfd: write failed");
+    atomic_fetch_sub_explicit(&running, 1, memory_order_relaxed);
+    return NULL;
+}
+
+int commitq_submit(COMMITQ *q, TRANSACTION *tp, void *arg){
+    struct commit *cp = malloc(sizeof(struct commit));
+    pthread_attr_t attr;
+    pthread_t tid;
+    int ret;
+
+    if(cp == NULL) return -1;
+    if(atomic_fetch_add_explicit(&running, 1, memory_order_relaxed) >= COMMITQ_THREADS){
+        atomic_fetch_sub_explicit(&running, 1, memory_order_relaxed);
+        debug("Transaction %d cannot wait to commit: too many waiting", tp->id);
+        free(cp);
+        return -1;
+    }
+    cp->q = q;
+    cp->tp = tp;
+    cp->arg = arg;
+    cp->id = tp->id;
+    cp->next = NULL;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, COMMITQ_STACK);
+    ret = pthread_create(&tid, &attr, commitq_thread, cp);
+    pthread_attr_destroy(&attr);
+    if(ret){
+        atomic_fetch_sub_explicit(&running, 1, memory_order_relaxed);
+        free(cp);
+        return -1;
+    }
+    return 0;
+}
+
+void *commitq_next(COMMITQ *q, int *idp, TRANS_STATUS *statusp){
+    struct commit *cp;
+    void *arg;
+
+    pthread_mutex_lock(&q->lock);
+    if((cp = q->head) != NULL && (q->head = cp->next) == NULL) q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+    if(cp == NULL) return NULL;
+    arg = cp->arg;
+    *idp = cp->id;
+    *statusp = cp->status;
+    free(cp);
+    return arg;
+}
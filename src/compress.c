@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "blob_ext.h"
+#include "lz.h"
+#include "settings.h"
+#include "debug.h"
+
+static struct {
+    size_t min_size;                // Smallest size eligible (0 = disabled)
+    pthread_mutex_t stats_mutex;
+    COMPRESS_STATS stats;
+} zconf;
+
+void compress_init(size_t min_size){
+    zconf.min_size = min_size ? min_size : 1;
+    pthread_mutex_init(&zconf.stats_mutex, NULL);
+    memset(&zconf.stats, 0, sizeof(COMPRESS_STATS));
+    info("Blob compression enabled for values of %zu bytes or more", zconf.min_size);
+}
+
+
+void compress_fini(void){
+    if(zconf.min_size == 0) return;
+    pthread_mutex_destroy(&zconf.stats_mutex);
+    zconf.min_size = 0;
+}
+
+
+int compress_eligible(size_t size){
+    return zconf.min_size && size >= zconf.min_size;
+}
+
+
+char *compress_content(char *content, size_t size, size_t *zsizep){
+    /* Only keep the result if it saves at least 1/COMPRESS_MIN_SAVING of the size. */
+    size_t cap = size - size / COMPRESS_MIN_SAVING;
+    char *zbuf = malloc(cap ? cap : 1);
+    size_t zsize = 0;
+
+    if(zbuf) zsize = lz_compress(content, size, zbuf, cap);
+    pthread_mutex_lock(&zconf.stats_mutex);
+    zconf.stats.candidates++;
+    if(zsize){
+        zconf.stats.compressed++;
+        zconf.stats.raw_bytes += size;
+        zconf.stats.stored_bytes += zsize;
+    }
+    pthread_mutex_unlock(&zconf.stats_mutex);
+    if(zsize == 0){
+        free(zbuf);
+        return NULL;
+    }
+    *zsizep = zsize;
+    return realloc(zbuf, zsize) ?: zbuf;
+}
+
+
+char *blob_compressed(BLOB *bp, size_t *zsizep){
+    if(!blob_is_ext(bp->size) || ((BLOB_EXT *)bp)->zsize == 0)
+        return NULL;
+    *zsizep = ((BLOB_EXT *)bp)->zsize;
+    return bp->content;
+}
+
+
+char *blob_data(BLOB *bp){
+    BLOB_EXT *ep = (BLOB_EXT *)bp;
+    char *data;
+
+    if(!blob_is_ext(bp->size) || ep->zsize == 0)
+        return bp->content;
+    data = malloc(bp->size);
+    if(data == NULL) return NULL;
+    if(lz_decompress(bp->content, ep->zsize, data, bp->size) != (ssize_t)bp->size){
+        error("corrupt compressed blob %p", bp);
+        free(data);
+        return NULL;
+    }
+    pthread_mutex_lock(&zconf.stats_mutex);
+    zconf.stats.expansions++;
+    pthread_mutex_unlock(&zconf.stats_mutex);
+    return data;
+}
+
+
+void blob_data_release(BLOB *bp, char *data){
+    if(data != bp->content) free(data);
+}
+
+
+void compress_get_stats(COMPRESS_STATS *sp){
+    pthread_mutex_lock(&zconf.stats_mutex);
+    *sp = zconf.stats;
+    pthread_mutex_unlock(&zconf.stats_mutex);
+}
+
+
+void compress_show(void){
+    COMPRESS_STATS s;
+    if(zconf.min_size == 0) return;
+    compress_get_stats(&s);
+    fprintf(stderr, "COMPRESS: candidates=%zu, compressed=%zu, %zu -> %zu bytes (%.2fx), expansions=%zu\n",
+            s.candidates, s.compressed, s.raw_bytes, s.stored_bytes,
+            s.stored_bytes ? (double)s.raw_bytes / s.stored_bytes : 1.0, s.expansions);
+}
@@ -0,0 +1,712 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "client_registry.h"
+#include "creg_ext.h"
+#include "proto_queue.h"
+#include "store.h"
+#include "batch.h"
+#include "proto_batch.h"
+#include "proto2.h"
+#include "proto_session.h"
+#include "blob_ext.h"
+#include "compress.h"
+#include "flow.h"
+#include "timeout.h"
+#include "admit.h"
+#include "reason.h"
+#include "commitq.h"
+#include "service.h"
+#include "settings.h"
+#include "wrappers.h"
+#include "debug.h"
+
+extern CLIENT_REGISTRY *client_registry;
+
+enum { STAGE_REQUEST, STAGE_KEY, STAGE_VALUE };
+
+/*
+ * Make room for at least n more bytes at the end of a buffer, moving the
+ * unconsumed bytes to the front first.
+ */
+static int buf_reserve(CONN_BUF *b, size_t n){
+    if(b->start == b->end){
+        b->start = b->end = 0;
+        if(b->cap > CONN_BUF_MAX && n <= CONN_BUF_INIT){
+            // Give back the memory after an unusually large packet.
+            free(b->data);
+            b->data = NULL;
+            b->cap = 0;
+        }
+    }
+    if(b->cap - b->end >= n) return 0;
+    if(b->start){
+        memmove(b->data, b->data + b->start, b->end - b->start);
+        b->end -= b->start;
+        b->start = 0;
+        if(b->cap - b->end >= n) return 0;
+    }
+    size_t cap = b->cap ? b->cap : CONN_BUF_INIT;
+    while(cap - b->end < n) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if(data == NULL) return -1;
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+static int buf_append(CONN_BUF *b, const void *data, size_t n){
+    if(buf_reserve(b, n)) return -1;
+    memcpy(b->data + b->end, data, n);
+    b->end += n;
+    return 0;
+}
+
+/*
+ * Make room for one more value to be sent from its blob.
+ */
+static int buf_value_reserve(CONN_BUF *b){
+    if(b->vend < b->vcap) return 0;
+    if(b->vstart){
+        memmove(b->values, b->values + b->vstart, (b->vend - b->vstart) * sizeof(CONN_VALUE));
+        b->vend -= b->vstart;
+        b->vstart = 0;
+        return 0;
+    }
+    int cap = b->vcap ? 2 * b->vcap : 8;
+    CONN_VALUE *values = realloc(b->values, cap * sizeof(CONN_VALUE));
+    if(values == NULL) return -1;
+    b->values = values;
+    b->vcap = cap;
+    return 0;
+}
+
+/*
+ * Queue a value to be sent from its blob after the bytes in the buffer,
+ * taking over the reference to the blob.  There must be room for it (see
+ * buf_value_reserve()).
+ */
+static void buf_append_value(CONN_BUF *b, BLOB *bp, char *data, size_t size, int expanded){
+    b->values[b->vend++] = (CONN_VALUE){ b->pos + b->end - b->start, bp, data, size, expanded };
+    b->vbytes += size;
+}
+
+static void value_release(CONN_VALUE *vp){
+    if(vp->expanded) blob_data_release(vp->bp, vp->data);
+    blob_unref(vp->bp, "value sent in GET reply");
+}
+
+size_t conn_buf_pending(CONN_BUF *b, struct iovec *iov, int *iovcntp){
+    size_t pos = b->pos, total = b->end - b->start + b->vbytes;
+    int n = 0, max = iovcntp ? *iovcntp : 0;
+
+    for(int i = b->vstart; i < b->vend && n < max; i++){
+        CONN_VALUE *vp = &b->values[i];
+        size_t off = i == b->vstart ? b->vsent : 0;
+        if(vp->at > pos){
+            iov[n].iov_base = b->data + b->start + (pos - b->pos);
+            iov[n++].iov_len = vp->at - pos;
+            pos = vp->at;
+            if(n == max) break;
+        }
+        iov[n].iov_base = vp->data + off;
+        iov[n++].iov_len = vp->size - off;
+    }
+    if(n < max && b->start + (pos - b->pos) < b->end){
+        iov[n].iov_base = b->data + b->start + (pos - b->pos);
+        iov[n++].iov_len = b->end - b->start - (pos - b->pos);
+    }
+    if(iovcntp) *iovcntp = n;
+    return total;
+}
+
+void conn_buf_sent(CONN_BUF *b, size_t n){
+    while(n > 0){
+        CONN_VALUE *vp = b->vstart < b->vend ? &b->values[b->vstart] : NULL;
+        size_t k;
+        if(vp && vp->at == b->pos){
+            k = vp->size - b->vsent < n ? vp->size - b->vsent : n;
+            b->vsent += k;
+            b->vbytes -= k;
+            if(b->vsent == vp->size){
+                value_release(vp);
+                b->vstart++;
+                b->vsent = 0;
+            }
+        } else {
+            k = vp ? vp->at - b->pos : b->end - b->start;
+            if(k > n) k = n;
+            if(k == 0) break;
+            b->start += k;
+            b->pos += k;
+        }
+        n -= k;
+    }
+    if(b->vstart == b->vend) b->vstart = b->vend = 0;
+}
+
+void conn_buf_free(CONN_BUF *b){
+    for(int i = b->vstart; i < b->vend; i++)
+        value_release(&b->values[i]);
+    free(b->values);
+    free(b->data);
+}
+
+CONN *conn_create(int fd){
+    creg_register(client_registry, fd);
+    timeout_open(fd);
+    return conn_attach(fd);
+}
+
+CONN *conn_attach(int fd){
+    CONN *cp = calloc(1, sizeof(CONN));
+    if(cp == NULL) return NULL;
+    cp->fd = fd;
+    cp->stage = STAGE_REQUEST;
+    cp->status = TRANS_PENDING;
+    cp->tp = admit_trans_create(&cp->rejected);
+    cp->done = (cp->tp == NULL);
+    if(!cp->rejected) creg_set_transaction(client_registry, fd, cp->tp);
+    flow_open(fd);
+    debug("[%d] Starting client service (transaction %d)", fd, cp->tp ? cp->tp->id : -1);
+    return cp;
+}
+
+void conn_destroy(CONN *cp){
+    if(cp->key) key_dispose(cp->key);
+    if(cp->tp){
+        creg_release_transaction(client_registry, cp->fd);
+        // Aborting a transaction still pending consumes our reference.
+        if(cp->status == TRANS_PENDING) trans_abort(cp->tp);
+        else trans_unref(cp->tp, "client service terminating");
+    }
+    debug("[%d] Ending client service", cp->fd);
+    flow_close(cp->fd);
+    timeout_close(cp->fd);
+    creg_unregister(client_registry, cp->fd);
+    close(cp->fd);
+    free(cp->payload);
+    free(cp->in.data);
+    conn_buf_free(&cp->out);
+    free(cp);
+}
+
+char *conn_rspace(CONN *cp, size_t *lenp){
+    size_t size = ntohl(cp->hdr.size);
+    if(cp->payload && cp->got < size){
+        *lenp = size - cp->got;
+        return cp->payload + cp->got;
+    }
+    size_t have = cp->in.end - cp->in.start;
+    size_t want = cp->need > have ? cp->need - have : 0;
+    if(want < CONN_BUF_INIT / 2) want = CONN_BUF_INIT / 2;
+    if(buf_reserve(&cp->in, want)) return NULL;
+    *lenp = cp->in.cap - cp->in.end;
+    return cp->in.data + cp->in.end;
+}
+
+void conn_received(CONN *cp, size_t n){
+    creg_add_bytes(client_registry, cp->fd, n, 0);
+    if(cp->payload && cp->got < ntohl(cp->hdr.size)) cp->got += n;
+    else cp->in.end += n;
+}
+
+/*
+ * Determine whether the output buffer is full, as far as flow control is
+ * concerned (see flow.h).
+ */
+static int conn_full(CONN *cp){
+    return conn_buf_pending(&cp->out, NULL, NULL) >= CONN_OUT_MAX;
+}
+
+int conn_throttled(CONN *cp){
+    return conn_full(cp) || cp->inflight >= service_max_inflight() || cp->committing;
+}
+
+size_t conn_pending(CONN *cp, struct iovec *iov, int *iovcntp){
+    return conn_buf_pending(&cp->out, iov, iovcntp);
+}
+
+void conn_sent(CONN *cp, size_t n){
+    creg_add_bytes(client_registry, cp->fd, 0, n);
+    conn_buf_sent(&cp->out, n);
+    if(conn_buf_pending(&cp->out, NULL, NULL) == 0){
+        cp->out.start = cp->out.end = 0;
+        cp->inflight = 0;
+    }
+}
+
+void conn_take_output(CONN *cp, CONN_BUF *bp){
+    CONN_BUF spare = *bp;
+    *bp = cp->out;
+    spare.start = spare.end = 0;
+    spare.vstart = spare.vend = 0;
+    spare.vsent = spare.vbytes = 0;
+    cp->out = spare;
+    cp->inflight = 0;
+}
+
+/*
+ * Queue a reply, in the wire format of the connection.  If has_value is
+ * set, the reply carries size bytes of data, or a null value if data is
+ * NULL; if rawlen is nonzero, the data is compressed and expands to
+ * rawlen bytes (v2 only); if by_ref is set, the data itself is left for
+ * the caller to queue.  An abort is explained as far as the client can
+ * take it (see proto_status.h).
+ */
+static int conn_put_reply(CONN *cp, TRANS_STATUS status, int has_value,
+                          char *data, size_t size, size_t rawlen, int by_ref){
+    int st = admit_status(status, cp->rejected && (cp->opts & PROTO2_OPT_OVERLOAD));
+    int reason = status == TRANS_ABORTED ? cp->abort.reason : XACTO_REASON_NONE;
+
+    cp->inflight++;
+    if(cp->proto == 2){
+        PROTO2_REPLY r = { st, 0, ntohl(cp->req.serial), data ? size : 0, rawlen };
+        if(cp->opts & PROTO2_OPT_TS) r.flags |= PROTO2_F_TS;
+        if(has_value) r.flags |= PROTO2_F_VALUE | (data ? 0 : PROTO2_F_NULL);
+        if(rawlen) r.flags |= PROTO2_F_LZ;
+        if((cp->opts & PROTO2_OPT_REASON) && reason != XACTO_REASON_NONE){
+            r.flags |= PROTO2_F_REASON;
+            r.reason = reason;
+            r.retry_us = cp->abort.retry_us;
+            r.key_hash = cp->abort.key_hash;
+        }
+        if(buf_reserve(&cp->out, PROTO2_HEAD_MAX + (by_ref ? 0 : r.vlen))) return -1;
+        cp->out.end += proto2_reply_head(cp->out.data + cp->out.end, &r);
+        return r.vlen && !by_ref ? buf_append(&cp->out, data, r.vlen) : 0;
+    }
+
+    XACTO_PACKET pkt;
+    proto_init_header(&pkt, XACTO_REPLY_PKT, cp->req.serial);
+    pkt.status = st;
+    if(buf_append(&cp->out, &pkt, sizeof(pkt))) return -1;
+    if(!has_value) return 0;
+    proto_init_header(&pkt, XACTO_VALUE_PKT, cp->req.serial);
+    pkt.null = (data == NULL);
+    pkt.size = htonl(data ? size : 0);
+    if(buf_reserve(&cp->out, sizeof(pkt) + (by_ref ? 0 : size))) return -1;
+    buf_append(&cp->out, &pkt, sizeof(pkt));
+    return data && !by_ref ? buf_append(&cp->out, data, size) : 0;
+}
+
+/*
+ * Queue a reply, with a value if the request was a GET.  The reference to
+ * the value is consumed.  A compressed value goes out as it is stored if
+ * the client accepts that.  A large value is sent from the blob, which
+ * keeps the reference until then.
+ */
+static int conn_reply(CONN *cp, TRANS_STATUS status, int is_get, BLOB *value){
+    char *data;
+    size_t size, rawlen = 0;
+    int expanded = 0, ret;
+
+    if(value == NULL) return conn_put_reply(cp, status, is_get, NULL, 0, 0, 0);
+    if((cp->opts & PROTO2_OPT_LZ) && (data = blob_compressed(value, &size)) != NULL){
+        rawlen = value->size;
+    } else if((data = blob_data(value)) != NULL){
+        size = value->size;
+        expanded = 1;
+    } else {
+        blob_unref(value, "value sent in GET reply");
+        return -1;
+    }
+    if(size >= CONN_SEND_REF_MIN && buf_value_reserve(&cp->out) == 0){
+        if((ret = conn_put_reply(cp, status, 1, data, size, rawlen, 1)) == 0){
+            buf_append_value(&cp->out, value, data, size, expanded);
+            return 0;
+        }
+    } else {
+        ret = conn_put_reply(cp, status, 1, data, size, rawlen, 0);
+    }
+    if(expanded) blob_data_release(value, data);
+    blob_unref(value, "value sent in GET reply");
+    return ret;
+}
+
+/*
+ * Decide whether requests may follow the one just handled: only while the
+ * transaction is pending, unless the connection is a session and the server
+ * is not draining.
+ */
+static int conn_continue(CONN *cp){
+    return (cp->session && !service_draining()) || cp->status == TRANS_PENDING ? 0 : -1;
+}
+
+/*
+ * Work out why the transaction was aborted, if it has been, the first time
+ * a request finds out; otherwise is the reason to give if the one that
+ * aborted it recorded none (see reason.h).
+ */
+static void conn_explain(CONN *cp, int id, XACTO_REASON otherwise){
+    if(cp->status == TRANS_ABORTED)
+        reason_explain(&cp->abort, id, cp->rejected ? XACTO_REASON_OVERLOADED : otherwise);
+}
+
+/*
+ * Make sure there is a transaction for a request: in a session, the one
+ * following a COMMIT (or BEGIN) starts a new one, unless the server is
+ * draining.
+ *
+ * @return  0 if successful, -1 if the transaction could not be created.
+ */
+static int conn_transaction(CONN *cp){
+    if(cp->tp) return 0;
+    if(service_draining() || (cp->tp = admit_trans_create(&cp->rejected)) == NULL) return -1;
+    cp->status = TRANS_PENDING;
+    cp->abort.reason = XACTO_REASON_NONE;
+    if(!cp->rejected) creg_set_transaction(client_registry, cp->fd, cp->tp);
+    debug("[%d] Starting transaction %d%s", cp->fd, cp->tp->id, cp->rejected ? " (not admitted)" : "");
+    return 0;
+}
+
+/*
+ * Abort any transaction left on the connection, make it a session, and
+ * queue the reply to BEGIN.
+ */
+static int conn_begin(CONN *cp){
+    debug("[%d] BEGIN packet received", cp->fd);
+    if(cp->tp){
+        creg_release_transaction(client_registry, cp->fd);
+        trans_abort(cp->tp);
+    }
+    cp->tp = NULL;
+    cp->status = TRANS_PENDING;
+    cp->session = 1;
+    return conn_put_reply(cp, TRANS_PENDING, 0, NULL, 0, 0, 0);
+}
+
+/*
+ * Execute a batched request and queue its reply.  An owned payload is
+ * freed.
+ *
+ * @return  0 if more packets may follow, -1 if the service has ended.
+ */
+static int conn_batch(CONN *cp, XACTO_PACKET *pkt, char *data, int owned){
+    char *values;
+    size_t size;
+    int ret;
+
+    debug("[%d] %s packet received", cp->fd, pkt->type == XACTO_MGET_PKT ? "MGET" : "MPUT");
+    cp->req = *pkt;
+    ret = batch_execute(cp->tp, pkt, data, &cp->status, &values, &size);
+    if(owned) free(data);
+    if(ret) return -1;
+    conn_explain(cp, cp->tp->id, XACTO_REASON_EXPIRED);
+    ret = conn_put_reply(cp, cp->status, values != NULL, values, size, 0, 0);
+    free(values);
+    return ret ? -1 : conn_continue(cp);
+}
+
+/*
+ * Perform the PUT or GET of the current request, given its key (inherited)
+ * and for a PUT its value (consumed), and queue the reply.
+ *
+ * @return  0 if more requests may follow, -1 if the service has ended.
+ */
+static int conn_access(CONN *cp, KEY *key, BLOB *value){
+    int is_get = (cp->req.type == XACTO_GET_PKT);
+    if(is_get) cp->status = store_get(cp->tp, key, &value);
+    else cp->status = store_put(cp->tp, key, value);
+    conn_explain(cp, cp->tp->id, XACTO_REASON_EXPIRED);
+    if(conn_reply(cp, cp->status, is_get, is_get ? value : NULL)) return -1;
+    return conn_continue(cp);
+}
+
+/*
+ * Record the outcome of the commit of transaction id and queue the reply.
+ * The service ends, unless the connection is a session (see
+ * conn_continue()).
+ */
+static int conn_finish(CONN *cp, int id, TRANS_STATUS status, XACTO_REASON otherwise){
+    cp->status = status;
+    conn_explain(cp, id, otherwise);
+    if(conn_reply(cp, cp->status, 0, NULL)) return -1;
+    return conn_continue(cp);
+}
+
+/*
+ * Commit the transaction, unless it has been aborted for overstaying its
+ * lifetime (see timeout.h) or was not admitted, and queue the reply.  A
+ * commit that would wait for other transactions is handed to the commit
+ * queue of the connection, if it has one, and no further requests are
+ * executed until conn_committed() is called with its outcome.
+ */
+static int conn_commit(CONN *cp){
+    TRANSACTION *tp = cp->tp;
+    int id = tp->id;
+
+    debug("[%d] COMMIT packet received", cp->fd);
+    cp->tp = NULL;
+    if(creg_release_transaction(client_registry, cp->fd)){
+        // Aborting an aborted transaction only lets go of the reference.
+        trans_abort(tp);
+        return conn_finish(cp, id, TRANS_ABORTED, XACTO_REASON_EXPIRED);
+    }
+    if(cp->commits && commitq_would_wait(tp)){
+        if(commitq_submit(cp->commits, tp, cp) == 0){
+            debug("[%d] Transaction %d waits to commit", cp->fd, id);
+            cp->committing = 1;
+            return 0;
+        }
+        // Never wait here, where other connections would wait too.
+        trans_abort(tp);
+        return conn_finish(cp, id, TRANS_ABORTED, XACTO_REASON_OVERLOADED);
+    }
+    return conn_finish(cp, id, admit_commit(tp), XACTO_REASON_DEPENDENCY);
+}
+
+int conn_committed(CONN *cp, int id, TRANS_STATUS status){
+    cp->committing = 0;
+    if(conn_finish(cp, id, status, XACTO_REASON_DEPENDENCY)) cp->done = 1;
+    return conn_process(cp);
+}
+
+/*
+ * Turn the payload of a packet into a blob, taking over its storage if
+ * that is owned.
+ */
+static BLOB *conn_blob(XACTO_PACKET *pkt, char *data, int owned){
+    if(owned) return blob_adopt(data, ntohl(pkt->size));
+    return blob_create(data, ntohl(pkt->size));
+}
+
+/*
+ * Handle one complete packet.  If owned is set, the payload is malloc'd
+ * storage that passes to this function.
+ *
+ * @return  0 if more packets may follow, -1 if the service has ended.
+ */
+static int conn_packet(CONN *cp, XACTO_PACKET *pkt, char *data, int owned){
+    BLOB *bp = NULL;
+    KEY *key;
+
+    if(cp->stage == STAGE_REQUEST && pkt->type != XACTO_BEGIN_PKT && conn_transaction(cp)){
+        if(owned) free(data);
+        return -1;
+    }
+    if(cp->stage == STAGE_REQUEST && (pkt->type == XACTO_MGET_PKT || pkt->type == XACTO_MPUT_PKT))
+        return conn_batch(cp, pkt, data, owned);
+    if(owned && (cp->stage == STAGE_REQUEST || pkt->null)){
+        free(data);
+        owned = 0;
+    }
+    switch(cp->stage){
+    case STAGE_REQUEST:
+        cp->req = *pkt;
+        switch(pkt->type){
+        case XACTO_PUT_PKT:
+            debug("[%d] PUT packet received", cp->fd);
+            cp->stage = STAGE_KEY;
+            return 0;
+        case XACTO_GET_PKT:
+            debug("[%d] GET packet received", cp->fd);
+            cp->stage = STAGE_KEY;
+            return 0;
+        case XACTO_COMMIT_PKT:
+            return conn_commit(cp);
+        case XACTO_BEGIN_PKT:
+            return conn_begin(cp);
+        default:
+            error("[%d] unexpected packet type %d", cp->fd, pkt->type);
+            return -1;
+        }
+    case STAGE_KEY:
+        if(pkt->type != XACTO_KEY_PKT || pkt->null){
+            error("[%d] expected key packet, got type %d", cp->fd, pkt->type);
+            if(owned) free(data);
+            return -1;
+        }
+        if((bp = conn_blob(pkt, data, owned)) == NULL) return -1;
+        if((cp->key = key_create(bp)) == NULL){
+            blob_unref(bp, "");
+            return -1;
+        }
+        if(cp->req.type == XACTO_PUT_PKT){
+            cp->stage = STAGE_VALUE;
+            return 0;
+        }
+        cp->stage = STAGE_REQUEST;
+        key = cp->key;
+        cp->key = NULL;
+        return conn_access(cp, key, NULL);
+    case STAGE_VALUE:
+        if(pkt->type != XACTO_VALUE_PKT){
+            error("[%d] expected value packet, got type %d", cp->fd, pkt->type);
+            if(owned) free(data);
+            return -1;
+        }
+        if(!pkt->null && (bp = conn_blob(pkt, data, owned)) == NULL) return -1;
+        cp->stage = STAGE_REQUEST;
+        key = cp->key;
+        cp->key = NULL;
+        return conn_access(cp, key, bp);
+    }
+    return -1;
+}
+
+/*
+ * Set a large packet whose header is at the start of the input buffer
+ * aside, to have the rest of its payload received directly into storage
+ * of its own.
+ *
+ * @return  0 if successful, -1 if memory could not be allocated.
+ */
+static int conn_divert(CONN *cp, XACTO_PACKET *pkt){
+    size_t size = ntohl(pkt->size);
+    size_t have = cp->in.end - cp->in.start - sizeof(*pkt);
+    if(size > 0x100000){
+        error("[%d] size error: %zu", cp->fd, size);
+        return -1;
+    }
+    if((cp->payload = malloc(size)) == NULL) return -1;
+    cp->hdr = *pkt;
+    memcpy(cp->payload, cp->in.data + cp->in.start + sizeof(*pkt), have);
+    cp->got = have;
+    cp->in.start = cp->in.end;
+    cp->need = 0;
+    return 0;
+}
+
+/*
+ * Execute the complete v1 packets in the input buffer, as long as there is
+ * room for their replies.
+ */
+static void conn_process_v1(CONN *cp){
+    XACTO_PACKET pkt;
+
+    while(!cp->done && !conn_throttled(cp)){
+        if(cp->payload){
+            if(cp->got < ntohl(cp->hdr.size)) break;
+            char *data = cp->payload;
+            cp->payload = NULL;
+            if(conn_packet(cp, &cp->hdr, data, 1)) cp->done = 1;
+            continue;
+        }
+        size_t have = cp->in.end - cp->in.start;
+        char *p = cp->in.data + cp->in.start;
+        if(have < sizeof(pkt)){
+            cp->need = sizeof(pkt);
+            break;
+        }
+        memcpy(&pkt, p, sizeof(pkt));
+        cp->need = sizeof(pkt) + ntohl(pkt.size);
+        if(have < cp->need){
+            // Everything buffered is part of this packet, so the rest of
+            // its payload can bypass the input buffer.
+            if(cp->need > CONN_BUF_INIT && conn_divert(cp, &pkt)) cp->done = 1;
+            break;
+        }
+        cp->in.start += cp->need;
+        cp->need = 0;
+        if(conn_packet(cp, &pkt, p + sizeof(pkt), 0)) cp->done = 1;
+    }
+}
+
+/*
+ * Handle one v2 request frame.
+ *
+ * @return  0 if more requests may follow, -1 if the service has ended.
+ */
+static int conn_frame(CONN *cp, char *body, size_t len){
+    PROTO2_REQ req;
+    BLOB *bp = NULL;
+    KEY *key;
+
+    if(proto2_parse(body, len, &req)){
+        error("[%d] malformed request frame", cp->fd);
+        return -1;
+    }
+    memset(&cp->req, 0, sizeof(cp->req));
+    cp->req.type = req.op;
+    cp->req.serial = htonl(req.serial);
+    if(req.op == XACTO_BEGIN_PKT) return conn_begin(cp);
+    if(conn_transaction(cp)) return -1;
+    switch(req.op){
+    case XACTO_PUT_PKT:
+    case XACTO_GET_PKT:
+        debug("[%d] %s frame received", cp->fd, req.op == XACTO_PUT_PKT ? "PUT" : "GET");
+        if((bp = blob_create(req.key, req.klen)) == NULL) return -1;
+        if((key = key_create(bp)) == NULL){
+            blob_unref(bp, "");
+            return -1;
+        }
+        bp = NULL;
+        if(req.value && (bp = blob_create(req.value, req.vlen)) == NULL){
+            key_dispose(key);
+            return -1;
+        }
+        return conn_access(cp, key, bp);
+    case XACTO_MGET_PKT:
+    case XACTO_MPUT_PKT:
+        cp->req.size = htonl(req.vlen);
+        return conn_batch(cp, &cp->req, req.value, 0);
+    default:
+        return conn_commit(cp);
+    }
+}
+
+/*
+ * Execute the complete v2 frames in the input buffer, as long as there is
+ * room for their replies.
+ */
+static void conn_process_v2(CONN *cp){
+    while(!cp->done && !conn_throttled(cp)){
+        size_t have = cp->in.end - cp->in.start, len;
+        char *p = cp->in.data + cp->in.start;
+        int k = proto2_frame(p, have, &len);
+        if(k < 0){
+            error("[%d] invalid frame", cp->fd);
+            cp->done = 1;
+            break;
+        }
+        if(k == 0 || have < k + len){
+            cp->need = k ? k + len : 0;
+            break;
+        }
+        cp->in.start += k + len;
+        cp->need = 0;
+        if(conn_frame(cp, p + k, len)) cp->done = 1;
+    }
+}
+
+/*
+ * Tell the wire format of the connection from its first bytes, and answer
+ * a v2 preface.
+ */
+static void conn_detect(CONN *cp){
+    size_t have = cp->in.end - cp->in.start;
+    char *p = cp->in.data + cp->in.start;
+    uint8_t opts;
+    int ret;
+
+    if(have == 0) return;
+    if((ret = proto2_detect(p, have, &opts)) == -1){
+        cp->need = PROTO2_PREFACE_LEN;
+    } else if(ret == -2){
+        error("[%d] invalid protocol preface", cp->fd);
+        cp->done = 1;
+    } else if(ret == 0){
+        cp->proto = 1;
+    } else {
+        char preface[PROTO2_PREFACE_LEN];
+        debug("[%d] Using protocol v2 (options %#x)", cp->fd, opts);
+        cp->in.start += PROTO2_PREFACE_LEN;
+        cp->need = 0;
+        cp->proto = 2;
+        cp->opts = opts;
+        proto2_preface(preface, opts);
+        if(buf_append(&cp->out, preface, sizeof(preface))) cp->done = 1;
+    }
+}
+
+int conn_process(CONN *cp){
+    if(cp->proto == 0 && !cp->done) conn_detect(cp);
+    if(cp->proto == 1) conn_process_v1(cp);
+    else if(cp->proto == 2) conn_process_v2(cp);
+    if(cp->in.start == cp->in.end) cp->in.start = cp->in.end = 0;
+    if(conn_full(cp) && !cp->throttled) flow_stalled(cp->fd);
+    cp->throttled = conn_full(cp);
+    return cp->done ? -1 : 0;
+}
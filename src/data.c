@@ -1,16 +1,96 @@
 #include "data.h"
 #include "string.h"
 #include "wrappers.h"
-#include <math.h>
+#include "blob_ext.h"
+#include "compress.h"
+#include "dedup.h"
+#include "vlist.h"
+#include "debug.h"
 
-BLOB *blob_create(char *content, size_t size){
-    BLOB *bp = malloc(sizeof(BLOB));
-    if(!bp) return bp;
-    bp->content = malloc(size);
-    memmove(bp->content, content, size);
-    bp->refcnt = 0;
+#define PREFIX_LEN 10
+
+int blob_is_ext(size_t size){
+    return dedup_eligible(size) || compress_eligible(size);
+}
+
+
+/*
+ * Fill in everything but the content of a new blob, whose uncompressed
+ * content is given.
+ */
+static void blob_setup(BLOB *bp, char *content, size_t size){
+    bp->size = size;
+    bp->prefix = malloc(PREFIX_LEN + 1);
+    if(bp->prefix){
+        size_t n = size < PREFIX_LEN ? size : PREFIX_LEN;
+        memmove(bp->prefix, content, n);
+        bp->prefix[n] = '\0';
+    }
+    bp->refcnt = 1;
     pthread_mutex_init(&bp->mutex, NULL);
-    info("%ld: created blob with content, size (%s, %i)", Pthread_self(), size, content);
+}
+
+
+int blob_init(BLOB *bp, char *content, size_t size){
+    size_t zsize = 0;
+    bp->content = NULL;
+    if(compress_eligible(size))
+        bp->content = compress_content(content, size, &zsize);
+    if(bp->content == NULL){
+        bp->content = malloc(size ? size : 1);
+        if(!bp->content) return -1;
+        memmove(bp->content, content, size);
+    }
+    if(blob_is_ext(size)){
+        ((BLOB_EXT *)bp)->zsize = zsize;
+        ((BLOB_EXT *)bp)->interned = 0;
+    }
+    blob_setup(bp, content, size);
+    return 0;
+}
+
+
+void blob_free(BLOB *bp){
+    pthread_mutex_destroy(&bp->mutex);
+    free(bp->prefix);
+    free(bp->content);
+    free(bp);
+}
+
+
+BLOB *blob_create(char *content, size_t size){
+    BLOB *bp;
+    if(dedup_eligible(size)){
+        bp = dedup_intern(content, size);
+    } else {
+        bp = malloc(blob_is_ext(size) ? sizeof(BLOB_EXT) : sizeof(BLOB));
+        if(!bp) return bp;
+        if(blob_init(bp, content, size)){
+            free(bp);
+            return NULL;
+        }
+    }
+    info("%ld: created blob %p with content, size (%s, %zu)", Pthread_self(), bp, bp ? bp->prefix : "", size);
+    return bp;
+}
+
+
+BLOB *blob_adopt(char *content, size_t size){
+    BLOB *bp;
+    if(blob_is_ext(size)){
+        // Dedup and compression keep the content in storage of their own.
+        bp = blob_create(content, size);
+        free(content);
+        return bp;
+    }
+    if((bp = malloc(sizeof(BLOB))) == NULL){
+        free(content);
+        return NULL;
+    }
+    bp->content = content;
+    blob_setup(bp, content, size);
+    info("%ld: adopted blob %p with content, size (%s, %zu)", Pthread_self(), bp, bp->prefix, size);
+    return bp;
 }
 
 
@@ -23,32 +103,50 @@ BLOB *blob_ref(BLOB *bp, char *why){
 
 
 void blob_unref(BLOB *bp, char *why){
-    pthread_mutex_lock(&bp->mutex);
-    if(--bp->refcnt == 0){
-        free(bp->content);
-        pthread_mutex_destroy(&bp->mutex);
-        free(bp);
+    if(blob_is_ext(bp->size) && ((BLOB_EXT *)bp)->interned){
+        dedup_unref(bp);
+        return;
     }
+    pthread_mutex_lock(&bp->mutex);
+    int last = (--bp->refcnt == 0);
     pthread_mutex_unlock(&bp->mutex);
-    return bp;
+    if(last) blob_free(bp);
+}
+
+
+/*
+ * Size of the content as stored, which differs from the size of the blob
+ * if the content is compressed.
+ */
+static size_t blob_stored_size(BLOB *bp){
+    if(blob_is_ext(bp->size) && ((BLOB_EXT *)bp)->zsize)
+        return ((BLOB_EXT *)bp)->zsize;
+    return bp->size;
 }
 
 
 int blob_compare(BLOB *bp1, BLOB *bp2){
+    if(bp1 == bp2) return 0;
     if(bp1->size != bp2->size) return 1;
-    return strncmp(bp1->content, bp2->content, bp1->size);
+    // Compression is deterministic, so equal content has equal stored form.
+    size_t stored = blob_stored_size(bp1);
+    if(stored != blob_stored_size(bp2)) return 1;
+    return memcmp(bp1->content, bp2->content, stored);
+}
+
+
+int blob_content_compare(BLOB *bp, char *content, size_t size){
+    if(bp->size != size) return 1;
+    char *data = blob_data(bp);
+    int ret = data ? memcmp(data, content, size) : 1;
+    if(data) blob_data_release(bp, data);
+    return ret;
 }
 
 
 int blob_hash(BLOB *bp){
-    int hash_value = 0;
-    if(bp == NULL || bp->size == 0 || bp->content == NULL) return hash_value;
-    int p = 1;
-    for(char c = bp->content; c < c+bp->size; c++){
-        hash_value = (hash_value + (c - 'a' + 1) * p) % (int)pow(1, 10);
-        p *= 10;
-    }
-    return hash_value;
+    if(bp == NULL || bp->size == 0 || bp->content == NULL) return 0;
+    return (int)(fnv1a64(bp->content, blob_stored_size(bp)) & 0x7fffffff);
 }
 
 
@@ -76,10 +174,26 @@ int key_compare(KEY *kp1, KEY *kp2){
 }
 
 
-VERSION *version_create(TRANSACTION *tp, BLOB *bp){
+void version_init(VERSION *vp, TRANSACTION *tp, BLOB *bp){
+    vp->creator = trans_ref(tp, "creator of version");
+    vp->blob = bp;
+    vp->next = vp->prev = NULL;
+}
 
+
+void version_fini(VERSION *vp){
+    trans_unref(vp->creator, "disposing version");
+    if(vp->blob) blob_unref(vp->blob, "");
+}
+
+
+VERSION *version_create(TRANSACTION *tp, BLOB *bp){
+    VERSION *vp = malloc(sizeof(VERSION));
+    if(vp) version_init(vp, tp, bp);
+    return vp;
 }
 
 void version_dispose(VERSION *vp){
-    blob_unref(vp->blob, "");
+    version_fini(vp);
+    free(vp);
 }
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "dedup.h"
+#include "settings.h"
+#include "wrappers.h"
+#include "debug.h"
+
+/*
+ * The table is a fixed array of buckets, protected by a smaller array of
+ * stripe locks so that unrelated values do not contend with each other.
+ * The counters are updated with relaxed atomic adds, outside the stripe
+ * locks, so that they do not bring the contention back; a reader may see
+ * them a little out of step with each other.
+ */
+static struct dedup_table {
+    BLOB_EXT **buckets;
+    size_t min_size;               // Smallest size eligible for dedup (0 = disabled)
+    pthread_mutex_t stripes[DEDUP_STRIPES];
+    struct {
+        atomic_size_t lookups, hits, live_blobs, live_bytes, logical_bytes, bytes_saved;
+    } stats;                       // As in DEDUP_STATS
+} table;
+
+#define STAT_ADD(f, n) atomic_fetch_add_explicit(&table.stats.f, (n), memory_order_relaxed)
+#define STAT_SUB(f, n) atomic_fetch_sub_explicit(&table.stats.f, (n), memory_order_relaxed)
+#define STAT_GET(f) atomic_load_explicit(&table.stats.f, memory_order_relaxed)
+
+#define BUCKET_OF(h) ((h) & (DEDUP_BUCKETS - 1))
+#define STRIPE_OF(h) (&table.stripes[BUCKET_OF(h) % DEDUP_STRIPES])
+
+void dedup_init(size_t min_size){
+    table.buckets = calloc(DEDUP_BUCKETS, sizeof(BLOB_EXT *));
+    if(table.buckets == NULL){
+        error("unable to allocate dedup table");
+        return;
+    }
+    for(int i = 0; i < DEDUP_STRIPES; i++)
+        pthread_mutex_init(&table.stripes[i], NULL);
+    memset(&table.stats, 0, sizeof(table.stats));
+    table.min_size = min_size ? min_size : 1;
+    info("Blob dedup enabled for values of %zu bytes or more", table.min_size);
+}
+
+
+void dedup_fini(void){
+    if(table.buckets == NULL) return;
+    if(STAT_GET(live_blobs))
+        warn("%zu interned blobs still referenced at dedup_fini", STAT_GET(live_blobs));
+    for(int i = 0; i < DEDUP_STRIPES; i++)
+        pthread_mutex_destroy(&table.stripes[i]);
+    free(table.buckets);
+    table.buckets = NULL;
+    table.min_size = 0;
+}
+
+
+int dedup_eligible(size_t size){
+    return table.buckets != NULL && size >= table.min_size;
+}
+
+
+BLOB *dedup_intern(char *content, size_t size){
+    uint64_t hash = fnv1a64(content, size);
+    pthread_mutex_t *stripe = STRIPE_OF(hash);
+    BLOB_EXT **bucket = &table.buckets[BUCKET_OF(hash)];
+    BLOB_EXT *np, *new;
+    int hit = 0;
+
+    /*
+     * The candidate is set up, and compressed if eligible, before the lock
+     * is taken.  Compression is deterministic, so it is compared with the
+     * nodes in their stored form, and nothing is expanded under the lock.
+     */
+    new = malloc(sizeof(BLOB_EXT));
+    if(new == NULL || blob_init(&new->blob, content, size)){
+        free(new);
+        return NULL;
+    }
+    new->hash = hash;
+    new->interned = 1;
+
+    pthread_mutex_lock(stripe);
+    for(np = *bucket; np; np = np->next){
+        if(np->hash == hash && !blob_compare(&np->blob, &new->blob)){
+            /*
+             * Nodes are unlinked under the stripe lock before being freed,
+             * so a node found here still has a nonzero reference count.
+             */
+            blob_ref(&np->blob, "dedup hit");
+            hit = 1;
+            break;
+        }
+    }
+    if(np == NULL){
+        np = new;
+        np->next = *bucket;
+        *bucket = np;
+    }
+    pthread_mutex_unlock(stripe);
+    if(hit) blob_free(&new->blob);
+
+    STAT_ADD(lookups, 1);
+    STAT_ADD(logical_bytes, size);
+    if(hit){
+        STAT_ADD(hits, 1);
+        STAT_ADD(bytes_saved, size);
+    } else {
+        STAT_ADD(live_blobs, 1);
+        STAT_ADD(live_bytes, size);
+    }
+    debug("dedup %s for blob %p (size %zu)", hit ? "hit" : "miss", &np->blob, size);
+    return &np->blob;
+}
+
+
+void dedup_unref(BLOB *bp){
+    BLOB_EXT *np = (BLOB_EXT *)bp;
+    pthread_mutex_t *stripe = STRIPE_OF(np->hash);
+    int last;
+
+    /*
+     * The stripe lock is taken before the blob mutex so that a concurrent
+     * dedup_intern() can never revive a blob whose count has reached zero.
+     */
+    pthread_mutex_lock(stripe);
+    pthread_mutex_lock(&bp->mutex);
+    last = (--bp->refcnt == 0);
+    pthread_mutex_unlock(&bp->mutex);
+    if(last){
+        BLOB_EXT **npp = &table.buckets[BUCKET_OF(np->hash)];
+        while(*npp != np) npp = &(*npp)->next;
+        *npp = np->next;
+    }
+    pthread_mutex_unlock(stripe);
+    if(!last) return;
+
+    STAT_SUB(live_blobs, 1);
+    STAT_SUB(live_bytes, bp->size);
+    blob_free(bp);
+}
+
+
+void dedup_get_stats(DEDUP_STATS *sp){
+    sp->lookups = STAT_GET(lookups);
+    sp->hits = STAT_GET(hits);
+    sp->live_blobs = STAT_GET(live_blobs);
+    sp->live_bytes = STAT_GET(live_bytes);
+    sp->logical_bytes = STAT_GET(logical_bytes);
+    sp->bytes_saved = STAT_GET(bytes_saved);
+}
+
+
+void dedup_show(void){
+    DEDUP_STATS s;
+    if(table.buckets == NULL) return;
+    dedup_get_stats(&s);
+    fprintf(stderr, "DEDUP: lookups=%zu, hits=%zu (%.1f%%), live=%zu blobs/%zu bytes, "
+            "ratio=%.2f, saved=%zu bytes\n",
+            s.lookups, s.hits, s.lookups ? 100.0 * s.hits / s.lookups : 0.0,
+            s.live_blobs, s.live_bytes,
+            s.logical_bytes - s.bytes_saved ? (double)s.logical_bytes / (s.logical_bytes - s.bytes_saved) : 1.0,
+            s.bytes_saved);
+}
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "evloop.h"
+#include "conn.h"
+#include "commitq.h"
+#include "flow.h"
+#include "settings.h"
+#include "debug.h"
+
+struct evloop {
+    int epfd;
+    int listenfd;
+    COMMITQ *commits;       // Commits of this loop's connections that wait
+    pthread_t tid;
+};
+
+/*
+ * Accept all pending connections and add them to this loop's epoll set.
+ * The listening socket is level-triggered, so anything left over (because
+ * of a transient failure) is reported again.  Once it has been shut down
+ * (to drain the server), it is dropped from the set.
+ */
+static void evloop_accept(struct evloop *lp){
+    while(1){
+        int fd = accept4(lp->listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            if(errno == EINVAL){
+                epoll_ctl(lp->epfd, EPOLL_CTL_DEL, lp->listenfd, NULL);
+                return;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+                warn("accept: %s", strerror(errno));
+            return;
+        }
+        CONN *cp = conn_create(fd);
+        if(cp == NULL){
+            close(fd);
+            continue;
+        }
+        cp->commits = lp->commits;
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = cp
+        };
+        if(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev) < 0){
+            error("epoll_ctl: %s", strerror(errno));
+            conn_destroy(cp);
+        }
+    }
+}
+
+/*
+ * Read everything the socket has, executing requests as they complete.
+ * Reading stops once the service has ended, or while the output buffer
+ * is full.
+ */
+static void evloop_read(CONN *cp){
+    while(!cp->done && !conn_throttled(cp)){
+        size_t len;
+        char *p = conn_rspace(cp, &len);
+        if(p == NULL){
+            cp->done = 1;
+            break;
+        }
+        ssize_t n = read(cp->fd, p, len);
+        if(n > 0){
+            conn_received(cp, n);
+            conn_process(cp);
+        } else if(n == 0){
+            cp->done = 1;
+        } else if(errno != EINTR){
+            if(errno != EAGAIN && errno != EWOULDBLOCK) cp->done = 1;
+            break;
+        }
+    }
+}
+
+/*
+ * Write as many pending replies as the socket will take.
+ *
+ * @return  0 if everything was written, 1 if the socket is full, -1 if the
+ *   connection has failed.
+ */
+static int evloop_write(CONN *cp){
+    struct iovec iov[CONN_SEND_IOV];
+    struct msghdr msg = { .msg_iov = iov };
+    int iovcnt = CONN_SEND_IOV;
+    while(conn_pending(cp, iov, &iovcnt) > 0){
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(cp->fd, &msg, MSG_NOSIGNAL);
+        iovcnt = CONN_SEND_IOV;
+        if(n > 0){
+            conn_sent(cp, n);
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return 1;
+        } else if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void evloop_event(struct evloop *lp, CONN *cp, uint32_t events){
+    int ret;
+
+    if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        evloop_read(cp);
+    while(1){
+        int stalled = !cp->done && conn_throttled(cp);
+        ret = evloop_write(cp);
+        // Input that arrived while reading was stopped raised no edge of its
+        // own, so reading resumes here, once the client has caught up.
+        if(ret < 0 || !stalled || conn_throttled(cp)) break;
+        conn_process(cp);
+        evloop_read(cp);
+    }
+    flow_queued(cp->fd, conn_pending(cp, NULL, NULL));
+    // Once the service has ended, the connection is closed as soon as the
+    // last reply is out (or cannot be delivered), and no commit refers to it.
+    if((ret < 0 || (cp->done && ret == 0)) && !cp->committing){
+        epoll_ctl(lp->epfd, EPOLL_CTL_DEL, cp->fd, NULL);
+        conn_destroy(cp);
+    }
+}
+
+/*
+ * Go on serving the connections whose commits have completed.  Reading was
+ * stopped meanwhile, so each is read as if it had input.
+ */
+static void evloop_commits(struct evloop *lp){
+    TRANS_STATUS status;
+    uint64_t n;
+    CONN *cp;
+    int id;
+
+    if(read(commitq_fd(lp->commits), &n, sizeof(n)) < 0 && errno != EAGAIN)
+        error("commit queue: %s", strerror(errno));
+    while((cp = commitq_next(lp->commits, &id, &status)) != NULL){
+        conn_committed(cp, id, status);
+        evloop_event(lp, cp, EPOLLIN);
+    }
+}
+
+static void *evloop_thread(void *arg){
+    struct evloop *lp = arg;
+    struct epoll_event events[EVLOOP_EVENTS];
+
+    while(1){
+        int n = epoll_wait(lp->epfd, events, EVLOOP_EVENTS, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            error("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            if(events[i].data.ptr == NULL) evloop_accept(lp);
+            else if(events[i].data.ptr == lp) evloop_commits(lp);
+            else evloop_event(lp, events[i].data.ptr, events[i].events);
+        }
+    }
+    return NULL;
+}
+
+int evloop_start(int listenfd, int nthreads){
+    sigset_t all, old;
+    int started = 0;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(int i = 0; i < nthreads; i++){
+        struct evloop *lp = calloc(1, sizeof(struct evloop));
+        if(lp == NULL) break;
+        lp->listenfd = listenfd;
+        if((lp->commits = commitq_create()) == NULL){
+            free(lp);
+            break;
+        }
+        if((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0){
+            commitq_destroy(lp->commits);
+            free(lp);
+            break;
+        }
+        // EPOLLEXCLUSIVE: a new connection wakes one loop, not all of them.
+        // The commit queue is level-triggered, since it is read only once
+        // per wakeup.
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+        struct epoll_event cev = { .events = EPOLLIN, .data.ptr = lp };
+        if(epoll_ctl(lp->epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0
+           || epoll_ctl(lp->epfd, EPOLL_CTL_ADD, commitq_fd(lp->commits), &cev) < 0
+           || pthread_create(&lp->tid, NULL, evloop_thread, lp)){
+            close(lp->epfd);
+            commitq_destroy(lp->commits);
+            free(lp);
+            break;
+        }
+        pthread_detach(lp->tid);
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(started == 0){
+        error("Could not start event loops");
+        return -1;
+    }
+    info("Started %d event loop threads", started);
+    return 0;
+}
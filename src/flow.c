@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#include "flow.h"
+#include "debug.h"
+
+/*
+ * Each entry is only written by the thread serving its connection, so the
+ * fields are plain counters; they are atomic for the sake of readers.
+ */
+struct flow_entry {
+    atomic_int open;
+    atomic_size_t queued;
+    atomic_size_t peak;
+    atomic_size_t stalls;
+};
+
+static struct {
+    struct flow_entry *table;
+    int size;
+    atomic_size_t peak;             // Over all connections, past and present
+    atomic_size_t stalls;
+} flow;
+
+static struct flow_entry *entry(int fd){
+    return fd >= 0 && fd < flow.size ? &flow.table[fd] : NULL;
+}
+
+void flow_init(void){
+    struct rlimit rl;
+    int size = 1024;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 20))
+        size = rl.rlim_cur;
+    if((flow.table = calloc(size, sizeof(struct flow_entry))) == NULL){
+        error("unable to allocate flow control table");
+        return;
+    }
+    flow.size = size;
+}
+
+void flow_open(int fd){
+    struct flow_entry *e = entry(fd);
+    if(e == NULL) return;
+    atomic_store_explicit(&e->queued, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->peak, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->stalls, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->open, 1, memory_order_release);
+}
+
+void flow_close(int fd){
+    struct flow_entry *e = entry(fd);
+    if(e == NULL) return;
+    atomic_store_explicit(&e->open, 0, memory_order_relaxed);
+    atomic_store_explicit(&e->queued, 0, memory_order_relaxed);
+}
+
+void flow_queued(int fd, size_t bytes){
+    struct flow_entry *e = entry(fd);
+    if(e == NULL) return;
+    atomic_store_explicit(&e->queued, bytes, memory_order_relaxed);
+    if(bytes <= atomic_load_explicit(&e->peak, memory_order_relaxed)) return;
+    atomic_store_explicit(&e->peak, bytes, memory_order_relaxed);
+    size_t peak = atomic_load_explicit(&flow.peak, memory_order_relaxed);
+    while(bytes > peak && !atomic_compare_exchange_weak(&flow.peak, &peak, bytes))
+        ;
+}
+
+void flow_stalled(int fd){
+    struct flow_entry *e = entry(fd);
+    if(e == NULL) return;
+    atomic_fetch_add_explicit(&e->stalls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&flow.stalls, 1, memory_order_relaxed);
+}
+
+int flow_get(int fd, FLOW_STATS *sp){
+    struct flow_entry *e = entry(fd);
+    if(e == NULL || !atomic_load_explicit(&e->open, memory_order_acquire)) return -1;
+    sp->queued = atomic_load_explicit(&e->queued, memory_order_relaxed);
+    sp->peak = atomic_load_explicit(&e->peak, memory_order_relaxed);
+    sp->stalls = atomic_load_explicit(&e->stalls, memory_order_relaxed);
+    return 0;
+}
+
+void flow_get_totals(FLOW_STATS *sp){
+    FLOW_STATS s;
+    sp->queued = 0;
+    for(int fd = 0; fd < flow.size; fd++)
+        if(flow_get(fd, &s) == 0) sp->queued += s.queued;
+    sp->peak = atomic_load_explicit(&flow.peak, memory_order_relaxed);
+    sp->stalls = atomic_load_explicit(&flow.stalls, memory_order_relaxed);
+}
+
+void flow_show(void){
+    FLOW_STATS s;
+    if(flow.table == NULL) return;
+    flow_get_totals(&s);
+    fprintf(stderr, "FLOW: queued=%zu bytes, largest queue=%zu bytes, stalls=%zu\n",
+            s.queued, s.peak, s.stalls);
+    for(int fd = 0; fd < flow.size; fd++){
+        if(flow_get(fd, &s) == 0 && s.queued)
+            fprintf(stderr, "FLOW: [%d] queued=%zu bytes, largest queue=%zu bytes, stalls=%zu\n",
+                    fd, s.queued, s.peak, s.stalls);
+    }
+}
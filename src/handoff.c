@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "mpmc.h"
+#include "sbuf.h"
+#include "settings.h"
+
+/*
+ * Connection handoff benchmark.
+ *
+ * Compares the lock-free queue that hands connections to the workers of
+ * the thread pool (see mpmc.h) with the semaphore-based buffer it replaced
+ * (see sbuf.h).  Items are ints, as connection descriptors are.  First a
+ * single thread pushes and pops each item in turn, which gives the cost of
+ * an uncontended handoff; then producers, standing in for acceptors, and
+ * as many consumers, standing in for workers, hand items over through a
+ * small queue all at once.  The time per item is printed for each, after
+ * checking that no item was lost or duplicated.
+ */
+
+static struct {
+    int threads;                // Producers, and consumers (-t)
+    int items;                  // Items per producer (-n)
+    int size;                   // Capacity of the queue (-q)
+} cfg;
+
+static MPMC_QUEUE handoff_q;
+static sbuf_t handoff_sb;
+static atomic_long handoff_sum;
+
+static void *mpmc_producer(void *arg){
+    for(int i = 1; i <= cfg.items; i++)
+        mpmc_push(&handoff_q, &i);
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg){
+    long sum = 0;
+    for(int i = 0, item; i < cfg.items; i++){
+        mpmc_pop(&handoff_q, &item);
+        sum += item;
+    }
+    atomic_fetch_add(&handoff_sum, sum);
+    return NULL;
+}
+
+static void *sbuf_producer(void *arg){
+    for(int i = 1; i <= cfg.items; i++)
+        sbuf_insert(&handoff_sb, i);
+    return NULL;
+}
+
+static void *sbuf_consumer(void *arg){
+    long sum = 0;
+    for(int i = 0; i < cfg.items; i++)
+        sum += sbuf_remove(&handoff_sb);
+    atomic_fetch_add(&handoff_sum, sum);
+    return NULL;
+}
+
+static double elapsed(struct timespec *t0){
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/*
+ * Run the producers and consumers against each other.
+ *
+ * @return  The time taken, in seconds, or -1 if items were lost or
+ *   duplicated.
+ */
+static double contended(void *(*producer)(void *), void *(*consumer)(void *)){
+    pthread_t tids[2 * cfg.threads];
+    struct timespec t0;
+
+    atomic_store(&handoff_sum, 0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(int i = 0; i < cfg.threads; i++){
+        pthread_create(&tids[2 * i], NULL, producer, NULL);
+        pthread_create(&tids[2 * i + 1], NULL, consumer, NULL);
+    }
+    for(int i = 0; i < 2 * cfg.threads; i++)
+        pthread_join(tids[i], NULL);
+    double t = elapsed(&t0);
+    if(atomic_load(&handoff_sum) != (long)cfg.threads * cfg.items * (cfg.items + 1) / 2)
+        return -1;
+    return t;
+}
+
+static void usage(char *name){
+    fprintf(stderr, "Usage: %s [-t <threads>] [-n <items>] [-q <queue size>]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+    // Option '-t <threads>' sets the number of producers, and of consumers,
+    // in the contended run.  Option '-n <items>' sets the number of items
+    // each producer hands over, and option '-q <size>' the capacity of the
+    // queue.
+    struct timespec t0;
+    int c, item;
+
+    cfg.threads = HANDOFF_THREADS;
+    cfg.items = HANDOFF_ITEMS;
+    cfg.size = HANDOFF_QUEUE_SIZE;
+    #define THREADS_OPTION 't'
+    #define ITEMS_OPTION 'n'
+    #define QUEUE_OPTION 'q'
+    while((c = getopt(argc, argv, "t:n:q:")) != -1){
+        switch(c){
+        case THREADS_OPTION:
+            cfg.threads = atoi(optarg);
+            break;
+        case ITEMS_OPTION:
+            cfg.items = atoi(optarg);
+            break;
+        case QUEUE_OPTION:
+            cfg.size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(optind < argc || cfg.threads < 1 || cfg.items < 1 || cfg.size < 1)
+        usage(argv[0]);
+    if(mpmc_init(&handoff_q, cfg.size, sizeof(int))){
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    sbuf_init(&handoff_sb, cfg.size);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(int i = 0; i < cfg.items; i++){
+        mpmc_push(&handoff_q, &i);
+        mpmc_pop(&handoff_q, &item);
+    }
+    double u_mpmc = elapsed(&t0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(int i = 0; i < cfg.items; i++){
+        sbuf_insert(&handoff_sb, i);
+        item = sbuf_remove(&handoff_sb);
+    }
+    double u_sbuf = elapsed(&t0);
+    double t_mpmc = contended(mpmc_producer, mpmc_consumer);
+    double t_sbuf = contended(sbuf_producer, sbuf_consumer);
+    mpmc_fini(&handoff_q);
+    sbuf_destroy(&handoff_sb);
+    if(t_mpmc < 0 || t_sbuf < 0){
+        fprintf(stderr, "Items were lost or duplicated (%s)\n", t_mpmc < 0 ? "mpmc" : "sbuf");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("handoff, 1 thread: mpmc %.1fns, sbuf %.1fns per item\n",
+           u_mpmc * 1e9 / cfg.items, u_sbuf * 1e9 / cfg.items);
+    printf("handoff, %dx%d threads: mpmc %.1fns, sbuf %.1fns per item\n",
+           cfg.threads, cfg.threads, t_mpmc * 1e9 / ((double)cfg.threads * cfg.items),
+           t_sbuf * 1e9 / ((double)cfg.threads * cfg.items));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,180 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "debug.h"
+#include "settings.h"
+
+/*
+ * A ring of preformatted messages, written only by its owning thread
+ * and read only by the drain thread.  When a thread exits its ring is
+ * marked as orphaned, and once drained it is handed to the next thread
+ * that needs one, so rings are never freed while the server runs.
+ */
+enum { RING_OWNED, RING_ORPHAN };
+
+struct log_slot {
+    int len;
+    char msg[LOG_MSG_MAX];
+};
+
+struct log_ring {
+    atomic_size_t head;             // Next slot to drain (drain thread)
+    atomic_size_t tail;             // Next slot to fill (owning thread)
+    atomic_int state;               // RING_OWNED or RING_ORPHAN
+    atomic_size_t dropped;          // Messages lost because the ring was full
+    struct log_ring *next;          // Next ring in the list of all rings
+    struct log_slot slots[LOG_RING_SLOTS];
+};
+
+atomic_int log_level = LOG_DEBUG;
+
+static _Atomic(struct log_ring *) rings;
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_t drain_tid;
+static atomic_int running;
+static atomic_int stopping;
+
+static const char *labels[] = {
+    KMAG "DEBUG", KBLU "INFO", KGRN "SUCCESS", KYEL "WARN", KRED "ERROR"
+};
+static const char *names[] = { "debug", "info", "success", "warn", "error", "off" };
+
+static void ring_orphan(void *arg){
+    struct log_ring *r = arg;
+    atomic_store_explicit(&r->state, RING_ORPHAN, memory_order_release);
+}
+
+static struct log_ring *ring_acquire(void){
+    struct log_ring *r;
+    for(r = atomic_load(&rings); r; r = r->next){
+        int expected = RING_ORPHAN;
+        if(!atomic_compare_exchange_strong(&r->state, &expected, RING_OWNED))
+            continue;
+        if(atomic_load(&r->head) == atomic_load(&r->tail))
+            break;
+        atomic_store(&r->state, RING_ORPHAN);   /* Not drained yet; leave it */
+    }
+    if(r == NULL){
+        r = calloc(1, sizeof(struct log_ring));
+        if(r == NULL) return NULL;
+        r->next = atomic_load(&rings);
+        while(!atomic_compare_exchange_weak(&rings, &r->next, r))
+            ;
+    }
+    pthread_setspecific(ring_key, r);
+    return r;
+}
+
+/*
+ * Move everything queued on the rings to stderr, one write per batch.
+ */
+static void drain(void){
+    static char batch[LOG_MSG_MAX * 64];
+    size_t n = 0;
+
+    for(struct log_ring *r = atomic_load(&rings); r; r = r->next){
+        size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+        size_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+        size_t lost = atomic_exchange(&r->dropped, 0);
+        for(; h != t; h++){
+            struct log_slot *sp = &r->slots[h % LOG_RING_SLOTS];
+            if(n + sp->len > sizeof(batch)){
+                fwrite(batch, 1, n, stderr);
+                n = 0;
+            }
+            memcpy(batch + n, sp->msg, sp->len);
+            n += sp->len;
+            atomic_store_explicit(&r->head, h + 1, memory_order_release);
+        }
+        if(lost && n + LOG_MSG_MAX <= sizeof(batch))
+            n += snprintf(batch + n, LOG_MSG_MAX, KYEL "WARN: " KNRM "%zu log messages dropped" NL, lost);
+    }
+    if(n){
+        fwrite(batch, 1, n, stderr);
+        fflush(stderr);
+    }
+}
+
+static void *drain_thread(void *arg){
+    struct timespec ts = { 0, LOG_DRAIN_INTERVAL_US * 1000L };
+    while(!atomic_load(&stopping)){
+        drain();
+        nanosleep(&ts, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+void log_init(void){
+    pthread_key_create(&ring_key, ring_orphan);
+    atomic_store(&stopping, 0);
+    if(pthread_create(&drain_tid, NULL, drain_thread, NULL) == 0)
+        atomic_store(&running, 1);
+}
+
+
+void log_fini(void){
+    if(!atomic_exchange(&running, 0)) return;
+    atomic_store(&stopping, 1);
+    pthread_join(drain_tid, NULL);
+}
+
+
+void log_set_level(int level){
+    if(level < LOG_DEBUG) level = LOG_DEBUG;
+    if(level > LOG_OFF) level = LOG_OFF;
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+
+int log_parse_level(const char *name){
+    for(int i = LOG_DEBUG; i <= LOG_OFF; i++)
+        if(!strcasecmp(name, names[i])) return i;
+    return -1;
+}
+
+
+void log_write(int level, const char *file, const char *func, int line,
+               const char *fmt, ...){
+    char buf[LOG_MSG_MAX];
+    char *msg = buf;
+    struct log_ring *r = NULL;
+    size_t t = 0;
+    va_list ap;
+
+    if(atomic_load_explicit(&running, memory_order_acquire)){
+        if((r = my_ring) == NULL) r = my_ring = ring_acquire();
+    }
+    if(r){
+        t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if(t - atomic_load_explicit(&r->head, memory_order_acquire) == LOG_RING_SLOTS){
+            atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        msg = r->slots[t % LOG_RING_SLOTS].msg;
+    }
+
+    int n = snprintf(msg, LOG_MSG_MAX, "%s: %s:%s:%d " KNRM, labels[level], file, func, line);
+    va_start(ap, fmt);
+    if(n < LOG_MSG_MAX - 1)
+        n += vsnprintf(msg + n, LOG_MSG_MAX - 1 - n, fmt, ap);
+    va_end(ap);
+    if(n > LOG_MSG_MAX - 2) n = LOG_MSG_MAX - 2;
+    msg[n++] = '\n';
+    msg[n] = '\0';
+
+    if(r == NULL){
+        fputs(msg, stderr);
+        return;
+    }
+    r->slots[t % LOG_RING_SLOTS].len = n;
+    atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+}
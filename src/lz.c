@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MAX_LIT  32                  /* Longest literal run */
+#define LZ_MAX_OFF  8192                /* Farthest back reference */
+#define LZ_MAX_REF  (264)               /* Longest back reference */
+#define LZ_HLOG     13
+#define LZ_HSIZE    (1 << LZ_HLOG)
+
+#define LZ_HASH(p) \
+    ((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2]) * 2654435761U) >> (32 - LZ_HLOG))
+
+size_t lz_compress(const char *in, size_t in_len, char *out, size_t out_cap){
+    const uint8_t *ip = (const uint8_t *)in;
+    uint8_t *op = (uint8_t *)out;
+    size_t i = 0, o = 0;
+    int lit = 0;
+    uint32_t htab[LZ_HSIZE];           /* Position + 1 of last occurrence, 0 if none */
+
+    memset(htab, 0, sizeof(htab));
+    if(out_cap == 0) return 0;
+    o++;                                /* Reserve control byte for first literal run */
+
+    while(i + 2 < in_len){
+        uint32_t h = LZ_HASH(ip + i);
+        size_t ref = htab[h];
+        htab[h] = i + 1;
+        if(ref && i - ref < LZ_MAX_OFF
+           && !memcmp(ip + ref - 1, ip + i, 3)){
+            size_t r = ref - 1, off = i - r - 1;
+            size_t max = in_len - i < LZ_MAX_REF ? in_len - i : LZ_MAX_REF;
+            size_t len = 3;
+            while(len < max && ip[r + len] == ip[i + len]) len++;
+
+            /* Close the pending literal run, or drop its unused control byte. */
+            if(lit) op[o - lit - 1] = lit - 1;
+            else o--;
+            if(o + 3 + 1 > out_cap) return 0;
+            len -= 2;
+            if(len < 7){
+                op[o++] = (len << 5) | (off >> 8);
+            } else {
+                op[o++] = (7 << 5) | (off >> 8);
+                op[o++] = len - 7;
+            }
+            op[o++] = off & 0xff;
+            i += len + 2;
+
+            /* Seed the hash table with the last position covered by the match. */
+            if(i + 2 < in_len) htab[LZ_HASH(ip + i - 1)] = i;
+            lit = 0;
+            o++;
+            continue;
+        }
+        if(o >= out_cap) return 0;
+        op[o++] = ip[i++];
+        if(++lit == LZ_MAX_LIT){
+            op[o - lit - 1] = lit - 1;
+            lit = 0;
+            if(o >= out_cap) return 0;
+            o++;
+        }
+    }
+    while(i < in_len){
+        if(o >= out_cap) return 0;
+        op[o++] = ip[i++];
+        if(++lit == LZ_MAX_LIT){
+            op[o - lit - 1] = lit - 1;
+            lit = 0;
+            if(o >= out_cap) return 0;
+            o++;
+        }
+    }
+    if(lit) op[o - lit - 1] = lit - 1;
+    else o--;
+    return o;
+}
+
+
+ssize_t lz_decompress(const char *in, size_t in_len, char *out, size_t out_cap){
+    const uint8_t *ip = (const uint8_t *)in;
+    uint8_t *op = (uint8_t *)out;
+    size_t i = 0, o = 0;
+
+    while(i < in_len){
+        unsigned int c = ip[i++];
+        if(c < 32){
+            size_t len = c + 1;
+            if(i + len > in_len || o + len > out_cap) return -1;
+            memcpy(op + o, ip + i, len);
+            i += len;
+            o += len;
+        } else {
+            size_t len = c >> 5, off;
+            if(len == 7){
+                if(i >= in_len) return -1;
+                len += ip[i++];
+            }
+            if(i >= in_len) return -1;
+            off = ((c & 0x1f) << 8 | ip[i++]) + 1;
+            len += 2;
+            if(off > o || o + len > out_cap) return -1;
+            /* Byte at a time, since the reference may overlap the output. */
+            for(size_t k = 0; k < len; k++, o++)
+                op[o] = op[o - off];
+        }
+    }
+    return o;
+}
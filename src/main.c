@@ -1,13 +1,26 @@
 #include <getopt.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "settings.h"
 #include "debug.h"
+#include "log.h"
 #include "client_registry.h"
+#include "creg_ext.h"
 #include "transaction.h"
 #include "tpool.h"
 #include "store.h"
+#include "dedup.h"
+#include "compress.h"
+#include "flow.h"
+#include "timeout.h"
+#include "admit.h"
+#include "reason.h"
 #include "server.h"
+#include "service.h"
+#include "evloop.h"
+#include "uring.h"
 #include "wrappers.h"
 
 static void terminate(int status);
@@ -15,33 +28,348 @@ static void terminate(int status);
 CLIENT_REGISTRY *client_registry;
 tpool_t *pool;
 
-void hangup_handler(int sig);
+void log_level_handler(int sig);
+
+/* Seconds that draining waits for transactions in progress (option -g) */
+static int drain_timeout = DRAIN_TIMEOUT;
+
+/* Listening sockets, shut down when draining starts */
+static int *listenfds;
+static int nlisten;
+
+/* Whether to look up the host name of each client (option -n) */
+static int resolve_names;
+
+/* Path of the Unix domain socket for local clients (option -s), if any */
+static char *unix_path;
+
+/* Seconds between reports of the statistics while running (option -S) */
+static int stats_interval = STATS_INTERVAL;
+
+/*
+ * A client whose host name is to be looked up.
+ */
+struct lookup {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    char name[MAXLINE], port[MAXLINE];  // Numeric forms, as logged on accept
+};
+
+/*
+ * Look up and log the host name of a client.  This runs on a thread of its
+ * own, so that a slow name server delays neither the acceptor nor the
+ * service of any client, which may be one of a few pool workers.
+ */
+static void *lookup(void *vargp) {
+    struct lookup *lp = vargp;
+    char host[MAXLINE];
+
+    if(getnameinfo((SA *) &lp->addr, lp->len, host, MAXLINE, NULL, 0, NI_NAMEREQD) == 0)
+        info("Client (%s, %s) is %s", lp->name, lp->port, host);
+    free(lp);
+    return NULL;
+}
+
+/*
+ * Start the lookup of the host name of a client, if it can be.
+ */
+static void start_lookup(struct sockaddr_storage *addr, socklen_t len, char *name, char *port) {
+    struct lookup *lp = malloc(sizeof(struct lookup));
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if(lp == NULL) return;
+    memcpy(&lp->addr, addr, len);
+    lp->len = len;
+    strcpy(lp->name, name);
+    strcpy(lp->port, port);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&tid, &attr, lookup, lp)) free(lp);
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Run a client session.
+ */
+static void *session(void *vargp) {
+    return xacto_client_service(vargp);
+}
+
+/*
+ * Close a connection that the pool stopped before serving it.
+ */
+static void refuse(void *vargp) {
+    Close(*(int *)vargp);
+    free(vargp);
+}
 
 void *thread(void *vargp) {
     Pthread_detach(Pthread_self());
-    void *fp = xacto_client_service(vargp);
+    void *fp = session(vargp);
     free(fp);
     return NULL; 
 }
 
+/*
+ * Accept connections on a listening socket and hand each one to a new
+ * thread or to the pool.  Client addresses are logged in numeric form
+ * only, so that accepting never waits for the name server.
+ */
+static void *acceptor(void *arg) {
+    int listenfd = (int)(intptr_t)arg, *connfd;
+    char client_name[MAXLINE], client_port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+    pthread_t tid;
+
+    while(1){
+        clientlen = sizeof(clientaddr);
+        connfd = malloc(sizeof(int));
+        if((*connfd = accept(listenfd, (SA *) &clientaddr, &clientlen)) < 0){
+            free(connfd);
+            // The listening socket is shut down once the server drains.
+            if(service_draining()) break;
+            if(errno != EINTR && errno != ECONNABORTED)
+                warn("accept: %s", strerror(errno));
+            continue;
+        }
+        if(clientaddr.ss_family == AF_UNIX){
+            info("Accepted local connection on fd %d", *connfd);
+        } else {
+            Getnameinfo((SA *) &clientaddr, clientlen, client_name, MAXLINE, client_port, MAXLINE,
+                        NI_NUMERICHOST | NI_NUMERICSERV);
+            info("Accepted connection from (%s, %s)\n", client_name, client_port);
+            if(resolve_names) start_lookup(&clientaddr, clientlen, client_name, client_port);
+        }
+
+        if(pool == NULL){
+            Pthread_create(&tid, NULL, thread, connfd);
+        } else if(!tpool_push_job(pool, (tpool_job_t){ session, connfd, refuse })){
+            warn("Could not queue connection, dropping it");
+            refuse(connfd);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Record a listening socket, so that it can be shut down to drain.
+ */
+static int listening(int listenfd) {
+    listenfds[nlisten++] = listenfd;
+    return listenfd;
+}
+
+/*
+ * Start an acceptor thread on a listening socket.  It blocks signals, so
+ * that SIGUSR1 and SIGUSR2 reach the main thread.
+ */
+static void start_acceptor(int listenfd) {
+    sigset_t all, old;
+    pthread_t tid;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    Pthread_create(&tid, NULL, acceptor, (void *)(intptr_t)listenfd);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Shut the server down gracefully: stop accepting connections, end the
+ * service of clients between transactions, and give the transactions in
+ * progress until the deadline to commit or abort, before terminating.
+ */
+static void drain(void) {
+    struct timespec deadline;
+
+    info("Draining clients (%d seconds at most)", drain_timeout);
+    service_drain();
+    for(int i = 0; i < nlisten; i++){
+        if(shutdown(listenfds[i], SHUT_RD) < 0)
+            warn("error shutting down listening socket: %s", strerror(errno));
+    }
+    creg_shutdown_idle(client_registry);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_timeout;
+    if(creg_wait_for_empty_until(client_registry, &deadline))
+        warn("Drain deadline passed, closing %d connections", creg_count(client_registry));
+    terminate(EXIT_SUCCESS);
+}
+
+/*
+ * Print the statistics that the modules keep, as they stand.
+ */
+static void show_stats(void) {
+    flow_show();
+    dedup_show();
+    compress_show();
+}
+
+/*
+ * Wait for SIGHUP, blocked in every thread since startup, and drain.  The
+ * work is done here rather than in a signal handler, where most of it
+ * would not be safe.  Meanwhile, the statistics are reported every
+ * stats_interval seconds, if that is set.
+ */
+static void wait_for_hangup(sigset_t *hup) {
+    struct timespec interval = { stats_interval, 0 };
+    int sig;
+    while(1){
+        if(stats_interval <= 0){
+            if(sigwait(hup, &sig) == 0) break;
+        } else if(sigtimedwait(hup, NULL, &interval) >= 0){
+            break;
+        } else if(errno == EAGAIN){
+            show_stats();
+        }
+    }
+    drain();
+}
+
 int main(int argc, char* argv[]){
     // Option processing should be performed here.
     // Option '-p <port>' is required in order to specify the port number
     // on which the server should listen.
+    // Option '-d <min_size>' enables deduplication of values of at least
+    // min_size bytes.
+    // Option '-z <min_size>' enables compression of values of at least
+    // min_size bytes.
+    // Option '-l <level>' sets the initial log level.
+    // Option '-i <max_inflight>' caps the number of pipelined requests
+    // taken from a connection whose replies have not all been sent.
+    // Option '-e <threads>' serves clients with that many event-loop
+    // threads instead of a thread per connection.
+    // Option '-u <threads>' does the same with io_uring threads, if the
+    // kernel supports it.
+    // Option '-t <threads>' runs client sessions on a pool of that many
+    // threads instead of a new thread per connection, and option '-a'
+    // pins each of them to its own CPU.
+    // Option '-r <acceptors>' accepts connections with that many threads,
+    // each on its own SO_REUSEPORT socket.
+    // Option '-n' logs the host name of each client, not just its address.
+    // Option '-s <path>' also accepts local clients on a Unix domain socket
+    // at path, over which they may switch to shared memory (see shm.h).
+    // Option '-g <seconds>' sets how long SIGHUP waits for transactions in
+    // progress to finish before closing their connections.
+    // Option '-w <seconds>' closes connections idle for that long, and
+    // option '-x <seconds>' aborts transactions going on for longer,
+    // leaving their connections open (see timeout.h); both are off unless
+    // given.
+    // Options '-m <transactions>', '-k <depth>' and '-c <milliseconds>'
+    // refuse new transactions while that many are in progress, or while
+    // dependency chains or commits are that long on average (see admit.h).
+    // Option '-S <seconds>' reports the statistics shown on shutdown every
+    // that many seconds while running as well.
     int c;
     char *port;
+    size_t dedup_min = 0, compress_min = 0;
+    int evloop_threads = 0, uring_threads = 0, pool_threads = 0, pin = 0;
+    int acceptors = 1;
+    int idle_timeout = IDLE_TIMEOUT, trans_lifetime = TRANS_LIFETIME;
+    int max_pending = ADMIT_MAX_PENDING, max_depth = ADMIT_MAX_DEPTH, max_commit_ms = ADMIT_MAX_COMMIT_MS;
     opterr = 0;
     #define PORT_OPTION 'p'
-    while((c = getopt(argc, argv, "p:")) != -1){
+    #define DEDUP_OPTION 'd'
+    #define COMPRESS_OPTION 'z'
+    #define LOG_OPTION 'l'
+    #define INFLIGHT_OPTION 'i'
+    #define EVLOOP_OPTION 'e'
+    #define URING_OPTION 'u'
+    #define POOL_OPTION 't'
+    #define PIN_OPTION 'a'
+    #define ACCEPTORS_OPTION 'r'
+    #define RESOLVE_OPTION 'n'
+    #define UNIX_OPTION 's'
+    #define DRAIN_OPTION 'g'
+    #define IDLE_OPTION 'w'
+    #define LIFETIME_OPTION 'x'
+    #define PENDING_OPTION 'm'
+    #define DEPTH_OPTION 'k'
+    #define COMMIT_OPTION 'c'
+    #define STATS_OPTION 'S'
+    while((c = getopt(argc, argv, "p:d:z:l:i:e:u:t:ar:ns:g:w:x:m:k:c:S:")) != -1){
         switch (c)
         {
         case PORT_OPTION:
             //TOOD ERROR CHECK
             port = optarg;
             break;
+        case DEDUP_OPTION:
+            dedup_min = strtoul(optarg, NULL, 10);
+            break;
+        case COMPRESS_OPTION:
+            compress_min = strtoul(optarg, NULL, 10);
+            break;
+        case LOG_OPTION:
+            if(log_parse_level(optarg) < 0){
+                error("unknown log level %s.", optarg);
+                terminate(EXIT_FAILURE);
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        case INFLIGHT_OPTION:
+            service_set_max_inflight(atoi(optarg));
+            break;
+        case EVLOOP_OPTION:
+            evloop_threads = atoi(optarg);
+            break;
+        case URING_OPTION:
+            uring_threads = atoi(optarg);
+            break;
+        case POOL_OPTION:
+            pool_threads = atoi(optarg);
+            break;
+        case PIN_OPTION:
+            pin = 1;
+            break;
+        case ACCEPTORS_OPTION:
+            if((acceptors = atoi(optarg)) < 1){
+                error("-%c requires a positive number.", ACCEPTORS_OPTION);
+                terminate(EXIT_FAILURE);
+            }
+            break;
+        case RESOLVE_OPTION:
+            resolve_names = 1;
+            break;
+        case UNIX_OPTION:
+            unix_path = optarg;
+            break;
+        case DRAIN_OPTION:
+            if((drain_timeout = atoi(optarg)) < 0){
+                error("-%c requires a number of seconds.", DRAIN_OPTION);
+                terminate(EXIT_FAILURE);
+            }
+            break;
+        case IDLE_OPTION:
+            idle_timeout = atoi(optarg);
+            break;
+        case LIFETIME_OPTION:
+            trans_lifetime = atoi(optarg);
+            break;
+        case PENDING_OPTION:
+            max_pending = atoi(optarg);
+            break;
+        case DEPTH_OPTION:
+            max_depth = atoi(optarg);
+            break;
+        case COMMIT_OPTION:
+            max_commit_ms = atoi(optarg);
+            break;
+        case STATS_OPTION:
+            stats_interval = atoi(optarg);
+            break;
         case '?':
-            if(optopt == PORT_OPTION){
-                error("-%c requires an argument.", PORT_OPTION);
+            if(optopt == PORT_OPTION || optopt == DEDUP_OPTION || optopt == COMPRESS_OPTION
+               || optopt == LOG_OPTION || optopt == INFLIGHT_OPTION
+               || optopt == EVLOOP_OPTION || optopt == URING_OPTION
+               || optopt == POOL_OPTION || optopt == ACCEPTORS_OPTION
+               || optopt == UNIX_OPTION || optopt == DRAIN_OPTION
+               || optopt == IDLE_OPTION || optopt == LIFETIME_OPTION
+               || optopt == PENDING_OPTION || optopt == DEPTH_OPTION
+               || optopt == COMMIT_OPTION || optopt == STATS_OPTION){
+                error("-%c requires an argument.", optopt);
                 terminate(EXIT_FAILURE);
             } else {
                 error("unknown option -%c.", optopt);
@@ -52,48 +380,100 @@ int main(int argc, char* argv[]){
         }
     }
     if(optind < argc) terminate(EXIT_FAILURE);
+
+    // SIGHUP is blocked before any thread is started, so that every thread
+    // inherits the mask and only the main thread takes it (with sigwait()).
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    if((listenfds = calloc(acceptors + 1, sizeof(int))) == NULL) terminate(EXIT_FAILURE);
+
+    log_init();
     info("Option validation complete");
     // Perform required initializations of the client_registry,
     // transaction manager, and object store.
     client_registry = creg_init();
+    flow_init();
+    timeout_init(idle_timeout, trans_lifetime);
+    admit_init(max_pending, max_depth, max_commit_ms);
+    if(dedup_min) dedup_init(dedup_min);
+    if(compress_min) compress_init(compress_min);
     trans_init();
     store_init();
 
-    // pool = tpool_init(10); // set up thread pool
+    if(pool_threads > 0){
+        if((pool = tpool_init(pool_threads)) == NULL){
+            error("Could not start thread pool");
+            terminate(EXIT_FAILURE);
+        }
+        if(pin && tpool_pin(pool)) warn("Could not pin pool threads to CPUs");
+        service_set_pool(pool);
+    }
     // TODO: Set up the server socket and enter a loop to accept connections
     // on this socket.  For each connection, a thread should be started to
     // run function xacto_client_service().  In addition, you should install
     // a SIGHUP handler, so that receipt of SIGHUP will perform a clean
     // shutdown of the server.
-    
-    /* install sighup handhler */
-    Signal(SIGHUP, hangup_handler);
+    // SIGHUP is taken by wait_for_hangup() below, which drains the server.
+
+    /* SIGUSR1 makes logging more verbose, SIGUSR2 less */
+    Signal(SIGUSR1, log_level_handler);
+    Signal(SIGUSR2, log_level_handler);
     
     /* setting up server socket */
-    int listenfd, *connfd;
-    char client_name[MAXLINE], client_port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t tid;
+    int listenfd;
 
-    listenfd = Open_listenfd(port);
+    // Local clients are always served by the threads (or the pool), which
+    // can wait on a shared-memory channel as well as on the socket.
+    if(unix_path != NULL){
+        int unixfd = Open_unix_listenfd(unix_path);
+        if(unixfd < 0){
+            unix_path = NULL;
+            terminate(EXIT_FAILURE);
+        }
+        start_acceptor(listening(unixfd));
+        info("Listening on %s ...", unix_path);
+    }
+    // With several acceptors, each listens on a socket of its own, so that
+    // the kernel spreads connections among them without a shared queue.
+    listenfd = listening(acceptors > 1 ? Open_reuseport_listenfd(port) : Open_listenfd(port));
     info("Listening on port %s ...", port);
-    while(1){
-        clientlen = sizeof(clientaddr);
-        connfd = malloc(sizeof(int));
-        *connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, client_name, MAXLINE, client_port, MAXLINE, 0);
-        info("Accepted connection from (%s, %s)\n", client_name, client_port);
-
-        Pthread_create(&tid, NULL, thread, connfd);
+    if(uring_threads > 0){
+        if(uring_start(listenfd, uring_threads) == 0)
+            wait_for_hangup(&hup);
+        warn("io_uring is not available, using standard I/O");
+    }
+    if(evloop_threads > 0){
+        if(evloop_start(listenfd, evloop_threads)) terminate(EXIT_FAILURE);
+        wait_for_hangup(&hup);
     }
-    terminate(EXIT_FAILURE);
+    if(acceptors > 1){
+        for(int i = 1; i < acceptors; i++)
+            start_acceptor(listening(Open_reuseport_listenfd(port)));
+        info("Accepting with %d threads", acceptors);
+    }
+    start_acceptor(listenfd);
+    wait_for_hangup(&hup);
 }
 
 /*
  * Function called to cleanly shut down the server.
  */
 void terminate(int status) {
+    if(unix_path != NULL) unlink(unix_path);
+
+    // Clients and their queues are shown while they are still there.
+    creg_show(client_registry);
+    flow_show();
+    timeout_show();
+    admit_show();
+    reason_show();
+
+    // Sessions still queued or parked on the pool would never be shut
+    // down: stopping it closes their connections.
+    if(pool) tpool_stop(pool);
+
     // Shutdown all client connections.
     // This will trigger the eventual termination of service threads.
     creg_shutdown_all(client_registry);
@@ -103,17 +483,23 @@ void terminate(int status) {
     debug("All service threads terminated.");
 
     // Finalize modules.
+    timeout_fini();
+    admit_fini();
     creg_fini(client_registry);
     trans_fini();
     store_fini();
+    dedup_show();
+    dedup_fini();
+    compress_show();
+    compress_fini();
 
-    // tpool_destroy(pool);
+    tpool_destroy(pool);
 
     debug("Xacto server terminating");
+    log_fini();
     exit(status);
 }
 
-void hangup_handler(int sig){
-    int status = (int)errno;
-    terminate(status);
-}
\ No newline at end of file
+void log_level_handler(int sig){
+    log_set_level(atomic_load(&log_level) + (sig == SIGUSR1 ? -1 : 1));
+}
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "mpmc.h"
+#include "settings.h"
+
+struct cell {
+    atomic_size_t seq;
+    char data[];
+};
+
+#define CELL(q, pos) ((struct cell *)((q)->cells + ((pos) & (q)->mask) * (q)->cell_size))
+
+static void futex_wait(atomic_uint *word, unsigned val){
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *word, int n){
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/*
+ * Wake a thread sleeping on the other side of the queue, if there is one.
+ * The fence orders the store that published the operation before the load
+ * of the waiter count; it pairs with the read-modify-write in wait().
+ */
+static void wake(atomic_uint *word, atomic_uint *waiters){
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(waiters, memory_order_relaxed)){
+        atomic_fetch_add(word, 1);
+        futex_wake(word, 1);
+    }
+}
+
+int mpmc_init(MPMC_QUEUE *q, size_t capacity, size_t elem_size){
+    size_t n = 2;
+    while(n < capacity) n *= 2;
+    memset(q, 0, sizeof(MPMC_QUEUE));
+    q->mask = n - 1;
+    q->elem_size = elem_size;
+    q->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MPMC_SPINS : 0;
+    q->cell_size = (sizeof(struct cell) + elem_size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    if((q->cells = malloc(n * q->cell_size)) == NULL) return -1;
+    for(size_t i = 0; i < n; i++)
+        atomic_init(&CELL(q, i)->seq, i);
+    return 0;
+}
+
+void mpmc_fini(MPMC_QUEUE *q){
+    free(q->cells);
+    q->cells = NULL;
+}
+
+bool mpmc_try_push(MPMC_QUEUE *q, const void *item){
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    struct cell *c;
+
+    while(1){
+        c = CELL(q, pos);
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return false;       // Not yet emptied on the previous lap: full
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    memcpy(c->data, item, q->elem_size);
+    atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+    wake(&q->not_empty, &q->pop_waiters);
+    return true;
+}
+
+bool mpmc_try_pop(MPMC_QUEUE *q, void *item){
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    struct cell *c;
+
+    while(1){
+        c = CELL(q, pos);
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                     memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return false;       // Not yet filled on this lap: empty
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    memcpy(item, c->data, q->elem_size);
+    atomic_store_explicit(&c->seq, pos + q->mask + 1, memory_order_release);
+    wake(&q->not_full, &q->push_waiters);
+    return true;
+}
+
+/*
+ * On a multiprocessor, a blocked operation spins briefly before sleeping:
+ * the other side usually catches up within a few hundred cycles, much less
+ * than a futex round trip.
+ */
+static void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+void mpmc_push(MPMC_QUEUE *q, const void *item){
+    mpmc_push_unless(q, item, NULL);
+}
+
+bool mpmc_push_unless(MPMC_QUEUE *q, const void *item, atomic_bool *cancel){
+    for(int i = 0; i < q->spins; i++){
+        if(mpmc_try_push(q, item)) return true;
+        cpu_relax();
+    }
+    while(!mpmc_try_push(q, item)){
+        unsigned key = atomic_load(&q->not_full);
+        atomic_fetch_add(&q->push_waiters, 1);
+        // Retry after registering as a waiter, so a pop in between is not
+        // missed, and look at cancel after taking the key, so that an
+        // mpmc_wake_all() after it was set is not either.
+        if(mpmc_try_push(q, item)){
+            atomic_fetch_sub(&q->push_waiters, 1);
+            return true;
+        }
+        if(cancel && atomic_load(cancel)){
+            atomic_fetch_sub(&q->push_waiters, 1);
+            return false;
+        }
+        futex_wait(&q->not_full, key);
+        atomic_fetch_sub(&q->push_waiters, 1);
+    }
+    return true;
+}
+
+void mpmc_wake_all(MPMC_QUEUE *q){
+    atomic_fetch_add(&q->not_full, 1);
+    atomic_fetch_add(&q->not_empty, 1);
+    futex_wake(&q->not_full, INT_MAX);
+    futex_wake(&q->not_empty, INT_MAX);
+}
+
+void mpmc_pop(MPMC_QUEUE *q, void *item){
+    for(int i = 0; i < q->spins; i++){
+        if(mpmc_try_pop(q, item)) return;
+        cpu_relax();
+    }
+    while(!mpmc_try_pop(q, item)){
+        unsigned key = atomic_load(&q->not_empty);
+        atomic_fetch_add(&q->pop_waiters, 1);
+        if(mpmc_try_pop(q, item)){
+            atomic_fetch_sub(&q->pop_waiters, 1);
+            return;
+        }
+        futex_wait(&q->not_empty, key);
+        atomic_fetch_sub(&q->pop_waiters, 1);
+    }
+}
@@ -0,0 +1,198 @@
+#include <string.h>
+#include <time.h>
+
+#include "proto2.h"
+#include "protocol.h"
+#include "proto_batch.h"
+#include "proto_session.h"
+
+static const char preface[PROTO2_PREFACE_LEN - 1] = { 0, 'X', '2' };
+
+
+int proto2_put_varint(char *p, uint64_t v){
+    int n = 0;
+    while(v >= 0x80){
+        p[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (char)v;
+    return n;
+}
+
+
+int proto2_get_varint(const char *p, size_t n, uint64_t *vp){
+    uint64_t v = 0;
+    for(int i = 0; i < PROTO2_VARINT_MAX; i++){
+        if(i == n) return 0;
+        // The last byte has room for the top bit of 64 only.
+        if(i == PROTO2_VARINT_MAX - 1 && (p[i] & 0xfe)) return -1;
+        v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+        if((p[i] & 0x80) == 0){
+            *vp = v;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+
+int proto2_detect(const char *p, size_t n, uint8_t *optsp){
+    if(p[0] != preface[0]) return 0;
+    for(size_t i = 1; i < sizeof(preface); i++){
+        if(i == n) return -1;
+        if(p[i] != preface[i]) return -2;
+    }
+    if(n < PROTO2_PREFACE_LEN) return -1;
+    *optsp = p[sizeof(preface)] & (PROTO2_OPT_TS | PROTO2_OPT_LZ | PROTO2_OPT_REASON | PROTO2_OPT_OVERLOAD);
+    return 1;
+}
+
+
+void proto2_preface(char *p, uint8_t opts){
+    memcpy(p, preface, sizeof(preface));
+    p[sizeof(preface)] = opts;
+}
+
+
+int proto2_frame(const char *p, size_t n, size_t *lenp){
+    uint64_t len;
+    int k = proto2_get_varint(p, n, &len);
+    if(k <= 0) return k;
+    if(len == 0 || len > PROTO2_FRAME_MAX) return -1;
+    *lenp = len;
+    return k;
+}
+
+
+/*
+ * Take a varint from the unparsed part of a body.
+ */
+static int take_varint(char **pp, char *end, uint64_t *vp){
+    int k = proto2_get_varint(*pp, end - *pp, vp);
+    if(k <= 0) return -1;
+    *pp += k;
+    return 0;
+}
+
+
+int proto2_parse(char *body, size_t len, PROTO2_REQ *req){
+    char *p = body + 1, *end = body + len;
+    uint64_t v;
+
+    memset(req, 0, sizeof(PROTO2_REQ));
+    req->op = body[0] & ~PROTO2_F_MASK;
+    req->flags = body[0] & PROTO2_F_MASK;
+    if(take_varint(&p, end, &v) || v > UINT32_MAX) return -1;
+    req->serial = v;
+    if((req->flags & PROTO2_F_TS) && (take_varint(&p, end, &v) || take_varint(&p, end, &v)))
+        return -1;
+    switch(req->op){
+    case XACTO_PUT_PKT:
+        if(take_varint(&p, end, &v) || v > end - p) return -1;
+        req->key = p;
+        req->klen = v;
+        p += v;
+        if(!(req->flags & PROTO2_F_NULL)){
+            req->value = p;
+            req->vlen = end - p;
+        }
+        return 0;
+    case XACTO_GET_PKT:
+        req->key = p;
+        req->klen = end - p;
+        return 0;
+    case XACTO_MGET_PKT:
+    case XACTO_MPUT_PKT:
+        req->value = p;
+        req->vlen = end - p;
+        return 0;
+    case XACTO_COMMIT_PKT:
+    case XACTO_BEGIN_PKT:
+        return p == end ? 0 : -1;
+    default:
+        return -1;
+    }
+}
+
+
+/*
+ * Put the current time, for a head with PROTO2_F_TS set.
+ */
+static size_t put_timestamp(char *p){
+    struct timespec ts;
+    size_t n;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    n = proto2_put_varint(p, ts.tv_sec);
+    return n + proto2_put_varint(p + n, ts.tv_nsec);
+}
+
+
+size_t proto2_reply_head(char *buf, PROTO2_REPLY *r){
+    char head[PROTO2_HEAD_MAX];
+    size_t n = 0;
+
+    head[n++] = r->status | r->flags;
+    n += proto2_put_varint(head + n, r->serial);
+    if(r->flags & PROTO2_F_TS)
+        n += put_timestamp(head + n);
+    if(r->flags & PROTO2_F_LZ)
+        n += proto2_put_varint(head + n, r->rawlen);
+    if(r->flags & PROTO2_F_REASON){
+        n += proto2_put_varint(head + n, r->reason);
+        n += proto2_put_varint(head + n, r->retry_us);
+        n += proto2_put_varint(head + n, r->key_hash);
+    }
+    size_t k = proto2_put_varint(buf, n + r->vlen);
+    memcpy(buf + k, head, n);
+    return k + n;
+}
+
+
+size_t proto2_request_head(char *buf, PROTO2_REQ *req){
+    char head[PROTO2_HEAD_MAX];
+    size_t n = 0;
+
+    head[n++] = req->op | req->flags;
+    n += proto2_put_varint(head + n, req->serial);
+    if(req->flags & PROTO2_F_TS)
+        n += put_timestamp(head + n);
+    if(req->op == XACTO_PUT_PKT)
+        n += proto2_put_varint(head + n, req->klen);
+    size_t k = proto2_put_varint(buf, n + req->klen + req->vlen);
+    memcpy(buf + k, head, n);
+    return k + n;
+}
+
+
+int proto2_parse_reply(char *body, size_t len, PROTO2_REPLY *r, char **valuep){
+    char *p = body + 1, *end = body + len;
+    uint64_t v;
+
+    memset(r, 0, sizeof(PROTO2_REPLY));
+    *valuep = NULL;
+    r->status = body[0] & ~(PROTO2_F_MASK | PROTO2_F_REASON);
+    r->flags = body[0] & (PROTO2_F_MASK | PROTO2_F_REASON);
+    if(take_varint(&p, end, &v) || v > UINT32_MAX) return -1;
+    r->serial = v;
+    if((r->flags & PROTO2_F_TS) && (take_varint(&p, end, &v) || take_varint(&p, end, &v)))
+        return -1;
+    if(r->flags & PROTO2_F_LZ){
+        if(take_varint(&p, end, &v)) return -1;
+        r->rawlen = v;
+    }
+    if(r->flags & PROTO2_F_REASON){
+        if(take_varint(&p, end, &v) || v > UINT8_MAX) return -1;
+        r->reason = v;
+        if(take_varint(&p, end, &v) || v > UINT32_MAX) return -1;
+        r->retry_us = v;
+        if(take_varint(&p, end, &v) || v > UINT32_MAX) return -1;
+        r->key_hash = v;
+    }
+    if((r->flags & PROTO2_F_VALUE) && !(r->flags & PROTO2_F_NULL)){
+        *valuep = p;
+        r->vlen = end - p;
+    } else if(p != end){
+        return -1;
+    }
+    return 0;
+}
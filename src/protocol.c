@@ -3,24 +3,230 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "protocol.h"
+#include "proto_queue.h"
+#include "proto_rbuf.h"
+#include "proto_batch.h"
 #include "wrappers.h"
 #include "debug.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+
+void proto_init_header(XACTO_PACKET *pkt, uint8_t type, uint32_t serial){
+    struct timespec ts;
+    memset(pkt, 0, sizeof(XACTO_PACKET));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pkt->type = type;
+    pkt->serial = serial;
+    pkt->timestamp_sec = htonl(ts.tv_sec);
+    pkt->timestamp_nsec = htonl(ts.tv_nsec);
+}
+
+
+/*
+ * Write out as much of a sequence of iovecs as possible, advancing *iovp
+ * and *iovcntp over what was written, which may end mid-segment.  With
+ * MSG_DONTWAIT in flags, stop as soon as the socket is full.
+ *
+ * @return  0 if successful, -1 otherwise, with errno set.
+ */
+static int writev_flags(int fd, struct iovec **iovp, int *iovcntp, int flags){
+    struct iovec *iov = *iovp;
+    int iovcnt = *iovcntp, ret = 0;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    while(iovcnt > 0){
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+        /* MSG_NOSIGNAL: a vanished client is an error, not a SIGPIPE. */
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+        if(n < 0 && errno == ENOTSOCK)
+            n = writev(fd, iov, msg.msg_iovlen);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            if((flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            ret = -1;
+            break;
+        }
+        while(iovcnt > 0 && n >= (ssize_t)iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    *iovp = iov;
+    *iovcntp = iovcnt;
+    return ret;
+}
+
+
+int proto_writev(int fd, struct iovec *iov, int iovcnt){
+    return writev_flags(fd, &iov, &iovcnt, 0);
+}
+
 
 int proto_send_packet(int fd, XACTO_PACKET *pkt, void *data){
-    int olderrno = errno;
-    debug("pkt: %p", pkt);
-    debug("data: %p", data);
+    struct iovec iov[2];
+    int iovcnt = 1;
     debug("sending packet: (timestamp=%d.%d, size=%d, serial=%d)", pkt->timestamp_sec, pkt->timestamp_nsec, pkt->size, pkt->serial);
 
-    Rio_writen(fd, pkt, sizeof(XACTO_PACKET));
+    iov[0].iov_base = pkt;
+    iov[0].iov_len = sizeof(XACTO_PACKET);
     if(pkt->size && data){
-        int payload_size = ntohl(pkt->size);
-        Rio_writen(fd, data, payload_size);
+        iov[1].iov_base = data;
+        iov[1].iov_len = ntohl(pkt->size);
+        iovcnt++;
     }
-    return errno == olderrno ? 0 : -1;
+    return proto_writev(fd, iov, iovcnt);
+}
+
+
+void proto_queue_init(PROTO_QUEUE *q, int fd){
+    q->fd = fd;
+    q->npkts = q->iovcnt = 0;
+    q->bytes = 0;
+    q->backlog = NULL;
+    q->backlog_start = q->backlog_end = q->backlog_cap = 0;
+}
+
+
+void proto_queue_fini(PROTO_QUEUE *q){
+    free(q->backlog);
+    q->backlog = NULL;
+    q->backlog_start = q->backlog_end = q->backlog_cap = 0;
+}
+
+
+int proto_queue_packet(PROTO_QUEUE *q, XACTO_PACKET *pkt, void *data,
+                       proto_release_t release, void *arg){
+    if(q->npkts == PROTO_QUEUE_PKTS && proto_queue_send(q)){
+        if(release) release(arg, data);
+        return -1;
+    }
+    int i = q->npkts++;
+    q->hdrs[i] = *pkt;
+    q->iov[q->iovcnt].iov_base = &q->hdrs[i];
+    q->iov[q->iovcnt++].iov_len = sizeof(XACTO_PACKET);
+    q->bytes += sizeof(XACTO_PACKET);
+    if(pkt->size && data){
+        q->iov[q->iovcnt].iov_base = data;
+        q->iov[q->iovcnt++].iov_len = ntohl(pkt->size);
+        q->bytes += ntohl(pkt->size);
+    }
+    q->release[i].func = release;
+    q->release[i].arg = arg;
+    q->release[i].data = data;
+    return 0;
+}
+
+
+/*
+ * Call the release functions of all queued packets and empty the queue.
+ */
+static void queue_release(PROTO_QUEUE *q){
+    for(int i = 0; i < q->npkts; i++){
+        if(q->release[i].func)
+            q->release[i].func(q->release[i].arg, q->release[i].data);
+    }
+    q->npkts = q->iovcnt = 0;
+    q->bytes = 0;
+}
+
+
+/*
+ * Write out as much of the backlog as possible, with the given flags.
+ */
+static int backlog_write(PROTO_QUEUE *q, int flags){
+    struct iovec iov = { q->backlog + q->backlog_start, q->backlog_end - q->backlog_start }, *iovp = &iov;
+    int iovcnt = 1;
+    int ret = writev_flags(q->fd, &iovp, &iovcnt, flags);
+    q->backlog_start = q->backlog_end - (iovcnt ? iov.iov_len : 0);
+    if(q->backlog_start == q->backlog_end){
+        q->backlog_start = q->backlog_end = 0;
+        if(q->backlog_cap > CONN_BUF_MAX){
+            // Give back the memory after a client has caught up.
+            free(q->backlog);
+            q->backlog = NULL;
+            q->backlog_cap = 0;
+        }
+    }
+    return ret;
+}
+
+
+/*
+ * Copy what is left of a sequence of iovecs to the end of the backlog.
+ */
+static int backlog_append(PROTO_QUEUE *q, struct iovec *iov, int iovcnt){
+    size_t n = 0;
+    for(int i = 0; i < iovcnt; i++) n += iov[i].iov_len;
+    if(q->backlog_start){
+        memmove(q->backlog, q->backlog + q->backlog_start, q->backlog_end - q->backlog_start);
+        q->backlog_end -= q->backlog_start;
+        q->backlog_start = 0;
+    }
+    if(q->backlog_cap - q->backlog_end < n){
+        size_t cap = q->backlog_cap ? q->backlog_cap : CONN_BUF_INIT;
+        while(cap - q->backlog_end < n) cap *= 2;
+        char *data = realloc(q->backlog, cap);
+        if(data == NULL) return -1;
+        q->backlog = data;
+        q->backlog_cap = cap;
+    }
+    for(int i = 0; i < iovcnt; i++){
+        memcpy(q->backlog + q->backlog_end, iov[i].iov_base, iov[i].iov_len);
+        q->backlog_end += iov[i].iov_len;
+    }
+    return 0;
+}
+
+
+int proto_queue_send(PROTO_QUEUE *q){
+    struct iovec *iov = q->iov;
+    int iovcnt = q->iovcnt, ret = 0;
+
+    // Nothing may overtake the backlog.
+    if(q->backlog_end > q->backlog_start)
+        ret = backlog_write(q, MSG_DONTWAIT);
+    if(ret == 0 && iovcnt){
+        debug("sending %d packets (%zu bytes) in one write", q->npkts, q->bytes);
+        if(q->backlog_end == q->backlog_start)
+            ret = writev_flags(q->fd, &iov, &iovcnt, MSG_DONTWAIT);
+        if(ret == 0 && iovcnt) ret = backlog_append(q, iov, iovcnt);
+    }
+    queue_release(q);
+    return ret;
+}
+
+
+int proto_queue_flush(PROTO_QUEUE *q){
+    int ret = 0;
+    if(q->backlog_end > q->backlog_start)
+        ret = backlog_write(q, 0);
+    if(ret == 0 && q->iovcnt){
+        debug("flushing %d packets (%zu bytes) in one write", q->npkts, q->bytes);
+        ret = proto_writev(q->fd, q->iov, q->iovcnt);
+    }
+    queue_release(q);
+    return ret;
+}
+
+
+size_t proto_queue_backlog(PROTO_QUEUE *q){
+    return q->backlog_end - q->backlog_start;
 }
 
 int proto_recv_packet(int fd, XACTO_PACKET *pkt, void **datap){
@@ -51,28 +257,122 @@ int proto_recv_packet(int fd, XACTO_PACKET *pkt, void **datap){
             return -1;
         }
 
-        void *buf = malloc(sizeof(pkt->size));
+        void *buf = payload_size ? malloc(payload_size) : NULL;
         void *bufptr = buf;
-        
-        while(1){
-            if(payload_size == 0){
-                if(datap == NULL) {
-                    free(buf);
-                } else {
-                    *datap = buf;
-                }
-                break;
-            }
+
+        if(datap) *datap = NULL;
+        while(payload_size > 0){
             debug("reading payload data...");
             nread = Read(fd, bufptr, payload_size);
-            if(nread == -1){
+            if(nread <= 0){
                 free(buf);
-                break;
+                if(nread == 0) errno = EIO;
+                return -1;
             }
             payload_size -= nread;
-            bufptr += payload_size;
+            bufptr += nread;
         }
+        if(datap == NULL) free(buf);
+        else *datap = buf;
     }
 
     return errno == olderrno ? 0 : -1;
-}
\ No newline at end of file
+}
+
+
+int proto_recv_packet_buffered(rio_t *rp, XACTO_PACKET *pkt, void **datap, int *ownedp){
+    ssize_t n;
+
+    *datap = NULL;
+    *ownedp = 0;
+    if((n = rio_fillb(rp, sizeof(XACTO_PACKET))) < (ssize_t)sizeof(XACTO_PACKET)){
+        if(n >= 0) errno = n ? EIO : 0;   /* EOF, possibly mid-header */
+        return -1;
+    }
+    memcpy(pkt, rp->rio_bufptr, sizeof(XACTO_PACKET));
+    rp->rio_bufptr += sizeof(XACTO_PACKET);
+    rp->rio_cnt -= sizeof(XACTO_PACKET);
+
+    size_t payload_size = ntohl(pkt->size);
+    if(payload_size == 0) return 0;
+    if(payload_size > 0x100000){
+        error("size error: %zu", payload_size);
+        errno = E2BIG;
+        return -1;
+    }
+    if(payload_size <= RIO_BUFSIZE){
+        /* Hand out a slice of the read buffer. */
+        if((n = rio_fillb(rp, payload_size)) < (ssize_t)payload_size){
+            if(n >= 0) errno = EIO;
+            return -1;
+        }
+        *datap = rp->rio_bufptr;
+        rp->rio_bufptr += payload_size;
+        rp->rio_cnt -= payload_size;
+        return 0;
+    }
+    void *buf = malloc(payload_size);
+    if(buf == NULL) return -1;
+    if((n = rio_readnb(rp, buf, payload_size)) < (ssize_t)payload_size){
+        if(n >= 0) errno = EIO;
+        free(buf);
+        return -1;
+    }
+    *datap = buf;
+    *ownedp = 1;
+    return 0;
+}
+
+
+int proto_batch_open(PROTO_BATCH *b, void *data, size_t size, int items){
+    uint32_t count;
+
+    if(size < sizeof(count)) return -1;
+    memcpy(&count, data, sizeof(count));
+    b->data = data;
+    b->size = size;
+    b->off = sizeof(count);
+    b->count = ntohl(count);
+    /* Every item takes at least its length field. */
+    if(b->count > (size - b->off) / sizeof(uint32_t) / items) return -1;
+    return 0;
+}
+
+
+int proto_batch_next(PROTO_BATCH *b, char **itemp, size_t *lenp){
+    uint32_t len;
+
+    if(b->size - b->off < sizeof(len)) return -1;
+    memcpy(&len, b->data + b->off, sizeof(len));
+    b->off += sizeof(len);
+    len = ntohl(len);
+    if(len == PROTO_BATCH_NULL){
+        *itemp = NULL;
+        *lenp = 0;
+        return 0;
+    }
+    if(b->size - b->off < len) return -1;
+    *itemp = b->data + b->off;
+    *lenp = len;
+    b->off += len;
+    return 0;
+}
+
+
+char *proto_batch_put_count(char *p, uint32_t count){
+    count = htonl(count);
+    memcpy(p, &count, sizeof(count));
+    return p + sizeof(count);
+}
+
+
+char *proto_batch_put(char *p, const void *item, size_t len){
+    uint32_t n = htonl(item ? len : PROTO_BATCH_NULL);
+    memcpy(p, &n, sizeof(n));
+    p += sizeof(n);
+    if(item && len){
+        memcpy(p, item, len);
+        p += len;
+    }
+    return p;
+}
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "reason.h"
+#include "creg_ext.h"
+#include "server.h"
+#include "settings.h"
+#include "debug.h"
+
+static struct {
+    atomic_uint_fast64_t tag;   // (ID << 32) | reason
+    atomic_uint key_hash;
+} slots[ABORT_REASON_SLOTS];
+
+static atomic_size_t counts[XACTO_REASONS];
+
+static const char *names[XACTO_REASONS] = {
+    "none", "conflict", "dependency", "expired", "overloaded", "too large"
+};
+
+void reason_set(int id, XACTO_REASON reason, uint32_t key_hash){
+    unsigned i = (unsigned)id & (ABORT_REASON_SLOTS - 1);
+    uint64_t tag = atomic_load_explicit(&slots[i].tag, memory_order_relaxed);
+    if(tag >> 32 == (unsigned)id && (uint8_t)tag != XACTO_REASON_NONE) return;
+    atomic_store_explicit(&slots[i].key_hash, key_hash, memory_order_relaxed);
+    atomic_store_explicit(&slots[i].tag, (uint64_t)(unsigned)id << 32 | reason, memory_order_release);
+}
+
+/*
+ * Suggest how long to wait before trying an aborted transaction again: a
+ * base delay for the reason, longer the more transactions are in progress
+ * to contend with.  An expired transaction was aborted for its own
+ * slowness, and may be tried again at once.
+ */
+static uint32_t retry_us(XACTO_REASON reason){
+    long us;
+
+    switch(reason){
+    case XACTO_REASON_CONFLICT:
+    case XACTO_REASON_DEPENDENCY:
+        us = ABORT_RETRY_CONFLICT_US;
+        break;
+    case XACTO_REASON_OVERLOADED:
+        us = ABORT_RETRY_OVERLOAD_US;
+        break;
+    default:
+        return 0;
+    }
+    if(client_registry) us *= 1 + creg_transactions(client_registry) / ABORT_RETRY_LOAD_STEP;
+    return us < ABORT_RETRY_MAX_US ? us : ABORT_RETRY_MAX_US;
+}
+
+void reason_explain(XACTO_ABORT_INFO *ip, int id, XACTO_REASON otherwise){
+    unsigned i = (unsigned)id & (ABORT_REASON_SLOTS - 1);
+
+    if(ip->reason != XACTO_REASON_NONE) return;
+    uint64_t tag = atomic_load_explicit(&slots[i].tag, memory_order_acquire);
+    // An empty slot reads as reason NONE for ID 0.
+    if(tag >> 32 == (unsigned)id && (uint8_t)tag != XACTO_REASON_NONE && otherwise != XACTO_REASON_OVERLOADED){
+        ip->reason = (uint8_t)tag;
+        ip->key_hash = atomic_load_explicit(&slots[i].key_hash, memory_order_relaxed);
+    } else {
+        ip->reason = otherwise;
+        ip->key_hash = 0;
+    }
+    ip->retry_us = retry_us(ip->reason);
+    atomic_fetch_add_explicit(&counts[ip->reason], 1, memory_order_relaxed);
+    debug("Transaction %d aborted (%s, key hash %#x, retry in %u us)",
+          id, names[ip->reason], ip->key_hash, ip->retry_us);
+}
+
+void reason_get_counts(size_t c[XACTO_REASONS]){
+    for(int r = 0; r < XACTO_REASONS; r++)
+        c[r] = atomic_load_explicit(&counts[r], memory_order_relaxed);
+}
+
+void reason_show(void){
+    size_t c[XACTO_REASONS];
+    reason_get_counts(c);
+    fprintf(stderr, "ABORTS: %zu %s, %zu %s, %zu %s, %zu %s, %zu %s\n",
+            c[XACTO_REASON_CONFLICT], names[XACTO_REASON_CONFLICT],
+            c[XACTO_REASON_DEPENDENCY], names[XACTO_REASON_DEPENDENCY],
+            c[XACTO_REASON_EXPIRED], names[XACTO_REASON_EXPIRED],
+            c[XACTO_REASON_OVERLOADED], names[XACTO_REASON_OVERLOADED],
+            c[XACTO_REASON_TOO_LARGE], names[XACTO_REASON_TOO_LARGE]);
+}
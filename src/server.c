@@ -0,0 +1,630 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "server.h"
+#include "protocol.h"
+#include "proto_queue.h"
+#include "proto_rbuf.h"
+#include "service.h"
+#include "conn.h"
+#include "batch.h"
+#include "proto_batch.h"
+#include "proto_session.h"
+#include "settings.h"
+#include "transaction.h"
+#include "store.h"
+#include "data.h"
+#include "blob_ext.h"
+#include "compress.h"
+#include "shm.h"
+#include "flow.h"
+#include "timeout.h"
+#include "admit.h"
+#include "reason.h"
+#include "creg_ext.h"
+#include "wrappers.h"
+#include "debug.h"
+
+CLIENT_REGISTRY *client_registry;
+
+static int max_inflight = MAX_INFLIGHT;
+
+void service_set_max_inflight(int n){
+    max_inflight = n > 0 ? n : 1;
+}
+
+int service_max_inflight(void){
+    return max_inflight;
+}
+
+static atomic_int draining;
+
+static tpool_t *service_pool;
+
+void service_set_pool(tpool_t *pool){
+    service_pool = pool;
+}
+
+void service_drain(void){
+    atomic_store(&draining, 1);
+}
+
+int service_draining(void){
+    return atomic_load_explicit(&draining, memory_order_relaxed);
+}
+
+/*
+ * Receive a data packet of the expected type and turn its payload into
+ * a blob.  A null data packet yields a NULL blob.  A payload too large
+ * for the read buffer is received into storage of its own, which then
+ * becomes the content of the blob without being copied again.
+ *
+ * @return  0 if successful, -1 if the connection failed or the client
+ *   sent something other than the expected data packet.
+ */
+static int recv_blob(rio_t *rp, uint8_t type, BLOB **bpp){
+    XACTO_PACKET pkt;
+    void *data;
+    int owned;
+
+    *bpp = NULL;
+    if(proto_recv_packet_buffered(rp, &pkt, &data, &owned)) return -1;
+    creg_add_bytes(client_registry, rp->rio_fd, sizeof(pkt) + ntohl(pkt.size), 0);
+    if(pkt.type != type){
+        error("[%d] expected data packet of type %d, got %d", rp->rio_fd, type, pkt.type);
+        if(owned) free(data);
+        return -1;
+    }
+    if(pkt.null){
+        if(owned) free(data);
+    } else if(owned){
+        *bpp = blob_adopt(data, ntohl(pkt.size));
+    } else {
+        *bpp = blob_create(data ? data : "", ntohl(pkt.size));
+    }
+    return (!pkt.null && *bpp == NULL) ? -1 : 0;
+}
+
+/*
+ * Add a packet to the reply queue, counting it as sent to the client.
+ */
+static int queue_packet(PROTO_QUEUE *q, XACTO_PACKET *pkt, void *data,
+                        proto_release_t release, void *arg){
+    creg_add_bytes(client_registry, q->fd, 0, sizeof(*pkt) + (data ? ntohl(pkt->size) : 0));
+    return proto_queue_packet(q, pkt, data, release, arg);
+}
+
+/*
+ * Release function for a GET value queued for sending.
+ */
+static void release_value(void *arg, void *data){
+    BLOB *bp = arg;
+    blob_data_release(bp, data);
+    blob_unref(bp, "value sent in GET reply");
+}
+
+static void release_batch(void *arg, void *data){
+    free(data);
+}
+
+/*
+ * Work out why a transaction was aborted, if the status of a request in it
+ * says it has been, so that the abort is counted (see reason.h); otherwise
+ * is the reason to give if the one that aborted it recorded none.  The
+ * transaction was not admitted if rejected is set.  A v1 reply does not
+ * carry the reason (see proto_status.h).
+ */
+static void explain_abort(XACTO_ABORT_INFO *why, TRANS_STATUS status, int id, int rejected,
+                          XACTO_REASON otherwise){
+    if(status != TRANS_ABORTED) return;
+    reason_explain(why, id, rejected ? XACTO_REASON_OVERLOADED : otherwise);
+}
+
+/*
+ * Execute a batched request and queue its reply.
+ */
+static int batch_reply(PROTO_QUEUE *q, XACTO_PACKET *req, void *data, TRANSACTION *tp,
+                       int rejected, XACTO_ABORT_INFO *why, TRANS_STATUS *statusp){
+    XACTO_PACKET pkt;
+    char *values;
+    size_t size;
+
+    if(batch_execute(tp, req, data, statusp, &values, &size)) return -1;
+    proto_init_header(&pkt, XACTO_REPLY_PKT, req->serial);
+    pkt.status = *statusp;
+    explain_abort(why, *statusp, tp->id, rejected, XACTO_REASON_EXPIRED);
+    if(queue_packet(q, &pkt, NULL, NULL, NULL)){
+        free(values);
+        return -1;
+    }
+    if(values == NULL) return 0;
+    proto_init_header(&pkt, XACTO_VALUE_PKT, req->serial);
+    pkt.size = htonl(size);
+    return queue_packet(q, &pkt, values, release_batch, NULL);
+}
+
+/*
+ * Queue a reply, followed by a value packet if the request was a GET.
+ * The reference to the value passes to the queue.  Compressed values are
+ * expanded here, at the last moment.
+ */
+static int queue_reply(PROTO_QUEUE *q, uint32_t serial, int status, int is_get, BLOB *value){
+    XACTO_PACKET pkt;
+    proto_init_header(&pkt, XACTO_REPLY_PKT, serial);
+    pkt.status = status;
+    if(queue_packet(q, &pkt, NULL, NULL, NULL)){
+        if(value) blob_unref(value, "value sent in GET reply");
+        return -1;
+    }
+    if(!is_get) return 0;
+
+    char *data = NULL;
+    proto_init_header(&pkt, XACTO_VALUE_PKT, serial);
+    if(value && (data = blob_data(value)) == NULL){
+        blob_unref(value, "value sent in GET reply");
+        value = NULL;
+    }
+    if(value == NULL){
+        pkt.null = 1;
+        return queue_packet(q, &pkt, NULL, NULL, NULL);
+    }
+    pkt.size = htonl(value->size);
+    return queue_packet(q, &pkt, data, release_value, value);
+}
+
+/*
+ * Wait for a client with a backlog of replies, sending them as it takes
+ * them, until it has caught up or, unless the backlog is full or capped is
+ * set, until it has sent another request.  A full backlog, or as many
+ * requests as may be in flight, thus stops reading requests, but the
+ * thread is never blocked in a write while requests that could move the
+ * client's transaction along are waiting.
+ *
+ * @return  0 if successful, -1 if the connection failed.
+ */
+static int await_client(PROTO_QUEUE *q, rio_t *rp, int capped){
+    size_t backlog;
+    int stalled = 0;
+
+    while((backlog = proto_queue_backlog(q)) > 0){
+        int full = backlog >= PROTO_QUEUE_MAX;
+        if(!full && !capped && proto_buffered(rp)) return 0;
+        if(full && !stalled){
+            flow_stalled(q->fd);
+            stalled = 1;
+        }
+        struct pollfd pfd = { q->fd, POLLOUT | (full || capped ? 0 : POLLIN), 0 };
+        if(poll(&pfd, 1, -1) < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(pfd.revents & POLLIN) return 0;
+        if(!(pfd.revents & POLLOUT) || proto_queue_send(q)) return -1;
+        flow_queued(q->fd, proto_queue_backlog(q));
+    }
+    return 0;
+}
+
+/*
+ * Wait for a client between transactions, with every reply sent, on a pool
+ * worker.  While other jobs are queued for the pool, the worker takes its
+ * turn instead: job goes to the back of the queue if the client has sent
+ * more, and is parked until it does otherwise.  On a thread of its own,
+ * the caller just goes on to read.  Within a transaction, a service keeps
+ * its worker: a commit that others wait for on their workers must not be
+ * held up behind them.  A service taken up again reads from its client
+ * before it calls this again, so that it does not just take turns with
+ * other jobs that do the same.
+ *
+ * @return  1 if job was queued or parked, in which case the caller must
+ *   return without touching the service again, 0 if the client can be
+ *   read.
+ */
+static int await_idle(int fd, tpool_job_t job){
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    if(service_pool == NULL) return 0;
+    while(1){
+        if(tpool_busy(service_pool)){
+            if(poll(&pfd, 1, 0) > 0 ? tpool_yield(service_pool, job)
+                                    : tpool_park(service_pool, fd, job))
+                return 1;
+        }
+        if(poll(&pfd, 1, TPOOL_YIELD_MS) != 0) return 0;
+    }
+}
+
+static void *run_conn(void *arg);
+static void end_conn(void *arg);
+
+/*
+ * Serve a client that speaks the v2 wire format with the connection state
+ * machine (see conn.h), waiting on the socket between rounds.  The bytes
+ * already buffered in rp are handed over first.  Replies are sent without
+ * blocking, and the socket is only read while the output buffer has room.
+ */
+static void serve_conn(int fd, rio_t *rp){
+    CONN *cp = conn_attach(fd);
+    char *p;
+    size_t len;
+
+    if(cp == NULL){
+        timeout_close(fd);
+        creg_unregister(client_registry, fd);
+        close(fd);
+        return;
+    }
+    while(rp->rio_cnt > 0 && (p = conn_rspace(cp, &len)) != NULL){
+        if(len > rp->rio_cnt) len = rp->rio_cnt;
+        memcpy(p, rp->rio_bufptr, len);
+        conn_received(cp, len);
+        rp->rio_bufptr += len;
+        rp->rio_cnt -= len;
+    }
+    run_conn(cp);
+}
+
+/*
+ * Send as many pending replies of a connection as the socket takes
+ * without waiting.
+ *
+ * @return  The number of bytes still pending; if nonzero, errno tells why.
+ */
+static size_t send_pending(CONN *cp){
+    struct iovec iov[CONN_SEND_IOV];
+    struct msghdr msg = { .msg_iov = iov };
+    int iovcnt = CONN_SEND_IOV;
+    size_t len;
+    ssize_t n;
+
+    while((len = conn_pending(cp, iov, &iovcnt)) > 0){
+        msg.msg_iovlen = iovcnt;
+        if((n = sendmsg(cp->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) <= 0) break;
+        conn_sent(cp, n);
+        iovcnt = CONN_SEND_IOV;
+    }
+    return len;
+}
+
+/*
+ * Serve a v2 client until the service ends, or until the client is idle
+ * and the service has been parked on the pool (see await_idle()).
+ */
+static void *run_conn(void *arg){
+    CONN *cp = arg;
+    int fd = cp->fd, done = 0, turn = 0;
+    char *p;
+    size_t len;
+    ssize_t n;
+
+    while(1){
+        // Replies go out even once the service has ended.
+        if(!done) done = conn_process(cp);
+        int stalled = conn_throttled(cp);
+        len = send_pending(cp);
+        flow_queued(fd, len);
+        if(len > 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) break;
+        if(done && len == 0) break;
+        // Requests already received when reading stopped are taken up now.
+        if(stalled && !done && !conn_throttled(cp)) continue;
+        // Between transactions, once the client has been read from.
+        if(turn && !done && cp->tp == NULL && len == 0 && !conn_throttled(cp)
+           && await_idle(fd, (tpool_job_t){ run_conn, cp, end_conn }))
+            return NULL;
+        struct pollfd pfd = { fd, (len ? POLLOUT : 0) | (done || conn_throttled(cp) ? 0 : POLLIN), 0 };
+        if(poll(&pfd, 1, -1) < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(pfd.revents & POLLIN){
+            if((p = conn_rspace(cp, &len)) == NULL) break;
+            if((n = read(fd, p, len)) > 0) conn_received(cp, n);
+            else if(n == 0 || errno != EINTR) done = 1;
+            turn = 1;
+        } else if(!(pfd.revents & POLLOUT)){
+            break;
+        }
+    }
+    conn_destroy(cp);
+    return NULL;
+}
+
+static void end_conn(void *arg){
+    conn_destroy(arg);
+}
+
+/*
+ * Serve a local client that has asked for a shared-memory channel (see
+ * shm.h) with the connection state machine, moving bytes through the rings
+ * instead of the socket.  Reading stops while the output buffer is full,
+ * and the reply ring with it.
+ */
+static void serve_shm(int fd){
+    SHM_CHAN *ch = shm_chan_create(fd);
+    CONN *cp = ch ? conn_attach(fd) : NULL;
+    int done = 0, iovcnt;
+    struct iovec iov;
+    char *p;
+    size_t len, n;
+
+    if(cp == NULL){
+        if(ch) shm_chan_destroy(ch);
+        timeout_close(fd);
+        creg_unregister(client_registry, fd);
+        close(fd);
+        return;
+    }
+    debug("[%d] Serving client over shared memory", fd);
+    while(1){
+        if(!done) done = conn_process(cp);
+        int stalled = conn_throttled(cp);
+        for(iovcnt = 1; (len = conn_pending(cp, &iov, &iovcnt)) > 0; iovcnt = 1){
+            if((n = shm_write(ch, iov.iov_base, iov.iov_len)) == 0) break;
+            conn_sent(cp, n);
+        }
+        flow_queued(fd, len);
+        if(len > 0 && (done || conn_throttled(cp))){
+            if(shm_wait(ch, SHM_WRITABLE)) break;
+            continue;
+        }
+        if(done) break;
+        if(stalled && !conn_throttled(cp)) continue;
+        if((p = conn_rspace(cp, &n)) == NULL) break;
+        if((n = shm_read(ch, p, n)) > 0) conn_received(cp, n);
+        else if(shm_wait(ch, SHM_READABLE | (len ? SHM_WRITABLE : 0))) break;
+    }
+    shm_chan_destroy(ch);
+    conn_destroy(cp);
+}
+
+/*
+ * The state of the service of a v1 client, kept between requests so that
+ * a pool worker can let go of it while the client is idle.
+ */
+struct v1_session {
+    int fd;
+    rio_t rio;
+    PROTO_QUEUE replies;
+    TRANSACTION *tp;
+    TRANS_STATUS status;
+    XACTO_ABORT_INFO why;
+    int rejected;
+    int inflight;
+    int session;                // Whether the client has sent BEGIN
+};
+
+static void *start_service(void *arg);
+static void *detect_service(void *arg);
+static void *serve_v1(void *arg);
+static void end_early(void *arg);
+static void end_v1(void *arg);
+
+void *xacto_client_service(void *arg){
+    int fd = *(int *)arg;
+    free(arg);
+    creg_register(client_registry, fd);
+    timeout_open(fd);
+
+    struct v1_session *sp = malloc(sizeof(struct v1_session));
+    if(sp == NULL){
+        timeout_close(fd);
+        creg_unregister(client_registry, fd);
+        close(fd);
+        return NULL;
+    }
+    sp->fd = fd;
+    rio_readinitb(&sp->rio, fd);
+    return start_service(sp);
+}
+
+static void *start_service(void *arg){
+    struct v1_session *sp = arg;
+
+    if(await_idle(sp->fd, (tpool_job_t){ detect_service, sp, end_early }))
+        return NULL;
+    return detect_service(sp);
+}
+
+/*
+ * Tell the wire format of a client from its first byte, and serve it.
+ */
+static void *detect_service(void *arg){
+    struct v1_session *sp = arg;
+    int fd = sp->fd;
+
+    if(rio_fillb(&sp->rio, 1) > 0 && sp->rio.rio_bufptr[0] == 0){
+        // A v1 packet cannot start with a zero byte: this is a v2 preface,
+        // or a local client asking for shared memory.
+        if(rio_fillb(&sp->rio, SHM_PREFACE_LEN) >= SHM_PREFACE_LEN
+           && memcmp(sp->rio.rio_bufptr, SHM_PREFACE, SHM_PREFACE_LEN - 1) == 0){
+            free(sp);
+            serve_shm(fd);
+            return NULL;
+        }
+        serve_conn(fd, &sp->rio);
+        free(sp);
+        return NULL;
+    }
+    proto_queue_init(&sp->replies, fd);
+    flow_open(fd);
+    sp->tp = admit_trans_create(&sp->rejected);
+    sp->status = TRANS_PENDING;
+    sp->why.reason = XACTO_REASON_NONE;
+    sp->inflight = sp->session = 0;
+    if(!sp->rejected) creg_set_transaction(client_registry, fd, sp->tp);
+    debug("[%d] Starting client service (transaction %d)", fd, sp->tp ? sp->tp->id : -1);
+    return serve_v1(sp);
+}
+
+/*
+ * Serve a v1 client until the service ends, or until the client is idle
+ * and the service has been parked on the pool (see await_idle()).
+ */
+static void *serve_v1(void *arg){
+    struct v1_session *sp = arg;
+    int fd = sp->fd, turn = 0;
+
+    while((sp->session && !service_draining()) || (sp->tp && sp->status == TRANS_PENDING)){
+        XACTO_PACKET pkt;
+        void *data;
+        int owned;
+        KEY *key = NULL;
+        BLOB *kbp, *value = NULL;
+        int ret, id;
+
+        // Between transactions, once the client has been read from.
+        if(turn && sp->tp == NULL && !proto_buffered(&sp->rio) && proto_queue_backlog(&sp->replies) == 0
+           && await_idle(fd, (tpool_job_t){ serve_v1, sp, end_v1 }))
+            return NULL;
+        if(proto_recv_packet_buffered(&sp->rio, &pkt, &data, &owned)) break;
+        turn = 1;
+        creg_add_bytes(client_registry, fd, sizeof(pkt) + ntohl(pkt.size), 0);
+        // Only a batched request uses the payload of the request packet.
+        if(owned && pkt.type != XACTO_MGET_PKT && pkt.type != XACTO_MPUT_PKT){
+            free(data);
+            data = NULL;
+            owned = 0;
+        }
+        if(pkt.type == XACTO_BEGIN_PKT){
+            debug("[%d] BEGIN packet received", fd);
+            if(sp->tp){
+                creg_release_transaction(client_registry, fd);
+                trans_abort(sp->tp);
+            }
+            sp->tp = NULL;
+            sp->session = 1;
+            if(queue_reply(&sp->replies, pkt.serial, TRANS_PENDING, 0, NULL)) goto disconnect;
+            goto flush;
+        }
+        if(sp->tp == NULL){
+            // In a session, the request after a COMMIT begins a new transaction.
+            if(service_draining() || (sp->tp = admit_trans_create(&sp->rejected)) == NULL){
+                if(owned) free(data);
+                goto disconnect;
+            }
+            sp->status = TRANS_PENDING;
+            sp->why.reason = XACTO_REASON_NONE;
+            if(!sp->rejected) creg_set_transaction(client_registry, fd, sp->tp);
+            debug("[%d] Starting transaction %d%s", fd, sp->tp->id, sp->rejected ? " (not admitted)" : "");
+        }
+        switch(pkt.type){
+        case XACTO_MGET_PKT:
+        case XACTO_MPUT_PKT:
+            debug("[%d] %s packet received", fd, pkt.type == XACTO_MGET_PKT ? "MGET" : "MPUT");
+            ret = batch_reply(&sp->replies, &pkt, data, sp->tp, sp->rejected, &sp->why, &sp->status);
+            if(owned) free(data);
+            if(ret) goto disconnect;
+            break;
+        case XACTO_PUT_PKT:
+            debug("[%d] PUT packet received", fd);
+            if(recv_blob(&sp->rio, XACTO_KEY_PKT, &kbp) || kbp == NULL) goto disconnect;
+            if((key = key_create(kbp)) == NULL){
+                blob_unref(kbp, "");
+                goto disconnect;
+            }
+            if(recv_blob(&sp->rio, XACTO_VALUE_PKT, &value)){
+                key_dispose(key);
+                goto disconnect;
+            }
+            sp->status = store_put(sp->tp, key, value);
+            explain_abort(&sp->why, sp->status, sp->tp->id, sp->rejected, XACTO_REASON_EXPIRED);
+            if(queue_reply(&sp->replies, pkt.serial, sp->status, 0, NULL))
+                goto disconnect;
+            break;
+        case XACTO_GET_PKT:
+            debug("[%d] GET packet received", fd);
+            if(recv_blob(&sp->rio, XACTO_KEY_PKT, &kbp) || kbp == NULL) goto disconnect;
+            if((key = key_create(kbp)) == NULL){
+                blob_unref(kbp, "");
+                goto disconnect;
+            }
+            sp->status = store_get(sp->tp, key, &value);
+            explain_abort(&sp->why, sp->status, sp->tp->id, sp->rejected, XACTO_REASON_EXPIRED);
+            if(queue_reply(&sp->replies, pkt.serial, sp->status, 1, value))
+                goto disconnect;
+            break;
+        case XACTO_COMMIT_PKT:
+            debug("[%d] COMMIT packet received", fd);
+            // Unless it has been aborted for overstaying its lifetime, or was
+            // not admitted.
+            id = sp->tp->id;
+            if(creg_release_transaction(client_registry, fd) == 0){
+                sp->status = admit_commit(sp->tp);
+                explain_abort(&sp->why, sp->status, id, sp->rejected, XACTO_REASON_DEPENDENCY);
+            } else {
+                trans_abort(sp->tp);
+                sp->status = TRANS_ABORTED;
+                explain_abort(&sp->why, sp->status, id, sp->rejected, XACTO_REASON_EXPIRED);
+            }
+            sp->tp = NULL;
+            if(queue_reply(&sp->replies, pkt.serial, sp->status, 0, NULL))
+                goto disconnect;
+            break;
+        default:
+            error("[%d] unexpected packet type %d", fd, pkt.type);
+            goto disconnect;
+        }
+    flush:
+        // Hold the reply back while further pipelined requests are already
+        // buffered, so that the replies to a whole burst go out in one write,
+        // but not so long that they would overflow the backlog.  The check
+        // comes after a reply has been queued, so the backlog may exceed
+        // PROTO_QUEUE_MAX by that one reply (see flow.h).  The requests
+        // taken since the backlog was last empty are in flight: at the cap,
+        // the next one waits until all their replies have gone out.
+        if(++sp->inflight >= max_inflight || !proto_buffered(&sp->rio)
+           || sp->replies.bytes + proto_queue_backlog(&sp->replies) >= PROTO_QUEUE_MAX){
+            if(proto_queue_send(&sp->replies)) goto disconnect;
+            flow_queued(fd, proto_queue_backlog(&sp->replies));
+            if(await_client(&sp->replies, &sp->rio, sp->inflight >= max_inflight)) goto disconnect;
+            if(proto_queue_backlog(&sp->replies) == 0) sp->inflight = 0;
+        }
+    }
+
+disconnect:
+    end_v1(sp);
+    return NULL;
+}
+
+/*
+ * End the service of a client that the pool stopped before it was heard
+ * from.
+ */
+static void end_early(void *arg){
+    struct v1_session *sp = arg;
+
+    timeout_close(sp->fd);
+    creg_unregister(client_registry, sp->fd);
+    close(sp->fd);
+    free(sp);
+}
+
+/*
+ * End the service of a v1 client, whether it has run its course or the
+ * pool stopped while it was parked.
+ */
+static void end_v1(void *arg){
+    struct v1_session *sp = arg;
+    int fd = sp->fd;
+
+    // The transaction is let go of before the last replies are written, so
+    // that a client slow to take them does not keep others waiting on it.
+    if(sp->tp){
+        creg_release_transaction(client_registry, fd);
+        if(sp->status == TRANS_PENDING) trans_abort(sp->tp);
+        else trans_unref(sp->tp, "client service terminating");
+    }
+    proto_queue_flush(&sp->replies);
+    proto_queue_fini(&sp->replies);
+    flow_close(fd);
+    debug("[%d] Ending client service", fd);
+    timeout_close(fd);
+    creg_unregister(client_registry, fd);
+    close(fd);
+    free(sp);
+}
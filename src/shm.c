@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "shm.h"
+#include "debug.h"
+
+enum { SERVER, CLIENT };
+enum { REQUESTS, REPLIES };
+
+/*
+ * Set up one side's view of a mapped region.
+ */
+static SHM_CHAN *chan_init(SHM_REGION *region, int side, int efd, int peer_efd, int sock){
+    SHM_CHAN *ch = calloc(1, sizeof(SHM_CHAN));
+    if(ch == NULL) return NULL;
+    ch->region = region;
+    ch->rx = &region->rings[side == SERVER ? REQUESTS : REPLIES];
+    ch->tx = &region->rings[side == SERVER ? REPLIES : REQUESTS];
+    ch->sleeping = &region->sleeping[side];
+    ch->peer_sleeping = &region->sleeping[!side];
+    ch->efd = efd;
+    ch->peer_efd = peer_efd;
+    ch->sock = sock;
+    ch->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPINS : 0;
+    ch->rx_head = atomic_load(&ch->rx->head);
+    ch->tx_tail = atomic_load(&ch->tx->tail);
+    return ch;
+}
+
+SHM_CHAN *shm_chan_create(int sock){
+    int fds[3] = { -1, -1, -1 };    /* Memfd, server's eventfd, client's eventfd */
+    SHM_REGION *region = MAP_FAILED;
+    SHM_CHAN *ch = NULL;
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { SHM_PREFACE, SHM_PREFACE_LEN };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cm;
+
+    if((fds[0] = memfd_create("xacto-shm", MFD_CLOEXEC)) < 0
+       || ftruncate(fds[0], sizeof(SHM_REGION)) < 0
+       || (fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+       || (fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        goto fail;
+    region = mmap(NULL, sizeof(SHM_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if(region == MAP_FAILED) goto fail;
+    region->magic = SHM_MAGIC;
+    region->ring_size = SHM_RING_SIZE;
+
+    memset(cbuf, 0, sizeof(cbuf));
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if(sendmsg(sock, &msg, MSG_NOSIGNAL) != SHM_PREFACE_LEN) goto fail;
+    if((ch = chan_init(region, SERVER, fds[1], fds[2], sock)) == NULL) goto fail;
+    close(fds[0]);
+    return ch;
+
+fail:
+    error("[%d] could not set up shared-memory channel: %s", sock, strerror(errno));
+    if(region != MAP_FAILED) munmap(region, sizeof(SHM_REGION));
+    for(int i = 0; i < 3; i++)
+        if(fds[i] >= 0) close(fds[i]);
+    return NULL;
+}
+
+/*
+ * Close the descriptors passed with a control message, if it has any: they
+ * are installed on receipt, whether or not the message is wanted.
+ */
+static void close_passed(struct cmsghdr *cm){
+    int fd;
+    if(cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) return;
+    for(size_t i = 0; CMSG_LEN((i + 1) * sizeof(int)) <= cm->cmsg_len; i++){
+        memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+        close(fd);
+    }
+}
+
+SHM_CHAN *shm_chan_connect(int sock){
+    int fds[3] = { -1, -1, -1 };
+    char preface[SHM_PREFACE_LEN] = SHM_PREFACE;
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { preface, SHM_PREFACE_LEN };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cm;
+    SHM_REGION *region = MAP_FAILED;
+    SHM_CHAN *ch = NULL;
+    ssize_t n;
+
+    if(send(sock, preface, SHM_PREFACE_LEN, MSG_NOSIGNAL) != SHM_PREFACE_LEN) return NULL;
+    if((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) return NULL;
+    cm = CMSG_FIRSTHDR(&msg);
+    if(n != SHM_PREFACE_LEN || memcmp(preface, SHM_PREFACE, SHM_PREFACE_LEN)
+       || cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+       || cm->cmsg_len != CMSG_LEN(sizeof(fds))){
+        close_passed(cm);
+        return NULL;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    region = mmap(NULL, sizeof(SHM_REGION), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if(region != MAP_FAILED && region->magic == SHM_MAGIC && region->ring_size == SHM_RING_SIZE)
+        ch = chan_init(region, CLIENT, fds[2], fds[1], sock);
+    if(ch == NULL){
+        if(region != MAP_FAILED) munmap(region, sizeof(SHM_REGION));
+        close(fds[1]);
+        close(fds[2]);
+    }
+    return ch;
+}
+
+void shm_chan_destroy(SHM_CHAN *ch){
+    munmap(ch->region, sizeof(SHM_REGION));
+    close(ch->efd);
+    close(ch->peer_efd);
+    free(ch);
+}
+
+/*
+ * Give up on a channel whose peer has set an index that cannot be right.
+ */
+static size_t chan_broken(SHM_CHAN *ch, uint64_t head, uint64_t tail){
+    if(!ch->broken)
+        error("[%d] shared-memory ring corrupted (head %lu, tail %lu)", ch->sock,
+              (unsigned long)head, (unsigned long)tail);
+    ch->broken = 1;
+    return 0;
+}
+
+size_t shm_readable(SHM_CHAN *ch){
+    uint64_t tail = atomic_load_explicit(&ch->rx->tail, memory_order_acquire);
+    if(ch->broken || tail - ch->rx_head > SHM_RING_SIZE)
+        return chan_broken(ch, ch->rx_head, tail);
+    return tail - ch->rx_head;
+}
+
+size_t shm_writable(SHM_CHAN *ch){
+    uint64_t head = atomic_load_explicit(&ch->tx->head, memory_order_acquire);
+    if(ch->broken || ch->tx_tail - head > SHM_RING_SIZE)
+        return chan_broken(ch, head, ch->tx_tail);
+    return SHM_RING_SIZE - (ch->tx_tail - head);
+}
+
+/*
+ * Wake the peer if it is sleeping.  The fence orders the update of the
+ * ring before the load of the flag; it pairs with the one in shm_wait().
+ */
+static void wake_peer(SHM_CHAN *ch){
+    uint64_t one = 1;
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(ch->peer_sleeping, memory_order_relaxed)
+       && write(ch->peer_efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        debug("could not wake shared-memory peer: %s", strerror(errno));
+}
+
+/*
+ * Copy between a buffer and a ring, which may wrap around.  n is at most
+ * SHM_RING_SIZE.
+ */
+static void ring_copy(SHM_RING *r, uint64_t pos, char *buf, size_t n, int to_ring){
+    size_t off = pos % SHM_RING_SIZE, first = SHM_RING_SIZE - off;
+    if(first > n) first = n;
+    if(to_ring){
+        memcpy(r->data + off, buf, first);
+        memcpy(r->data, buf + first, n - first);
+    } else {
+        memcpy(buf, r->data + off, first);
+        memcpy(buf + first, r->data, n - first);
+    }
+}
+
+size_t shm_read(SHM_CHAN *ch, void *buf, size_t n){
+    size_t avail = shm_readable(ch);
+    if(n > avail) n = avail;
+    if(n == 0) return 0;
+    ring_copy(ch->rx, ch->rx_head, buf, n, 0);
+    ch->rx_head += n;
+    atomic_store_explicit(&ch->rx->head, ch->rx_head, memory_order_release);
+    wake_peer(ch);
+    return n;
+}
+
+size_t shm_write(SHM_CHAN *ch, const void *buf, size_t n){
+    size_t room = shm_writable(ch);
+    if(n > room) n = room;
+    if(n == 0) return 0;
+    ring_copy(ch->tx, ch->tx_tail, (char *)buf, n, 1);
+    ch->tx_tail += n;
+    atomic_store_explicit(&ch->tx->tail, ch->tx_tail, memory_order_release);
+    wake_peer(ch);
+    return n;
+}
+
+static int ready(SHM_CHAN *ch, int events){
+    return ((events & SHM_READABLE) && shm_readable(ch) > 0)
+        || ((events & SHM_WRITABLE) && shm_writable(ch) > 0);
+}
+
+int shm_wait(SHM_CHAN *ch, int events){
+    struct pollfd pfd[2] = { { ch->efd, POLLIN, 0 }, { ch->sock, POLLIN | POLLRDHUP, 0 } };
+    uint64_t count;
+    int ret = 0, n;
+
+    for(int i = 0; i < ch->spins && !ch->broken; i++){
+        if(ready(ch, events)) return 0;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    while(1){
+        atomic_store(ch->sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if(ready(ch, events)) break;
+        if(ch->broken){
+            ret = -1;
+            break;
+        }
+        if((n = poll(pfd, 2, -1)) < 0 && errno != EINTR){
+            ret = -1;
+            break;
+        }
+        if(n > 0 && pfd[1].revents){
+            ret = -1;
+            break;
+        }
+        if(n > 0 && pfd[0].revents && read(ch->efd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+            ret = -1;
+            break;
+        }
+    }
+    atomic_store(ch->sleeping, 0);
+    return ret;
+}
+
+int shm_send(SHM_CHAN *ch, const void *buf, size_t n){
+    while(n > 0){
+        size_t k = shm_write(ch, buf, n);
+        if(k == 0 && shm_wait(ch, SHM_WRITABLE)) return -1;
+        buf = (const char *)buf + k;
+        n -= k;
+    }
+    return 0;
+}
+
+ssize_t shm_recv(SHM_CHAN *ch, void *buf, size_t n){
+    size_t k;
+    while((k = shm_read(ch, buf, n)) == 0){
+        if(shm_wait(ch, SHM_READABLE)) return shm_read(ch, buf, n);
+    }
+    return k;
+}
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+#include "store_batch.h"
+#include "vlist.h"
+#include "admit.h"
+#include "reason.h"
+#include "wrappers.h"
+#include "debug.h"
+
+static char *status_names[] = { "pending", "committed", "aborted" };
+
+/*
+ * A map entry of this store, which keeps the versions of its key in an
+ * array-based list (see vlist.h) rather than the linked list of the
+ * MAP_ENTRY of store.h.  The map is built like the_map, out of these.
+ */
+typedef struct store_entry {
+    KEY *key;
+    VERSION_LIST versions;
+    struct store_entry *next;
+} STORE_ENTRY;
+
+static struct {
+    STORE_ENTRY **table;    // The hash table
+    int num_buckets;        // Size of the table
+    pthread_mutex_t mutex;  // Protects the table and all its entries
+} store_map;
+
+void store_init(void){
+    store_map.num_buckets = NUM_BUCKETS;
+    store_map.table = calloc(NUM_BUCKETS, sizeof(STORE_ENTRY *));
+    pthread_mutex_init(&store_map.mutex, NULL);
+    info("Initialize object store");
+}
+
+
+void store_fini(void){
+    for(int i = 0; i < store_map.num_buckets; i++){
+        STORE_ENTRY *ep = store_map.table[i];
+        while(ep){
+            STORE_ENTRY *next = ep->next;
+            vlist_fini(&ep->versions);
+            key_dispose(ep->key);
+            free(ep);
+            ep = next;
+        }
+    }
+    free(store_map.table);
+    store_map.table = NULL;
+    pthread_mutex_destroy(&store_map.mutex);
+    info("Finalize object store");
+}
+
+/*
+ * Find the map entry for a key, creating it if there is none.
+ * The key is inherited: it is either stored in a new entry or disposed of.
+ * Must be called with the map mutex held.
+ */
+static STORE_ENTRY *find_entry(KEY *key){
+    STORE_ENTRY **bucket = &store_map.table[key->hash % store_map.num_buckets];
+    for(STORE_ENTRY *ep = *bucket; ep; ep = ep->next){
+        if(!key_compare(ep->key, key)){
+            key_dispose(key);
+            return ep;
+        }
+    }
+    STORE_ENTRY *ep = malloc(sizeof(STORE_ENTRY));
+    if(ep == NULL){
+        key_dispose(key);
+        return NULL;
+    }
+    ep->key = key;
+    vlist_init(&ep->versions);
+    ep->next = *bucket;
+    *bucket = ep;
+    return ep;
+}
+
+/*
+ * Garbage-collect the version list of a map entry: drop all but the
+ * last committed version, and drop the first aborted version along with
+ * everything after it, aborting the creators of the dropped versions.
+ * Must be called with the map mutex held.
+ */
+static void garbage_collect(STORE_ENTRY *ep){
+    VERSION_LIST *vl = &ep->versions;
+    int last_committed = -1, first_aborted = vl->count;
+
+    for(int i = 0; i < vl->count; i++){
+        TRANS_STATUS st = trans_get_status(VLIST_AT(vl, i)->creator);
+        if(st == TRANS_ABORTED){
+            first_aborted = i;
+            break;
+        }
+        if(st == TRANS_COMMITTED) last_committed = i;
+    }
+    for(int i = first_aborted + 1; i < vl->count; i++){
+        TRANSACTION *creator = VLIST_AT(vl, i)->creator;
+        if(trans_get_status(creator) == TRANS_PENDING){
+            debug("Aborting transaction %d (follows aborted version)", creator->id);
+            reason_set(creator->id, XACTO_REASON_DEPENDENCY, ep->key->hash);
+            trans_abort(trans_ref(creator, "aborting creator of later version"));
+        }
+    }
+    vlist_remove(vl, first_aborted, vl->count);
+    if(last_committed > 0) vlist_remove(vl, 0, last_committed);
+}
+
+/*
+ * Common part of store_put() and store_get(), for a store that is already
+ * locked.  For a GET, value is ignored and the value read is stored into
+ * *valuep.  The key is inherited; the value is consumed only on success.
+ *
+ * @return  0 if successful, -1 if the transaction must abort.
+ */
+static int store_access_locked(TRANSACTION *tp, KEY *key, BLOB *value, BLOB **valuep){
+    VERSION_LIST *vl;
+    VERSION *last;
+
+    STORE_ENTRY *ep = find_entry(key);
+    if(ep == NULL) return -1;
+    garbage_collect(ep);
+    vl = &ep->versions;
+    last = VLIST_LAST(vl);
+    if(trans_get_status(tp) == TRANS_ABORTED) return -1;
+    if(last && last->creator->id > tp->id){
+        debug("Transaction %d is older than version by %d", tp->id, last->creator->id);
+        reason_set(tp->id, XACTO_REASON_CONFLICT, ep->key->hash);
+        return -1;
+    }
+    for(int i = 0; i < vl->count; i++){
+        TRANSACTION *creator = VLIST_AT(vl, i)->creator;
+        if(creator != tp && trans_get_status(creator) == TRANS_PENDING){
+            trans_add_dependency(tp, creator);
+            admit_dependency(tp, creator);
+        }
+    }
+
+    if(valuep == NULL){
+        if(last && last->creator == tp){
+            if(last->blob) blob_unref(last->blob, "replaced by PUT");
+            last->blob = value;
+        } else if(vlist_append(vl, tp, value)){
+            return -1;
+        }
+    } else {
+        BLOB *bp = last ? last->blob : NULL;
+        if(!(last && last->creator == tp)
+           && vlist_append(vl, tp, bp ? blob_ref(bp, "version created by GET") : NULL)){
+            if(bp) blob_unref(bp, "version created by GET");
+            return -1;
+        }
+        *valuep = bp ? blob_ref(bp, "value returned by GET") : NULL;
+    }
+    return 0;
+}
+
+/*
+ * Abort a transaction after a failed operation, unless it already was.
+ */
+static TRANS_STATUS store_abort(TRANSACTION *tp){
+    if(trans_get_status(tp) == TRANS_ABORTED) return TRANS_ABORTED;
+    return trans_abort(trans_ref(tp, "aborted by store"));
+}
+
+static TRANS_STATUS store_access(TRANSACTION *tp, KEY *key, BLOB *value, BLOB **valuep){
+    pthread_mutex_lock(&store_map.mutex);
+    int ret = store_access_locked(tp, key, value, valuep);
+    pthread_mutex_unlock(&store_map.mutex);
+    if(ret == 0) return trans_get_status(tp);
+    if(value) blob_unref(value, "discarded by aborted operation");
+    return store_abort(tp);
+}
+
+/*
+ * Common part of store_put_many() and store_get_many().  The buckets of
+ * all the keys are prefetched before the operations are performed in order
+ * under a single acquisition of the map mutex, so that the cache misses of
+ * the walk down each bucket overlap instead of being taken one at a time.
+ */
+static TRANS_STATUS store_access_many(TRANSACTION *tp, KEY **keys, BLOB **values, int n, int get){
+    int i = 0;
+
+    for(int j = 0; j < n; j++)
+        __builtin_prefetch(&store_map.table[keys[j]->hash % store_map.num_buckets]);
+    pthread_mutex_lock(&store_map.mutex);
+    for(int j = 0; j < n; j++)
+        __builtin_prefetch(store_map.table[keys[j]->hash % store_map.num_buckets]);
+    for(; i < n; i++){
+        if(get) values[i] = NULL;
+        if(store_access_locked(tp, keys[i], get ? NULL : values[i], get ? &values[i] : NULL))
+            break;
+    }
+    pthread_mutex_unlock(&store_map.mutex);
+    if(i == n) return trans_get_status(tp);
+
+    // The key of the failed operation has been inherited, but not its value.
+    for(int j = i + 1; j < n; j++){
+        key_dispose(keys[j]);
+        if(get) values[j] = NULL;
+    }
+    if(!get){
+        for(int j = i; j < n; j++)
+            if(values[j]) blob_unref(values[j], "discarded by aborted operation");
+    }
+    return store_abort(tp);
+}
+
+
+TRANS_STATUS store_put(TRANSACTION *tp, KEY *key, BLOB *value){
+    return store_access(tp, key, value, NULL);
+}
+
+
+TRANS_STATUS store_get(TRANSACTION *tp, KEY *key, BLOB **valuep){
+    *valuep = NULL;
+    return store_access(tp, key, NULL, valuep);
+}
+
+
+TRANS_STATUS store_put_many(TRANSACTION *tp, KEY **keys, BLOB **values, int n){
+    return store_access_many(tp, keys, values, n, 0);
+}
+
+
+TRANS_STATUS store_get_many(TRANSACTION *tp, KEY **keys, BLOB **values, int n){
+    return store_access_many(tp, keys, values, n, 1);
+}
+
+
+void store_show(void){
+    fprintf(stderr, "CONTENTS OF STORE:\n");
+    for(int i = 0; i < store_map.num_buckets; i++){
+        for(STORE_ENTRY *ep = store_map.table[i]; ep; ep = ep->next){
+            VERSION_LIST *vl = &ep->versions;
+            fprintf(stderr, "%d\t[key %p, hash %d, \"%s\"]:", i, ep->key,
+                    ep->key->hash, ep->key->blob->prefix);
+            for(int j = 0; j < vl->count; j++){
+                VERSION *vp = VLIST_AT(vl, j);
+                fprintf(stderr, " {creator=%d (%s), blob=%p \"%s\"}", vp->creator->id,
+                        status_names[trans_get_status(vp->creator)], vp->blob,
+                        vp->blob ? vp->blob->prefix : "");
+            }
+            fprintf(stderr, "%s\n", vl->heap ? " (heap)" : "");
+        }
+    }
+}
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "timeout.h"
+#include "twheel.h"
+#include "creg_ext.h"
+#include "server.h"
+#include "settings.h"
+#include "debug.h"
+
+static struct {
+    pthread_mutex_t lock;           // Protects the wheel and the timers
+    TWHEEL wheel;
+    TWHEEL_TIMER *timers;           // Indexed by file descriptor
+    int size;
+    long idle_ms, lifetime_ms;      // Zero if disabled
+    struct timespec base;           // When tick 0 was
+    pthread_t tid;
+    atomic_int stopping;
+    atomic_size_t idle;             // Connections shut down for being idle
+    atomic_size_t expired;          // Same, for the age of their transaction
+} tmo;
+
+static uint64_t current_tick(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ts.tv_sec - tmo.base.tv_sec) * 1000L
+            + (ts.tv_nsec - tmo.base.tv_nsec) / 1000000) / TIMEOUT_TICK_MS;
+}
+
+static void start_timer(int fd, long ms){
+    twheel_start(&tmo.wheel, &tmo.timers[fd], tmo.wheel.now + (ms + TIMEOUT_TICK_MS - 1) / TIMEOUT_TICK_MS);
+}
+
+/*
+ * Get the time after which to look at a connection that has just been
+ * active, and has no transaction: soon enough to notice either deadline.
+ * A transaction that starts in between overstays its lifetime by at most
+ * a TIMEOUT_LIFETIME_DIV'th.
+ */
+static long recheck_ms(void){
+    long ms = tmo.lifetime_ms ? tmo.lifetime_ms / TIMEOUT_LIFETIME_DIV : tmo.idle_ms;
+    return tmo.idle_ms && tmo.idle_ms < ms ? tmo.idle_ms : ms;
+}
+
+/*
+ * Check the deadlines of a connection whose timer has expired, and start
+ * the timer again for the nearer one, unless the connection has been idle
+ * for too long, in which case it is shut down.
+ */
+static void check(int fd){
+    CLIENT_INFO ci;
+    long left;
+
+    if(creg_info(client_registry, fd, &ci)) return;
+    if(tmo.lifetime_ms && ci.trans_ms >= tmo.lifetime_ms
+       && creg_abort_transaction(client_registry, fd) == 0){
+        atomic_fetch_add_explicit(&tmo.expired, 1, memory_order_relaxed);
+        info("[%d] Aborted transaction %d, pending for %ld ms", fd, ci.trans_id, ci.trans_ms);
+        ci.trans_ms = -1;
+    }
+    if(tmo.idle_ms && ci.idle_ms >= tmo.idle_ms){
+        atomic_fetch_add_explicit(&tmo.idle, 1, memory_order_relaxed);
+        info("[%d] Closing connection idle for %ld ms", fd, ci.idle_ms);
+        // The transaction goes first, in case the thread serving the
+        // connection is busy elsewhere (waiting in the commit of another).
+        creg_abort_transaction(client_registry, fd);
+        // The connection is still open: it cannot be closed while it is watched.
+        if(shutdown(fd, SHUT_RDWR) < 0 && errno != ENOTCONN)
+            warn("error shutting down fd %d: %s", fd, strerror(errno));
+        return;
+    }
+    left = tmo.idle_ms ? tmo.idle_ms - ci.idle_ms : recheck_ms();
+    if(tmo.lifetime_ms){
+        long trans_left = ci.trans_ms < 0 ? recheck_ms() : tmo.lifetime_ms - ci.trans_ms;
+        if(trans_left < left) left = trans_left;
+    }
+    start_timer(fd, left);
+}
+
+static void *timeout_thread(void *arg){
+    struct timespec ts = { 0, TIMEOUT_TICK_MS * 1000000L };
+    TWHEEL_TIMER expired;
+
+    twheel_timer_init(&expired);
+    while(!atomic_load(&tmo.stopping)){
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&tmo.lock);
+        twheel_advance(&tmo.wheel, current_tick(), &expired);
+        while(twheel_pending(&expired)){
+            TWHEEL_TIMER *t = expired.next;
+            twheel_stop(t);
+            check(t - tmo.timers);
+        }
+        pthread_mutex_unlock(&tmo.lock);
+    }
+    return NULL;
+}
+
+void timeout_init(int idle_secs, int lifetime_secs){
+    struct rlimit rl;
+    sigset_t all, old;
+    int size = 1024;
+
+    if(idle_secs <= 0 && lifetime_secs <= 0) return;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < (1 << 20))
+        size = rl.rlim_cur;
+    if((tmo.timers = calloc(size, sizeof(TWHEEL_TIMER))) == NULL){
+        error("unable to allocate connection timers");
+        return;
+    }
+    for(int fd = 0; fd < size; fd++)
+        twheel_timer_init(&tmo.timers[fd]);
+    tmo.idle_ms = idle_secs > 0 ? idle_secs * 1000L : 0;
+    tmo.lifetime_ms = lifetime_secs > 0 ? lifetime_secs * 1000L : 0;
+    clock_gettime(CLOCK_MONOTONIC, &tmo.base);
+    twheel_init(&tmo.wheel, 0);
+    pthread_mutex_init(&tmo.lock, NULL);
+    atomic_store(&tmo.stopping, 0);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    int err = pthread_create(&tmo.tid, NULL, timeout_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err){
+        error("unable to start timeout thread: %s", strerror(err));
+        pthread_mutex_destroy(&tmo.lock);
+        free(tmo.timers);
+        tmo.timers = NULL;
+        return;
+    }
+    tmo.size = size;
+    info("Timeouts: idle %d s, transaction lifetime %d s", idle_secs, lifetime_secs);
+}
+
+void timeout_fini(void){
+    if(tmo.size == 0) return;
+    atomic_store(&tmo.stopping, 1);
+    pthread_join(tmo.tid, NULL);
+    tmo.size = 0;
+    pthread_mutex_destroy(&tmo.lock);
+    free(tmo.timers);
+    tmo.timers = NULL;
+}
+
+void timeout_open(int fd){
+    if(fd < 0 || fd >= tmo.size) return;
+    pthread_mutex_lock(&tmo.lock);
+    start_timer(fd, recheck_ms());
+    pthread_mutex_unlock(&tmo.lock);
+}
+
+void timeout_close(int fd){
+    if(fd < 0 || fd >= tmo.size) return;
+    pthread_mutex_lock(&tmo.lock);
+    twheel_stop(&tmo.timers[fd]);
+    pthread_mutex_unlock(&tmo.lock);
+}
+
+void timeout_get_counts(size_t *idle, size_t *expired){
+    *idle = atomic_load_explicit(&tmo.idle, memory_order_relaxed);
+    *expired = atomic_load_explicit(&tmo.expired, memory_order_relaxed);
+}
+
+void timeout_show(void){
+    size_t idle, expired;
+    if(tmo.size == 0) return;
+    timeout_get_counts(&idle, &expired);
+    fprintf(stderr, "TIMEOUTS: %zu idle connections closed, %zu transactions expired\n", idle, expired);
+}
@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "tpool.h"
+#include "debug.h"
+
+struct worker_arg {
+    tpool_t *pool;
+    size_t id;
+};
+
+/* Which pool and deque the calling thread works for, if any */
+static __thread tpool_t *my_pool;
+static __thread size_t my_id;
+
+static bool deque_push(tpool_deque_t *dq, tpool_job_t job){
+    bool ok = false;
+    pthread_mutex_lock(&dq->mutex);
+    if(dq->tail - dq->head < TPOOL_DEQUE_SIZE){
+        dq->jobs[dq->tail++ % TPOOL_DEQUE_SIZE] = job;
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return ok;
+}
+
+static bool deque_take(tpool_deque_t *dq, tpool_job_t *job){
+    bool ok = false;
+    pthread_mutex_lock(&dq->mutex);
+    if(dq->head != dq->tail){
+        *job = dq->jobs[dq->head++ % TPOOL_DEQUE_SIZE];
+        ok = true;
+    }
+    pthread_mutex_unlock(&dq->mutex);
+    return ok;
+}
+
+/*
+ * Look for a job: in the worker's own deque, then in the shared queue,
+ * then in the other workers' deques.  The caller is counted as working
+ * before the job stops being counted as queued, so that tpool_wait() never
+ * sees both counts at zero while a job is in transit.
+ */
+static bool find_job(tpool_t *pool, size_t id, tpool_job_t *job){
+    bool found = deque_take(&pool->deques[id], job) || mpmc_try_pop(&pool->inject, job);
+    for(size_t i = 1; !found && i < pool->thread_cnt; i++){
+        if((found = deque_take(&pool->deques[(id + i) % pool->thread_cnt], job)))
+            atomic_fetch_add_explicit(&pool->steals, 1, memory_order_relaxed);
+    }
+    if(found){
+        atomic_fetch_add(&pool->working_cnt, 1);
+        atomic_fetch_sub(&pool->queued, 1);
+    }
+    return found;
+}
+
+static void *tpool_worker(void *vargp){
+    struct worker_arg wa = *(struct worker_arg *)vargp;
+    tpool_t *pool = wa.pool;
+    tpool_job_t job;
+    free(vargp);
+    my_pool = pool;
+    my_id = wa.id;
+
+    while(1){
+        if(!atomic_load(&pool->stop) && find_job(pool, wa.id, &job)){
+            job.func(job.arg);
+            if(atomic_fetch_sub(&pool->working_cnt, 1) == 1 && atomic_load(&pool->queued) <= 0){
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->work_in_progress);
+                pthread_mutex_unlock(&pool->mutex);
+            }
+            continue;
+        }
+        // Counted as idle before looking at the queue, so that a push that
+        // does not see this worker idle is seen by it.
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->idle_cnt, 1);
+        while(!atomic_load(&pool->stop) && atomic_load(&pool->queued) <= 0)
+            pthread_cond_wait(&pool->work_to_be_processed, &pool->mutex);
+        atomic_fetch_sub(&pool->idle_cnt, 1);
+        pthread_mutex_unlock(&pool->mutex);
+        if(atomic_load(&pool->stop)) break;
+    }
+    return NULL;
+}
+
+static void drop_job(tpool_job_t *job){
+    if(job->drop) job->drop(job->arg);
+}
+
+/*
+ * Queue the parked jobs whose file descriptors have become ready, until the
+ * pool stops.
+ */
+static void *tpool_parker(void *vargp){
+    tpool_t *pool = vargp;
+    struct epoll_event events[TPOOL_PARK_EVENTS];
+
+    while(!atomic_load(&pool->stop)){
+        int n = epoll_wait(pool->parkfd, events, TPOOL_PARK_EVENTS, -1);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            error("Thread pool: epoll_wait failed, parked jobs are stuck");
+            break;
+        }
+        for(int i = 0; i < n; i++){
+            tpool_parked_t *pp = events[i].data.ptr;
+            if(pp == NULL) continue; // Woken to stop
+            pthread_mutex_lock(&pool->park_mutex);
+            if(pp->prev) pp->prev->next = pp->next;
+            else pool->parked = pp->next;
+            if(pp->next) pp->next->prev = pp->prev;
+            epoll_ctl(pool->parkfd, EPOLL_CTL_DEL, pp->fd, NULL);
+            pthread_mutex_unlock(&pool->park_mutex);
+            if(!tpool_push_job(pool, pp->job)) drop_job(&pp->job);
+            free(pp);
+        }
+    }
+    return NULL;
+}
+
+tpool_t *tpool_init(size_t num_threads){
+    sigset_t all, old;
+    tpool_t *pool = calloc(1, sizeof(tpool_t));
+    if(pool == NULL) return NULL;
+    pool->parkfd = pool->wakefd = -1;
+    if(num_threads == 0) goto fail;
+    pool->deques = calloc(num_threads, sizeof(tpool_deque_t));
+    pool->threads = calloc(num_threads, sizeof(pthread_t));
+    if(pool->deques == NULL || pool->threads == NULL) goto fail;
+    if(mpmc_init(&pool->inject, TPOOL_QUEUE_SIZE, sizeof(tpool_job_t))) goto fail;
+    if((pool->parkfd = epoll_create1(EPOLL_CLOEXEC)) < 0
+       || (pool->wakefd = eventfd(0, EFD_CLOEXEC)) < 0
+       || epoll_ctl(pool->parkfd, EPOLL_CTL_ADD, pool->wakefd,
+                    &(struct epoll_event){ EPOLLIN, { .ptr = NULL } }))
+        goto fail;
+    for(size_t i = 0; i < num_threads; i++)
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_mutex_init(&pool->park_mutex, NULL);
+    pthread_cond_init(&pool->work_to_be_processed, NULL);
+    pthread_cond_init(&pool->work_in_progress, NULL);
+
+    // Workers inherit a full signal mask, so that signals are handled by
+    // the thread that would join them.
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if(pthread_create(&pool->parker, NULL, tpool_parker, pool) == 0)
+        atomic_store(&pool->parking, true);
+    for(size_t i = 0; atomic_load(&pool->parking) && i < num_threads; i++){
+        struct worker_arg *wa = malloc(sizeof(struct worker_arg));
+        if(wa == NULL) break;
+        wa->pool = pool;
+        wa->id = i;
+        if(pthread_create(&pool->threads[i], NULL, tpool_worker, wa)){
+            free(wa);
+            break;
+        }
+        pool->thread_cnt++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(pool->thread_cnt == 0){
+        tpool_stop(pool);
+        goto fail;
+    }
+    info("Started thread pool with %zu workers", pool->thread_cnt);
+    return pool;
+
+fail:
+    if(pool->parkfd >= 0) close(pool->parkfd);
+    if(pool->wakefd >= 0) close(pool->wakefd);
+    mpmc_fini(&pool->inject);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+    return NULL;
+}
+
+int tpool_pin(tpool_t *pool){
+    cpu_set_t allowed, one;
+    int ncpus, ret = 0;
+
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) || (ncpus = CPU_COUNT(&allowed)) == 0)
+        return -1;
+    for(size_t i = 0; i < pool->thread_cnt; i++){
+        int nth = i % ncpus, cpu = -1;
+        while(nth >= 0)
+            if(CPU_ISSET(++cpu, &allowed)) nth--;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if(pthread_setaffinity_np(pool->threads[i], sizeof(one), &one)) ret = -1;
+    }
+    return ret;
+}
+
+void tpool_stop(tpool_t *pool){
+    tpool_parked_t *pp, *next;
+    tpool_job_t job;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->stop, true);
+    pthread_cond_broadcast(&pool->work_to_be_processed);
+    pthread_cond_broadcast(&pool->work_in_progress);
+    pthread_mutex_unlock(&pool->mutex);
+    mpmc_wake_all(&pool->inject);
+
+    // The parker is stopped before the jobs that it may be queueing are
+    // taken; no job is parked or queued once the pool has stopped.
+    if(atomic_exchange(&pool->parking, false)){
+        if(write(pool->wakefd, &one, sizeof(one)) < 0)
+            error("Thread pool: could not wake the parker");
+        pthread_join(pool->parker, NULL);
+    }
+    while(atomic_load(&pool->pushing) > 0)
+        sched_yield();
+    pthread_mutex_lock(&pool->park_mutex);
+    pp = pool->parked;
+    pool->parked = NULL;
+    pthread_mutex_unlock(&pool->park_mutex);
+    for(; pp; pp = next){
+        next = pp->next;
+        drop_job(&pp->job);
+        free(pp);
+    }
+    for(size_t i = 0; i < pool->thread_cnt; i++){
+        while(deque_take(&pool->deques[i], &job)){
+            atomic_fetch_sub(&pool->queued, 1);
+            drop_job(&job);
+        }
+    }
+    while(mpmc_try_pop(&pool->inject, &job)){
+        atomic_fetch_sub(&pool->queued, 1);
+        drop_job(&job);
+    }
+}
+
+void tpool_destroy(tpool_t *pool){
+    if(pool == NULL) return;
+    tpool_stop(pool);
+    for(size_t i = 0; i < pool->thread_cnt; i++)
+        pthread_join(pool->threads[i], NULL);
+    debug("Thread pool destroyed (%zu jobs stolen)", atomic_load(&pool->steals));
+    for(size_t i = 0; i < pool->thread_cnt; i++)
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_mutex_destroy(&pool->park_mutex);
+    close(pool->parkfd);
+    close(pool->wakefd);
+    pthread_cond_destroy(&pool->work_to_be_processed);
+    pthread_cond_destroy(&pool->work_in_progress);
+    mpmc_fini(&pool->inject);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Count a job just queued, and wake a worker for it if some are asleep.
+ * It is counted only now, so a worker may already have taken it and
+ * briefly made the count negative.
+ */
+static void job_queued(tpool_t *pool){
+    atomic_fetch_add(&pool->queued, 1);
+    if(atomic_load(&pool->idle_cnt) > 0){
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->work_to_be_processed);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+}
+
+bool tpool_push(tpool_t *pool, thread_func_t func, void *arg){
+    return tpool_push_job(pool, (tpool_job_t){ func, arg, NULL });
+}
+
+bool tpool_push_job(tpool_t *pool, tpool_job_t job){
+    bool ok = true;
+
+    // Counted as pushing before looking at stop, so that tpool_stop() waits
+    // for a push that has not seen it to end before dropping what is queued.
+    atomic_fetch_add(&pool->pushing, 1);
+    if(atomic_load(&pool->stop)){
+        ok = false;
+    } else if(my_pool != pool){
+        // Waits on the queue for room, until tpool_stop() ends the wait.
+        ok = mpmc_push_unless(&pool->inject, &job, &pool->stop);
+    } else if(!deque_push(&pool->deques[my_id], job) && !mpmc_try_push(&pool->inject, &job)){
+        ok = false;
+    }
+    if(ok) job_queued(pool);
+    atomic_fetch_sub(&pool->pushing, 1);
+    return ok;
+}
+
+bool tpool_park(tpool_t *pool, int fd, tpool_job_t job){
+    tpool_parked_t *pp = malloc(sizeof(tpool_parked_t));
+    struct epoll_event ev = { EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, { .ptr = pp } };
+    bool ok = false;
+
+    if(pp == NULL) return false;
+    pp->job = job;
+    pp->fd = fd;
+    pp->prev = NULL;
+    // Once watched, the job may be queued and run before this returns.
+    pthread_mutex_lock(&pool->park_mutex);
+    if(!atomic_load(&pool->stop) && atomic_load(&pool->parking)){
+        if((pp->next = pool->parked) != NULL) pp->next->prev = pp;
+        pool->parked = pp;
+        if(epoll_ctl(pool->parkfd, EPOLL_CTL_ADD, fd, &ev) == 0){
+            ok = true;
+        } else if((pool->parked = pp->next) != NULL){
+            pp->next->prev = NULL;
+        }
+    }
+    pthread_mutex_unlock(&pool->park_mutex);
+    if(!ok) free(pp);
+    return ok;
+}
+
+bool tpool_yield(tpool_t *pool, tpool_job_t job){
+    bool ok;
+
+    atomic_fetch_add(&pool->pushing, 1);
+    if((ok = !atomic_load(&pool->stop) && mpmc_try_push(&pool->inject, &job)))
+        job_queued(pool);
+    atomic_fetch_sub(&pool->pushing, 1);
+    return ok;
+}
+
+bool tpool_busy(tpool_t *pool){
+    return atomic_load(&pool->queued) > 0;
+}
+
+void tpool_wait(tpool_t *pool){
+    pthread_mutex_lock(&pool->mutex);
+    while(!atomic_load(&pool->stop)
+          && (atomic_load(&pool->queued) > 0 || atomic_load(&pool->working_cnt)))
+        pthread_cond_wait(&pool->work_in_progress, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,87 @@
+#include "twheel.h"
+
+#define MASK (TWHEEL_SLOTS - 1)
+#define SPAN(level) ((uint64_t)1 << (TWHEEL_BITS * (level)))
+
+static void link_last(TWHEEL_TIMER *head, TWHEEL_TIMER *t){
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+/*
+ * Put a timer in its slot.  Its expiry must not be before the current tick,
+ * which is only the case while cascading, in time for level 0 to be done.
+ */
+static void insert(TWHEEL *w, TWHEEL_TIMER *t){
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+
+    if(delta >= SPAN(TWHEEL_LEVELS)){
+        delta = SPAN(TWHEEL_LEVELS) - 1;
+        t->expires = w->now + delta;
+    }
+    while(delta >= SPAN(level + 1))
+        level++;
+    link_last(&w->slots[level][(t->expires >> (TWHEEL_BITS * level)) & MASK], t);
+}
+
+/*
+ * Move all the timers of a list to the end of another.
+ */
+static void splice(TWHEEL_TIMER *from, TWHEEL_TIMER *to){
+    if(from->next == from) return;
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    twheel_timer_init(from);
+}
+
+void twheel_init(TWHEEL *w, uint64_t now){
+    w->now = now;
+    for(int l = 0; l < TWHEEL_LEVELS; l++)
+        for(int s = 0; s < TWHEEL_SLOTS; s++)
+            twheel_timer_init(&w->slots[l][s]);
+}
+
+void twheel_timer_init(TWHEEL_TIMER *t){
+    t->next = t->prev = t;
+}
+
+int twheel_pending(TWHEEL_TIMER *t){
+    return t->next != t;
+}
+
+void twheel_start(TWHEEL *w, TWHEEL_TIMER *t, uint64_t expires){
+    twheel_stop(t);
+    t->expires = expires > w->now ? expires : w->now + 1;
+    insert(w, t);
+}
+
+void twheel_stop(TWHEEL_TIMER *t){
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    twheel_timer_init(t);
+}
+
+void twheel_advance(TWHEEL *w, uint64_t to, TWHEEL_TIMER *expired){
+    TWHEEL_TIMER list;
+
+    while(w->now < to){
+        w->now++;
+        // At the start of each span of a level, the timers of its slot for
+        // that span are spread over the levels below.
+        for(int l = 1; l < TWHEEL_LEVELS && (w->now & (SPAN(l) - 1)) == 0; l++){
+            twheel_timer_init(&list);
+            splice(&w->slots[l][(w->now >> (TWHEEL_BITS * l)) & MASK], &list);
+            while(list.next != &list){
+                TWHEEL_TIMER *t = list.next;
+                twheel_stop(t);
+                insert(w, t);
+            }
+        }
+        splice(&w->slots[0][w->now & MASK], expired);
+    }
+}
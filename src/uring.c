@@ -0,0 +1,439 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "conn.h"
+#include "commitq.h"
+#include "flow.h"
+#include "server.h"
+#include "creg_ext.h"
+#include "service.h"
+#include "settings.h"
+#include "debug.h"
+
+/*
+ * Completions are matched to their operation by user_data, which holds a
+ * pointer to the connection (NULL for the listening socket and the commit
+ * queue) with the kind of operation in its low bits.
+ */
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL, OP_COMMITS };
+#define OP_MASK 7UL
+#define BUF_GROUP 0
+
+struct uconn {
+    CONN *cp;
+    int recv_armed;         // A multishot receive is outstanding
+    int sending;            // A send is outstanding
+    int cancelling;         // The receive is being cancelled
+    int paused;             // Receiving stopped on a full output buffer
+    int failed;             // The connection is broken; drop pending output
+    CONN_BUF out;           // Replies being sent, taken from the connection
+    struct iovec iov[CONN_SEND_IOV];
+    struct msghdr msg;      // Describes them while a send is outstanding
+};
+
+struct uring {
+    int fd;
+    int listenfd;
+    int single_accept;                  // Multishot accept turned out not to work
+    COMMITQ *commits;                   // Commits of this thread's connections that wait
+    pthread_t tid;
+    unsigned sq_entries;
+    unsigned sq_tail;                   // Local copy, published on submit
+    unsigned *sq_khead, *sq_ktail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_khead, *cq_ktail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_size;
+    struct io_uring_buf_ring *br;       // Receive buffers registered with the kernel
+    char *bufs;
+    unsigned short br_tail;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p){
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args){
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Hand a receive buffer (back) to the kernel.
+ */
+static void uring_buf_put(struct uring *r, unsigned short bid){
+    struct io_uring_buf *b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+    b->addr = (uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_close(struct uring *r){
+    if(r->br) munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+    if(r->sqes) munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    if(r->ring_mem) munmap(r->ring_mem, r->ring_size);
+    if(r->fd >= 0) close(r->fd);
+    free(r->bufs);
+}
+
+/*
+ * Create an io_uring instance, map its rings, and register the receive
+ * buffers.  Fails on kernels without single-mmap rings or buffer rings,
+ * which also lack the multishot operations used below.
+ */
+static int uring_open(struct uring *r){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if((r->fd = sys_setup(URING_ENTRIES, &p)) < 0) return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) goto fail;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    r->ring_mem = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    if(r->ring_mem == MAP_FAILED){
+        r->ring_mem = NULL;
+        goto fail;
+    }
+    r->sq_entries = p.sq_entries;
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED){
+        r->sqes = NULL;
+        goto fail;
+    }
+    char *ring = r->ring_mem;
+    r->sq_khead = (unsigned *)(ring + p.sq_off.head);
+    r->sq_ktail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(ring + p.sq_off.array);
+    r->sq_tail = *r->sq_ktail;
+    r->cq_khead = (unsigned *)(ring + p.cq_off.head);
+    r->cq_ktail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    r->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(r->br == MAP_FAILED){
+        r->br = NULL;
+        goto fail;
+    }
+    if((r->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE)) == NULL) goto fail;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)r->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = BUF_GROUP;
+    if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) goto fail;
+    for(unsigned i = 0; i < URING_BUFS; i++)
+        uring_buf_put(r, i);
+    return 0;
+
+fail:
+    uring_close(r);
+    return -1;
+}
+
+/*
+ * Submit all queued operations and optionally wait for a completion.
+ */
+static int uring_submit(struct uring *r, int wait){
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    unsigned n = r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+    if(n == 0 && !wait) return 0;
+    return sys_enter(r->fd, n, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r, int op, int fd, void *ptr){
+    if(r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) == r->sq_entries)
+        uring_submit(r, 0);
+    if(r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) == r->sq_entries)
+        return NULL;
+    unsigned idx = r->sq_tail++ & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op == OP_ACCEPT ? IORING_OP_ACCEPT : op == OP_RECV ? IORING_OP_RECV
+        : op == OP_SEND ? IORING_OP_SENDMSG : op == OP_COMMITS ? IORING_OP_POLL_ADD : IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)ptr | op;
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+static void uring_accept(struct uring *r){
+    struct io_uring_sqe *sqe = uring_sqe(r, OP_ACCEPT, r->listenfd, NULL);
+    if(sqe == NULL) return;
+    if(!r->single_accept) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/*
+ * Wait for commits handed to the commit queue to complete.
+ */
+static void uring_commits(struct uring *r){
+    struct io_uring_sqe *sqe = uring_sqe(r, OP_COMMITS, commitq_fd(r->commits), NULL);
+    if(sqe == NULL){
+        error("io_uring: cannot wait for commits");
+        return;
+    }
+    sqe->poll32_events = POLLIN;
+}
+
+static void uring_recv(struct uring *r, struct uconn *uc){
+    struct io_uring_sqe *sqe = uring_sqe(r, OP_RECV, uc->cp->fd, uc);
+    if(sqe == NULL){
+        uc->failed = 1;
+        return;
+    }
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    uc->recv_armed = 1;
+}
+
+/*
+ * Stop receiving on a connection whose output buffer is full, by
+ * cancelling its multishot receive; uring_update() arms it again once the
+ * replies have been taken for sending.  While one buffer of replies is
+ * being sent, the connection may fill another, so at most twice
+ * CONN_OUT_MAX bytes are queued.
+ */
+static void uring_pause(struct uring *r, struct uconn *uc){
+    uc->paused = 1;
+    if(uc->recv_armed && !uc->cancelling){
+        struct io_uring_sqe *sqe = uring_sqe(r, OP_CANCEL, -1, NULL);
+        if(sqe) sqe->addr = (uintptr_t)uc | OP_RECV;
+        uc->cancelling = 1;
+    }
+}
+
+/*
+ * Take the pending replies of a connection for sending, unless some are
+ * being sent already.
+ *
+ * @return  The number of bytes to send.
+ */
+static size_t uring_output(struct uconn *uc){
+    if(!uc->sending && conn_buf_pending(&uc->out, NULL, NULL) == 0
+       && conn_pending(uc->cp, NULL, NULL))
+        conn_take_output(uc->cp, &uc->out);
+    return conn_buf_pending(&uc->out, NULL, NULL);
+}
+
+/*
+ * Start whatever a connection needs next: sending its pending replies,
+ * resuming its receive, or, once its service has ended and the replies are
+ * out, cancelling its receive and finally destroying it when no operation
+ * refers to it.
+ */
+static void uring_update(struct uring *r, struct uconn *uc){
+    CONN *cp = uc->cp;
+    size_t len = uring_output(uc);
+
+    if(uc->paused && !uc->recv_armed && !uc->failed && !cp->done && !conn_throttled(cp)){
+        conn_process(cp);
+        if(!conn_throttled(cp) && !cp->done){
+            uc->paused = 0;
+            uring_recv(r, uc);
+        }
+        len = uring_output(uc);
+    }
+    flow_queued(cp->fd, len + conn_pending(cp, NULL, NULL));
+    if(!uc->failed && !uc->sending && len){
+        struct io_uring_sqe *sqe = uring_sqe(r, OP_SEND, cp->fd, uc);
+        if(sqe){
+            int iovcnt = CONN_SEND_IOV;
+            conn_buf_pending(&uc->out, uc->iov, &iovcnt);
+            uc->msg.msg_iov = uc->iov;
+            uc->msg.msg_iovlen = iovcnt;
+            sqe->addr = (uintptr_t)&uc->msg;
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+            uc->sending = 1;
+            return;
+        }
+        uc->failed = 1;
+    }
+    if(uc->failed || (cp->done && !uc->sending && !len)){
+        if(uc->recv_armed && !uc->cancelling){
+            struct io_uring_sqe *sqe = uring_sqe(r, OP_CANCEL, -1, NULL);
+            if(sqe) sqe->addr = (uintptr_t)uc | OP_RECV;
+            uc->cancelling = 1;
+        }
+        if(!uc->recv_armed && !uc->sending && !cp->committing){
+            conn_destroy(cp);
+            conn_buf_free(&uc->out);
+            free(uc);
+        }
+    }
+}
+
+/*
+ * Go on serving the connections whose commits have completed, and wait for
+ * more.
+ */
+static void uring_committed(struct uring *r){
+    TRANS_STATUS status;
+    uint64_t n;
+    CONN *cp;
+    int id;
+
+    if(read(commitq_fd(r->commits), &n, sizeof(n)) < 0 && errno != EAGAIN)
+        error("commit queue: %s", strerror(errno));
+    while((cp = commitq_next(r->commits, &id, &status)) != NULL){
+        conn_committed(cp, id, status);
+        uring_update(r, cp->engine);
+    }
+    uring_commits(r);
+}
+
+static void uring_complete(struct uring *r, struct io_uring_cqe *cqe){
+    struct uconn *uc = (struct uconn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    int res = cqe->res;
+
+    switch(cqe->user_data & OP_MASK){
+    case OP_ACCEPT:
+        if(res >= 0){
+            CONN *cp = conn_create(res);
+            if(cp == NULL || (uc = calloc(1, sizeof(struct uconn))) == NULL){
+                if(cp) conn_destroy(cp);
+                else close(res);
+            } else {
+                uc->cp = cp;
+                cp->commits = r->commits;
+                cp->engine = uc;
+                uring_recv(r, uc);
+                uring_update(r, uc);
+            }
+        } else if(res == -EINVAL){
+            // The listening socket has been shut down to drain, or else the
+            // kernel does not take multishot accepts on it after all.
+            if(service_draining()) return;
+            if(r->single_accept){
+                error("accept: %s", strerror(-res));
+                return;
+            }
+            warn("Multishot accept not supported, accepting one connection at a time");
+            r->single_accept = 1;
+        } else if(res != -EINTR && res != -ECONNABORTED){
+            warn("accept: %s", strerror(-res));
+        }
+        if(!(cqe->flags & IORING_CQE_F_MORE)) uring_accept(r);
+        return;
+    case OP_RECV:
+        uc->recv_armed = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        if(res > 0){
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            char *buf = r->bufs + (size_t)bid * URING_BUF_SIZE;
+            for(size_t off = 0, len; off < (size_t)res; off += len){
+                char *p = conn_rspace(uc->cp, &len);
+                if(p == NULL){
+                    uc->cp->done = 1;
+                    break;
+                }
+                if(len > res - off) len = res - off;
+                memcpy(p, buf + off, len);
+                conn_received(uc->cp, len);
+            }
+            uring_buf_put(r, bid);
+            conn_process(uc->cp);
+            if(conn_throttled(uc->cp)) uring_pause(r, uc);
+        } else if(res != -ENOBUFS && !(res == -ECANCELED && uc->paused)){
+            uc->cp->done = 1;     // EOF, error, or cancelled
+        }
+        if(!uc->recv_armed && uc->paused) uc->cancelling = 0;
+        else if(!uc->recv_armed && !uc->cp->done && !uc->cancelling) uring_recv(r, uc);
+        break;
+    case OP_SEND:
+        uc->sending = 0;
+        if(res > 0){
+            conn_buf_sent(&uc->out, res);
+            creg_add_bytes(client_registry, uc->cp->fd, 0, res);
+        } else if(res != -EINTR && res != -EAGAIN){
+            uc->failed = 1;
+        }
+        break;
+    case OP_COMMITS:
+        uring_committed(r);
+        return;
+    default:
+        return;
+    }
+    uring_update(r, uc);
+}
+
+static void *uring_thread(void *arg){
+    struct uring *r = arg;
+
+    uring_accept(r);
+    uring_commits(r);
+    while(1){
+        if(uring_submit(r, 1) < 0 && errno != EINTR && errno != EBUSY){
+            error("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        unsigned head = *r->cq_khead;
+        unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            __atomic_store_n(r->cq_khead, head + 1, __ATOMIC_RELEASE);
+            uring_complete(r, &cqe);
+        }
+    }
+    return NULL;
+}
+
+int uring_start(int listenfd, int nthreads){
+    sigset_t all, old;
+    int started = 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(int i = 0; i < nthreads; i++){
+        struct uring *r = calloc(1, sizeof(struct uring));
+        if(r == NULL) break;
+        r->fd = -1;
+        r->listenfd = listenfd;
+        if(uring_open(r)){
+            debug("io_uring setup failed: %s", strerror(errno));
+            free(r);
+            break;
+        }
+        if((r->commits = commitq_create()) == NULL){
+            uring_close(r);
+            free(r);
+            break;
+        }
+        if(pthread_create(&r->tid, NULL, uring_thread, r)){
+            commitq_destroy(r->commits);
+            uring_close(r);
+            free(r);
+            break;
+        }
+        pthread_detach(r->tid);
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(started == 0) return -1;
+    info("Started %d io_uring threads", started);
+    return 0;
+}
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "vlist.h"
+#include "debug.h"
+
+void vlist_init(VERSION_LIST *vl){
+    vl->count = 0;
+    vl->capacity = VLIST_INLINE;
+    vl->heap = NULL;
+}
+
+
+void vlist_fini(VERSION_LIST *vl){
+    vlist_remove(vl, 0, vl->count);
+    free(vl->heap);
+    vlist_init(vl);
+}
+
+
+int vlist_append(VERSION_LIST *vl, TRANSACTION *tp, BLOB *bp){
+    if(vl->count == vl->capacity){
+        int capacity = vl->capacity * 2;
+        VERSION *heap = realloc(vl->heap, capacity * sizeof(VERSION));
+        if(heap == NULL) return -1;
+        if(vl->heap == NULL)
+            memcpy(heap, vl->inline_slots, vl->count * sizeof(VERSION));
+        vl->heap = heap;
+        vl->capacity = capacity;
+        debug("version list %p grown to %d slots", vl, capacity);
+    }
+    version_init(VLIST_AT(vl, vl->count), tp, bp);
+    vl->count++;
+    return 0;
+}
+
+
+void vlist_remove(VERSION_LIST *vl, int from, int to){
+    VERSION *slots = VLIST_SLOTS(vl);
+    if(from >= to) return;
+    for(int i = from; i < to; i++)
+        version_fini(&slots[i]);
+    memmove(&slots[from], &slots[to], (vl->count - to) * sizeof(VERSION));
+    vl->count -= to - from;
+
+    /* Go back to the inline slots once they suffice again. */
+    if(vl->heap && vl->count <= VLIST_INLINE){
+        memcpy(vl->inline_slots, vl->heap, vl->count * sizeof(VERSION));
+        free(vl->heap);
+        vl->heap = NULL;
+        vl->capacity = VLIST_INLINE;
+    }
+}
@@ -7,6 +7,7 @@
 #include <sys/wait.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <sys/un.h>
 
 #include "wrappers.h"
 #include "debug.h"
@@ -278,6 +279,8 @@ void rio_readinitb(rio_t *rp, int fd)
 
 /*
  * rio_readnb - Robustly read n bytes (buffered)
+ *    Once the internal buffer is empty, reads of a buffer's worth or more
+ *    go straight into the user buffer instead of through the internal one.
  */
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) 
 {
@@ -286,6 +289,12 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     char *bufp = usrbuf;
     
     while (nleft > 0) {
+        if (rp->rio_cnt <= 0 && nleft >= RIO_BUFSIZE) {
+            if ((nread = rio_readn(rp->rio_fd, bufp, nleft)) < 0)
+                return -1;
+            nleft -= nread;
+            break;
+        }
         if ((nread = rio_read(rp, bufp, nleft)) < 0) 
                 return -1;          /* errno set by read() */ 
         else if (nread == 0)
@@ -296,6 +305,40 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     return (n - nleft);         /* return >= 0 */
 }
 
+/*
+ * rio_fillb - Make at least n (<= RIO_BUFSIZE) unread bytes available
+ *    contiguously at rio_bufptr, without consuming them.  Unread bytes are
+ *    moved to the front of the internal buffer and each read() asks for
+ *    as much as will fit, so one call may pick up many small messages.
+ *    Returns the number of unread bytes, which is less than n only at EOF.
+ */
+ssize_t rio_fillb(rio_t *rp, size_t n)
+{
+    ssize_t nread;
+
+    if (rp->rio_cnt >= n)
+        return rp->rio_cnt;
+    if (rp->rio_cnt <= 0)
+        rp->rio_cnt = 0;
+    if (rp->rio_bufptr + n > rp->rio_buf + RIO_BUFSIZE) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    while (rp->rio_cnt < n) {
+        char *end = rp->rio_bufptr + rp->rio_cnt;
+        if ((nread = read(rp->rio_fd, end, rp->rio_buf + RIO_BUFSIZE - end)) < 0) {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;
+        }
+        else if (nread == 0)    /* EOF */
+            break;
+        else
+            rp->rio_cnt += nread;
+    }
+    debug("buffered %d/%ld bytes", rp->rio_cnt, n);
+    return rp->rio_cnt;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
@@ -640,7 +683,12 @@ void V(sem_t *sem)
 
 void Sem_getvalue(struct mac_sema *sem, int *val)
 {
-    if()
+#ifdef __APPLE__
+    *val = -1;  /* dispatch semaphores cannot be inspected */
+#else
+    if (sem_getvalue(&sem->sem, val) < 0)
+	unix_error("Sem_getvalue error");
+#endif
 }
 
 /******************************** 
@@ -700,7 +748,7 @@ int open_clientfd(char *hostname, char *port) {
  *       -2 for getaddrinfo error
  *       -1 with errno set for other errors.
  */
-int open_listenfd(char *port) 
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -724,6 +772,13 @@ int open_listenfd(char *port)
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
 
+        /* Share the port with other sockets that also set SO_REUSEPORT */
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
+
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break; /* Success */
@@ -746,6 +801,48 @@ int open_listenfd(char *port)
     return listenfd;
 }
 
+int open_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but with SO_REUSEPORT set,
+ *     so that several sockets can listen on the same port, each with its
+ *     own accept queue, and the kernel spreads connections among them.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+/*
+ * open_unix_listenfd - Open and return a listening Unix domain socket at
+ *     path, replacing any socket left there.  Returns -1 with errno set
+ *     on error.
+ */
+int open_unix_listenfd(char *path)
+{
+    struct sockaddr_un addr;
+    int listenfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (bind(listenfd, (SA *)&addr, sizeof(addr)) < 0 || listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
  ****************************************************/
@@ -767,4 +864,22 @@ int Open_listenfd(char *port)
     if ((rc = open_listenfd(port)) < 0)
 	unix_error("Open_listenfd error");
     return rc;
+}
+
+int Open_reuseport_listenfd(char *port)
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
+int Open_unix_listenfd(char *path)
+{
+    int rc;
+
+    if ((rc = open_unix_listenfd(path)) < 0)
+	unix_error("Open_unix_listenfd error");
+    return rc;
 }
\ No newline at end of file
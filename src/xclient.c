@@ -0,0 +1,600 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/tcp.h>
+
+#include "xclient.h"
+#include "protocol.h"
+#include "proto2.h"
+#include "proto_batch.h"
+#include "proto_session.h"
+#include "proto_status.h"
+#include "transaction.h"
+#include "shm.h"
+#include "lz.h"
+#include "settings.h"
+#include "wrappers.h"
+
+typedef struct xc_buf {
+    char *data;
+    size_t start, end, size;
+} XC_BUF;
+
+/*
+ * A request waiting for its reply.
+ */
+typedef struct xc_call {
+    uint32_t serial;
+    XC_CALLBACK *cb;
+    void *arg;
+} XC_CALL;
+
+struct xc_conn {
+    int fd;
+    SHM_CHAN *shm;              // Shared-memory channel, if any
+    int failed;
+    int preface;                // Whether the server's preface has arrived
+    int dirty;                  // Requests made since the last COMMIT or BEGIN
+    int dispatching;            // Inside a callback: do not send
+    uint32_t serial;
+    unsigned int seed;          // For backoff delays
+    XACTO_ABORT_INFO abort;     // Explanation of the last abort
+    size_t need;                // Bytes needed to complete the next reply
+    XC_BUF in, out;
+    XC_CALL *calls;             // Unanswered requests, oldest first (circular)
+    size_t first, ncalls, maxcalls;
+    XC_CONN *next;              // In the free list of a pool
+};
+
+struct xc_pool {
+    char *host, *port;
+    int flags;
+    int size, open;             // Connections allowed, established
+    XC_CONN *free;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * Make room for n more bytes at the end of a buffer.
+ */
+static int buf_reserve(XC_BUF *b, size_t n){
+    if(b->start == b->end) b->start = b->end = 0;
+    if(b->size - b->end >= n) return 0;
+    if(b->start > 0){
+        memmove(b->data, b->data + b->start, b->end - b->start);
+        b->end -= b->start;
+        b->start = 0;
+        if(b->size - b->end >= n) return 0;
+    }
+    size_t size = b->size ? b->size : XC_READ_SIZE;
+    while(size - b->end < n) size *= 2;
+    char *data = realloc(b->data, size);
+    if(data == NULL) return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+/*
+ * Give up on a connection, telling the callers of unanswered requests.
+ */
+static int conn_fail(XC_CONN *c){
+    c->failed = 1;
+    c->dispatching++;
+    while(c->ncalls > 0){
+        XC_CALL call = c->calls[c->first];
+        c->first = (c->first + 1) % c->maxcalls;
+        c->ncalls--;
+        if(call.cb) call.cb(call.arg, XC_ERROR, NULL, 0);
+    }
+    c->dispatching--;
+    return XC_ERROR;
+}
+
+/*
+ * Transfers that do not wait.
+ *
+ * @return  The number of bytes transferred, possibly 0, or -1 if the
+ *   connection has failed or ended.
+ */
+static ssize_t conn_send(XC_CONN *c, char *p, size_t n){
+    if(c->shm) return shm_write(c->shm, p, n);
+    ssize_t k = send(c->fd, p, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    return k;
+}
+
+static ssize_t conn_recv(XC_CONN *c, char *p, size_t n){
+    if(c->shm) return shm_read(c->shm, p, n);
+    ssize_t k = recv(c->fd, p, n, MSG_DONTWAIT);
+    if(k < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    return k > 0 ? k : -1;
+}
+
+/*
+ * Wait until a reply can be read, or a request written if sending is set.
+ *
+ * @return  0 if so, -1 if the connection has ended.
+ */
+static int conn_poll(XC_CONN *c, int sending){
+    if(c->shm) return shm_wait(c->shm, SHM_READABLE | (sending ? SHM_WRITABLE : 0));
+    struct pollfd pfd = { c->fd, POLLIN | (sending ? POLLOUT : 0), 0 };
+    while(poll(&pfd, 1, -1) < 0)
+        if(errno != EINTR) return -1;
+    return 0;
+}
+
+/*
+ * Call the callback of a request with its reply.
+ */
+static int deliver(XC_CALL *call, PROTO2_REPLY *r, char *value){
+    char *raw = NULL;
+    size_t size = r->vlen;
+
+    if(call->cb == NULL) return 0;
+    if(value && (r->flags & PROTO2_F_LZ)){
+        if((raw = malloc(r->rawlen ? r->rawlen : 1)) == NULL
+           || lz_decompress(value, r->vlen, raw, r->rawlen) != r->rawlen){
+            free(raw);
+            return -1;
+        }
+        value = raw;
+        size = r->rawlen;
+    }
+    call->cb(call->arg, r->status, value, size);
+    free(raw);
+    return 0;
+}
+
+/*
+ * Process all complete replies in the input buffer.
+ *
+ * @return  0 if successful, -1 if the server sent something invalid.
+ */
+static int dispatch(XC_CONN *c){
+    while(c->in.end > c->in.start){
+        char *p = c->in.data + c->in.start, *value;
+        size_t have = c->in.end - c->in.start, len;
+        PROTO2_REPLY r;
+        uint8_t opts;
+        int k;
+
+        if(!c->preface){
+            if(have < PROTO2_PREFACE_LEN) break;
+            if(proto2_detect(p, have, &opts) != 1) return -1;
+            c->in.start += PROTO2_PREFACE_LEN;
+            c->preface = 1;
+            continue;
+        }
+        if((k = proto2_frame(p, have, &len)) < 0) return -1;
+        if(k == 0 || have < k + len){
+            c->need = k ? k + len : have + 1;
+            break;
+        }
+        if(proto2_parse_reply(p + k, len, &r, &value) || c->ncalls == 0
+           || r.serial != c->calls[c->first].serial)
+            return -1;
+        if(r.flags & PROTO2_F_REASON){
+            c->abort.reason = r.reason;
+            c->abort.retry_us = r.retry_us;
+            c->abort.key_hash = r.key_hash;
+        }
+        XC_CALL call = c->calls[c->first];
+        c->first = (c->first + 1) % c->maxcalls;
+        c->ncalls--;
+        c->in.start += k + len;
+        // The callback may queue requests, but not read, so the value
+        // stays where it is in the input buffer.
+        c->dispatching++;
+        k = deliver(&call, &r, value);
+        c->dispatching--;
+        if(k) return -1;
+    }
+    c->need = 0;
+    return 0;
+}
+
+/*
+ * Send all queued requests, processing replies as they arrive, and go on
+ * reading until at most n requests remain unanswered.
+ */
+static int pump(XC_CONN *c, size_t n){
+    while(!c->failed){
+        size_t pending = c->out.end - c->out.start;
+        int progress = 0;
+        ssize_t k;
+
+        if(pending > 0){
+            if((k = conn_send(c, c->out.data + c->out.start, pending)) < 0) return conn_fail(c);
+            c->out.start += k;
+            pending -= k;
+            progress |= k > 0;
+        }
+        if(c->ncalls > 0 || !c->preface){
+            size_t room = c->need > c->in.end - c->in.start ? c->need - (c->in.end - c->in.start) : 0;
+            if(buf_reserve(&c->in, room > XC_READ_SIZE ? room : XC_READ_SIZE)) return conn_fail(c);
+            if((k = conn_recv(c, c->in.data + c->in.end, c->in.size - c->in.end)) < 0)
+                return conn_fail(c);
+            c->in.end += k;
+            progress |= k > 0;
+            if(k > 0 && dispatch(c)) return conn_fail(c);
+        }
+        if(pending == 0 && c->ncalls <= n) return 0;
+        // A channel may still hold replies when its socket reports the end.
+        if(!progress && conn_poll(c, pending > 0)
+           && (c->shm == NULL || shm_readable(c->shm) == 0))
+            return conn_fail(c);
+    }
+    return XC_ERROR;
+}
+
+/*
+ * Queue a request whose body after the head takes klen + vlen bytes, and
+ * return where to put them.
+ */
+static char *request(XC_CONN *c, uint8_t op, uint8_t flags, size_t klen, size_t vlen,
+                     XC_CALLBACK *cb, void *arg){
+    PROTO2_REQ req = { op, flags, ++c->serial, NULL, klen, NULL, vlen };
+
+    if(c->failed) return NULL;
+    if(c->ncalls == c->maxcalls){
+        size_t max = c->maxcalls ? 2 * c->maxcalls : 64;
+        XC_CALL *calls = malloc(max * sizeof(XC_CALL));
+        if(calls == NULL) return NULL;
+        for(size_t i = 0; i < c->ncalls; i++)
+            calls[i] = c->calls[(c->first + i) % c->maxcalls];
+        free(c->calls);
+        c->calls = calls;
+        c->first = 0;
+        c->maxcalls = max;
+    }
+    if(buf_reserve(&c->out, PROTO2_HEAD_MAX + klen + vlen)) return NULL;
+    c->out.end += proto2_request_head(c->out.data + c->out.end, &req);
+    char *p = c->out.data + c->out.end;
+    c->out.end += klen + vlen;
+    c->calls[(c->first + c->ncalls++) % c->maxcalls] = (XC_CALL){ req.serial, cb, arg };
+    c->dirty = !(op == XACTO_COMMIT_PKT || op == XACTO_BEGIN_PKT);
+    return p;
+}
+
+/*
+ * Send the queued requests once there are enough of them.
+ */
+static int queued(XC_CONN *c){
+    if(c->out.end - c->out.start < XC_FLUSH_SIZE || c->dispatching) return 0;
+    return pump(c, c->ncalls) ? XC_ERROR : 0;
+}
+
+static int connect_unix(const char *path){
+    struct sockaddr_un addr;
+    int fd;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if(connect(fd, (SA *)&addr, sizeof(addr)) < 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+XC_CONN *xc_connect(const char *host, const char *port, int flags){
+    int fd = host ? open_clientfd((char *)host, (char *)port) : connect_unix(port), one = 1;
+    XC_CONN *c;
+
+    if(fd < 0) return NULL;
+    if((c = calloc(1, sizeof(XC_CONN))) == NULL){
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->seed = time(NULL) ^ (fd << 16) ^ (uintptr_t)c;
+    if(host) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(host == NULL && (flags & XC_SHM) && (c->shm = shm_chan_connect(fd)) == NULL){
+        xc_close(c);
+        return NULL;
+    }
+    // The preface and a BEGIN, which makes the connection a session, go
+    // out with the first requests.
+    if(buf_reserve(&c->out, PROTO2_PREFACE_LEN)){
+        xc_close(c);
+        return NULL;
+    }
+    proto2_preface(c->out.data, PROTO2_OPT_REASON | PROTO2_OPT_OVERLOAD
+                                | ((flags & XC_LZ) ? PROTO2_OPT_LZ : 0));
+    c->out.end = PROTO2_PREFACE_LEN;
+    if(xc_begin_async(c, NULL, NULL)){
+        xc_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+void xc_close(XC_CONN *c){
+    if(c->shm) shm_chan_destroy(c->shm);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    free(c->calls);
+    free(c);
+}
+
+int xc_put_async(XC_CONN *c, const void *key, size_t klen, const void *value, size_t vlen,
+                 XC_CALLBACK *cb, void *arg){
+    char *p = request(c, XACTO_PUT_PKT, value ? 0 : PROTO2_F_NULL, klen, value ? vlen : 0, cb, arg);
+    if(p == NULL) return XC_ERROR;
+    memcpy(p, key, klen);
+    if(value) memcpy(p + klen, value, vlen);
+    return queued(c);
+}
+
+int xc_get_async(XC_CONN *c, const void *key, size_t klen, XC_CALLBACK *cb, void *arg){
+    char *p = request(c, XACTO_GET_PKT, 0, klen, 0, cb, arg);
+    if(p == NULL) return XC_ERROR;
+    memcpy(p, key, klen);
+    return queued(c);
+}
+
+/*
+ * Queue a batched request: n keys, and values if values is not NULL.
+ */
+static int batch(XC_CONN *c, uint8_t op, int n, const void **keys, const size_t *klens,
+                 const void **values, const size_t *vlens, XC_CALLBACK *cb, void *arg){
+    size_t size = sizeof(uint32_t);
+    char *p;
+
+    for(int i = 0; i < n; i++){
+        size += sizeof(uint32_t) + klens[i];
+        if(values) size += sizeof(uint32_t) + (values[i] ? vlens[i] : 0);
+    }
+    if((p = request(c, op, 0, 0, size, cb, arg)) == NULL) return XC_ERROR;
+    p = proto_batch_put_count(p, n);
+    for(int i = 0; i < n; i++){
+        p = proto_batch_put(p, keys[i], klens[i]);
+        if(values) p = proto_batch_put(p, values[i], values[i] ? vlens[i] : 0);
+    }
+    return queued(c);
+}
+
+int xc_mput_async(XC_CONN *c, int n, const void **keys, const size_t *klens,
+                  const void **values, const size_t *vlens, XC_CALLBACK *cb, void *arg){
+    return batch(c, XACTO_MPUT_PKT, n, keys, klens, values, vlens, cb, arg);
+}
+
+int xc_mget_async(XC_CONN *c, int n, const void **keys, const size_t *klens,
+                  XC_CALLBACK *cb, void *arg){
+    return batch(c, XACTO_MGET_PKT, n, keys, klens, NULL, NULL, cb, arg);
+}
+
+int xc_commit_async(XC_CONN *c, XC_CALLBACK *cb, void *arg){
+    return request(c, XACTO_COMMIT_PKT, 0, 0, 0, cb, arg) ? queued(c) : XC_ERROR;
+}
+
+int xc_begin_async(XC_CONN *c, XC_CALLBACK *cb, void *arg){
+    return request(c, XACTO_BEGIN_PKT, 0, 0, 0, cb, arg) ? queued(c) : XC_ERROR;
+}
+
+int xc_wait(XC_CONN *c, int n){
+    if(c->dispatching) return XC_ERROR;
+    return pump(c, n);
+}
+
+/*
+ * Result of a synchronous request, filled in by its callback.
+ */
+typedef struct result {
+    int status;
+    int batch;                  // Whether the value is a framed batch payload
+    int n;                      // Values wanted: 1 for GET, the count for MGET
+    char **values;
+    size_t *sizes;
+} RESULT;
+
+/*
+ * Copy a value, with a null byte after it, so that text can be used as
+ * a string.
+ */
+static char *copy_value(const char *value, size_t size){
+    char *copy = malloc(size + 1);
+    if(copy == NULL) return NULL;
+    memcpy(copy, value, size);
+    copy[size] = '\0';
+    return copy;
+}
+
+/*
+ * Copy the value, or the n values, of a reply.
+ */
+static int copy_values(RESULT *r, char *value, size_t size){
+    PROTO_BATCH b;
+    char *item;
+
+    if(!r->batch){
+        if((r->values[0] = copy_value(value, size)) == NULL) return -1;
+        r->sizes[0] = size;
+        return 0;
+    }
+    if(proto_batch_open(&b, value, size, 1) || b.count != r->n) return -1;
+    for(int i = 0; i < r->n; i++){
+        if(proto_batch_next(&b, &item, &r->sizes[i])) return -1;
+        if(item == NULL){
+            r->sizes[i] = 0;
+        } else if((r->values[i] = copy_value(item, r->sizes[i])) == NULL){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void result(void *arg, int status, char *value, size_t size){
+    RESULT *r = arg;
+
+    r->status = status;
+    for(int i = 0; i < r->n; i++){
+        r->values[i] = NULL;
+        r->sizes[i] = 0;
+    }
+    if(value == NULL || r->n == 0 || copy_values(r, value, size) == 0) return;
+    for(int i = 0; i < r->n; i++){
+        free(r->values[i]);
+        r->values[i] = NULL;
+    }
+    r->status = XC_ERROR;
+}
+
+static int sync_status(XC_CONN *c, RESULT *r, int queued){
+    if(queued || xc_wait(c, 0)) return XC_ERROR;
+    return r->status;
+}
+
+int xc_put(XC_CONN *c, const void *key, size_t klen, const void *value, size_t vlen){
+    RESULT r = { XC_ERROR };
+    return sync_status(c, &r, xc_put_async(c, key, klen, value, vlen, result, &r));
+}
+
+int xc_get(XC_CONN *c, const void *key, size_t klen, char **valuep, size_t *sizep){
+    RESULT r = { XC_ERROR, 0, 1, valuep, sizep };
+    return sync_status(c, &r, xc_get_async(c, key, klen, result, &r));
+}
+
+int xc_mput(XC_CONN *c, int n, const void **keys, const size_t *klens,
+            const void **values, const size_t *vlens){
+    RESULT r = { XC_ERROR };
+    return sync_status(c, &r, xc_mput_async(c, n, keys, klens, values, vlens, result, &r));
+}
+
+int xc_mget(XC_CONN *c, int n, const void **keys, const size_t *klens,
+            char **values, size_t *sizes){
+    RESULT r = { XC_ERROR, 1, n, values, sizes };
+    return sync_status(c, &r, xc_mget_async(c, n, keys, klens, result, &r));
+}
+
+int xc_commit(XC_CONN *c){
+    RESULT r = { XC_ERROR };
+    return sync_status(c, &r, xc_commit_async(c, result, &r));
+}
+
+int xc_begin(XC_CONN *c){
+    RESULT r = { XC_ERROR };
+    return sync_status(c, &r, xc_begin_async(c, result, &r));
+}
+
+/*
+ * Sleep before retrying an aborted transaction: a random time between half
+ * and all of a delay that doubles with each attempt, so that transactions
+ * that conflicted do not collide again in lockstep.  The delay is at least
+ * the one the server suggested with the abort.
+ */
+static void backoff(XC_CONN *c, int attempt){
+    long max = XC_BACKOFF_MIN_US;
+    while(--attempt > 0 && max < XC_BACKOFF_MAX_US) max *= 2;
+    if(max > XC_BACKOFF_MAX_US) max = XC_BACKOFF_MAX_US;
+    if(c->abort.retry_us > max) max = c->abort.retry_us;
+    long us = max / 2 + rand_r(&c->seed) % (max / 2 + 1);
+    struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+    nanosleep(&ts, NULL);
+}
+
+int xc_abort_reason(XC_CONN *c, uint32_t *retry_usp, uint32_t *key_hashp){
+    if(retry_usp) *retry_usp = c->abort.retry_us;
+    if(key_hashp) *key_hashp = c->abort.key_hash;
+    return c->abort.reason;
+}
+
+int xc_run(XC_CONN *c, XC_TXN *fn, void *arg, int tries){
+    int status = TRANS_ABORTED;
+
+    for(int i = 0; tries <= 0 || i < tries; i++){
+        if(i > 0) backoff(c, i);
+        // A transaction left open, or aborted, is abandoned for a new one.
+        if(c->dirty && xc_begin_async(c, NULL, NULL)) return XC_ERROR;
+        if((status = fn(c, arg)) == TRANS_PENDING) status = xc_commit(c);
+        if(status != TRANS_ABORTED && status != XACTO_OVERLOADED) return status;
+    }
+    return status;
+}
+
+XC_POOL *xc_pool_create(const char *host, const char *port, int flags, int size){
+    XC_POOL *p = calloc(1, sizeof(XC_POOL));
+    if(p == NULL) return NULL;
+    if((host && (p->host = strdup(host)) == NULL) || (p->port = strdup(port)) == NULL){
+        free(p->host);
+        free(p);
+        return NULL;
+    }
+    p->flags = flags;
+    p->size = size;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    return p;
+}
+
+void xc_pool_destroy(XC_POOL *p){
+    XC_CONN *c;
+    while((c = p->free) != NULL){
+        p->free = c->next;
+        xc_close(c);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p->host);
+    free(p->port);
+    free(p);
+}
+
+XC_CONN *xc_pool_get(XC_POOL *p){
+    XC_CONN *c;
+
+    pthread_mutex_lock(&p->lock);
+    while(p->free == NULL && p->open == p->size)
+        pthread_cond_wait(&p->cond, &p->lock);
+    if((c = p->free) != NULL){
+        p->free = c->next;
+        pthread_mutex_unlock(&p->lock);
+        return c;
+    }
+    p->open++;
+    pthread_mutex_unlock(&p->lock);
+    // Connect without holding the lock, so others can still take and return.
+    if((c = xc_connect(p->host, p->port, p->flags)) == NULL){
+        pthread_mutex_lock(&p->lock);
+        p->open--;
+        pthread_cond_signal(&p->cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return c;
+}
+
+void xc_pool_put(XC_POOL *p, XC_CONN *c){
+    if(!c->failed && (xc_wait(c, 0) || (c->dirty && xc_begin(c) != TRANS_PENDING)))
+        c->failed = 1;
+    pthread_mutex_lock(&p->lock);
+    if(c->failed){
+        xc_close(c);
+        p->open--;
+    } else {
+        c->next = p->free;
+        p->free = c;
+    }
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int xc_pool_run(XC_POOL *p, XC_TXN *fn, void *arg, int tries){
+    XC_CONN *c = xc_pool_get(p);
+    if(c == NULL) return XC_ERROR;
+    int status = xc_run(c, fn, arg, tries);
+    xc_pool_put(p, c);
+    return status;
+}
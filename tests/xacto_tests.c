@@ -4,13 +4,46 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <string.h>
+#include <time.h>
 #include <wait.h>
 
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
 
 #include "client_registry.h"
+#include "creg_ext.h"
 #include "data.h"
+#include "blob_ext.h"
+#include "dedup.h"
+#include "compress.h"
+#include "lz.h"
+#include "vlist.h"
+#include "transaction.h"
+#include "store.h"
+#include "batch.h"
+#include "proto_batch.h"
+#include "proto2.h"
+#include "proto_session.h"
+#include "shm.h"
+#include "conn.h"
+#include "flow.h"
+#include "twheel.h"
+#include "admit.h"
+#include "proto_status.h"
+#include "reason.h"
+#include "commitq.h"
+#include "uring.h"
+#include "evloop.h"
+#include "proto_queue.h"
+#include "server.h"
+#include "service.h"
+#include "xclient.h"
+#include "tpool.h"
+#include "mpmc.h"
+#include "wrappers.h"
 
 static void init() {
 #ifndef NO_SERVER
@@ -180,4 +213,1170 @@ Test(student_suite, 04_creg, .timeout = 5, .disabled = true){
 //     BLOB *blob = blob_create("sadlfkm", 8);
 //     blob_ref(blob, "");
 //     blob_ref(blob, "");
-// }
\ No newline at end of file
+// }
+Test(student_suite, 06_dedup, .timeout = 5){
+    char value[128];
+    memset(value, 'x', sizeof(value));
+    dedup_init(64);
+    BLOB *b1 = blob_create(value, sizeof(value));
+    BLOB *b2 = blob_create(value, sizeof(value));
+    BLOB *small1 = blob_create(value, 8);
+    BLOB *small2 = blob_create(value, 8);
+    cr_assert_eq(b1, b2, "Equal values above the threshold were not shared");
+    cr_assert_neq(small1, small2, "Values below the threshold were shared");
+    cr_assert_eq(b1->refcnt, 2);
+
+    DEDUP_STATS s;
+    dedup_get_stats(&s);
+    cr_assert_eq(s.hits, 1);
+    cr_assert_eq(s.bytes_saved, sizeof(value));
+    cr_assert_eq(s.live_blobs, 1);
+
+    // A blob of eligible size that is not in the table is freed as usual.
+    BLOB_EXT *ep = malloc(sizeof(BLOB_EXT));
+    cr_assert_eq(blob_init(&ep->blob, value, sizeof(value)), 0);
+    blob_unref(&ep->blob, "");
+    dedup_get_stats(&s);
+    cr_assert_eq(s.live_blobs, 1);
+
+    blob_unref(b1, "");
+    blob_unref(b2, "");
+    blob_unref(small1, "");
+    blob_unref(small2, "");
+    dedup_get_stats(&s);
+    cr_assert_eq(s.live_blobs, 0);
+    cr_assert_eq(s.live_bytes, 0);
+    dedup_fini();
+}
+
+Test(student_suite, 07_compress, .timeout = 5){
+    char value[4096], out[4096];
+    for(int i = 0; i < sizeof(value); i++)
+        value[i] = "{\"status\": \"ok\", \"count\": 0}"[i % 29];
+    char *z = malloc(sizeof(value));
+    size_t zsize = lz_compress(value, sizeof(value), z, sizeof(value));
+    cr_assert_neq(zsize, 0, "Repetitive value did not compress");
+    cr_assert_lt(zsize, sizeof(value) / 4);
+    cr_assert_eq(lz_decompress(z, zsize, out, sizeof(out)), sizeof(value));
+    cr_assert_arr_eq(out, value, sizeof(value));
+    free(z);
+
+    compress_init(1024);
+    BLOB *bp = blob_create(value, sizeof(value));
+    cr_assert_eq(bp->size, sizeof(value));
+    char *data = blob_data(bp);
+    cr_assert_neq(data, bp->content, "Blob was not stored compressed");
+    cr_assert_arr_eq(data, value, sizeof(value));
+    blob_data_release(bp, data);
+    blob_unref(bp, "");
+    compress_fini();
+}
+
+Test(student_suite, 08_vlist, .timeout = 5){
+    trans_init();
+    VERSION_LIST vl;
+    TRANSACTION *tps[5];
+    vlist_init(&vl);
+    for(int i = 0; i < 5; i++){
+        tps[i] = trans_create();
+        cr_assert_eq(vlist_append(&vl, tps[i], blob_create("v", 1)), 0);
+    }
+    cr_assert_eq(vl.count, 5);
+    cr_assert_not_null(vl.heap, "Five versions should not fit inline");
+    for(int i = 0; i < 5; i++)
+        cr_assert_eq(VLIST_AT(&vl, i)->creator, tps[i]);
+
+    vlist_remove(&vl, 1, 4);
+    cr_assert_eq(vl.count, 2);
+    cr_assert_null(vl.heap, "Two versions should be back inline");
+    cr_assert_eq(VLIST_AT(&vl, 0)->creator, tps[0]);
+    cr_assert_eq(VLIST_AT(&vl, 1)->creator, tps[4]);
+
+    vlist_fini(&vl);
+    for(int i = 0; i < 5; i++)
+        trans_abort(tps[i]);
+    trans_fini();
+}
+
+static atomic_int tpool_count, tpool_refused;
+static tpool_t *test_pool;
+
+static void *count_job(void *arg){
+    atomic_fetch_add(&tpool_count, 1);
+    return NULL;
+}
+
+static void *spawn_job(void *arg){
+    // Jobs pushed by a worker go to its own deque, to be stolen by the others.
+    for(int i = 0; i < 50; i++)
+        if(!tpool_push(test_pool, count_job, NULL))
+            atomic_fetch_add(&tpool_refused, 1);
+    return NULL;
+}
+
+Test(student_suite, 09_tpool, .timeout = 5){
+    atomic_store(&tpool_count, 0);
+    test_pool = tpool_init(4);
+    cr_assert_not_null(test_pool);
+    for(int i = 0; i < 10; i++)
+        cr_assert(tpool_push(test_pool, spawn_job, NULL));
+    tpool_wait(test_pool);
+    cr_assert_eq(atomic_load(&tpool_refused), 0);
+    cr_assert_eq(atomic_load(&tpool_count), 10 * 50);
+    tpool_destroy(test_pool);
+}
+
+/*
+ * Connection handoff test: producers stand in for acceptors and consumers
+ * for workers, handing over ints through a small queue.  The timings are
+ * taken by bin/xacto_handoff.
+ */
+static MPMC_QUEUE handoff_q;
+static atomic_long handoff_sum;
+
+static void *mpmc_producer(void *arg){
+    for(int i = 1; i <= HANDOFF_ITEMS; i++)
+        mpmc_push(&handoff_q, &i);
+    return NULL;
+}
+
+static atomic_bool handoff_cancel;
+
+static void *mpmc_canceled(void *arg){
+    int item = 0;
+    return mpmc_push_unless(&handoff_q, &item, &handoff_cancel) ? arg : NULL;
+}
+
+static void *mpmc_consumer(void *arg){
+    long sum = 0;
+    for(int i = 0, item; i < HANDOFF_ITEMS; i++){
+        mpmc_pop(&handoff_q, &item);
+        sum += item;
+    }
+    atomic_fetch_add(&handoff_sum, sum);
+    return NULL;
+}
+
+Test(student_suite, 10_mpmc, .timeout = 30){
+    pthread_t tids[2 * HANDOFF_THREADS];
+    int item;
+    cr_assert_eq(mpmc_init(&handoff_q, 3, sizeof(int)), 0);
+    for(int i = 0; i < 4; i++)
+        cr_assert(mpmc_try_push(&handoff_q, &i));
+    cr_assert_not(mpmc_try_push(&handoff_q, &item), "Capacity should round up to 4");
+
+    // A push waiting on the full queue gives up once canceled and woken.
+    void *ret;
+    pthread_t tid;
+    atomic_store(&handoff_cancel, false);
+    pthread_create(&tid, NULL, mpmc_canceled, &tid);
+    usleep(100000);
+    atomic_store(&handoff_cancel, true);
+    mpmc_wake_all(&handoff_q);
+    pthread_join(tid, &ret);
+    cr_assert_null(ret, "Push went through a full queue");
+    for(int i = 0; i < 4; i++){
+        cr_assert(mpmc_try_pop(&handoff_q, &item));
+        cr_assert_eq(item, i);
+    }
+    cr_assert_not(mpmc_try_pop(&handoff_q, &item));
+    mpmc_fini(&handoff_q);
+
+    // Producers and consumers at once, blocking on a full or empty queue.
+    mpmc_init(&handoff_q, 64, sizeof(int));
+    atomic_store(&handoff_sum, 0);
+    for(int i = 0; i < HANDOFF_THREADS; i++){
+        pthread_create(&tids[2 * i], NULL, mpmc_producer, NULL);
+        pthread_create(&tids[2 * i + 1], NULL, mpmc_consumer, NULL);
+    }
+    for(int i = 0; i < 2 * HANDOFF_THREADS; i++)
+        pthread_join(tids[i], NULL);
+    mpmc_fini(&handoff_q);
+    cr_assert_eq(atomic_load(&handoff_sum),
+                 (long)HANDOFF_THREADS * HANDOFF_ITEMS * (HANDOFF_ITEMS + 1) / 2,
+                 "Items were lost or duplicated");
+}
+
+Test(student_suite, 11_blob_adopt, .timeout = 5){
+    size_t size = 200000;
+    char *content = malloc(size);
+    memset(content, 'v', size);
+    BLOB *bp = blob_adopt(content, size);
+    cr_assert_not_null(bp);
+    cr_assert_eq(bp->content, content, "Adopted content was copied");
+    cr_assert_eq(bp->size, size);
+    cr_assert_eq(bp->refcnt, 1);
+    cr_assert_str_eq(bp->prefix, "vvvvvvvvvv");
+    BLOB *copy = blob_create(content, size);
+    cr_assert_eq(blob_compare(bp, copy), 0);
+    blob_unref(copy, "");
+    blob_unref(bp, "");
+}
+
+Test(student_suite, 12_batch, .timeout = 5){
+    char mput[256], mget[256], *p, *item;
+    char *keys[] = { "alpha", "beta", "gamma" }, *vals[] = { "1", NULL, "333" };
+    XACTO_PACKET pkt;
+    TRANS_STATUS status;
+    PROTO_BATCH b;
+    size_t size, len;
+    trans_init();
+    store_init();
+
+    p = proto_batch_put_count(mput, 3);
+    for(int i = 0; i < 3; i++){
+        p = proto_batch_put(p, keys[i], strlen(keys[i]));
+        p = proto_batch_put(p, vals[i], vals[i] ? strlen(vals[i]) : 0);
+    }
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.type = XACTO_MPUT_PKT;
+    pkt.size = htonl(p - mput);
+    TRANSACTION *tp = trans_create();
+    cr_assert_eq(batch_execute(tp, &pkt, mput, &status, &p, &size), 0);
+    cr_assert_eq(status, TRANS_PENDING);
+    cr_assert_null(p, "MPUT returned values");
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED);
+
+    p = proto_batch_put_count(mget, 4);
+    for(int i = 0; i < 3; i++)
+        p = proto_batch_put(p, keys[i], strlen(keys[i]));
+    p = proto_batch_put(p, "delta", 5);
+    pkt.type = XACTO_MGET_PKT;
+    pkt.size = htonl(p - mget);
+    tp = trans_create();
+    cr_assert_eq(batch_execute(tp, &pkt, mget, &status, &p, &size), 0);
+    cr_assert_eq(status, TRANS_PENDING);
+    cr_assert_eq(proto_batch_open(&b, p, size, 1), 0);
+    cr_assert_eq(b.count, 4);
+    for(int i = 0; i < 4; i++){
+        cr_assert_eq(proto_batch_next(&b, &item, &len), 0);
+        if(i < 3 && vals[i]){
+            cr_assert_eq(len, strlen(vals[i]));
+            cr_assert_arr_eq(item, vals[i], len);
+        } else {
+            cr_assert_null(item, "Value %d should be null", i);
+        }
+    }
+    cr_assert_neq(proto_batch_next(&b, &item, &len), 0, "Values past the count");
+    free(p);
+    trans_commit(tp);
+
+    // Values too large for one reply abort the transaction instead.
+    size_t big = PROTO_BATCH_REPLY_MAX / 2;
+    char *bval = malloc(big), *bput = malloc(5 * sizeof(uint32_t) + 2 * (big + 4)), *bget;
+    cr_assert(bval && bput);
+    memset(bval, 'b', big);
+    p = proto_batch_put_count(bput, 2);
+    p = proto_batch_put(proto_batch_put(p, "big1", 4), bval, big);
+    p = proto_batch_put(proto_batch_put(p, "big2", 4), bval, big);
+    pkt.type = XACTO_MPUT_PKT;
+    pkt.size = htonl(p - bput);
+    tp = trans_create();
+    cr_assert_eq(batch_execute(tp, &pkt, bput, &status, &p, &size), 0);
+    cr_assert_eq(trans_commit(tp), TRANS_COMMITTED);
+    free(bput);
+    free(bval);
+    p = proto_batch_put_count(mget, 2);
+    p = proto_batch_put(proto_batch_put(p, "big1", 4), "big2", 4);
+    pkt.type = XACTO_MGET_PKT;
+    pkt.size = htonl(p - mget);
+    tp = trans_create();
+    cr_assert_eq(batch_execute(tp, &pkt, mget, &status, &bget, &size), 0);
+    cr_assert_eq(status, TRANS_ABORTED, "Oversized MGET was answered");
+    cr_assert_eq(trans_get_status(tp), TRANS_ABORTED);
+    cr_assert_eq(size, sizeof(uint32_t) + 2 * proto_batch_item_size(0));
+    cr_assert_eq(proto_batch_open(&b, bget, size, 1), 0);
+    for(int i = 0; i < 2; i++){
+        cr_assert_eq(proto_batch_next(&b, &item, &len), 0);
+        cr_assert_null(item);
+    }
+    XACTO_ABORT_INFO why = { XACTO_REASON_NONE, 0, 0 };
+    reason_explain(&why, tp->id, XACTO_REASON_EXPIRED);
+    cr_assert_eq(why.reason, XACTO_REASON_TOO_LARGE);
+    free(bget);
+    trans_unref(tp, "");
+
+    // A count the payload cannot hold is rejected before anything is done.
+    proto_batch_put_count(mget, 1000);
+    pkt.size = htonl(sizeof(uint32_t) + 5);
+    tp = trans_create();
+    cr_assert_neq(batch_execute(tp, &pkt, mget, &status, &p, &size), 0);
+    trans_abort(tp);
+    store_fini();
+    trans_fini();
+}
+
+Test(student_suite, 13_proto2, .timeout = 5){
+    char buf[PROTO2_HEAD_MAX + 16], body[32];
+    uint64_t v;
+    uint8_t opts;
+    size_t len;
+    uint64_t samples[] = { 0, 1, 127, 128, 300, 0x100000, UINT32_MAX, UINT64_MAX };
+    for(int i = 0; i < sizeof(samples) / sizeof(samples[0]); i++){
+        int n = proto2_put_varint(buf, samples[i]);
+        cr_assert_eq(proto2_get_varint(buf, n, &v), n);
+        cr_assert_eq(v, samples[i]);
+        cr_assert_eq(proto2_get_varint(buf, n - 1, &v), 0, "Truncated varint was accepted");
+    }
+    memset(buf, 0xff, PROTO2_VARINT_MAX - 1);
+    buf[PROTO2_VARINT_MAX - 1] = 0x02;
+    cr_assert_eq(proto2_get_varint(buf, PROTO2_VARINT_MAX, &v), -1, "Varint past 64 bits was accepted");
+
+    cr_assert_eq(proto2_detect("\x01", 1, &opts), 0, "v1 packet taken for v2");
+    cr_assert_eq(proto2_detect("\0X", 2, &opts), -1);
+    cr_assert_eq(proto2_detect("\0Y2\1", 4, &opts), -2);
+    cr_assert_eq(proto2_detect("\0X2\3", 4, &opts), 1);
+    cr_assert_eq(opts, PROTO2_OPT_TS | PROTO2_OPT_LZ);
+
+    // PUT of "key" -> "value", serial 300: 1 + 2 + 1 + 3 + 5 bytes of body.
+    PROTO2_REQ req;
+    memcpy(body, "\x01\xac\x02\x03keyvalue", 12);
+    cr_assert_eq(proto2_parse(body, 12, &req), 0);
+    cr_assert_eq(req.op, XACTO_PUT_PKT);
+    cr_assert_eq(req.serial, 300);
+    cr_assert_eq(req.klen, 3);
+    cr_assert_arr_eq(req.key, "key", 3);
+    cr_assert_eq(req.vlen, 5);
+    cr_assert_arr_eq(req.value, "value", 5);
+    body[3] = 20;
+    cr_assert_neq(proto2_parse(body, 12, &req), 0, "Key past the end of the frame was accepted");
+
+    PROTO2_REPLY r = { TRANS_COMMITTED, PROTO2_F_VALUE, 5, 4, 0 };
+    size_t n = proto2_reply_head(buf, &r);
+    cr_assert_eq(n, 3, "Reply head is %zu bytes", n);
+    cr_assert_eq(proto2_frame(buf, n, &len), 1);
+    cr_assert_eq(len, 2 + 4);
+    cr_assert_eq((uint8_t)buf[1], TRANS_COMMITTED | PROTO2_F_VALUE);
+}
+
+/*
+ * Server side of the shared-memory test: check the bytes sent through the
+ * request ring, then send them back and hang up.
+ */
+#define SHM_TEST_BYTES (3 * SHM_RING_SIZE + 123)
+
+static void *shm_echo(void *arg){
+    SHM_CHAN *ch = arg;
+    static char buf[4096];
+    size_t got = 0, sent = 0;
+    ssize_t n;
+    while(got < SHM_TEST_BYTES && (n = shm_recv(ch, buf, sizeof(buf))) > 0){
+        for(ssize_t i = 0; i < n; i++)
+            if(buf[i] != (char)((got + i) % 251)) return (void *)1;
+        got += n;
+    }
+    while(sent < got){
+        size_t k = got - sent < sizeof(buf) ? got - sent : sizeof(buf);
+        for(size_t i = 0; i < k; i++) buf[i] = (char)((sent + i) % 251);
+        if(shm_send(ch, buf, k)) return (void *)1;
+        sent += k;
+    }
+    close(ch->sock);
+    return got == SHM_TEST_BYTES ? NULL : (void *)1;
+}
+
+Test(student_suite, 14_shm, .timeout = 5){
+    int sv[2];
+    char buf[1000];
+    size_t total = 0;
+    ssize_t n;
+    void *ret;
+    pthread_t tid;
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    SHM_CHAN *server = shm_chan_create(sv[0]);
+    cr_assert_not_null(server);
+    SHM_CHAN *client = shm_chan_connect(sv[1]);
+    cr_assert_not_null(client);
+    cr_assert_eq(read(sv[0], buf, SHM_PREFACE_LEN), SHM_PREFACE_LEN, "No preface from the client");
+    pthread_create(&tid, NULL, shm_echo, server);
+
+    // Several times the size of a ring, in odd chunks, so that both wrap.
+    while(total < SHM_TEST_BYTES){
+        size_t k = SHM_TEST_BYTES - total < sizeof(buf) ? SHM_TEST_BYTES - total : sizeof(buf);
+        for(size_t i = 0; i < k; i++) buf[i] = (char)((total + i) % 251);
+        cr_assert_eq(shm_send(client, buf, k), 0);
+        total += k;
+    }
+    total = 0;
+    while((n = shm_recv(client, buf, sizeof(buf))) > 0){
+        for(ssize_t i = 0; i < n; i++)
+            cr_assert_eq(buf[i], (char)((total + i) % 251), "Byte %zu is wrong", total + i);
+        total += n;
+    }
+    cr_assert_eq(total, SHM_TEST_BYTES, "Received %zu bytes before the hangup", total);
+    pthread_join(tid, &ret);
+    cr_assert_null(ret, "Server side saw wrong bytes");
+
+    // Indices that put more than a ring's worth, or less than nothing, in a
+    // ring break the channel instead of being followed out of it.
+    atomic_store(&client->tx->tail, server->rx_head + SHM_RING_SIZE + 1);
+    cr_assert_eq(shm_readable(server), 0, "Overfull ring was read");
+    cr_assert_eq(shm_read(server, buf, sizeof(buf)), 0);
+    cr_assert_eq(shm_wait(server, SHM_READABLE), -1);
+    atomic_store(&server->rx->head, client->tx_tail + 1);
+    cr_assert_eq(shm_writable(client), 0, "Ring consumed past its end was written");
+    cr_assert_eq(shm_write(client, buf, 1), 0);
+    shm_chan_destroy(server);
+    shm_chan_destroy(client);
+    close(sv[1]);
+
+    // Descriptors passed along with a wrong preface are not kept.
+    int fds[3], lowest;
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = { "bogus", SHM_PREFACE_LEN };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = cbuf, .msg_controllen = sizeof(cbuf) };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    close(lowest = dup(0));
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    fds[0] = fds[1] = fds[2] = 0;
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    cr_assert_eq(sendmsg(sv[0], &msg, 0), SHM_PREFACE_LEN);
+    cr_assert_null(shm_chan_connect(sv[1]));
+    cr_assert_eq(n = dup(0), lowest, "Passed descriptors were leaked");
+    close(n);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Client library test: a server thread serves one connection on a Unix
+ * domain socket, and the client runs pipelined, batched and retried
+ * transactions over it.
+ */
+#define XC_TEST_SOCKET "xclient_test.sock"
+#define XC_TEST_PUTS 1000
+
+static void *xc_serve_one(void *arg){
+    int *connfd = malloc(sizeof(int));
+    *connfd = accept(*(int *)arg, NULL, NULL);
+    return xacto_client_service(connfd);
+}
+
+static void xc_count(void *arg, int status, char *value, size_t size){
+    if(status == TRANS_PENDING) (*(int *)arg)++;
+}
+
+static int xc_aborts_once(XC_CONN *c, void *arg){
+    if((*(int *)arg)++ == 0) return TRANS_ABORTED;
+    return xc_put(c, "retried", 7, "yes", 3);
+}
+
+Test(student_suite, 15_xclient, .timeout = 10){
+    const void *keys[] = { "k1", "k2" }, *vals[] = { "v1", NULL };
+    size_t klens[] = { 2, 2 }, vlens[] = { 2, 0 }, sizes[2], size;
+    char key[16], *values[2], *value;
+    int listenfd, replies = 0, calls = 0;
+    pthread_t tid;
+
+    trans_init();
+    store_init();
+    client_registry = creg_init();
+    cr_assert((listenfd = open_unix_listenfd(XC_TEST_SOCKET)) >= 0);
+    pthread_create(&tid, NULL, xc_serve_one, &listenfd);
+    XC_CONN *c = xc_connect(NULL, XC_TEST_SOCKET, 0);
+    cr_assert_not_null(c);
+
+    for(int i = 0; i < XC_TEST_PUTS; i++){
+        int n = sprintf(key, "p%d", i);
+        cr_assert_eq(xc_put_async(c, key, n, key, n, xc_count, &replies), 0);
+    }
+    cr_assert_eq(xc_wait(c, 0), 0);
+    cr_assert_eq(replies, XC_TEST_PUTS, "%d of %d pipelined PUTs answered", replies, XC_TEST_PUTS);
+    cr_assert_eq(xc_mput(c, 2, keys, klens, vals, vlens), TRANS_PENDING);
+    cr_assert_eq(xc_commit(c), TRANS_COMMITTED);
+
+    // The next transaction goes on on the same connection.
+    cr_assert_eq(xc_get(c, "p7", 2, &value, &size), TRANS_PENDING);
+    cr_assert_eq(size, 2);
+    cr_assert_arr_eq(value, "p7", 2);
+    free(value);
+    cr_assert_eq(xc_mget(c, 2, keys, klens, values, sizes), TRANS_PENDING);
+    cr_assert_eq(sizes[0], 2);
+    cr_assert_arr_eq(values[0], "v1", 2);
+    cr_assert_null(values[1]);
+    free(values[0]);
+    cr_assert_eq(xc_commit(c), TRANS_COMMITTED);
+
+    cr_assert_eq(xc_run(c, xc_aborts_once, &calls, 3), TRANS_COMMITTED);
+    cr_assert_eq(calls, 2, "Aborted transaction was not retried");
+
+    xc_close(c);
+    pthread_join(tid, NULL);
+    close(listenfd);
+    unlink(XC_TEST_SOCKET);
+    creg_fini(client_registry);
+    store_fini();
+    trans_fini();
+}
+
+/*
+ * Flow control test: a client pipelines GETs of a large value and reads
+ * none of the replies.  The connection must stop executing requests once
+ * its output buffer is full, and go on as the replies are taken.
+ */
+#define FLOW_TEST_VALUE (32 * 1024)
+#define FLOW_TEST_GETS 16
+
+static void flow_feed(CONN *cp, uint8_t type, const void *data, size_t size){
+    XACTO_PACKET pkt;
+    size_t len;
+    proto_init_header(&pkt, type, 0);
+    pkt.size = htonl(size);
+    for(size_t off = 0, n = sizeof(pkt) + size; off < n; off += len){
+        char *p = conn_rspace(cp, &len);
+        cr_assert_not_null(p);
+        if(len > n - off) len = n - off;
+        for(size_t i = 0; i < len; i++)
+            p[i] = off + i < sizeof(pkt) ? ((char *)&pkt)[off + i] : ((char *)data)[off + i - sizeof(pkt)];
+        conn_received(cp, len);
+    }
+}
+
+/*
+ * Server state for the tests that drive connections directly: the
+ * transaction manager, the store and the client registry, set up for each
+ * test and torn down after it along with the client ends of the
+ * connections it made.
+ */
+#define CONN_TEST_PEERS 4
+
+static int conn_test_peers[CONN_TEST_PEERS];
+static int conn_test_npeers;
+
+static void server_state_init(void){
+    trans_init();
+    store_init();
+    client_registry = creg_init();
+    conn_test_npeers = 0;
+}
+
+static void server_state_fini(void){
+    while(conn_test_npeers > 0)
+        close(conn_test_peers[--conn_test_npeers]);
+    creg_fini(client_registry);
+    store_fini();
+    trans_fini();
+}
+
+/*
+ * Serve a new connection over a socketpair, whose client end is left
+ * for server_state_fini() to close.
+ */
+static CONN *conn_test_create(void){
+    int sv[2];
+    cr_assert_lt(conn_test_npeers, CONN_TEST_PEERS);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    conn_test_peers[conn_test_npeers++] = sv[1];
+    CONN *cp = conn_create(sv[0]);
+    cr_assert_not_null(cp);
+    return cp;
+}
+
+Test(student_suite, 16_flow, .init = server_state_init, .fini = server_state_fini, .timeout = 5){
+    static char value[FLOW_TEST_VALUE];
+    size_t total = 0, len;
+    struct iovec iov[4];
+    int iovcnt = 4;
+    FLOW_STATS s;
+
+    flow_init();
+    CONN *cp = conn_test_create();
+    int fd = cp->fd;
+
+    memset(value, 'v', sizeof(value));
+    flow_feed(cp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(cp, XACTO_KEY_PKT, "flow", 4);
+    flow_feed(cp, XACTO_VALUE_PKT, value, sizeof(value));
+    for(int i = 0; i < FLOW_TEST_GETS; i++){
+        flow_feed(cp, XACTO_GET_PKT, NULL, 0);
+        flow_feed(cp, XACTO_KEY_PKT, "flow", 4);
+    }
+    flow_feed(cp, XACTO_COMMIT_PKT, NULL, 0);
+
+    cr_assert_eq(conn_process(cp), 0, "Service ended with its output buffer full");
+    cr_assert(conn_throttled(cp), "Output buffer did not fill up");
+    len = conn_pending(cp, iov, &iovcnt);
+    cr_assert_lt(len, CONN_OUT_MAX + FLOW_TEST_VALUE + 2 * sizeof(XACTO_PACKET),
+                 "%zu bytes queued for a client that reads nothing", len);
+    // The values go out of the stored blob, between the packet headers.
+    cr_assert_eq(iovcnt, 4);
+    cr_assert_eq(iov[0].iov_len, 3 * sizeof(XACTO_PACKET));
+    cr_assert_eq(iov[1].iov_len, FLOW_TEST_VALUE);
+    cr_assert_eq(iov[2].iov_base, (char *)iov[0].iov_base + iov[0].iov_len);
+    cr_assert_eq(iov[3].iov_base, iov[1].iov_base, "Value was copied");
+    cr_assert_eq(cp->status, TRANS_PENDING);
+    flow_queued(fd, len);
+    cr_assert_eq(flow_get(fd, &s), 0);
+    cr_assert_eq(s.queued, len);
+    cr_assert_eq(s.stalls, 1);
+
+    // As the client takes its replies, the rest of the requests are executed.
+    do {
+        len = conn_pending(cp, NULL, NULL);
+        total += len;
+        conn_sent(cp, len);
+    } while(conn_process(cp) == 0 || conn_pending(cp, NULL, NULL));
+    cr_assert_eq(cp->status, TRANS_COMMITTED);
+    cr_assert_eq(total, (2 + 2 * FLOW_TEST_GETS) * sizeof(XACTO_PACKET) + FLOW_TEST_GETS * sizeof(value),
+                 "%zu bytes of replies", total);
+    conn_destroy(cp);
+    cr_assert_neq(flow_get(fd, &s), 0, "Closed connection is still tracked");
+}
+
+/*
+ * Client registry test: metadata of registered clients, a descriptor far
+ * from the others, and a drain that must block until the last client is
+ * gone.
+ */
+static volatile int creg_drained;
+
+static void *creg_drain(void *arg){
+    creg_wait_for_empty(arg);
+    creg_drained = 1;
+    return NULL;
+}
+
+Test(student_suite, 17_creg, .timeout = 5){
+    CLIENT_REGISTRY *cr = creg_init();
+    struct rlimit rl;
+    CLIENT_INFO ci;
+    pthread_t tid;
+    char c;
+    int sv[2], hi;
+
+    trans_init();
+    TRANSACTION *tp = trans_create();
+    cr_assert_not_null(cr);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(creg_register(cr, sv[0]), 0);
+    cr_assert_eq(creg_register(cr, sv[0]), -1, "Registered the same fd twice");
+    cr_assert_eq(creg_info(cr, sv[0], &ci), 0);
+    cr_assert_str_eq(ci.peer, "local");
+    cr_assert_eq(ci.trans_id, -1);
+    creg_set_transaction(cr, sv[0], tp);
+    creg_add_bytes(cr, sv[0], 10, 20);
+    creg_add_bytes(cr, sv[0], 1, 0);
+    cr_assert_eq(creg_info(cr, sv[0], &ci), 0);
+    cr_assert_eq(ci.trans_id, tp->id);
+    cr_assert_eq(ci.bytes_in, 11);
+    cr_assert_eq(ci.bytes_out, 20);
+    cr_assert_eq(creg_release_transaction(cr, sv[0]), 0);
+    cr_assert_eq(creg_release_transaction(cr, sv[0]), -1, "Released a transaction twice");
+    trans_abort(tp);
+
+    // A descriptor in a chunk of its own.
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if(rl.rlim_cur < 4096 && rl.rlim_max >= 4096){
+        rl.rlim_cur = 4096;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    cr_assert((hi = dup2(sv[0], rl.rlim_cur > 4096 ? 4000 : rl.rlim_cur - 1)) > sv[0]);
+    cr_assert_eq(creg_register(cr, hi), 0);
+    cr_assert_eq(creg_count(cr), 2);
+    cr_assert_eq(creg_info(cr, hi, &ci), 0);
+    cr_assert_eq(ci.bytes_in, 0, "Entry of a new client was not cleared");
+    cr_assert_eq(creg_unregister(cr, sv[1]), -1, "Unregistered an unknown fd");
+
+    pthread_create(&tid, NULL, creg_drain, cr);
+    creg_shutdown_all(cr);
+    cr_assert_eq(read(sv[1], &c, 1), 0, "Connection was not shut down");
+    cr_assert_eq(creg_unregister(cr, sv[0]), 0);
+    usleep(100000);
+    cr_assert_eq(creg_drained, 0, "Drain returned with a client left");
+    cr_assert_eq(creg_unregister(cr, hi), 0);
+    pthread_join(tid, NULL);
+    cr_assert_eq(creg_drained, 1);
+    cr_assert_eq(creg_info(cr, hi, &ci), -1);
+    close(hi);
+    close(sv[0]);
+    close(sv[1]);
+    creg_fini(cr);
+    trans_fini();
+}
+
+/*
+ * Drain test: once draining, an idle session is shut down, while a session
+ * with a transaction in progress is left to commit it, and then ends.
+ */
+Test(student_suite, 18_drain, .init = server_state_init, .fini = server_state_fini, .timeout = 5){
+    struct timespec deadline;
+    char c;
+
+    CONN *bp = conn_test_create(), *ip = conn_test_create();
+
+    flow_feed(bp, XACTO_BEGIN_PKT, NULL, 0);
+    flow_feed(bp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(bp, XACTO_KEY_PKT, "drain", 5);
+    flow_feed(bp, XACTO_VALUE_PKT, "v", 1);
+    cr_assert_eq(conn_process(bp), 0);
+    flow_feed(ip, XACTO_BEGIN_PKT, NULL, 0);
+    cr_assert_eq(conn_process(ip), 0);
+
+    service_drain();
+    creg_shutdown_idle(client_registry);
+    cr_assert_eq(read(ip->fd, &c, 1), 0, "Idle session was not shut down");
+    fcntl(bp->fd, F_SETFL, O_NONBLOCK);
+    cr_assert_eq(read(bp->fd, &c, 1), -1, "Session with a transaction was shut down");
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 50000000;
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    cr_assert_eq(creg_wait_for_empty_until(client_registry, &deadline), -1);
+
+    flow_feed(bp, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(conn_process(bp), -1, "Session went on while draining");
+    cr_assert_eq(bp->status, TRANS_COMMITTED);
+    conn_destroy(bp);
+    conn_destroy(ip);
+    cr_assert_eq(creg_wait_for_empty_until(client_registry, &deadline), 0);
+}
+
+/*
+ * Timeout test: timers spread over all the levels of a timing wheel expire
+ * at their own tick, and a transaction aborted through the client registry
+ * (as when it overstays its lifetime) releases the one waiting on it.
+ */
+#define TWHEEL_TEST_TIMERS 200
+
+static void *timeout_commit(void *arg){
+    return (void *)(intptr_t)trans_commit(arg);
+}
+
+Test(student_suite, 19_timeout, .init = server_state_init, .fini = server_state_fini, .timeout = 10){
+    static TWHEEL w;
+    static TWHEEL_TIMER timers[TWHEEL_TEST_TIMERS];
+    TWHEEL_TIMER expired;
+    uint64_t last = 0;
+    int count = 0, sv[2];
+    pthread_t tid;
+    void *ret;
+
+    twheel_init(&w, 5);
+    twheel_timer_init(&expired);
+    for(int i = 0; i < TWHEEL_TEST_TIMERS; i++){
+        uint64_t d = 1 + (uint64_t)i * i * i * 37 % (TWHEEL_SLOTS * TWHEEL_SLOTS * TWHEEL_SLOTS);
+        twheel_timer_init(&timers[i]);
+        twheel_start(&w, &timers[i], 5 + d);
+        if(5 + d > last) last = 5 + d;
+    }
+    twheel_stop(&timers[3]);
+    cr_assert(!twheel_pending(&timers[3]));
+    for(uint64_t tick = 6; tick <= last; tick++){
+        twheel_advance(&w, tick, &expired);
+        while(twheel_pending(&expired)){
+            TWHEEL_TIMER *t = expired.next;
+            cr_assert_eq(t->expires, tick, "Timer %ld due at %lu expired at %lu",
+                         (long)(t - timers), (unsigned long)t->expires, (unsigned long)tick);
+            twheel_stop(t);
+            count++;
+        }
+    }
+    cr_assert_eq(count, TWHEEL_TEST_TIMERS - 1);
+
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    cr_assert_eq(creg_register(client_registry, sv[0]), 0);
+    TRANSACTION *silent = trans_create(), *waiting = trans_create();
+    creg_set_transaction(client_registry, sv[0], silent);
+    cr_assert_eq(store_put(silent, key_create(blob_create("tk", 2)), blob_create("a", 1)), TRANS_PENDING);
+    cr_assert_eq(store_put(waiting, key_create(blob_create("tk", 2)), blob_create("b", 1)), TRANS_PENDING);
+    pthread_create(&tid, NULL, timeout_commit, waiting);
+    usleep(100000);
+    cr_assert_eq(creg_abort_transaction(client_registry, sv[0]), 0);
+    cr_assert_eq(creg_abort_transaction(client_registry, sv[0]), -1, "Aborted a transaction twice");
+    pthread_join(tid, &ret);
+    cr_assert_eq((TRANS_STATUS)(intptr_t)ret, TRANS_ABORTED, "Dependent transaction was not released");
+    // The thread serving the client finds out when it would commit.
+    cr_assert_eq(creg_release_transaction(client_registry, sv[0]), -1);
+    cr_assert_eq(trans_get_status(silent), TRANS_ABORTED);
+    trans_abort(silent);
+    creg_unregister(client_registry, sv[0]);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * Admission control test: with at most one transaction in progress, a
+ * second client is turned away without touching the store (with a plain
+ * abort, as a v1 client does not ask for XACTO_OVERLOADED), and admitted
+ * again once the first one has committed.
+ */
+Test(student_suite, 20_admit, .init = server_state_init, .fini = server_state_fini, .timeout = 5){
+    XACTO_PACKET *reply;
+    struct iovec iov;
+    ADMIT_STATS s;
+    int one = 1;
+
+    admit_init(1, 0, 0);
+    CONN *fp = conn_test_create(), *sp = conn_test_create();
+    cr_assert_eq(creg_transactions(client_registry), 1);
+
+    flow_feed(sp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(sp, XACTO_KEY_PKT, "admit", 5);
+    flow_feed(sp, XACTO_VALUE_PKT, "no", 2);
+    cr_assert_eq(conn_process(sp), -1, "Service went on in a rejected transaction");
+    cr_assert_eq(conn_pending(sp, &iov, &one), sizeof(XACTO_PACKET));
+    reply = iov.iov_base;
+    cr_assert_eq(reply->status, TRANS_ABORTED);
+    conn_destroy(sp);
+
+    flow_feed(fp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(fp, XACTO_KEY_PKT, "admit", 5);
+    flow_feed(fp, XACTO_VALUE_PKT, "yes", 3);
+    flow_feed(fp, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(conn_process(fp), -1);
+    cr_assert_eq(fp->status, TRANS_COMMITTED, "Transaction in progress was disturbed");
+    conn_destroy(fp);
+    cr_assert_eq(creg_transactions(client_registry), 0);
+
+    sp = conn_test_create();
+    cr_assert_eq(sp->rejected, 0, "Rejected a transaction with none in progress");
+    conn_destroy(sp);
+    admit_get_stats(&s);
+    cr_assert_eq(s.admitted, 2);
+    cr_assert_eq(s.rejected_pending, 1);
+    admit_fini();
+}
+
+/*
+ * Abort reason test: an older transaction that tries to write over the
+ * version of a newer one is found to have lost a conflict on that key,
+ * which its v1 reply does not tell, and the explanation survives a v2
+ * reply head.
+ */
+Test(student_suite, 21_reason, .init = server_state_init, .fini = server_state_fini, .timeout = 5){
+    PROTO2_REPLY r = { TRANS_ABORTED, PROTO2_F_REASON, 7, 0, 0, XACTO_REASON_CONFLICT, 1500, 0xdeadbeef };
+    char buf[PROTO2_HEAD_MAX], *value;
+    XACTO_PACKET *reply;
+    struct iovec iov;
+    size_t counts[XACTO_REASONS], len;
+    int k, one = 1;
+
+    len = proto2_reply_head(buf, &r);
+    cr_assert_gt(k = proto2_frame(buf, len, &len), 0);
+    memset(&r, 0, sizeof(r));
+    cr_assert_eq(proto2_parse_reply(buf + k, len, &r, &value), 0);
+    cr_assert_eq(r.status, TRANS_ABORTED);
+    cr_assert_eq(r.reason, XACTO_REASON_CONFLICT);
+    cr_assert_eq(r.retry_us, 1500);
+    cr_assert_eq(r.key_hash, 0xdeadbeef);
+
+    CONN *op = conn_test_create(), *np = conn_test_create();
+    reason_get_counts(counts);
+
+    flow_feed(np, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(np, XACTO_KEY_PKT, "why", 3);
+    flow_feed(np, XACTO_VALUE_PKT, "new", 3);
+    cr_assert_eq(conn_process(np), 0);
+    flow_feed(op, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(op, XACTO_KEY_PKT, "why", 3);
+    flow_feed(op, XACTO_VALUE_PKT, "old", 3);
+    cr_assert_eq(conn_process(op), -1);
+    cr_assert_eq(conn_pending(op, &iov, &one), sizeof(XACTO_PACKET));
+    reply = iov.iov_base;
+    cr_assert_eq(reply->status, TRANS_ABORTED);
+    cr_assert_eq(reply->null, 0, "Reason sent to a v1 client");
+    cr_assert_eq(op->abort.reason, XACTO_REASON_CONFLICT);
+    BLOB *bp = blob_create("why", 3);
+    cr_assert_eq(op->abort.key_hash, (uint32_t)blob_hash(bp));
+    cr_assert_gt(op->abort.retry_us, 0);
+    blob_unref(bp, "");
+    len = counts[XACTO_REASON_CONFLICT];
+    reason_get_counts(counts);
+    cr_assert_eq(counts[XACTO_REASON_CONFLICT], len + 1);
+
+    conn_destroy(op);
+    conn_destroy(np);
+}
+
+/*
+ * Commit queue test: a connection whose commit has to wait for another
+ * transaction hands it off and stops, while the connection it waits for
+ * is served and commits, which lets the first one commit in turn.
+ */
+Test(student_suite, 22_commitq, .init = server_state_init, .fini = server_state_fini, .timeout = 5){
+    TRANS_STATUS status;
+    int id;
+    uint64_t n;
+
+    COMMITQ *q = commitq_create();
+    cr_assert_not_null(q);
+    CONN *fp = conn_test_create(), *sp = conn_test_create();
+    fp->commits = sp->commits = q;
+
+    flow_feed(fp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(fp, XACTO_KEY_PKT, "wait", 4);
+    flow_feed(fp, XACTO_VALUE_PKT, "first", 5);
+    cr_assert_eq(conn_process(fp), 0);
+    flow_feed(sp, XACTO_PUT_PKT, NULL, 0);
+    flow_feed(sp, XACTO_KEY_PKT, "wait", 4);
+    flow_feed(sp, XACTO_VALUE_PKT, "second", 6);
+    flow_feed(sp, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(conn_process(sp), 0);
+    cr_assert(sp->committing, "Commit that has to wait was not handed off");
+    cr_assert(conn_throttled(sp));
+    cr_assert_null(commitq_next(q, &id, &status));
+
+    flow_feed(fp, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(conn_process(fp), -1);
+    cr_assert_eq(fp->status, TRANS_COMMITTED);
+    struct pollfd pfd = { commitq_fd(q), POLLIN, 0 };
+    cr_assert_eq(poll(&pfd, 1, 2000), 1, "Commit did not complete");
+    cr_assert_eq(read(commitq_fd(q), &n, sizeof(n)), sizeof(n));
+    cr_assert_eq(commitq_next(q, &id, &status), sp);
+    cr_assert_eq(status, TRANS_COMMITTED);
+    size_t before = conn_pending(sp, NULL, NULL);
+    cr_assert_eq(conn_committed(sp, id, status), -1);
+    cr_assert_gt(conn_pending(sp, NULL, NULL), before, "Commit was not answered");
+    cr_assert_not(sp->committing);
+
+    conn_destroy(fp);
+    conn_destroy(sp);
+    commitq_destroy(q);
+}
+
+static void uring_send(int fd, uint8_t type, const void *data, size_t size){
+    XACTO_PACKET pkt;
+    proto_init_header(&pkt, type, 0);
+    pkt.size = htonl(size);
+    cr_assert_eq(proto_send_packet(fd, &pkt, (void *)data), 0);
+}
+
+static int uring_reply(int fd){
+    XACTO_PACKET pkt;
+    void *data = NULL;
+    cr_assert_eq(proto_recv_packet(fd, &pkt, &data), 0, "No reply");
+    free(data);
+    cr_assert_eq(pkt.type, XACTO_REPLY_PKT);
+    return pkt.status;
+}
+
+/*
+ * io_uring core test, over loopback: of two clients served by the one ring
+ * thread, the newer one commits first and has to wait for the older one,
+ * whose requests must still be served while it does.
+ */
+Test(student_suite, 23_uring, .timeout = 10){
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    char port[8];
+    int lfd, older, newer;
+
+    trans_init();
+    store_init();
+    client_registry = creg_init();
+    cr_assert_geq(lfd = open_listenfd("0"), 0);
+    cr_assert_eq(getsockname(lfd, (struct sockaddr *)&sa, &len), 0);
+    snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+    if(uring_start(lfd, 1) == -1)
+        cr_skip_test("io_uring is not available");
+    cr_assert_geq(older = open_clientfd("localhost", port), 0);
+    cr_assert_geq(newer = open_clientfd("localhost", port), 0);
+
+    uring_send(older, XACTO_PUT_PKT, NULL, 0);
+    uring_send(older, XACTO_KEY_PKT, "ring", 4);
+    uring_send(older, XACTO_VALUE_PKT, "older", 5);
+    cr_assert_eq(uring_reply(older), TRANS_PENDING);
+    uring_send(newer, XACTO_PUT_PKT, NULL, 0);
+    uring_send(newer, XACTO_KEY_PKT, "ring", 4);
+    uring_send(newer, XACTO_VALUE_PKT, "newer", 5);
+    cr_assert_eq(uring_reply(newer), TRANS_PENDING);
+    uring_send(newer, XACTO_COMMIT_PKT, NULL, 0);
+    uring_send(older, XACTO_COMMIT_PKT, NULL, 0);
+    cr_assert_eq(uring_reply(older), TRANS_COMMITTED, "Ring thread stopped in a commit");
+    cr_assert_eq(uring_reply(newer), TRANS_COMMITTED);
+
+    // The ring thread runs on, so the store is left as it is.
+    close(older);
+    close(newer);
+}
+
+static atomic_int tpool_dropped;
+
+static void count_drop(void *arg){
+    atomic_fetch_add(&tpool_dropped, 1);
+}
+
+/*
+ * Parking test: a job parked on a socket is run once there is something to
+ * read from it, and a job still parked when the pool stops is dropped.
+ */
+Test(student_suite, 24_tpool_park, .timeout = 5){
+    tpool_job_t job = { count_job, NULL, count_drop };
+    int ready[2], idle[2];
+
+    atomic_store(&tpool_count, 0);
+    atomic_store(&tpool_dropped, 0);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, ready), 0);
+    cr_assert_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, idle), 0);
+    test_pool = tpool_init(2);
+    cr_assert_not_null(test_pool);
+    cr_assert(tpool_park(test_pool, ready[0], job));
+    cr_assert(tpool_park(test_pool, idle[0], job));
+    usleep(50000);
+    cr_assert_eq(atomic_load(&tpool_count), 0, "Parked job ran before its socket was ready");
+    cr_assert_eq(write(ready[1], "x", 1), 1);
+    for(int i = 0; i < 200 && atomic_load(&tpool_count) == 0; i++)
+        usleep(10000);
+    cr_assert_eq(atomic_load(&tpool_count), 1, "Parked job did not run");
+    tpool_destroy(test_pool);
+    cr_assert_eq(atomic_load(&tpool_dropped), 1, "Parked job was not dropped");
+    cr_assert_eq(atomic_load(&tpool_count), 1);
+    close(ready[0]);
+    close(ready[1]);
+    close(idle[0]);
+    close(idle[1]);
+}
+
+static void v2_request(int fd, uint8_t op, uint32_t serial, const char *key, const char *value){
+    PROTO2_REQ req = { op, 0, serial, NULL, key ? strlen(key) : 0, NULL, value ? strlen(value) : 0 };
+    char buf[PROTO2_HEAD_MAX + 64];
+    size_t n = proto2_request_head(buf, &req);
+    memcpy(buf + n, key, req.klen);
+    memcpy(buf + n + req.klen, value, req.vlen);
+    n += req.klen + req.vlen;
+    cr_assert_eq(write(fd, buf, n), n);
+}
+
+static char *v2_reply(int fd, PROTO2_REPLY *r, char *body, size_t cap){
+    char head[PROTO2_VARINT_MAX], *value;
+    size_t len;
+    int k = 0, ret;
+    do {
+        cr_assert_eq(read(fd, head + k, 1), 1, "No reply");
+        k++;
+    } while((ret = proto2_frame(head, k, &len)) == 0);
+    cr_assert_gt(ret, 0);
+    cr_assert_leq(len, cap);
+    cr_assert_eq(recv(fd, body, len, MSG_WAITALL), len);
+    cr_assert_eq(proto2_parse_reply(body, len, r, &value), 0);
+    return value;
+}
+
+/*
+ * Open a v2 connection to a server on the given port, and take the
+ * preface that the server answers with.
+ */
+static int v2_connect(char *port){
+    char preface[PROTO2_PREFACE_LEN];
+    uint8_t opts;
+    int fd;
+    cr_assert_geq(fd = open_clientfd("localhost", port), 0);
+    proto2_preface(preface, PROTO2_OPT_REASON);
+    cr_assert_eq(write(fd, preface, sizeof(preface)), sizeof(preface));
+    cr_assert_eq(recv(fd, preface, sizeof(preface), MSG_WAITALL), sizeof(preface));
+    cr_assert_eq(proto2_detect(preface, sizeof(preface), &opts), 1);
+    cr_assert_eq(opts, PROTO2_OPT_REASON);
+    return fd;
+}
+
+/*
+ * v2 test against an event-loop server, over loopback: a transaction of
+ * PUT, GET and COMMIT, then frames whose length or serial number is a
+ * varint of more than 64 bits, which would read as small numbers if the
+ * bits past 64 were dropped, and must instead end the connection.
+ */
+Test(student_suite, 25_proto2_server, .timeout = 10){
+    static const char overlong_len[] = "\x85\x80\x80\x80\x80\x80\x80\x80\x80\x02";
+    static const char overlong_serial[] = "\x81\x80\x80\x80\x80\x80\x80\x80\x80\x02";
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    PROTO2_REPLY r;
+    char port[8], body[64], frame[32], *value;
+    int lfd, fd;
+
+    trans_init();
+    store_init();
+    client_registry = creg_init();
+    cr_assert_geq(lfd = open_listenfd("0"), 0);
+    cr_assert_eq(getsockname(lfd, (struct sockaddr *)&sa, &len), 0);
+    snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+    cr_assert_eq(evloop_start(lfd, 1), 0);
+
+    fd = v2_connect(port);
+    v2_request(fd, XACTO_PUT_PKT, 1, "key", "value");
+    v2_request(fd, XACTO_GET_PKT, 2, "key", NULL);
+    v2_request(fd, XACTO_COMMIT_PKT, 3, NULL, NULL);
+    cr_assert_null(v2_reply(fd, &r, body, sizeof(body)));
+    cr_assert_eq(r.status, TRANS_PENDING);
+    cr_assert_eq(r.serial, 1);
+    value = v2_reply(fd, &r, body, sizeof(body));
+    cr_assert_eq(r.status, TRANS_PENDING);
+    cr_assert_eq(r.serial, 2);
+    cr_assert_eq(r.vlen, 5);
+    cr_assert_arr_eq(value, "value", 5);
+    v2_reply(fd, &r, body, sizeof(body));
+    cr_assert_eq(r.status, TRANS_COMMITTED);
+    cr_assert_eq(r.serial, 3);
+    cr_assert_eq(read(fd, body, 1), 0, "Service went on after the commit");
+    close(fd);
+
+    // A GET of "key" with serial 1, in a frame of length 5.
+    fd = v2_connect(port);
+    memcpy(frame, overlong_len, PROTO2_VARINT_MAX);
+    memcpy(frame + PROTO2_VARINT_MAX, "\x02\x01key", 5);
+    cr_assert_eq(write(fd, frame, PROTO2_VARINT_MAX + 5), PROTO2_VARINT_MAX + 5);
+    cr_assert_eq(read(fd, body, 1), 0, "Frame length past 64 bits was accepted");
+    close(fd);
+
+    fd = v2_connect(port);
+    frame[0] = 1 + PROTO2_VARINT_MAX + 3;
+    frame[1] = XACTO_GET_PKT;
+    memcpy(frame + 2, overlong_serial, PROTO2_VARINT_MAX);
+    memcpy(frame + 2 + PROTO2_VARINT_MAX, "key", 3);
+    cr_assert_eq(write(fd, frame, 5 + PROTO2_VARINT_MAX), 5 + PROTO2_VARINT_MAX);
+    cr_assert_eq(read(fd, body, 1), 0, "Serial number past 64 bits was accepted");
+    close(fd);
+
+    // The event loop runs on, so the store is left as it is.
+}
+
+/*
+ * Pool test, against an event-loop server over loopback: a connection put
+ * back with a request still queued in an open transaction must not hand
+ * either to whoever takes it next.
+ */
+Test(student_suite, 26_xc_pool, .timeout = 10){
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    char port[8], *value;
+    size_t size;
+    int lfd, replies = 0;
+
+    trans_init();
+    store_init();
+    client_registry = creg_init();
+    cr_assert_geq(lfd = open_listenfd("0"), 0);
+    cr_assert_eq(getsockname(lfd, (struct sockaddr *)&sa, &len), 0);
+    snprintf(port, sizeof(port), "%d", ntohs(sa.sin_port));
+    cr_assert_eq(evloop_start(lfd, 1), 0);
+    XC_POOL *p = xc_pool_create("localhost", port, 0, 1);
+    cr_assert_not_null(p);
+
+    XC_CONN *c = xc_pool_get(p);
+    cr_assert_not_null(c);
+    cr_assert_eq(xc_put(c, "left", 4, "open", 4), TRANS_PENDING);
+    cr_assert_eq(xc_put_async(c, "queued", 6, "yes", 3, xc_count, &replies), 0);
+    xc_pool_put(p, c);
+    cr_assert_eq(replies, 1, "Queued request was not seen through");
+
+    cr_assert_eq(xc_pool_get(p), c, "Connection was not pooled");
+    cr_assert_eq(xc_get(c, "queued", 6, &value, &size), TRANS_PENDING);
+    cr_assert_null(value, "Transaction left open was carried over");
+    cr_assert_eq(xc_get(c, "left", 4, &value, &size), TRANS_PENDING);
+    cr_assert_null(value, "Transaction left open was carried over");
+    cr_assert_eq(xc_put(c, "text", 4, "1234", 4), TRANS_PENDING);
+    cr_assert_eq(xc_get(c, "text", 4, &value, &size), TRANS_PENDING);
+    cr_assert_str_eq(value, "1234", "Value copy is not a string");
+    free(value);
+    cr_assert_eq(xc_commit(c), TRANS_COMMITTED);
+    xc_pool_put(p, c);
+    xc_pool_destroy(p);
+}